@@ -13,8 +13,24 @@
 #define ARP_FREE       0 // slot is unused
 #define ARP_WAITING    1 // ARP request sent but no reply yet
 #define ARP_RESOLVED   2 // valid mapping
+#define ARP_STALE      3 // loaded from a snapshot, used as is but confirmed with a request on first use
+#define ARP_PROBE      4 // stale mapping in use, request sent, gone unless answered within ARP_WAIT_TTL
 
 #define ARP_CACHE_TTL  60 // 1 min timeout 
+#define ARP_WAIT_TTL   3  // seconds an unanswered request keeps its slot
+
+#define ARP_CACHE_SIZE 4096 // neighbors the cache holds at most, the least recently used make room
+#define ARP_HASH_BITS  10   // lookup buckets, 1 << bits
+
+#define ARP_RL_BITS    8  // per-source rate limit buckets, 1 << bits, sources share them by hash
+#define ARP_RL_RATE    10 // ARP frames per second a source may send us, sustained
+#define ARP_RL_BURST   20 // ... and in a burst
+
+#define ARP_SNAPSHOT_MAGIC   0x50415354 // "TSAP" in the file on little-endian hosts
+#define ARP_SNAPSHOT_VERSION 1
+
+#define ARP_REPLICA_BITS  6 // per-thread read replica of the cache, 1 << bits entries
+#define ARP_REPLICA_SLOTS (1 << ARP_REPLICA_BITS)
 
 /* ARP packet format */
 struct arp_header {
@@ -34,15 +50,32 @@ struct arp_ipv4 {
     uint32_t dip; // dest IP
 } __attribute__((packed));
 
-/* ARP Cache to store IP-to-MAC mappings */
+/* ARP Cache to store IP-to-MAC mappings, a slot of a fixed table */
 struct arp_cache_entry {
-    list_head ace_list;
+    list_head ace_list; // linkage in its hash bucket, or the free list
     uint32_t ip; // IP address
     uint8_t mac[6]; // hardware address
+    uint8_t referenced; // looked up since the eviction hand last passed, spared once
     int ttl; // entry timeout
     int state; // state of the entry (complete, incomplete)
 };
 
+/*
+ * Cache snapshot file: a header, then one record per resolved entry. Written in host byte order
+ * (the addresses as they are, network order) for the same host to read back after a restart
+ */
+struct arp_snapshot_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+    uint32_t count; // records that follow
+} __attribute__((packed));
+
+struct arp_snapshot_rec {
+    uint32_t ip;
+    uint8_t mac[6];
+} __attribute__((packed));
+
 /* Initialize ARP module */
 int arp_init(void);
 
@@ -52,15 +85,31 @@ int arp_request(uint32_t dip);
 /* process incoming ARP packets */
 void arp_process(struct arp_header *hdr, int len);
 
-/* update ARP cache with new IP-to-MAC mapping  */
+/*
+ * update ARP cache with new IP-to-MAC mapping, unconditionally. Frames from the wire go through
+ * arp_process instead, which only lets replies to our requests and requests for us add neighbors
+ */
 void arp_update_cache(uint32_t ip, uint8_t *mac);
 
 /* Clean up expired ARP cache entries */
 void arp_cache_timer(void);
 
-/* resolves an IP address to a MAC address for sending packets */
+/*
+ * resolves an IP address to a MAC address for sending packets. Hits are served from a per-thread
+ * replica that's dropped whenever the shared cache changes, so the lock is only taken on a miss
+ */
 int arp_resolve(uint32_t ip, uint8_t *mac);
 
+/*
+ * Load the snapshot at path (if there is one) as stale entries, so a restarted stack can send to
+ * its neighbors right away, and write the resolved entries back to it every interval seconds
+ * (0 for only on arp_snapshot_stop). Peers whose MAC changed meanwhile get corrected on first use
+ */
+int arp_snapshot_start(const char *path, int interval);
+
+/* Stop the periodic writes and write a last snapshot, nothing if no snapshot was started */
+void arp_snapshot_stop(void);
+
 /* handles ethernet frames with ARP EtherType */
 void arp_recv(struct pktbuf *pkt);
 
@@ -0,0 +1,57 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "pktbuf.h"
+
+#define CAPTURE_RING_SIZE 4096        // frames waiting for the writer, power of two
+#define CAPTURE_SNAPLEN   65535       // bytes kept of each frame, a super-frame may be longer
+#define CAPTURE_FILE_STEP (4u << 20)  // the output file grows by this much at a time
+
+/* Which way a frame was going, as pcapng's epb_flags direction */
+enum capture_dir {
+    CAPTURE_IN = 1,
+    CAPTURE_OUT = 2,
+};
+
+/*
+ * Packet capture from inside the stack, to a pcapng file. Frames are taken as the device layer
+ * reads them and as the stack hands them to the device layer, so the file shows what the stack
+ * itself saw: its own drops aren't in it and super-frames appear whole. The hooks copy each frame
+ * that passes the filter onto a ring, and a writer thread appends them to the file through a
+ * shared mapping it grows as needed. While capture is off the hooks are a single relaxed load.
+ *
+ * Filters are space separated terms that must all match: ip, arp, icmp, tcp, udp and
+ * host A.B.C.D (either address of an IP packet, or of an ARP packet's sender or target).
+ */
+
+extern _Atomic int capture_on;
+
+/* Start capturing to a new pcapng file at path, with filter (NULL or "" for everything) */
+int capture_start(const char *path, const char *filter);
+
+/* Pause a running capture, or resume a paused one. Safe from a signal handler */
+void capture_toggle(void);
+
+/* Stop capturing, write out what's queued and close the file */
+void capture_stop(void);
+
+/* Copy a frame (data at the Ethernet header) onto the ring, if it passes the filter */
+void capture_frame(struct pktbuf *pkt, enum capture_dir dir);
+
+/* Capture hooks for the device layer */
+static inline void capture_rx(struct pktbuf *pkt) {
+    if (__builtin_expect(atomic_load_explicit(&capture_on, memory_order_relaxed), 0)) {
+        capture_frame(pkt, CAPTURE_IN);
+    }
+}
+
+static inline void capture_tx(struct pktbuf *pkt) {
+    if (__builtin_expect(atomic_load_explicit(&capture_on, memory_order_relaxed), 0)) {
+        capture_frame(pkt, CAPTURE_OUT);
+    }
+}
+
+#endif /* CAPTURE_H */
@@ -23,9 +23,15 @@ struct eth_header {
 /* Transmit an Ethernet frame */
 int ethernet_tx(struct pktbuf *pkt, const uint8_t *dst_mac, uint16_t ethertype);
 
-/* Processing incoming Ethernet frames */
+/* Processing incoming Ethernet frames, ethernet_parse followed by ethernet_deliver */
 void ethernet_rx(struct pktbuf *pkt);
 
+/* Check an incoming frame and strip its header. Returns 0 if it's one to deliver, -1 if it was dropped */
+int ethernet_parse(struct pktbuf *pkt);
+
+/* Hand a parsed frame to the protocol its ethertype names. Consumes pkt */
+void ethernet_deliver(struct pktbuf *pkt);
+
 /* Initialize Ethernet layer */
 void ethernet_init(void);
 
@@ -0,0 +1,28 @@
+#ifndef GRO_H
+#define GRO_H
+
+#include "pktbuf.h"
+
+#define GRO_MAX_FLOWS 8     // flows a thread holds segments of at once
+#define GRO_MAX_SIZE  65535 // IP length of a coalesced packet
+
+/*
+ * Generic receive offload in software, the mirror image of gso.h. During an RX burst, in-order
+ * TCP segments of one flow that carry nothing but data and an unchanged ACK are chained onto
+ * the first one as pieces of its payload, without copying, so the flow lookup, socket lock, ACK
+ * processing and reader wakeup happen once per run of segments instead of once per segment.
+ * A coalesced packet has gso_size and gso_segs set like a super-frame. Whatever a thread holds
+ * goes up to TCP when its burst ends, on gro_flush, or as soon as anything else of the flow
+ * comes along.
+ */
+
+/* Turn coalescing off for the whole stack, TCP then gets every segment as it arrives */
+void gro_disable(void);
+
+/* Take a TCP segment from ip_recv (data at the TCP header), hold it or hand it to tcp_recv. Consumes pkt */
+void gro_receive(struct pktbuf *pkt);
+
+/* Hand everything the calling thread holds to tcp_recv, at the end of each RX burst */
+void gro_flush(void);
+
+#endif /* GRO_H */
@@ -0,0 +1,16 @@
+#ifndef GSO_H
+#define GSO_H
+
+#include "pktbuf.h"
+
+/*
+ * Generic segmentation offload in software. TCP hands the IP layer one super-frame of up to 64KB
+ * with a single header and pkt->gso_size set, so building headers, routing and ARP happen once
+ * per super-frame rather than once per segment. If the device can't take it whole (NETDEV_F_GSO),
+ * ethernet_tx calls gso_xmit to cut it into gso_size wire frames right before the device.
+ */
+
+/* Segment an Ethernet/IPv4/TCP super-frame and transmit the pieces. Consumes pkt */
+int gso_xmit(struct pktbuf *pkt);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+/* 
+ * HDR-style log-linear histogram. Values are grouped by power of two and each power 
+ * of two is split into HIST_SUB_BUCKETS linear buckets, so the relative error of any
+ * reported value is bounded by 1/HIST_SUB_BUCKETS no matter how large it gets.
+ * Recording is a couple of shifts and an increment, no allocation.
+ */
+#define HIST_SUB_BITS    5                       // 32 linear buckets per power of two (~3% precision)
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS    40                      // largest trackable value is 2^40 (~18 minutes in ns)
+#define HIST_BUCKETS     ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+struct histogram {
+    uint64_t count;     // number of recorded values
+    uint64_t sum;       // sum of recorded values, for the mean
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+/* Reset a histogram to empty */
+void hist_init(struct histogram *h);
+
+/* Record a single value */
+void hist_record(struct histogram *h, uint64_t value);
+
+/* Add all values of src into dst (used to aggregate per-thread histograms) */
+void hist_merge(struct histogram *dst, const struct histogram *src);
+
+/* Value at the given percentile (0-100), reported as the upper bound of its bucket */
+uint64_t hist_percentile(const struct histogram *h, double pct);
+
+/* Mean of the recorded values */
+uint64_t hist_mean(const struct histogram *h);
+
+#endif /* HISTOGRAM_H */
@@ -39,4 +39,10 @@ void icmp_recv(struct pktbuf *pkt);
 /* Send an ICMP Echo Request (ping) */
 int icmp_send_echo_request(uint32_t dst_addr, uint16_t id, uint16_t seq);
 
+/* Send an ICMP Destination Unreachable about a received packet (needs pkt->nh) */
+int icmp_send_dest_unreachable(struct pktbuf *orig, uint8_t code);
+
+/* Send an ICMP Echo Request carrying the given payload (e.g. a timestamp) */
+int icmp_send_echo(uint32_t dst_addr, uint16_t id, uint16_t seq, const void *data, int data_len);
+
 #endif
\ No newline at end of file
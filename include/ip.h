@@ -2,6 +2,7 @@
 #define IPV4_H
 #include <stdint.h>
 #include "pktbuf.h"
+#include "utils.h"
 
 #define IPV4 4
 
@@ -20,7 +21,7 @@
 
 /* Debug output macro */
 #define ip_dbg(fmt, ...) \
-    printf("IP: " fmt "\n", ##__VA_ARGS__)
+    do { if (verbose) printf("IP: " fmt "\n", ##__VA_ARGS__); } while (0)
 
 struct ip_header {
     uint8_t ihl : 4;     // number of 32-bit words in the IP header. These two lines pack two 4-bit fields into a single byte
@@ -40,6 +41,36 @@ struct ip_header {
 /* Calculate IP checksum, works on any header */
 uint16_t checksum(void *addr, int count);
 
+/* Add 16-bit words to a running one's complement sum. Only the last chunk may have an odd length */
+uint32_t checksum_partial(const void *addr, int count, uint32_t sum);
+
+/* Fold a running sum into the final 16-bit checksum */
+uint16_t checksum_fold(uint32_t sum);
+
+/* Update a checksum for one 16-bit field changing from old to new (RFC 1624), all in network byte order */
+uint16_t checksum_adjust(uint16_t csum, uint16_t old, uint16_t new);
+
+/* Running sum of the IPv4 pseudo header alone, for checksums completed elsewhere (GSO, the device) */
+uint32_t ip_pseudo_sum(uint32_t saddr, uint32_t daddr, uint8_t proto, int len);
+
+/* Checksum of an L4 segment including the IPv4 pseudo header (UDP, TCP), addresses in network byte order */
+uint16_t ip_pseudo_checksum(uint32_t saddr, uint32_t daddr, uint8_t proto, const void *data, int len);
+
+/* Same for a segment starting at pkt->data, zero-copy fragment included. The linear part must have an even length */
+uint16_t ip_pseudo_checksum_pkt(uint32_t saddr, uint32_t daddr, uint8_t proto, struct pktbuf *pkt);
+
+/* Why an incoming packet was dropped, the first argument of the ip_drop probe (see probe.h) */
+enum ip_drop_reason {
+    IP_DROP_SHORT = 1,  // shorter than an IP header
+    IP_DROP_VERSION,    // not IPv4
+    IP_DROP_IHL,        // header length below 20 bytes
+    IP_DROP_TRUNCATED,  // total length beyond what arrived
+    IP_DROP_HDR_LEN,    // header longer than the total length
+    IP_DROP_CSUM,       // bad header checksum
+    IP_DROP_NOT_FOR_US, // destination isn't our address
+    IP_DROP_PROTO,      // no handler for the protocol
+};
+
 /* Validate an IP packet */
 int ip_validate_packet(struct ip_header *hdr, int len);
 
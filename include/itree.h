@@ -0,0 +1,63 @@
+#ifndef ITREE_H
+#define ITREE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Intrusive interval tree (AVL balanced, augmented with the largest end point of each subtree)
+ * over 32-bit sequence numbers. Embed an itree_node in your struct and use container_of to get
+ * back to it, same as list_head.
+ *
+ * Intervals are half-open [start, end) and compared with sequence number arithmetic, so they
+ * may wrap around 2^32 as long as everything in the tree lies within 2^31 of each other (always
+ * true for data inside a TCP receive window). Starts must be unique.
+ */
+struct itree_node {
+    struct itree_node *left, *right;
+    uint32_t start;   // first sequence number covered
+    uint32_t end;     // one past the last sequence number covered
+    uint32_t max_end; // largest end in this subtree
+    int height;
+};
+
+struct itree {
+    struct itree_node *root;
+    int count;
+};
+
+/* Sequence number comparisons that survive wrap around */
+static inline int seq_before(uint32_t a, uint32_t b) { return (int32_t)(a - b) < 0; }
+static inline int seq_after(uint32_t a, uint32_t b)  { return (int32_t)(a - b) > 0; }
+static inline int seq_leq(uint32_t a, uint32_t b)    { return (int32_t)(a - b) <= 0; }
+static inline int seq_geq(uint32_t a, uint32_t b)    { return (int32_t)(a - b) >= 0; }
+
+/* Initialize an empty tree */
+static inline void itree_init(struct itree *tree) {
+    tree->root = NULL;
+    tree->count = 0;
+}
+
+static inline int itree_empty(struct itree *tree) {
+    return tree->root == NULL;
+}
+
+/* Insert a node, its start and end must already be set */
+void itree_insert(struct itree *tree, struct itree_node *node);
+
+/* Remove a node that is in the tree */
+void itree_remove(struct itree *tree, struct itree_node *node);
+
+/* Node with the lowest start, NULL if empty */
+struct itree_node *itree_first(struct itree *tree);
+
+/* Node with the highest start, NULL if empty */
+struct itree_node *itree_last(struct itree *tree);
+
+/* In-order successor of a node, NULL if it's the last one */
+struct itree_node *itree_next(struct itree *tree, struct itree_node *node);
+
+/* Lowest-starting node that overlaps [start, end), NULL if nothing does */
+struct itree_node *itree_first_overlap(struct itree *tree, uint32_t start, uint32_t end);
+
+#endif /* ITREE_H */
@@ -0,0 +1,71 @@
+#ifndef MEM_H
+#define MEM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define MEM_BATCH            (64 * 1024)  // bytes a thread counts locally before folding into the totals
+#define MEM_DEFAULT_LOW      (192 << 20)  // pressure ends once the stack is back under this many bytes
+#define MEM_DEFAULT_HIGH     (256 << 20)  // pressure starts at this many bytes
+#define MEM_PRESSURE_RCVSHIFT 2           // under pressure a socket may only fill 1/4 of its receive buffer
+
+/*
+ * Memory accounting. Packet buffers and ARP entries are charged when they're allocated and
+ * uncharged when freed, data waiting in socket receive queues is tracked on top as a share of the
+ * buffers. Like the kernel's percpu counters, each thread adds up a delta of its own and only
+ * folds it into the shared totals once it passes MEM_BATCH, or on every charge while under
+ * pressure. Threads also fold before they sleep (in the reactor or waiting on a socket), so only
+ * busy threads may be up to MEM_BATCH off. Above the high watermark the stack is under pressure until it gets back below the
+ * low one: RX sheds frames before any protocol work (TCP segments pass as bare ACKs, since those
+ * free send queues, and ARP passes as its cache is bounded anyway), and sockets advertise and
+ * fill only a fraction of their receive buffers.
+ */
+enum mem_class {
+    MEM_PKTBUF,   // every live packet buffer, struct and data room
+    MEM_ARP,      // ARP cache entries
+    MEM_SOCK_RCV, // payload queued to sockets, already part of MEM_PKTBUF
+    MEM_MAX
+};
+
+/* The calling thread's not yet folded counts */
+struct mem_local {
+    int registered; // the thread's exit folds what's left
+    int64_t bytes[MEM_MAX];
+    int64_t objs[MEM_MAX];
+};
+
+extern __thread struct mem_local mem_local;
+extern _Atomic int mem_under_pressure;
+
+/* Fold the calling thread's counts into the totals and update the pressure state, also before sleeping */
+void mem_fold(void);
+
+/* Count bytes and objects allocated (positive) or freed (negative) for a class */
+static inline void mem_charge(enum mem_class c, int64_t bytes, int64_t objs) {
+    mem_local.bytes[c] += bytes;
+    mem_local.objs[c] += objs;
+    // under pressure every charge counts, so the stack notices as soon as it's back under the low mark
+    if (__builtin_expect(mem_local.bytes[c] >= MEM_BATCH || mem_local.bytes[c] <= -MEM_BATCH ||
+                         !mem_local.registered || atomic_load_explicit(&mem_under_pressure, memory_order_relaxed), 0)) {
+        mem_fold();
+    }
+}
+
+/* Whether the stack is above its high watermark and hasn't got back below the low one yet */
+static inline int mem_pressure(void) {
+    return atomic_load_explicit(&mem_under_pressure, memory_order_relaxed);
+}
+
+/* What a socket with receive buffer limit may hold right now */
+static inline uint32_t mem_sock_limit(uint32_t limit) {
+    return mem_pressure() ? limit >> MEM_PRESSURE_RCVSHIFT : limit;
+}
+
+/* Parse "low,high" in bytes, each with an optional K, M or G suffix, and set the watermarks */
+int mem_parse_watermarks(const char *spec);
+
+/* Print the current usage and watermarks, as a line of names and a line of values */
+void mem_dump(FILE *f);
+
+#endif /* MEM_H */
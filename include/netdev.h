@@ -2,11 +2,20 @@
 #define NETDEV_H
 
 #include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
 #include <linux/if.h>
 
 #include "pktbuf.h"
+#include "reactor.h"
+#include "utils.h"
 
 #define NETDEV_MTU 1500 // Default MTU 
+#define NETDEV_RX_BURST 64 // frames per RX burst before flushing ACKs and running timers
+#define NETDEV_MAX_QUEUES 16
+
+/* Device features */
+#define NETDEV_F_GSO 0x1 // takes TCP super-frames (gso_size set) and segments them itself
 
 /* Single global network device structure */
 struct netdev {
@@ -15,12 +24,31 @@ struct netdev {
     uint32_t netmask;       // Network mask
     char name[IFNAMSIZ]; // Interface name ()
     int mtu;                // maximum transimission unit
+    int features;           // NETDEV_F_* the device supports
 };
 
+/*
+ * A device queue. With more than one, each is owned by a worker pinned to its own core that runs
+ * every frame it receives to completion: RX, the protocol layers and the TX that results, all on
+ * that core. Counters sit on the queue's own cache line
+ */
+struct netdev_queue {
+    int id;
+    int fd;                     // tap file descriptor of this queue
+    pthread_t thread;           // its worker, queue 0 runs on the RX thread itself
+    struct reactor reactor;     // the worker sleeps here until frames, a timer or netdev_close come along
+    atomic_ullong rx_packets;
+    atomic_ullong rx_bytes;
+    atomic_ullong tx_packets;   // other threads send through it too
+    atomic_ullong tx_bytes;
+} __attribute__((aligned(CACHELINE_SIZE)));
+
 /* Tap device structure */
 struct tapdev {
     struct netdev dev; // Embedded network device
-    int fd;            // tap device file descriptor
+    int vnet_hdr;      // frames in both directions are preceded by a struct virtio_net_hdr
+    int nqueues;
+    struct netdev_queue queues[NETDEV_MAX_QUEUES];
 };
 
 /* Single global TAP device */
@@ -29,18 +57,43 @@ extern struct tapdev tap;
 /* Initialize a network device */
 void netdev_init(void);
 
-/* Initialize and open the TAP device */
-int tapdev_init(const char *name);
+/*
+ * Initialize and open the TAP device, asking for the NETDEV_F_* features in features. With nqueues
+ * above 1 it's opened multiqueue and netdev_rx_loop runs a pinned worker per queue
+ */
+int tapdev_init(const char *name, int features, int nqueues);
 
-/* Transmit a packet through the network device */
+/* Transmit a packet through the network device, by way of the TX thread in pipeline mode. Consumes pkt */
 int netdev_tx(struct pktbuf *pkt);
 
-/* Poll for incoming packets (non-blocking) */
-int netdev_poll(void);
+/* Write a packet to the device from the calling thread, whatever the mode. Consumes pkt */
+int netdev_xmit(struct pktbuf *pkt);
+
+/*
+ * Hand a frame, data at its Ethernet header, to the stack the way a device read does. queue is
+ * the one it came in on, or the one whose thread is feeding it. Consumes pkt
+ */
+void netdev_rx(struct pktbuf *pkt, int queue);
+
+/* End a burst of netdev_rx: coalesced ACKs go out, or the workers get their frames */
+void netdev_rx_flush(void);
 
-/* Dedicated thread function to receive packets */
+/*
+ * Have queue 0 take frames from fill besides the device, to replay traffic. Its thread calls fill
+ * between polls of the device, fill hands a burst of frames to netdev_rx and returns how many, or
+ * -1 once it has no more. Set before netdev_rx_loop starts
+ */
+void netdev_set_feed(int (*fill)(void *arg), void *arg);
+
+/* Poll a queue for incoming packets (non-blocking) */
+int netdev_poll(struct netdev_queue *q);
+
+/* Dedicated thread function to receive packets, it starts the other queues' workers itself */
 void *netdev_rx_loop(void *arg);
 
+/* Print the per-queue counters */
+void netdev_print_stats(void);
+
 /* Clean up resources */
 void netdev_close(void);
 
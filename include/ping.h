@@ -0,0 +1,34 @@
+#ifndef PING_H
+#define PING_H
+
+#include <stdint.h>
+#include "icmp.h"
+
+#define PING_SLOTS       65536 // tracked outstanding requests, power of two
+#define PING_MAX_WINDOW  (PING_SLOTS / 2)
+#define PING_TIMEOUT_MS  1000  // a request unanswered this long no longer counts against the window
+#define PING_FLOOD_WINDOW 64   // default window in flood mode
+
+/* Payload we put at the start of every echo request, the peer echoes it back unchanged */
+struct ping_stamp {
+    uint64_t tx_ns; // CLOCK_MONOTONIC send time
+    uint64_t seq;   // full sequence number, the echo header only carries the low 16 bits
+} __attribute__((packed));
+
+/* Load/latency run parameters */
+struct ping_config {
+    uint32_t dst_addr; // destination, network byte order
+    uint16_t id;       // echo identifier, replies with another id are ignored
+    uint64_t count;    // requests to send, 0 = until interrupted
+    int rate;          // requests per second, 0 = as fast as the window allows
+    int window;        // max outstanding requests, 0 = unlimited
+    int size;          // echo payload bytes, at least sizeof(struct ping_stamp)
+};
+
+/* Run the load/latency test on the calling thread, prints a report when done */
+int ping_run(const struct ping_config *cfg, volatile int *running);
+
+/* Match an incoming echo reply against our requests (called from icmp_recv) */
+void ping_recv_reply(struct icmp_v4_echo *echo, int data_len);
+
+#endif /* PING_H */
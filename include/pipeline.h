@@ -0,0 +1,35 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "pktbuf.h"
+
+#define PIPELINE_RING_SIZE 1024 // frames queued between two stages, power of two
+
+/*
+ * Pipelined mode: the work of a frame is split over three threads joined by rings of pktbuf
+ * pointers. The RX thread reads the device and parses the Ethernet header, the protocol thread
+ * runs IP, ARP, ICMP, UDP and TCP along with the timers, and the TX thread writes frames to the
+ * device. RX hands frames to the protocol thread in one batch per burst over a single producer
+ * ring; anything may transmit, so the TX ring takes many producers. A stage whose ring is full
+ * drops the frame, like a full device queue would.
+ */
+
+/* Start the protocol and TX threads and route frames through them */
+int pipeline_start(void);
+
+/* Non-zero while frames go through the pipeline */
+int pipeline_enabled(void);
+
+/* RX stage: parse a received frame (data at the Ethernet header) and stage it for the protocol thread. Consumes pkt */
+void pipeline_rx(struct pktbuf *pkt);
+
+/* Queue the frames staged since the last call to the protocol thread and wake it. Once per RX burst */
+void pipeline_kick(void);
+
+/* Queue a frame for the TX thread. Returns its length, or -1 if the ring was full. Consumes pkt */
+int pipeline_tx(struct pktbuf *pkt);
+
+/* Stop the protocol and TX threads. Frames still queued for TX are sent, received ones dropped */
+void pipeline_stop(void);
+
+#endif /* PIPELINE_H */
@@ -2,7 +2,33 @@
 #define PKTBUF_H
 
 #include <stdint.h>
+#include <stdatomic.h>
 #include "list.h"
+#include "trace.h"
+
+#define PKTBUF_POOL_BUF 2048 // data room of pooled buffers, a full frame plus headroom
+#define PKTBUF_POOL_MAX 512  // idle buffers a thread's pool keeps, the rest go back to malloc
+#define PKTBUF_MAX_PIECES 64 // payload pieces one buffer references, a super-frame's segments
+
+struct zc_ubuf;
+struct pktbuf;
+
+/*
+ * Payload a buffer references in other buffers, on the wire after frag. A GSO super-frame built
+ * from queued segments points at each of them rather than copying them together, and so does a
+ * segment GRO coalesced the ones behind it into
+ */
+struct pktbuf_pieces {
+    uint32_t len;   // bytes in all pieces
+    int count;
+    struct pktbuf_piece {
+        uint8_t *data;
+        uint32_t len;
+        struct pktbuf *owner; // holds the bytes in its data or fragment, referenced until we're freed
+        uint32_t csum;        // partial checksum of the bytes, if csum_ok
+        int csum_ok;
+    } piece[PKTBUF_MAX_PIECES];
+};
 
 /* Packet buffer structure */
 struct pktbuf {
@@ -13,7 +39,23 @@ struct pktbuf {
     uint32_t size;      // Total buffer size
     uint32_t len;       // Current data length
     uint16_t protocol;  // Protocol identifier (ETH_P_IP, ETH_P_ARP, etc.) 
-    int refcnt;         // reference count
+    uint8_t *nh;        // Network (IP) header, set on receive so upper layers can still reach it after pulls
+    uint8_t *th;        // Transport (UDP/TCP) header
+    atomic_int refcnt;  // reference count, the last one may be dropped on any thread
+    uint32_t hash;      // flow hash from RSS, same for both directions of a flow, 0 if not computed
+    int pooled;         // data lives in the same allocation, recycled through a thread's pool
+    uint16_t gso_size;  // TCP super-frame: payload bytes per wire segment, 0 for a normal frame
+    uint16_t gso_segs;  // wire segments the super-frame turns into
+    uint8_t l4_csum_ok; // the transport checksum was checked already, segment by segment by GRO
+    uint8_t *frag;      // payload left in application memory (zero-copy send), goes on the wire after data..len
+    uint32_t frag_len;
+    struct zc_ubuf *ubuf; // owner of frag, told once no buffer references it anymore
+    struct pktbuf *frag_owner; // or the buffer holding frag in its data or fragment, referenced until this one is freed
+    struct pktbuf_pieces *pieces; // more payload after frag, NULL if none
+    uint8_t cb[64] __attribute__((aligned(8))); // Control block, private to whichever layer currently owns the buffer (e.g. TCP seq numbers)
+#ifdef PKT_TRACE
+    uint64_t tstamp[TRACE_POINT_MAX]; // cycle counter at each trace point passed, 0 if not
+#endif
 
     struct netdev *dev; // Reference to the network device
 };
@@ -25,6 +67,16 @@ struct pktbuf *alloc_pktbuf(uint32_t size);
 /* Free a packet buffer */
 void free_pktbuf(struct pktbuf *pkt);
 
+/*
+ * Give the calling thread its own pool of buffers: small allocations on it come from the pool
+ * and buffers freed on it go back there, without touching malloc's shared state. Buffers may
+ * still be freed on any thread, one without a pool hands them back to malloc
+ */
+void pktbuf_pool_enable(void);
+
+/* Release the thread's pool, before the thread exits */
+void pktbuf_pool_drain(void);
+
 /* Increment the reference count for a packet buffer */
 void pktbuf_hold(struct pktbuf *pkt);
 
@@ -40,7 +92,40 @@ void *pktbuf_pull(struct pktbuf *pkt, uint32_t len);
 /* Add data to the end of the buffer */
 void *pktbuf_put(struct pktbuf *pkt, uint32_t len);
 
-/* Clone a packet buffer */
+/*
+ * Clone a packet buffer for sending it again. The clone has headroom of its own for the headers
+ * but shares the payload, data..len becoming its fragment, so nobody may change those bytes while
+ * it lives. A zero-copy fragment is shared too. Header pointers (nh, th) aren't carried over
+ */
 struct pktbuf *pktbuf_clone(struct pktbuf *pkt);
 
+/* Point a buffer at application memory instead of copying it in, holding a reference to ubuf */
+void pktbuf_attach(struct pktbuf *pkt, uint8_t *frag, uint32_t len, struct zc_ubuf *ubuf);
+
+/* Point a buffer at len bytes that owner holds, in its data or fragment, taking a reference to owner */
+void pktbuf_attach_pkt(struct pktbuf *pkt, uint8_t *frag, uint32_t len, struct pktbuf *owner);
+
+/*
+ * Append len bytes that owner holds as another piece of pkt's payload, taking a reference to owner.
+ * csum is their partial checksum if the caller knows it, else NULL. -1 if pkt has no room for more
+ */
+int pktbuf_add_piece(struct pktbuf *pkt, struct pktbuf *owner, uint8_t *data, uint32_t len, const uint32_t *csum);
+
+/* Copy up to len bytes of the frame from its start, wherever they lie. Returns how many */
+uint32_t pktbuf_copy(struct pktbuf *pkt, void *to, uint32_t len);
+
+/* Drop len bytes of zero-copy payload from the front */
+void pktbuf_frag_pull(struct pktbuf *pkt, uint32_t len);
+
+/* Drop len bytes from the front wherever they lie, data..len first, then the fragment and pieces */
+void pktbuf_pull_all(struct pktbuf *pkt, uint32_t len);
+
+/* Cut the frame down to its first len bytes, releasing pieces that fall off the end */
+void pktbuf_trim(struct pktbuf *pkt, uint32_t len);
+
+/* Length including the zero-copy fragment and any pieces */
+static inline uint32_t pktbuf_total_len(struct pktbuf *pkt) {
+    return pkt->len + pkt->frag_len + (pkt->pieces ? pkt->pieces->len : 0);
+}
+
 #endif
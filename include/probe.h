@@ -0,0 +1,43 @@
+#ifndef PROBE_H
+#define PROBE_H
+
+/*
+ * USDT static tracepoints, for bpftrace or perf to attach to in a running stack without a
+ * rebuild, e.g. bpftrace -e 'usdt:./tenstack:tenstack:ip_drop { @[arg0] = count(); }'. Where
+ * <sys/sdt.h> is around (systemtap-sdt-dev, systemtap-sdt-devel) each probe is a single nop plus
+ * a note in the ELF file telling tracers where its arguments live; without it they compile away.
+ * Addresses are IPv4 in network byte order, data arguments point at the frame's first byte.
+ *
+ *   netdev_rx(queue, data, len)              frame entering the stack, read or replayed, vnet header off
+ *   netdev_tx(data, len, gso_segs)           frame handed to the device layer
+ *   eth_deliver(ethertype, len)              frame dispatched to ARP or IP, Ethernet header off
+ *   ip_drop(reason, saddr, daddr, len)       IP packet dropped, reason is an enum ip_drop_reason
+ *   arp_miss(ip)                             arp_resolve found no MAC and sends a request
+ *   arp_update(ip, mac, created)             mapping learned, created is 0 for a refresh
+ */
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define PROBE_SDT 1
+#endif
+#endif
+
+#ifdef PROBE_SDT
+
+#include <sys/sdt.h>
+
+#define PROBE1(name, a) DTRACE_PROBE1(tenstack, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(tenstack, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(tenstack, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(tenstack, name, a, b, c, d)
+
+#else
+
+#define PROBE1(name, a) do { } while (0)
+#define PROBE2(name, a, b) do { } while (0)
+#define PROBE3(name, a, b, c) do { } while (0)
+#define PROBE4(name, a, b, c, d) do { } while (0)
+
+#endif /* PROBE_SDT */
+
+#endif /* PROBE_H */
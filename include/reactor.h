@@ -0,0 +1,55 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <stdint.h>
+
+#define REACTOR_MAX_EVENTS 16 // ready sources handled per wait
+
+/*
+ * Event loop for a stack thread. One epoll set multiplexes the thread's device queue, a timerfd
+ * the timer wheel keeps armed to its next deadline, and eventfds other threads write to wake it
+ * up. The thread sleeps until one of them is ready, so it neither polls nor oversleeps a timer,
+ * and an idle stack uses no CPU. Everything is level triggered: a handler that leaves work behind
+ * (a device it didn't drain) is simply called again on the next wait.
+ */
+
+/* A file descriptor the reactor watches, owned by the caller */
+struct reactor_source {
+    int fd;
+    void (*handler)(void *arg); // called on the reactor's thread while fd is readable
+    void *arg;
+};
+
+struct reactor {
+    int epfd;
+    int tfd;                        // follows its thread's timer wheel, -1 if it doesn't run timers
+    int efd;                        // reactor_wake
+    struct reactor_source timer_src;
+    struct reactor_source wake_src;
+};
+
+/* Set up a reactor, any thread may do it for the one that will wait on it */
+int reactor_init(struct reactor *r);
+
+/* Run the calling thread's timers from the reactor, which from now on is that thread's */
+int reactor_timers_start(struct reactor *r);
+
+/* Leave the thread's timers alone again, on the thread that started them */
+void reactor_timers_stop(struct reactor *r);
+
+/* Watch src->fd for input */
+int reactor_add(struct reactor *r, struct reactor_source *src);
+
+/* Stop watching src->fd, call before closing it */
+int reactor_del(struct reactor *r, struct reactor_source *src);
+
+/* Wait up to timeout_ms (-1 = no limit) for sources to become ready and run their handlers. Returns how many ran, -1 on error */
+int reactor_poll(struct reactor *r, int timeout_ms);
+
+/* Make the reactor's current or next reactor_poll return, from any thread */
+void reactor_wake(struct reactor *r);
+
+/* Release the reactor once nothing waits on or wakes it anymore */
+void reactor_close(struct reactor *r);
+
+#endif /* REACTOR_H */
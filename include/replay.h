@@ -0,0 +1,35 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdint.h>
+
+#define REPLAY_BURST    32  // frames handed to the stack between polls of the device
+#define REPLAY_DRAIN_MS 500 // how long the stack's output may trail the last frame in the report
+
+/*
+ * Traffic replay: the frames of a pcap or pcapng file, loaded into memory, fed to the stack as if
+ * the device had read them, as fast as it takes them or at a fixed rate, once or over and over.
+ * They enter through netdev_rx on queue 0's thread, so RSS, the pipeline and capture all see them
+ * like real traffic, while the device keeps working alongside. The report gives the sustained
+ * rate, the CPU time each frame cost and what the stack sent back or dropped meanwhile.
+ */
+
+/* Replay parameters */
+struct replay_config {
+    const char *path;
+    uint64_t loops;       // passes over the file, 0 = until interrupted
+    uint64_t rate;        // frames per second, 0 = as fast as the stack takes them
+    int rewrite_dst;      // aim every frame at the stack: its MAC (unless broadcast) and IP as destination
+    uint32_t rewrite_src; // source IP put in every frame, network byte order, 0 = keep
+};
+
+/* Parse comma separated rewrites into cfg: dst, src=A.B.C.D */
+int replay_parse_rewrite(struct replay_config *cfg, const char *spec);
+
+/* Load the file and make it queue 0's feed, after the device is set up and before the RX thread starts */
+int replay_start(const struct replay_config *cfg);
+
+/* Wait for the replay to finish or running to drop, then print the report */
+int replay_run(volatile int *running);
+
+#endif /* REPLAY_H */
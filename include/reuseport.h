@@ -0,0 +1,36 @@
+#ifndef REUSEPORT_H
+#define REUSEPORT_H
+
+#include <stdint.h>
+
+#define REUSEPORT_MAX 64 // sockets sharing one address and port
+
+/*
+ * A group of sockets bound to the same local address and port (SO_REUSEPORT). Each member keeps
+ * its own queues and lock; incoming traffic is spread over them by a hash of the 4-tuple, so a
+ * given flow always lands on the same member while membership stays the same. The owning
+ * protocol's hash table lock protects the group.
+ */
+struct reuseport {
+    int num;
+    void *socks[REUSEPORT_MAX];
+};
+
+/* Start a group with its first member */
+struct reuseport *reuseport_alloc(void *sk);
+
+/* Add a member, -1 if the group is full */
+int reuseport_add(struct reuseport *group, void *sk);
+
+/* Remove a member, returns how many are left. The last one out frees the group */
+int reuseport_remove(struct reuseport *group, void *sk);
+
+/* Pick the member for a flow */
+static inline void *reuseport_select(struct reuseport *group, uint32_t hash) {
+    return group->socks[((uint64_t)hash * group->num) >> 32];
+}
+
+/* Flow hash for reuseport_select, keyed so remote peers can't aim at one member */
+uint32_t reuseport_hash(uint32_t saddr, uint16_t sport, uint32_t daddr, uint16_t dport);
+
+#endif /* REUSEPORT_H */
@@ -0,0 +1,152 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <sched.h>
+
+#include "utils.h"
+
+/*
+ * Fixed size ring of pointers for handing objects from thread to thread without a lock, in the
+ * style of DPDK's rte_ring. There is always a single consumer; producers are either a single
+ * thread (ring_sp_*) or any number of threads (ring_mp_*), and one ring must stick to one kind.
+ * Objects move in batches, so the index updates and their cache line transfers are paid once per
+ * batch rather than once per object.
+ *
+ * A multi-producer enqueue claims its slots by moving prod_head forward with a compare and swap,
+ * fills them, then waits for the producers that claimed earlier slots to publish theirs before
+ * moving prod_tail past its own. The consumer only ever looks at prod_tail, so it never sees a
+ * slot that is claimed but not filled yet.
+ */
+struct ring {
+    uint32_t size; // slots, power of two
+    uint32_t mask;
+
+    _Atomic uint32_t prod_head __attribute__((aligned(CACHELINE_SIZE))); // next slot a producer claims
+    _Atomic uint32_t prod_tail; // slots before this one are filled and visible to the consumer
+    _Atomic uint32_t cons_head __attribute__((aligned(CACHELINE_SIZE))); // next slot the consumer takes
+
+    void *slots[] __attribute__((aligned(CACHELINE_SIZE)));
+};
+
+/* Allocate a ring of size slots, size must be a power of two. NULL on failure */
+static inline struct ring *ring_create(uint32_t size) {
+    struct ring *r;
+    size_t len = sizeof(struct ring) + size * sizeof(void *);
+
+    if (size < 2 || (size & (size - 1))) {
+        return NULL;
+    }
+
+    // aligned_alloc wants a multiple of the alignment
+    len = (len + CACHELINE_SIZE - 1) & ~(size_t)(CACHELINE_SIZE - 1);
+    r = aligned_alloc(CACHELINE_SIZE, len);
+    if (!r) {
+        return NULL;
+    }
+    memset(r, 0, len);
+    r->size = size;
+    r->mask = size - 1;
+    return r;
+}
+
+/* Free a ring, whatever is still on it is the caller's problem */
+static inline void ring_free(struct ring *r) {
+    free(r);
+}
+
+/* Objects waiting for the consumer */
+static inline uint32_t ring_count(struct ring *r) {
+    return atomic_load_explicit(&r->prod_tail, memory_order_acquire) -
+           atomic_load_explicit(&r->cons_head, memory_order_acquire);
+}
+
+/* Back off while another producer finishes publishing, politely since it may share our core */
+static inline void ring_relax(int *spins) {
+    if (++*spins < 64) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+        return;
+    }
+    *spins = 0;
+    sched_yield();
+}
+
+/* Copy n objects into the slots starting at index head */
+static inline void ring_fill(struct ring *r, uint32_t head, void *const *objs, uint32_t n) {
+    uint32_t i;
+
+    for (i = 0; i < n; i++) {
+        r->slots[(head + i) & r->mask] = objs[i];
+    }
+}
+
+/* Single producer enqueue of up to n objects. Returns how many fit, the rest stay with the caller */
+static inline uint32_t ring_sp_enqueue_burst(struct ring *r, void *const *objs, uint32_t n) {
+    uint32_t head = atomic_load_explicit(&r->prod_head, memory_order_relaxed);
+    uint32_t room = r->size - (head - atomic_load_explicit(&r->cons_head, memory_order_acquire));
+
+    if (n > room) {
+        n = room;
+    }
+    if (n == 0) {
+        return 0;
+    }
+
+    ring_fill(r, head, objs, n);
+    atomic_store_explicit(&r->prod_head, head + n, memory_order_relaxed);
+    atomic_store_explicit(&r->prod_tail, head + n, memory_order_release);
+    return n;
+}
+
+/* Multi producer enqueue of up to n objects. Returns how many fit, the rest stay with the caller */
+static inline uint32_t ring_mp_enqueue_burst(struct ring *r, void *const *objs, uint32_t n) {
+    uint32_t head = atomic_load_explicit(&r->prod_head, memory_order_relaxed);
+    uint32_t want = n, room;
+    int spins = 0;
+
+    // claim the slots, a failed compare and swap reloads head and we size the batch again
+    do {
+        room = r->size - (head - atomic_load_explicit(&r->cons_head, memory_order_acquire));
+        n = want < room ? want : room;
+        if (n == 0) {
+            return 0;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&r->prod_head, &head, head + n,
+                                                    memory_order_relaxed, memory_order_relaxed));
+
+    ring_fill(r, head, objs, n);
+
+    // publish in claim order, the slots before ours must be visible first
+    while (atomic_load_explicit(&r->prod_tail, memory_order_relaxed) != head) {
+        ring_relax(&spins);
+    }
+    atomic_store_explicit(&r->prod_tail, head + n, memory_order_release);
+    return n;
+}
+
+/* Single consumer dequeue of up to n objects. Returns how many were taken */
+static inline uint32_t ring_sc_dequeue_burst(struct ring *r, void **objs, uint32_t n) {
+    uint32_t tail = atomic_load_explicit(&r->cons_head, memory_order_relaxed);
+    uint32_t avail = atomic_load_explicit(&r->prod_tail, memory_order_acquire) - tail;
+    uint32_t i;
+
+    if (n > avail) {
+        n = avail;
+    }
+    for (i = 0; i < n; i++) {
+        objs[i] = r->slots[(tail + i) & r->mask];
+    }
+
+    // hands the slots back to the producers
+    if (n) {
+        atomic_store_explicit(&r->cons_head, tail + n, memory_order_release);
+    }
+    return n;
+}
+
+#endif /* RING_H */
@@ -0,0 +1,42 @@
+#ifndef RSS_H
+#define RSS_H
+
+#include <stdint.h>
+
+#include "pktbuf.h"
+
+#define RSS_MAX_WORKERS 16
+#define RSS_RETA_SIZE   128  // indirection table entries, hash buckets mapped to workers
+#define RSS_RING_SIZE   1024 // frames queued per worker, power of two
+
+/*
+ * Software receive side scaling. The device has a single queue, so the RX thread becomes a
+ * dispatcher: it hashes each frame's IP 5-tuple with a symmetric Toeplitz hash, looks the hash up
+ * in the indirection table and queues the frame to that worker thread, which runs the protocol
+ * layers. Both directions of a flow hash the same, so a flow is always processed in order by one
+ * worker. Fragments hash on the addresses only since only the first one carries the ports, and
+ * anything that isn't IP goes to worker 0. Timers keep running on the RX thread.
+ */
+
+/* Build the hash's lookup tables, rss_start does it too */
+void rss_init(void);
+
+/* Flow hash of an Ethernet frame, 0 for anything that isn't IPv4 */
+uint32_t rss_hash(const uint8_t *frame, uint32_t len);
+
+/* Start nworkers worker threads and route received frames through them */
+int rss_start(int nworkers);
+
+/* Non-zero while frames go through the workers */
+int rss_enabled(void);
+
+/* Stage a received frame (data at the Ethernet header) for its worker. Consumes pkt */
+void rss_dispatch(struct pktbuf *pkt);
+
+/* Queue the frames staged since the last call, one batch per worker, and wake those workers. Once per RX burst */
+void rss_kick(void);
+
+/* Stop the workers, dropping whatever they still had queued */
+void rss_stop(void);
+
+#endif /* RSS_H */
@@ -0,0 +1,90 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/*
+ * Shared-memory socket interface between the daemon and client processes. Every socket is a
+ * channel of its own: a client connects to the daemon's Unix control socket and gets back a
+ * memfd holding the channel (struct ts_shm) plus two eventfds, one per direction. Requests go
+ * through the submission ring, results come back on the completion ring, payloads sit in the
+ * channel's buffers. Both rings have a single producer and a single consumer, and each side
+ * only writes its own index.
+ *
+ * Nobody makes a syscall while the other side keeps up. A consumer spins for a while on an empty
+ * ring, then sets its sleeping flag, checks the ring again and blocks on its eventfd. A producer
+ * only writes the eventfd when it fills a ring the consumer sleeps on.
+ *
+ * This header is shared by the daemon and the client library, it must not pull in stack internals.
+ */
+#define TS_SHM_MAGIC   0x74737368 // "tssh"
+#define TS_SHM_VERSION 2
+#define TS_RING_SIZE   64         // entries per ring, power of two
+#define TS_NBUFS       64         // payload buffers per channel
+#define TS_BUF_SIZE    16384
+#define TS_SPIN_NS     50000      // how long a consumer polls before going to sleep
+#define TS_SOCK_PATH   "/tmp/tenstack.sock"
+
+/*
+ * Requests. Reads (RECV, RECVFROM, ACCEPT) and TCP sends wait for the network, so the daemon runs
+ * each kind on a thread of its own, and nothing queues up behind them: reads one at a time, sends
+ * in order. All other requests execute right away and in order, a close after the sends before it.
+ */
+#define TS_OP_LISTEN   1 // arg0 port, arg1 backlog, arg2 nonzero to share the port (reuseport)
+#define TS_OP_ACCEPT   2 // on a listener. Result is a token for TS_OP_ADOPT, addr and port are the peer's
+#define TS_OP_CONNECT  3 // addr, arg0 port
+#define TS_OP_SEND     4 // buf, len. Completes as soon as the data is queued, the buffer is free again
+#define TS_OP_RECV     5 // buf, len. Result is the bytes read, 0 at end of stream
+#define TS_OP_BIND     6 // arg0 port (0 = ephemeral), arg2 nonzero to share the port. Makes this a UDP socket
+#define TS_OP_SENDTO   7 // buf, len, addr, arg0 port
+#define TS_OP_RECVFROM 8 // buf, len. Completion carries the sender's addr and port
+#define TS_OP_SETOPT   9 // arg0 option (TCP_NODELAY, TCP_CORK), arg1 value
+#define TS_OP_CLOSE    10
+#define TS_OP_ADOPT    11 // arg0 listener channel id, arg1 token from its ACCEPT. This channel becomes the connection, from the accepting process only
+#define TS_OP_SHUTDOWN 12 // arg0 SHUT_RD, SHUT_WR or SHUT_RDWR. Queued sends go out before the FIN
+
+/* Submission entry */
+struct ts_sqe {
+    uint64_t user_data; // echoed in the completion
+    uint16_t op;
+    uint16_t buf;       // payload buffer index
+    uint32_t len;
+    uint32_t addr;      // IPv4 address, network byte order
+    uint32_t arg0;
+    uint32_t arg1;
+    uint32_t arg2;
+};
+
+/* Completion entry */
+struct ts_cqe {
+    uint64_t user_data;
+    int32_t result;     // >= 0 on success, -errno on failure
+    uint16_t buf;
+    uint16_t port;      // RECVFROM/ACCEPT: peer port, host byte order. LISTEN/BIND: the bound port
+    uint32_t addr;      // RECVFROM/ACCEPT: peer address
+};
+
+/* One direction of a channel */
+#define TS_RING(name, type)                                                              \
+    struct name {                                                                        \
+        _Atomic uint32_t head __attribute__((aligned(64)));  /* next entry to fill */     \
+        _Atomic uint32_t tail __attribute__((aligned(64)));  /* next entry to consume */  \
+        _Atomic uint32_t sleeping;                           /* consumer waits on its eventfd */ \
+        type entries[TS_RING_SIZE] __attribute__((aligned(64)));                         \
+    }
+
+TS_RING(ts_sq, struct ts_sqe);
+TS_RING(ts_cq, struct ts_cqe);
+
+/* The shared region of one channel */
+struct ts_shm {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t id;        // channel id, names a listener in TS_OP_ADOPT
+    struct ts_sq sq;    // client -> daemon
+    struct ts_cq cq;    // daemon -> client
+    uint8_t bufs[TS_NBUFS][TS_BUF_SIZE] __attribute__((aligned(64)));
+};
+
+#endif /* SHM_H */
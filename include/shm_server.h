@@ -0,0 +1,15 @@
+#ifndef SHM_SERVER_H
+#define SHM_SERVER_H
+
+#include "shm.h"
+
+#define SHM_CHAN_HASH 256 // channel id lookup buckets, power of two
+
+/*
+ * Serve shared-memory sockets (see shm.h) to client processes on the Unix socket at path. Every
+ * channel gets threads of its own that execute its requests with the blocking socket calls, so
+ * one slow socket never holds up another. Returns when *running drops to 0
+ */
+int shm_server_run(const char *path, volatile int *running);
+
+#endif /* SHM_SERVER_H */
@@ -0,0 +1,138 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "list.h"
+#include "histogram.h"
+#include "trace.h"
+#include "utils.h"
+
+/*
+ * Stack-wide counters in the spirit of the kernel's /proc/net/snmp and /proc/net/netstat. Every
+ * thread that touches the stack counts into a block of its own, so the fast path is a plain add
+ * to a cache line nobody else writes: no locked instruction and no bouncing between cores. A
+ * reader adds up all the blocks when it wants the numbers. A thread's block is folded into the
+ * totals when the thread exits, so short-lived threads (one per echoed connection) lose nothing.
+ */
+enum stat_id {
+    // Link: the device and the Ethernet layer
+    STAT_LINK_IN_FRAMES,
+    STAT_LINK_IN_RUNTS,         // shorter than an Ethernet header
+    STAT_LINK_IN_UNKNOWN_TYPES, // neither IP nor ARP
+    STAT_LINK_IN_ERRORS,        // device read failed
+    STAT_LINK_IN_DROPS,         // a worker's or the protocol thread's ring was full
+    STAT_LINK_IN_PRESSURE_DROPS, // dropped on arrival because the stack is short of memory
+    STAT_LINK_IN_PRESSURE_TRIMS, // TCP segments whose payload was dropped on arrival, their ACK kept
+    STAT_LINK_OUT_FRAMES,
+    STAT_LINK_OUT_ERRORS,       // device write failed
+    STAT_LINK_OUT_DROPS,        // the pipeline's TX ring was full
+
+    STAT_ARP_IN_REQUESTS,
+    STAT_ARP_IN_REPLIES,
+    STAT_ARP_IN_ERRORS,         // truncated or not Ethernet/IPv4
+    STAT_ARP_OUT_REQUESTS,
+    STAT_ARP_OUT_REPLIES,
+    STAT_ARP_UNRESOLVED,        // lookups that missed and sent a request instead
+    STAT_ARP_NOT_LEARNED,       // unknown senders that neither answered us nor asked for our address
+    STAT_ARP_RATE_LIMITED,      // frames from senders over their rate, ignored
+    STAT_ARP_EVICTIONS,         // entries pushed out of a full cache
+    STAT_ARP_STALE_LOADED,      // entries read from a snapshot at startup
+    STAT_ARP_STALE_PROBES,      // stale entries put to use, and a request sent to confirm them
+
+    STAT_IP_IN_RECEIVES,
+    STAT_IP_IN_HDR_ERRORS,
+    STAT_IP_IN_CSUM_ERRORS,
+    STAT_IP_IN_ADDR_ERRORS,     // not for our address
+    STAT_IP_IN_UNKNOWN_PROTOS,
+    STAT_IP_IN_DELIVERS,
+    STAT_IP_OUT_REQUESTS,
+    STAT_IP_OUT_DISCARDS,       // no room for the header or no MAC for the destination yet
+
+    STAT_ICMP_IN_MSGS,
+    STAT_ICMP_IN_ERRORS,
+    STAT_ICMP_IN_CSUM_ERRORS,
+    STAT_ICMP_IN_DEST_UNREACHS,
+    STAT_ICMP_IN_ECHOS,
+    STAT_ICMP_IN_ECHO_REPS,
+    STAT_ICMP_OUT_MSGS,
+    STAT_ICMP_OUT_DEST_UNREACHS,
+    STAT_ICMP_OUT_ECHOS,
+    STAT_ICMP_OUT_ECHO_REPS,
+
+    STAT_TCP_ACTIVE_OPENS,
+    STAT_TCP_PASSIVE_OPENS,
+    STAT_TCP_IN_SEGS,
+    STAT_TCP_OUT_SEGS,          // super-frames count every segment they carry
+    STAT_TCP_RETRANS_SEGS,
+    STAT_TCP_IN_ERRS,
+    STAT_TCP_OUT_RSTS,
+    STAT_TCP_IN_CSUM_ERRORS,
+
+    STAT_UDP_IN_DATAGRAMS,
+    STAT_UDP_NO_PORTS,
+    STAT_UDP_IN_ERRORS,
+    STAT_UDP_OUT_DATAGRAMS,
+    STAT_UDP_RCVBUF_ERRORS,     // the socket's receive ring or buffer was full
+    STAT_UDP_IN_CSUM_ERRORS,
+
+    // TcpExt: listener and handshake events
+    STAT_TCP_SYN_RECV,          // SYNs that reached a listener
+    STAT_TCP_SYNCOOKIES_SENT,   // SYN-ACKs carrying a cookie because the SYN queue was full
+    STAT_TCP_SYNCOOKIES_RECV,   // ACKs with a valid cookie, connections set up without a queued request
+    STAT_TCP_SYNCOOKIES_FAILED, // ACKs to a listener matching neither a request nor a cookie
+    STAT_TCP_SYNACK_TIMEOUTS,   // requests given up after TCP_SYNACK_RETRIES
+    STAT_TCP_LISTEN_DROPS,      // SYNs or handshakes dropped because the accept queue was full
+    STAT_TCP_RCVQ_DROP,         // in-order data dropped because the receive buffer was full
+    STAT_TCP_OFO_DROP,          // out-of-order data dropped, receive buffer full or memory pressure
+    STAT_TCP_OFO_PRUNED,        // out-of-order queues given up under memory pressure
+
+    STAT_MAX
+};
+
+/* One thread's counters, a whole number of cache lines so neighbouring blocks never share one */
+struct stats_block {
+    list_head list; // on the list of live blocks
+    _Atomic uint64_t v[STAT_MAX];
+#ifdef PKT_TRACE
+    struct histogram lat[TRACE_STAGE_MAX]; // cycles, read without a lock so a dump may be a sample off
+#endif
+} __attribute__((aligned(CACHELINE_SIZE)));
+
+extern __thread struct stats_block *stats_local;
+
+/* Give the calling thread its block. NULL if out of memory, the count is lost then */
+struct stats_block *stats_block_new(void);
+
+/* Count n events on the calling thread. Only the owner writes a block, readers may load it any time */
+static inline void stats_add(enum stat_id id, uint64_t n) {
+    struct stats_block *b = stats_local;
+
+    if (__builtin_expect(!b, 0) && !(b = stats_block_new())) {
+        return;
+    }
+    atomic_store_explicit(&b->v[id], atomic_load_explicit(&b->v[id], memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+#define STATS_INC(id) stats_add(id, 1)
+#define STATS_ADD(id, n) stats_add(id, n)
+
+/* Add up every thread's counters into out */
+void stats_snapshot(uint64_t out[STAT_MAX]);
+
+/* Print all counters, each group as a line of names and a line of values like /proc/net/snmp, then memory usage and the stage latencies of a TRACE=1 build */
+void stats_dump(FILE *f);
+
+/* Serve stats_dump to anyone connecting to the Unix socket at path, from a thread of its own */
+int stats_server_start(const char *path);
+
+/* Stop serving and remove the socket */
+void stats_server_stop(void);
+
+/* Fetch the dump from a stack serving it at path and print it to stdout */
+int stats_query(const char *path);
+
+#endif /* STATS_H */
@@ -2,10 +2,17 @@
 #define TAP_H
 
 /* creates and configures a TAP dev */
-//int alloc_tap(char *dev);
+//int alloc_tap(char *dev, int *vnet_hdr, int multi_queue);
 
-/* Completes network interface setup with naming options */
-int setup_network_if(char *tap_name, int choose_name, char* cidr);
+/*
+ * Completes network interface setup with naming options. *vnet_hdr asks for virtio_net_hdr framing,
+ * on return it says whether the device has it. With multi_queue set the fd is the device's first
+ * queue and tap_open_queue adds more
+ */
+int setup_network_if(char *tap_name, int choose_name, char* cidr, int *vnet_hdr, int multi_queue);
+
+/* Open another queue of a multiqueue TAP device, returns its fd */
+int tap_open_queue(char *dev, int vnet_hdr);
 
 /* Read raw data from TAP device */
 int tap_read(int tapfd, unsigned char *buffer, int len);
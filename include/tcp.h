@@ -0,0 +1,433 @@
+#ifndef TCP_H
+#define TCP_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "pktbuf.h"
+#include "list.h"
+#include "itree.h"
+#include "timer.h"
+#include "tcp_cong.h"
+#include "zerocopy.h"
+#include "reuseport.h"
+#include "ethernet.h"
+#include "ip.h"
+
+/* TCP flags */
+#define TCP_FIN 0x01
+#define TCP_SYN 0x02
+#define TCP_RST 0x04
+#define TCP_PSH 0x08
+#define TCP_ACK 0x10
+#define TCP_URG 0x20
+#define TCP_ECE 0x40
+#define TCP_CWR 0x80
+
+/* TCP option kinds */
+#define TCPOPT_EOL       0
+#define TCPOPT_NOP       1
+#define TCPOPT_MSS       2
+#define TCPOPT_WSCALE    3
+#define TCPOPT_SACK_PERM 4
+#define TCPOPT_SACK      5
+#define TCPOPT_TIMESTAMP 8
+
+#define TCPOLEN_MSS       4
+#define TCPOLEN_WSCALE    3
+#define TCPOLEN_SACK_PERM 2
+#define TCPOLEN_TIMESTAMP 10
+#define TCPOLEN_TSTAMP_ALIGNED 12 // NOP NOP TIMESTAMP
+#define TCP_MAX_OPTLEN    40
+#define TCP_MAX_SACKS     4
+
+/* TCP connection states */
+#define TCP_CLOSED       0
+#define TCP_LISTEN       1
+#define TCP_SYN_SENT     2
+#define TCP_SYN_RECEIVED 3
+#define TCP_ESTABLISHED  4
+#define TCP_FIN_WAIT_1   5
+#define TCP_FIN_WAIT_2   6
+#define TCP_CLOSE_WAIT   7
+#define TCP_CLOSING      8
+#define TCP_LAST_ACK     9
+#define TCP_TIME_WAIT    10
+
+/* Tunables */
+#define TCP_DEFAULT_MSS   536               // when the peer doesn't tell us
+#define TCP_SNDBUF        (4 * 1024 * 1024) // bytes we buffer for sending
+#define TCP_RCVBUF        (4 * 1024 * 1024) // bytes we buffer for receiving, decides our window scale
+#define TCP_MAX_WSCALE    14
+#define TCP_INIT_CWND     10                // segments (RFC 6928)
+#define TCP_RTO_INIT_MS   1000
+#define TCP_RTO_MIN_MS    200
+#define TCP_RTO_MAX_MS    60000
+#define TCP_DELACK_MS     40                // delayed ACK timeout
+#define TCP_DUPTHRESH     3                 // dupACKs or SACKed segments that mean loss without timing information
+#define TCP_PTO_MIN_MS    10                // tail loss probe timeout floor
+#define TCP_WC_DELACK_MS  200               // worst case delayed ACK timer of a peer
+#define TCP_QUICKACKS     16                // segments ACKed immediately at connection start
+#define TCP_TIMEWAIT_MS   60000             // 2 * MSL
+#define TCP_SYN_RETRIES   5
+#define TCP_MAX_RETRIES   15
+#define TCP_EHASH_SIZE    4096              // established connection buckets, power of two
+#define TCP_LHASH_SIZE    256               // listening socket buckets, power of two
+#define TCP_FLOW_SLOTS    1024              // per-thread flow table entries, power of two
+#define TCP_FLOW_GC_SLOTS 64                // flow table entries checked per tcp_flow_gc call
+#define TCP_SYNQ_HASH     64                // half-open request buckets per listener, power of two
+#define TCP_SYNACK_RETRIES 5
+#define TCP_COOKIE_WINDOW_MS 120000         // ACKs are checked for cookies this long after the SYN queue overflowed
+#define TCP_GSO_MAX_SIZE  65000             // payload per super-frame, the IP length field has to hold it
+#define TCP_MAX_HEADER    (sizeof(struct eth_header) + sizeof(struct ip_header) + sizeof(struct tcp_header) + TCP_MAX_OPTLEN)
+
+/* Socket options */
+#define TCP_NODELAY  1 // disable Nagle, send small segments right away
+#define TCP_CORK     2 // hold back partial segments until uncorked
+#define TCP_NONBLOCK 3 // calls return -1/EAGAIN instead of waiting
+
+/* TCP header */
+struct tcp_header {
+    uint16_t sport;     // source port
+    uint16_t dport;     // destination port
+    uint32_t seq;       // sequence number of the first data byte (or the SYN)
+    uint32_t ack_seq;   // next sequence number we expect from the peer, valid with ACK
+    uint8_t rsvd : 4;   // reserved. These two lines pack two 4-bit fields into a single byte
+    uint8_t doff : 4;   // header length in 32-bit words, options included
+    uint8_t flags;      // FIN, SYN, RST, PSH, ACK, URG
+    uint16_t win;       // receive window, scaled by the window scale option outside of SYNs
+    uint16_t csum;      // checksum over pseudo header, header and data
+    uint16_t urp;       // urgent pointer (unused)
+    uint8_t options[];
+} __attribute__((packed));
+
+/* Options parsed from a received segment */
+struct tcp_options {
+    uint16_t mss;
+    uint8_t wscale;
+    uint8_t saw_mss : 1;
+    uint8_t saw_wscale : 1;
+    uint8_t sack_ok : 1;
+    uint8_t saw_tstamp : 1;
+    uint32_t tsval;
+    uint32_t tsecr;
+    int num_sacks;
+    struct {
+        uint32_t start, end;
+    } sacks[TCP_MAX_SACKS];
+};
+
+/* Per-segment state kept in pktbuf->cb */
+struct tcp_skb_cb {
+    uint32_t seq;          // first sequence number
+    uint32_t end_seq;      // seq + data length, +1 for SYN or FIN
+    uint64_t tx_ns;        // last (re)transmission time
+    uint8_t tcp_flags;     // flags sent with / received on this segment
+    uint8_t sacked;        // TCPCB_* scoreboard bits
+    uint8_t csum_ok;       // send side: csum is current, cleared whenever the payload changes
+    uint32_t csum;         // partial checksum of the payload, summed once for software GSO
+    union {
+        struct itree_node ooo;     // receive side: out-of-order queue linkage, same range as seq/end_seq
+        struct {
+            uint32_t delivered;    // sk->delivered when sent
+            uint32_t app_limited;  // sent while the sender was application limited
+            uint64_t delivered_ns; // sk->delivered_ns when sent
+            uint64_t first_tx_ns;  // sk->first_tx_ns when sent
+        } tx;                      // send side: delivery rate estimation
+    };
+};
+
+#define TCP_CB(pkt) ((struct tcp_skb_cb *)(pkt)->cb)
+_Static_assert(sizeof(struct tcp_skb_cb) <= sizeof(((struct pktbuf *)0)->cb), "tcp_skb_cb doesn't fit in pktbuf cb");
+
+/* Scoreboard bits */
+#define TCPCB_SACKED  0x01 // peer has it (selectively acknowledged)
+#define TCPCB_LOST    0x02 // considered lost, needs retransmission
+#define TCPCB_RETRANS 0x04 // retransmitted and not yet acknowledged
+#define TCPCB_EVER_RETRANS 0x08 // retransmitted at least once, no RTT samples from it (Karn)
+
+/*
+ * A half-open connection. Listeners keep one of these per SYN instead of a full socket, the
+ * tcp_sock only gets created once the handshake's final ACK shows up. When the SYN queue is full
+ * the same fields travel in a SYN cookie instead and nothing is kept at all
+ */
+struct tcp_request_sock {
+    list_head list;            // linkage in the listener's SYN queue hash
+    uint32_t saddr, daddr;     // network byte order, saddr is ours
+    uint16_t sport, dport;     // host byte order
+    uint32_t irs;              // their ISN
+    uint32_t iss;              // ours, a cookie if the request isn't queued
+    uint32_t snd_wnd;          // window from their SYN, never scaled
+    uint16_t peer_mss;
+    uint8_t snd_wscale;
+    uint8_t wscale_ok : 1;
+    uint8_t sack_ok : 1;
+    uint8_t ts_ok : 1;
+    uint32_t ts_recent;        // timestamp to echo in the SYN-ACK
+    int retries;               // SYN-ACK retransmissions so far
+    uint64_t syn_tx_ns;        // first SYN-ACK, for the initial RTT sample
+    uint64_t expires;          // next SYN-ACK retransmission
+};
+
+/* A TCP endpoint: listener or connection */
+struct tcp_sock {
+    list_head hash_list;       // linkage in the established or listening hash
+    pthread_mutex_t lock;
+    pthread_cond_t wait;       // applications blocked in connect/accept/send/recv
+    atomic_int refcnt;
+    int state;
+    int err;                   // pending error for the application (ECONNRESET, ...)
+    int hashed;
+    int orphan;                // the application closed it, the stack finishes the shutdown
+
+    /* Addresses in network byte order, ports in host byte order */
+    uint32_t saddr, daddr;
+    uint16_t sport, dport;
+
+    /* Send sequence space */
+    uint32_t iss;
+    uint32_t snd_una;          // oldest unacknowledged sequence number
+    uint32_t snd_nxt;          // next sequence number to send
+    uint32_t snd_wnd;          // peer's receive window, already scaled
+    uint32_t snd_wl1, snd_wl2; // seq and ack of the segment that last updated snd_wnd
+    uint32_t max_window;       // largest window the peer ever offered
+    uint16_t mss;              // largest payload per segment (options excluded)
+    uint16_t peer_mss;
+
+    /* Receive sequence space */
+    uint32_t irs;
+    uint32_t rcv_nxt;          // next sequence number expected
+    uint32_t rcv_wnd;          // window we last advertised
+    uint32_t rcv_wup;          // rcv_nxt when we last advertised it
+    uint32_t rcv_buf;          // receive buffer limit
+
+    /* Negotiated options */
+    uint8_t snd_wscale;        // shift applied to windows the peer sends
+    uint8_t rcv_wscale;        // shift applied to windows we send
+    uint8_t wscale_ok : 1;
+    uint8_t sack_ok : 1;
+    uint8_t ts_ok : 1;
+    uint32_t ts_recent;        // latest timestamp from the peer, echoed back (RFC 7323)
+    uint32_t ts_recent_stamp;  // our clock when ts_recent was updated
+
+    /* RTT measurement (RFC 6298), microseconds */
+    uint32_t srtt_us;
+    uint32_t rttvar_us;
+    uint32_t rto_ms;
+    int backoff;               // RTO doublings since the last forward progress
+    int retries;
+    uint64_t syn_tx_ns;        // when the SYN or SYN-ACK went out, for the first RTT sample
+
+    /* Congestion control, windows in segments */
+    struct tcp_cong_ops *ca_ops;
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    uint32_t cwnd_cnt;         // ACKed segments towards the next congestion avoidance increment
+    uint32_t dupacks;
+    uint32_t high_seq;         // snd_nxt when recovery started, recovery ends once it's ACKed
+    int in_recovery;
+    uint64_t ca_priv[TCP_CA_PRIV_SIZE / 8]; // algorithm private state
+
+    /* RACK-TLP loss detection (RFC 8985) */
+    uint32_t min_rtt_us;       // lowest RTT seen
+    uint64_t rack_xmit_ns;     // send time of the most recently sent segment known delivered, 0 before any
+    uint32_t rack_end_seq;     // its end, orders segments sent in the same instant
+    uint32_t rack_rtt_us;      // RTT it measured
+    uint32_t rack_fack;        // highest end_seq delivered, delivering below it means reordering
+    uint8_t rack_reord : 1;    // the path reorders, keep a reordering window even in recovery
+    uint8_t rack_advanced : 1; // rack_xmit_ns moved, loss detection has work to do
+    uint8_t tlp_retrans : 1;   // the outstanding loss probe was a retransmission
+    uint32_t tlp_high_seq;     // snd_nxt when the loss probe went out, 0 if none is outstanding
+
+    /* Delivery rate estimation (draft-cheng-iccrg-delivery-rate-estimation) */
+    uint32_t delivered;        // segments ever delivered (ACKed or SACKed)
+    uint64_t delivered_ns;     // when delivered last went up
+    uint64_t first_tx_ns;      // send time of the segment that started the current interval
+    uint32_t app_limited;      // delivered count at which an application limited period ends, 0 if not limited
+
+    /* Pacing */
+    uint64_t pacing_rate;      // bytes per second, 0 = unpaced
+    uint64_t pacing_next_ns;   // earliest time the next segment may go out
+
+    /* Send queue: a pktbuf chain of segments, the acknowledged ones are freed from the front */
+    list_head write_queue;
+    struct pktbuf *send_head;  // first segment never sent, NULL if all were
+    uint32_t write_seq;        // sequence number after the last byte queued by the application
+    uint32_t sndbuf;           // send buffer limit
+    uint32_t packets_out;      // segments sent and not yet cumulatively ACKed
+    uint32_t sacked_out;       // ... of those, SACKed
+    uint32_t lost_out;         // ... of those, marked lost
+    uint32_t retrans_out;      // ... of those, retransmitted and still outstanding
+    uint32_t highest_sack;     // end of the highest SACKed range
+
+    /* Receive queue: in-order pktbufs waiting for the application, payloads read in place */
+    list_head rcv_queue;
+    uint32_t rcv_queue_bytes;
+    struct itree ooo_queue;    // out-of-order segments keyed by sequence range
+    uint32_t ooo_bytes;
+    uint32_t ooo_last_start;   // most recently queued out-of-order range, reported first in SACKs
+    uint32_t ooo_last_end;
+    int rcv_shutdown;          // FIN received, no more data will come
+
+    /* ACK scheduling */
+    int ack_pending;           // data arrived that we haven't ACKed yet
+    int ack_now;               // send the ACK at the end of this RX burst
+    int quickacks;             // remaining segments to ACK without delay
+    uint32_t rcv_segs;         // full-sized segments received since our last ACK
+    list_head ack_list;        // linkage in the per-burst ACK flush list
+
+    /* Send policy */
+    int nodelay;
+    int cork;
+    int nonblock;
+    int fin_queued;            // the application closed its side, FIN goes after the data
+
+    /* Timers */
+    struct timer rto_timer;    // retransmission, zero window probes, SYN retries
+    struct timer delack_timer;
+    struct timer tw_timer;     // TIME_WAIT
+    struct timer pacing_timer; // releases segments held back by pacing
+    struct timer rack_timer;   // RACK reordering window expiry
+    struct timer tlp_timer;    // tail loss probe
+
+    /* Listening sockets */
+    struct tcp_sock *parent;   // listener this connection came from, until accepted
+    list_head accept_queue;    // established children waiting for tcp_accept
+    list_head accept_list;     // linkage in the parent's accept queue
+    int backlog;               // bounds both the SYN queue and the accept queue
+    list_head *syn_table;      // half-open requests hashed by 4-tuple, TCP_SYNQ_HASH buckets
+    int syn_count;             // requests in syn_table
+    int accept_count;
+    uint64_t cookie_ns;        // last time the SYN queue overflowed and we sent a cookie
+    struct reuseport *reuse;   // listeners sharing this address and port, NULL if it's not shared
+};
+
+/* Segments the network may still be holding: sent, not (S)ACKed and not presumed lost (RFC 6675 pipe) */
+static inline uint32_t tcp_packets_in_flight(struct tcp_sock *sk) {
+    return sk->packets_out - (sk->sacked_out + sk->lost_out) + sk->retrans_out;
+}
+
+/* Initialize TCP module */
+void tcp_init(void);
+
+/* Handle an incoming TCP segment (data points at the TCP header) */
+void tcp_recv(struct pktbuf *pkt);
+
+/* Send the ACKs that were coalesced during an RX burst */
+void tcp_flush_acks(void);
+
+/*
+ * Each thread that runs tcp_recv keeps a small direct-mapped flow table of connections in front
+ * of the shared hash, indexed by the packet's RSS hash. With RSS a worker only ever sees its own
+ * flows, so lookups mostly stay on this thread's cache lines and skip the hash table lock. The
+ * table holds references: tcp_flow_gc lets go of a few closed connections at a time when the
+ * thread is idle, tcp_flow_flush drops the whole table before the thread exits
+ */
+void tcp_flow_gc(void);
+void tcp_flow_flush(void);
+
+/* Open a listening socket on a local address (0 = any) and port */
+struct tcp_sock *tcp_listen(uint32_t addr, uint16_t port, int backlog);
+
+/*
+ * Same, but any number of listeners opened this way may share the address and port, one per worker
+ * thread. Each gets its own SYN and accept queues, new connections are spread over them by 4-tuple
+ */
+struct tcp_sock *tcp_listen_reuseport(uint32_t addr, uint16_t port, int backlog);
+
+/* Wait for and return the next established connection on a listener */
+struct tcp_sock *tcp_accept(struct tcp_sock *lsk);
+
+/* Open a connection, address in network byte order and port in host byte order */
+struct tcp_sock *tcp_connect(uint32_t daddr, uint16_t dport);
+
+/* Queue data for sending, returns bytes accepted or -1 */
+int tcp_send(struct tcp_sock *sk, const void *buf, int len);
+
+/*
+ * Queue data for sending without copying it. Segments reference buf until the peer ACKs them, then
+ * cookie shows up on cq. Returns bytes accepted or -1, and there's no completion if nothing was
+ */
+int tcp_send_zc(struct tcp_sock *sk, const void *buf, int len, struct zc_queue *cq, uint64_t cookie);
+
+/* Read received data, returns bytes read, 0 at end of stream or -1 */
+int tcp_recv_data(struct tcp_sock *sk, void *buf, int len);
+
+/* Set a socket option (TCP_NODELAY, TCP_CORK, TCP_NONBLOCK) */
+int tcp_setsockopt(struct tcp_sock *sk, int opt, int val);
+
+/* Pick the congestion control algorithm ("reno", "cubic", "bbr"), listeners pass it on to their connections */
+int tcp_set_congestion(struct tcp_sock *sk, const char *name);
+
+/*
+ * Shut down one or both directions, how is SHUT_RD, SHUT_WR or SHUT_RDWR. Reading ends once
+ * what's queued is read, writing sends a FIN. Anyone blocked on the socket wakes up
+ */
+int tcp_shutdown(struct tcp_sock *sk, int how);
+
+/* Close the application's side, the stack finishes the shutdown on its own */
+void tcp_close(struct tcp_sock *sk);
+
+/* Print the stack-wide counters */
+void tcp_print_stats(void);
+
+/* Internal, shared between tcp.c, tcp_in.c and tcp_out.c */
+void tcp_sock_hold(struct tcp_sock *sk);
+void tcp_sock_put(struct tcp_sock *sk);
+struct tcp_sock *tcp_sock_alloc(void);
+struct tcp_sock *tcp_lookup(uint32_t laddr, uint16_t lport, uint32_t raddr, uint16_t rport);
+struct tcp_sock *tcp_flow_lookup(uint32_t hash, uint32_t laddr, uint16_t lport, uint32_t raddr, uint16_t rport);
+void tcp_hash(struct tcp_sock *sk);
+void tcp_set_state(struct tcp_sock *sk, int state);
+void tcp_done(struct tcp_sock *sk);
+void tcp_reset_timer(struct tcp_sock *sk, struct timer *t, uint64_t expires);
+void tcp_clear_timer(struct tcp_sock *sk, struct timer *t);
+void tcp_rto_handler(struct timer *t);
+void tcp_delack_handler(struct timer *t);
+void tcp_timewait_handler(struct timer *t);
+uint32_t tcp_new_isn(uint32_t saddr, uint16_t sport, uint32_t daddr, uint16_t dport);
+uint32_t tcp_time_stamp(void);
+void tcp_rtt_sample(struct tcp_sock *sk, uint32_t rtt_us);
+void tcp_enter_loss(struct tcp_sock *sk);
+void tcp_enter_recovery(struct tcp_sock *sk);
+void tcp_pacing_handler(struct timer *t);
+
+/* Listener SYN queue and SYN cookies (tcp_synq.c). Call with the listener's lock held */
+void tcp_synq_init(void);
+int tcp_synq_alloc(struct tcp_sock *lsk);
+struct tcp_request_sock *tcp_synq_find(struct tcp_sock *lsk, uint32_t saddr, uint32_t daddr, uint16_t dport);
+void tcp_synq_add(struct tcp_sock *lsk, struct tcp_request_sock *req);
+void tcp_synq_remove(struct tcp_sock *lsk, struct tcp_request_sock *req);
+void tcp_synq_purge(struct tcp_sock *lsk);
+void tcp_synq_timer(struct tcp_sock *lsk);
+uint32_t tcp_syncookie_make(struct tcp_request_sock *req);
+int tcp_syncookie_check(struct tcp_request_sock *req, uint32_t cookie);
+
+/* RACK-TLP (tcp_recovery.c). Call with sk->lock held */
+void tcp_rack_advance(struct tcp_sock *sk, struct tcp_skb_cb *cb, uint64_t now);
+void tcp_rack_detect_loss(struct tcp_sock *sk);
+void tcp_rack_handler(struct timer *t);
+void tcp_schedule_loss_probe(struct tcp_sock *sk);
+void tcp_tlp_ack(struct tcp_sock *sk, uint32_t ack);
+void tcp_tlp_handler(struct timer *t);
+
+void tcp_parse_options(struct tcp_header *th, struct tcp_options *opts);
+void tcp_sync_mss(struct tcp_sock *sk);
+uint32_t tcp_select_window(struct tcp_sock *sk);
+void tcp_rcv_space_update(struct tcp_sock *sk);
+
+int tcp_send_syn(struct tcp_sock *sk);
+int tcp_send_synack(struct tcp_sock *sk);
+int tcp_send_synack_req(struct tcp_sock *lsk, struct tcp_request_sock *req);
+int tcp_send_ack(struct tcp_sock *sk);
+void tcp_send_reset(struct pktbuf *in);
+void tcp_send_active_reset(struct tcp_sock *sk);
+void tcp_send_probe(struct tcp_sock *sk);
+void tcp_schedule_ack(struct tcp_sock *sk);
+void tcp_write_xmit(struct tcp_sock *sk, int push_one);
+int tcp_retransmit_pkt(struct tcp_sock *sk, struct pktbuf *pkt);
+void tcp_xmit_retransmit_queue(struct tcp_sock *sk);
+void tcp_queue_fin(struct tcp_sock *sk);
+
+#endif /* TCP_H */
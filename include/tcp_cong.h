@@ -0,0 +1,76 @@
+#ifndef TCP_CONG_H
+#define TCP_CONG_H
+
+#include <stdint.h>
+#include "list.h"
+
+struct tcp_sock;
+
+#define TCP_CA_NAME_MAX 16
+#define TCP_CA_PRIV_SIZE 128 // bytes of per-connection state an algorithm can keep in the socket
+
+/* Why on_loss was called */
+#define TCP_CA_RECOVERY 1 // fast recovery, dupacks or SACKs showed a hole
+#define TCP_CA_LOSS     2 // retransmission timeout
+
+/* What one ACK delivered, handed to on_ack */
+struct tcp_rate_sample {
+    uint32_t acked;           // segments newly ACKed or SACKed by this ACK
+    uint32_t delivered;       // segments delivered over the sample interval
+    uint32_t prior_delivered; // sk->delivered when the newest delivered segment was sent
+    uint32_t prior_in_flight; // segments in flight before this ACK
+    uint64_t interval_us;     // time the delivery took, 0 if there's no valid sample
+    int64_t rtt_us;           // RTT sample from this ACK, -1 if none
+    int is_app_limited;       // the sender ran out of data during the interval, the rate understates the path
+};
+
+/*
+ * A congestion control algorithm. It owns sk->cwnd and sk->ssthresh, and may set sk->pacing_rate
+ * (bytes per second, 0 leaves the connection unpaced). Per-connection state goes in
+ * tcp_ca_priv(sk). All calls are made with sk->lock held.
+ */
+struct tcp_cong_ops {
+    list_head list;                   // linkage in the registry
+    char name[TCP_CA_NAME_MAX];
+
+    /* Set up a new connection, or one switching to this algorithm (required) */
+    void (*init)(struct tcp_sock *sk);
+
+    /* Data was delivered, grow the window (required). Also called during recovery, sk->in_recovery tells */
+    void (*on_ack)(struct tcp_sock *sk, const struct tcp_rate_sample *rs);
+
+    /* Loss detected (TCP_CA_RECOVERY) or retransmission timeout (TCP_CA_LOSS), cut the window (required) */
+    void (*on_loss)(struct tcp_sock *sk, int event);
+};
+
+#define tcp_ca_priv(sk) ((void *)(sk)->ca_priv)
+
+/* Built-in algorithms */
+extern struct tcp_cong_ops tcp_reno_ops;
+extern struct tcp_cong_ops tcp_cubic_ops;
+extern struct tcp_cong_ops tcp_bbr_ops;
+
+/* Register the built-in algorithms, called from tcp_init */
+void tcp_cong_init(void);
+
+/* Make an algorithm selectable by name */
+int tcp_cong_register(struct tcp_cong_ops *ops);
+
+/* Find an algorithm by name, NULL if unknown */
+struct tcp_cong_ops *tcp_cong_find(const char *name);
+
+/* Algorithm for new connections, "reno" unless changed */
+int tcp_cong_set_default(const char *name);
+struct tcp_cong_ops *tcp_cong_default(void);
+
+/* Switch a connection's algorithm. Call with sk->lock held */
+void tcp_cong_assign(struct tcp_sock *sk, struct tcp_cong_ops *ops);
+
+/* Delivery rate estimation: stamp a segment as it's sent (after setting tx_ns), account for it as it's (S)ACKed */
+struct pktbuf;
+void tcp_rate_skb_sent(struct tcp_sock *sk, struct pktbuf *pkt);
+void tcp_rate_skb_delivered(struct tcp_sock *sk, struct pktbuf *pkt, struct tcp_rate_sample *rs);
+void tcp_rate_gen(struct tcp_sock *sk, struct tcp_rate_sample *rs);
+void tcp_rate_check_app_limited(struct tcp_sock *sk);
+
+#endif /* TCP_CONG_H */
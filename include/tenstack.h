@@ -0,0 +1,87 @@
+#ifndef TENSTACK_H
+#define TENSTACK_H
+
+#include <stdint.h>
+
+/*
+ * Client library for the stack's shared-memory sockets (tenstack -S path). Link with
+ * libtenstack.a; this header is all an application needs.
+ *
+ * Reads, sends and everything else on one socket each execute in order, but reads and sends don't
+ * hold up the other calls. ts_send copies the data into shared memory and only waits if all of the
+ * socket's buffers are in use; the stack copies it again into its send queue. If a send fails,
+ * the error comes back from the next call on that socket and every call after it. All other
+ * calls wait for their result, reads and sends only unless the socket is nonblocking. A socket
+ * must only be used by one thread at a time.
+ *
+ * Addresses are IPv4 in network byte order, ports are in host byte order. Calls return -1 and
+ * set errno on failure.
+ */
+typedef struct ts_sock ts_sock;
+
+/* Open a socket on the daemon listening at path, NULL for the default path */
+ts_sock *ts_socket(const char *path);
+
+/* Make it a TCP listener. With reuseport set, other listeners with reuseport set may share the port */
+int ts_listen(ts_sock *sk, uint16_t port, int backlog, int reuseport);
+
+/* Wait for a connection on a listener, returns it as a new socket. addr and port may be NULL */
+ts_sock *ts_accept(ts_sock *lsk, uint32_t *addr, uint16_t *port);
+
+/* Make it a TCP connection to addr:port */
+int ts_connect(ts_sock *sk, uint32_t addr, uint16_t port);
+
+/* Queue data on a connection, returns len, or less if the socket is nonblocking and ran out of buffers */
+int ts_send(ts_sock *sk, const void *buf, int len);
+
+/* Read from a connection, returns bytes read or 0 at end of stream */
+int ts_recv(ts_sock *sk, void *buf, int len);
+
+/* Make it a UDP socket on port (0 = pick one), returns the bound port */
+int ts_bind(ts_sock *sk, uint16_t port, int reuseport);
+
+/* Send a datagram, returns len */
+int ts_sendto(ts_sock *sk, const void *buf, int len, uint32_t addr, uint16_t port);
+
+/* Wait for a datagram, returns its length, truncated to len. addr and port may be NULL */
+int ts_recvfrom(ts_sock *sk, void *buf, int len, uint32_t *addr, uint16_t *port);
+
+/* Set a TCP option (1 = TCP_NODELAY, 2 = TCP_CORK) */
+int ts_setsockopt(ts_sock *sk, int opt, int val);
+
+/*
+ * Shut down a connection's reading, writing or both: how is SHUT_RD, SHUT_WR or SHUT_RDWR.
+ * Writing sends a FIN once queued sends went out, later sends fail with EPIPE. After reading is
+ * shut down ts_recv returns 0
+ */
+int ts_shutdown(ts_sock *sk, int how);
+
+/* Make reads (ts_recv, ts_recvfrom, ts_accept) and ts_send fail with EAGAIN instead of waiting */
+void ts_set_nonblock(ts_sock *sk, int on);
+
+/*
+ * A descriptor for poll, select or epoll that is readable while a read would return right away.
+ * From now on the socket keeps a read posted ahead, so data is already on its way when asked for.
+ * It always polls writable; after a nonblocking ts_send runs out of buffers it turns readable when
+ * one comes back. Owned by the socket, ts_close closes it
+ */
+int ts_fd(ts_sock *sk);
+
+#define TS_POLLIN    0x1 // a read returns right away
+#define TS_POLLOUT   0x2 // a send takes at least some data without waiting
+#define TS_POLLRDHUP 0x4 // the peer finished sending, or reading was shut down
+#define TS_POLLERR   0x8 // a send failed or the connection broke
+
+/* What the socket is ready for right now as TS_POLL* bits, for callers woken up by ts_fd. Never waits */
+int ts_poll(ts_sock *sk);
+
+/*
+ * With on set, ts_fd is also readable while a send would go through, for callers waiting to send
+ * rather than to read. Anyone polling it for reads then wakes up for that as well
+ */
+void ts_set_poll_out(ts_sock *sk, int on);
+
+/* Close the socket and free it. Returns the error of any failed send that wasn't reported yet */
+int ts_close(ts_sock *sk);
+
+#endif /* TENSTACK_H */
@@ -0,0 +1,62 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+#include "list.h"
+
+/*
+ * One-shot timers on a hashed timing wheel. Timers are sorted into TIMER_WHEEL_SIZE slots by
+ * their expiry tick, so arming and cancelling are O(1) no matter how many connections have
+ * timers running. Timers further out than one revolution wait in their slot for later rounds.
+ *
+ * There's one shared wheel, and a thread may ask for one of its own with timer_wheel_local. A
+ * timer stays on the wheel of the thread that set it up and fires from that thread's timers_run,
+ * so connections owned by a run-to-completion worker keep their timers on its core.
+ */
+#define TIMER_TICK_NS    1000000ULL // 1 ms resolution
+#define TIMER_WHEEL_SIZE 1024       // slots, power of two
+
+struct timer_wheel;
+
+struct timer {
+    list_head list;                 // linkage in a wheel slot
+    struct timer_wheel *wheel;      // the wheel it's bound to
+    uint64_t expires;               // deadline, clock_ns() time base
+    void (*handler)(struct timer *t);
+    void *arg;                      // for the handler
+    int pending;                    // armed and not yet fired
+};
+
+/* Set up a timer, it's not armed until timer_mod */
+void timer_init(struct timer *t, void (*handler)(struct timer *t), void *arg);
+
+/* Arm or re-arm a timer for an absolute deadline. Returns 1 if it was already pending */
+int timer_mod(struct timer *t, uint64_t expires);
+
+/* Cancel a timer. Returns 1 if it was pending (so the handler won't run) */
+int timer_del(struct timer *t);
+
+/* Check if a timer is armed */
+int timer_pending(struct timer *t);
+
+/* Run the handlers of all expired timers on the calling thread's wheel */
+void timers_run(void);
+
+/* Earliest pending deadline on the calling thread's wheel, UINT64_MAX if no timer is armed */
+uint64_t timers_next_deadline(void);
+
+/*
+ * Keep tfd, a CLOCK_MONOTONIC timerfd, armed to the earliest deadline on the calling thread's
+ * wheel, so the thread can sleep in epoll until a timer is due; timers_run sets it again after
+ * each run and timer_mod brings it forward from any thread. -1 stops that. Fails if another
+ * thread's timerfd already follows the wheel
+ */
+int timers_set_timerfd(int tfd);
+
+/* Give the calling thread a wheel of its own, timers set up on it from now on go there */
+int timer_wheel_local(void);
+
+/* Hand the thread's timers back to the shared wheel before it exits */
+void timer_wheel_local_exit(void);
+
+#endif /* TIMER_H */
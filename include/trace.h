@@ -0,0 +1,81 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#include "utils.h"
+
+/*
+ * Per-stage packet latency tracing, built in with `make TRACE=1`. Buffers carry a cycle counter
+ * timestamp for each point of the path they pass, and whoever reaches the next point records the
+ * time in between into the calling thread's histogram of that stage, next to its counters (see
+ * stats.h). The stats dump then shows which layer a slow packet spent its time in. Without
+ * TRACE=1 the timestamps aren't even in the buffer and every macro below is empty.
+ */
+
+/* Points a buffer is stamped at */
+enum trace_point {
+    TRACE_DEV_RX,   // read from the device
+    TRACE_ETH_RX,   // Ethernet header parsed
+    TRACE_IP_RX,    // IP layer picked it up
+    TRACE_TX_QUEUE, // handed to the device layer for sending
+    TRACE_POINT_MAX
+};
+
+/* Stretches of the path timed between two points */
+enum trace_stage {
+    TRACE_STAGE_DEV_ETH,  // device read to Ethernet, includes the RSS worker's ring
+    TRACE_STAGE_ETH_IP,   // Ethernet to IP, includes the pipeline's protocol ring
+    TRACE_STAGE_IP_L4,    // IP validation up to the transport handler
+    TRACE_STAGE_L4,       // the transport handler, waking up any reader included
+    TRACE_STAGE_RX_TOTAL, // device read to the transport handler
+    TRACE_STAGE_TX_QUEUE, // handed to the device layer until the write starts, the pipeline's TX ring
+    TRACE_STAGE_TX_WRITE, // the device write
+    TRACE_STAGE_MAX
+};
+
+#ifdef PKT_TRACE
+
+/* Cycle counter, the monotonic clock where there is none */
+static inline uint64_t trace_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return clock_ns();
+#endif
+}
+
+/* Remember the cycle counter and the clock now, to turn cycles into nanoseconds later */
+void trace_init(void);
+
+/* Cycles per nanosecond since trace_init */
+double trace_cycles_per_ns(void);
+
+/* Add one sample of cycles to the calling thread's histogram of stage */
+void trace_record(enum trace_stage stage, uint64_t cycles);
+
+/* Time from point from, if the buffer passed it, to now */
+static inline void trace_since(enum trace_stage stage, uint64_t from, uint64_t now) {
+    if (from && now >= from) {
+        trace_record(stage, now - from);
+    }
+}
+
+#define TRACE_NOW(var) uint64_t var = trace_now()
+#define TRACE_STAMP(pkt, point) ((pkt)->tstamp[point] = trace_now())
+#define TRACE_STAMP_AT(pkt, point, now) ((pkt)->tstamp[point] = (now))
+#define TRACE_SINCE(stage, pkt, point, now) trace_since(stage, (pkt)->tstamp[point], now)
+#define TRACE_RECORD(stage, cycles) trace_record(stage, cycles)
+
+#else
+
+#define trace_init() do { } while (0)
+#define TRACE_NOW(var) do { } while (0)
+#define TRACE_STAMP(pkt, point) do { } while (0)
+#define TRACE_STAMP_AT(pkt, point, now) do { } while (0)
+#define TRACE_SINCE(stage, pkt, point, now) do { } while (0)
+#define TRACE_RECORD(stage, cycles) do { } while (0)
+
+#endif /* PKT_TRACE */
+
+#endif /* TRACE_H */
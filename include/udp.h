@@ -0,0 +1,112 @@
+#ifndef UDP_H
+#define UDP_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "pktbuf.h"
+#include "list.h"
+#include "zerocopy.h"
+#include "reuseport.h"
+#include "utils.h"
+
+#define UDP_HASH_SIZE   256  // port demux buckets, power of two
+#define UDP_RING_SIZE   1024 // datagrams queued per socket, power of two
+#define UDP_RCVBUF      (512 * 1024) // payload bytes queued per socket
+#define UDP_PORT_EPHEMERAL_MIN 49152
+
+/* UDP header */
+struct udp_header {
+    uint16_t sport; // source port
+    uint16_t dport; // destination port
+    uint16_t len;   // length of header + payload
+    uint16_t csum;  // checksum over pseudo header, header and payload, 0 = not computed
+} __attribute__((packed));
+
+/* A bound UDP endpoint */
+struct udp_sock {
+    list_head hash_list; // linkage in the port demux table
+    uint32_t addr;       // bound local address, network byte order, 0 = any
+    uint16_t port;       // bound local port, host byte order
+    uint64_t drops;      // datagrams dropped because the ring or the receive buffer was full
+    uint32_t rcvbuf;     // receive buffer limit, payload bytes in the ring
+    struct reuseport *reuse; // sockets sharing this address and port, NULL if it's not shared
+
+    /*
+     * A reader blocked in udp_wait. Producers only take wait_lock when the ring goes from empty
+     * to non-empty while somebody is waiting, so a busy socket never touches it
+     */
+    pthread_mutex_t wait_lock;
+    pthread_cond_t wait;
+    _Atomic int waiters;
+    _Atomic int shutdown; // udp_wait gives up
+
+    /*
+     * Receive ring of pktbuf references. Single consumer (the application), which takes no lock.
+     * Producers are the RX threads; with RSS, flows from different peers may be handled by
+     * different workers, so they serialize on push_lock, which is uncontended otherwise. Indexes
+     * sit on their own cache lines so the two sides don't bounce one line between cores.
+     */
+    pthread_spinlock_t push_lock;
+    _Atomic uint32_t head __attribute__((aligned(CACHELINE_SIZE))); // next slot the producer fills
+    _Atomic uint32_t tail __attribute__((aligned(CACHELINE_SIZE))); // next slot the consumer reads
+    _Atomic uint32_t rmem; // payload bytes in the ring, added by producers and taken off by the consumer
+    struct pktbuf *ring[UDP_RING_SIZE] __attribute__((aligned(CACHELINE_SIZE)));
+};
+
+/* A received datagram. The payload is read in place, release it when done */
+struct udp_dgram {
+    struct pktbuf *pkt; // buffer holding the datagram
+    uint8_t *data;      // payload, points into pkt
+    int len;            // payload length
+    uint32_t saddr;     // sender address, network byte order
+    uint16_t sport;     // sender port, host byte order
+};
+
+/* Initialize UDP module */
+void udp_init(void);
+
+/* Handle an incoming UDP packet (data points at the UDP header) */
+void udp_recv(struct pktbuf *pkt);
+
+/* Bind a socket to a local address (0 = any) and port (0 = pick an ephemeral one) */
+struct udp_sock *udp_bind(uint32_t addr, uint16_t port);
+
+/* Bind a socket that may share its address and port with others bound this way, datagrams are spread over them by 4-tuple */
+struct udp_sock *udp_bind_reuseport(uint32_t addr, uint16_t port);
+
+/* Unbind a socket and release any datagrams still queued on it */
+void udp_close(struct udp_sock *sk);
+
+/*
+ * Send a datagram, address in network byte order and port in host byte order. Fails with
+ * EMSGSIZE if it doesn't fit one frame, there's no IP fragmentation
+ */
+int udp_sendto(struct udp_sock *sk, uint32_t daddr, uint16_t dport, const void *data, int len);
+
+/*
+ * Send a datagram straight from data without copying it. cookie shows up on cq once data may be
+ * reused. Returns len, or -1 like udp_sendto. With EIO the datagram failed on the way out and
+ * its completion still comes, any other error refused it up front (EMSGSIZE as for udp_sendto,
+ * or no memory) and no completion will come
+ */
+int udp_sendto_zc(struct udp_sock *sk, uint32_t daddr, uint16_t dport, const void *data, int len,
+                  struct zc_queue *cq, uint64_t cookie);
+
+/* Take the next queued datagram without copying it. Returns 1 if one was available, 0 if not */
+int udp_recv_zc(struct udp_sock *sk, struct udp_dgram *dgram);
+
+/* Take up to max queued datagrams in one go. Returns how many were taken */
+int udp_recv_batch(struct udp_sock *sk, struct udp_dgram *dgrams, int max);
+
+/* Block until a datagram is queued. Returns 0, or -1 with EPIPE once the socket is shut down */
+int udp_wait(struct udp_sock *sk);
+
+/* Wake whoever waits in udp_wait and make every later wait fail, before closing a socket a reader may be blocked on */
+void udp_shutdown(struct udp_sock *sk);
+
+/* Give a received datagram's buffer back to the stack */
+void udp_release(struct udp_dgram *dgram);
+
+#endif /* UDP_H */
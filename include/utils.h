@@ -3,13 +3,27 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
 
 #define CMDBUFLEN 256
 
+#define CACHELINE_SIZE 64 // for keeping data written by different threads apart
+
 /* When set to 1, commands will be printed before execution, extern because defined in diff file */
 extern int debug;
 
+/* When set to 0, per-packet debug output of every layer is suppressed (needed for load tests) */
+extern int verbose;
+
 /* Formats and executes shell command */
 int run_cmd(char *cmd, ...);
 
-#endif /* UTILS_H */
\ No newline at end of file
+/* Monotonic clock in nanoseconds, used for timestamps and deadlines */
+static inline uint64_t clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#endif /* UTILS_H */
@@ -0,0 +1,54 @@
+#ifndef ZEROCOPY_H
+#define ZEROCOPY_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "list.h"
+
+/*
+ * Zero-copy send. Instead of copying, the stack points packet buffers at the application's
+ * memory (pktbuf frag) and keeps a reference to a zc_ubuf for every buffer that does. When the
+ * last one is freed, after transmission for UDP or once the peer ACKed everything for TCP, the
+ * ubuf is posted to the completion queue the send named, carrying the caller's cookie. Until its
+ * cookie comes back the application must neither modify nor free the memory.
+ */
+
+/* Completion queue, any number of sends can report to one */
+struct zc_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t wait;
+    list_head done; // completed ubufs, oldest first
+    int count;      // entries in done
+};
+
+/* One zero-copy send in flight */
+struct zc_ubuf {
+    list_head list;      // linkage in the completion queue once done
+    atomic_int refcnt;   // the send call, plus every pktbuf referencing the memory
+    struct zc_queue *cq;
+    uint64_t cookie;     // handed back on completion
+};
+
+/* Create and destroy a completion queue. Destroy only once every send on it completed */
+struct zc_queue *zc_queue_create(void);
+void zc_queue_destroy(struct zc_queue *cq);
+
+/* Take up to max completed cookies, oldest first. Returns how many, 0 if none are ready */
+int zc_poll(struct zc_queue *cq, uint64_t *cookies, int max);
+
+/* Like zc_poll, but wait until at least one completion is ready */
+int zc_wait(struct zc_queue *cq, uint64_t *cookies, int max);
+
+/* Start a send, the caller holds the first reference */
+struct zc_ubuf *zc_ubuf_alloc(struct zc_queue *cq, uint64_t cookie);
+
+/* References held by packet buffers. The last put posts the completion */
+void zc_ubuf_get(struct zc_ubuf *ubuf);
+void zc_ubuf_put(struct zc_ubuf *ubuf);
+
+/* Drop a send that never queued anything, no completion is posted */
+void zc_ubuf_abort(struct zc_ubuf *ubuf);
+
+#endif /* ZEROCOPY_H */
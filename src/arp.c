@@ -2,20 +2,52 @@
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
 #include <arpa/inet.h>
 
 #include "arp.h"
 #include "netdev.h"
 #include "pktbuf.h"
-
-/* Global ARP cache with mutex protection */
-static LIST_HEAD(arp_cache);
+#include "stats.h"
+#include "probe.h"
+#include "mem.h"
+#include "timer.h"
+#include "utils.h"
+
+/*
+ * Global ARP cache with mutex protection: a fixed table, so a flood of senders can neither grow it
+ * nor lengthen lookups. Slots in use hang off hash buckets, the rest are on the free list. When
+ * it's full, a CLOCK hand picks the slot to reuse, sparing once every entry looked up since it
+ * last passed, which approximates evicting the least recently used
+ */
+static struct arp_cache_entry arp_table[ARP_CACHE_SIZE];
+static list_head arp_buckets[1 << ARP_HASH_BITS];
+static LIST_HEAD(arp_free);
+static int arp_hand; // next slot the eviction hand looks at
 static pthread_mutex_t arp_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Per-source admission: the earliest time each bucket's sources are allowed their next frame (GCRA) */
+static uint64_t arp_rl_tat[1 << ARP_RL_BITS];
+
+/* Bumped whenever a mapping appears, changes or goes away, so replicas know they're stale */
+static atomic_uint arp_cache_gen = 1;
+
+/* This thread's read replica of the cache, direct-mapped by address */
+static __thread struct {
+    unsigned int gen;
+    struct {
+        uint32_t ip; // 0 = empty
+        uint8_t mac[6];
+    } slots[ARP_REPLICA_SLOTS];
+} arp_replica;
 static const uint8_t ETH_BROADCAST_ADDR[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF}; // ethernet broadcast address, meaning send to all devices on local network
 
 /* Debug output macro */
 #define arp_dbg(fmt, ...) \
-    printf("ARP: " fmt "\n", ##__VA_ARGS__)
+    do { if (verbose) printf("ARP: " fmt "\n", ##__VA_ARGS__); } while (0)
 
 /* Print IP address in dotted notation */
 /* static void print_ip(const char *name, uint32_t ip) {
@@ -29,25 +61,74 @@ static const uint8_t ETH_BROADCAST_ADDR[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
 } */
 
 int arp_init(void) {
-    // arp_cache already initialized by LIST_HEAD
-    arp_dbg("ARP module initialized\n");
+    int i;
+
+    pthread_mutex_lock(&arp_cache_lock);
+    for (i = 0; i < (1 << ARP_HASH_BITS); i++) {
+        list_init(&arp_buckets[i]);
+    }
+    for (i = 0; i < ARP_CACHE_SIZE; i++) {
+        arp_table[i].state = ARP_FREE;
+        list_add_tail(&arp_free, &arp_table[i].ace_list);
+    }
+    pthread_mutex_unlock(&arp_cache_lock);
+
+    arp_dbg("ARP module initialized, %d entries", ARP_CACHE_SIZE);
     return 0;
 }
 
-/* Create a new ARP cache entry */
-static struct arp_cache_entry *arp_cache_entry_create(uint32_t ip, uint8_t *mac) {
-    struct arp_cache_entry *entry = malloc(sizeof(struct arp_cache_entry)); 
-    if (!entry) {
-        perror("Failed to allocate ARP cache entry");
-        return NULL;
+static inline list_head *arp_bucket(uint32_t ip) {
+    return &arp_buckets[(ntohl(ip) * 0x9e3779b1) >> (32 - ARP_HASH_BITS)];
+}
+
+/* Take an entry out of the cache and put its slot back on the free list */
+static void arp_cache_entry_release(struct arp_cache_entry *entry) {
+    list_del(&entry->ace_list);
+    entry->state = ARP_FREE;
+    list_add(&arp_free, &entry->ace_list);
+    mem_charge(MEM_ARP, -(int64_t)sizeof(*entry), -1);
+    atomic_fetch_add(&arp_cache_gen, 1);
+}
+
+/* Make room for one more entry: the first one the hand finds not looked up since its last pass */
+static void arp_cache_evict(void) {
+    struct arp_cache_entry *entry;
+    char ip_str[INET_ADDRSTRLEN];
+
+    // every slot is in use, so at most one full turn clears all the marks and the next finds a victim
+    for (;;) {
+        entry = &arp_table[arp_hand];
+        arp_hand = (arp_hand + 1) % ARP_CACHE_SIZE;
+        if (!entry->referenced) {
+            break;
+        }
+        entry->referenced = 0;
+    }
+
+    inet_ntop(AF_INET, &entry->ip, ip_str, INET_ADDRSTRLEN);
+    arp_dbg("Cache full, evicting entry for IP %s", ip_str);
+    STATS_INC(STAT_ARP_EVICTIONS);
+    arp_cache_entry_release(entry);
+}
+
+/* Create a new ARP cache entry, in a free slot or the one of an evicted entry. Caller holds the lock */
+static struct arp_cache_entry *arp_cache_entry_create(uint32_t ip, const uint8_t *mac, int state) {
+    struct arp_cache_entry *entry;
+
+    if (list_empty(&arp_free)) {
+        arp_cache_evict();
     }
-    list_init(&entry->ace_list);
+    entry = list_first_entry(&arp_free, struct arp_cache_entry, ace_list);
+    list_del(&entry->ace_list);
 
     entry->ip = ip;
     memcpy(entry->mac, mac, sizeof(entry->mac));
-    entry->ttl = ARP_CACHE_TTL; 
-    entry->state = ARP_RESOLVED;
+    entry->referenced = 0; // has to earn its keep like anyone else
+    entry->ttl = state == ARP_WAITING ? ARP_WAIT_TTL : ARP_CACHE_TTL;
+    entry->state = state;
+    list_add(arp_bucket(ip), &entry->ace_list);
 
+    mem_charge(MEM_ARP, sizeof(*entry), 1);
     return entry;
 }
 
@@ -55,9 +136,9 @@ static struct arp_cache_entry *arp_cache_entry_create(uint32_t ip, uint8_t *mac)
 static struct arp_cache_entry *arp_cache_lookup(uint32_t ip) {
     struct arp_cache_entry *entry; // curr cache entry we're examining
     list_head *elem; // pointer that traverses through linked list nodes
-    
-    // traverse the list for a matching IP
-    list_for_each(elem, &arp_cache) {
+
+    // only the address's bucket can have it
+    list_for_each(elem, arp_bucket(ip)) {
         entry = list_entry(elem, struct arp_cache_entry, ace_list); // convert from list_head pointer to containing struct (arp_cache_entry)
         if (entry->ip == ip) {
             return entry; // found match
@@ -67,7 +148,29 @@ static struct arp_cache_entry *arp_cache_lookup(uint32_t ip) {
     return NULL; // no match found
 }
 
-void arp_update_cache(uint32_t ip, uint8_t *mac) {
+/*
+ * Whether a frame from ip is admitted, at ARP_RL_RATE per second with bursts of ARP_RL_BURST.
+ * Sources sharing a bucket share the allowance, a spoofed flood can't take more than the buckets
+ */
+static int arp_rate_ok(uint32_t ip) {
+    const uint64_t interval = 1000000000ULL / ARP_RL_RATE;
+    uint64_t now = clock_ns(), *tat = &arp_rl_tat[(ntohl(ip) * 0x9e3779b1) >> (32 - ARP_RL_BITS)];
+    int ok = 0;
+
+    pthread_mutex_lock(&arp_cache_lock);
+    if (*tat < now) {
+        *tat = now;
+    }
+    if (*tat - now <= (ARP_RL_BURST - 1) * interval) {
+        *tat += interval;
+        ok = 1;
+    }
+    pthread_mutex_unlock(&arp_cache_lock);
+    return ok;
+}
+
+/* Refresh the mapping for ip, and add one if there's none yet and create is set. Returns 0 if neither happened */
+static int arp_learn(uint32_t ip, uint8_t *mac, int create) {
     struct arp_cache_entry *entry;
 
     // acquire mutex lock safely to prevent concurrent modifying
@@ -81,34 +184,44 @@ void arp_update_cache(uint32_t ip, uint8_t *mac) {
     entry = arp_cache_lookup(ip);
 
     if (entry) {
-        // update existing entry
+        // update existing entry, replicas only need to hear about it if the MAC moved
+        if (memcmp(entry->mac, mac, sizeof(entry->mac)) != 0 || entry->state != ARP_RESOLVED) {
+            atomic_fetch_add(&arp_cache_gen, 1);
+        }
         memcpy(entry->mac, mac, sizeof(entry->mac));
         entry->ttl = ARP_CACHE_TTL; // reset ttl
         entry->state = ARP_RESOLVED;
         arp_dbg("Updated ARP cache entry for IP %s", ip_str);
-    } else {
+        PROBE3(arp_update, ip, mac, 0);
+    } else if (create) {
         // create new entry
-        entry = arp_cache_entry_create(ip, mac);
-        if (entry) {
-            // Add to cache
-            list_add(&entry->ace_list, &arp_cache);
-            arp_dbg("Added new ARP cache entry for IP %s", ip_str);
-        }
+        entry = arp_cache_entry_create(ip, mac, ARP_RESOLVED);
+        atomic_fetch_add(&arp_cache_gen, 1);
+        arp_dbg("Added new ARP cache entry for IP %s", ip_str);
+        PROBE3(arp_update, ip, mac, 1);
     }
 
     pthread_mutex_unlock(&arp_cache_lock);
+    return entry != NULL;
+}
+
+void arp_update_cache(uint32_t ip, uint8_t *mac) {
+    arp_learn(ip, mac, 1);
 }
 
 /* Clean up expired ARP cache entries */
 void arp_cache_timer(void) {
     struct arp_cache_entry *entry;
-    list_head *elem, *tmp;
     char ip_str[INET_ADDRSTRLEN]; 
-    
+    int i;
+
     pthread_mutex_lock(&arp_cache_lock);
-    
-    list_for_each_safe(elem, tmp, &arp_cache) {
-        entry = list_entry(elem, struct arp_cache_entry, ace_list);
+
+    for (i = 0; i < ARP_CACHE_SIZE; i++) {
+        entry = &arp_table[i];
+        if (entry->state == ARP_FREE) {
+            continue;
+        }
 
         // decrement TTL
         entry->ttl--;
@@ -117,9 +230,7 @@ void arp_cache_timer(void) {
         if (entry->ttl <= 0) {
             inet_ntop(AF_INET, &entry->ip, ip_str, INET_ADDRSTRLEN);
             arp_dbg("Removing expired ARP entry for IP %s", ip_str);
-
-            list_del(elem); // remove from list
-            free(entry); // free memory
+            arp_cache_entry_release(entry);
         }
     }
 
@@ -165,6 +276,7 @@ int arp_request(uint32_t dip) {
 
     inet_ntop(AF_INET, &dip, ip_str, INET_ADDRSTRLEN);
     arp_dbg("Sending ARP request for IP %s", ip_str);
+    STATS_INC(STAT_ARP_OUT_REQUESTS);
 
     // send the ARP request as an Ethernet frame to the broadcast address
     return ethernet_tx(pkt, ETH_BROADCAST_ADDR, ETH_P_ARP);
@@ -174,9 +286,11 @@ void arp_process(struct arp_header *hdr, int len) {
     struct arp_ipv4 *arp_data;
     struct netdev *dev = netdev_get();
     uint16_t opcode;
+    int learn;
 
     if (len < sizeof(struct arp_header) + sizeof(struct arp_ipv4)) {
         arp_dbg("ARP packet too short");
+        STATS_INC(STAT_ARP_IN_ERRORS);
         return;
     }
 
@@ -184,18 +298,37 @@ void arp_process(struct arp_header *hdr, int len) {
     if (ntohs(hdr->hwtype) != ARP_HW_ETHERNET || 
         ntohs(hdr->protype) != ETH_P_IP || hdr->hwlen != 6 || hdr->prolen != 4) {
         arp_dbg("Unsupported ARP packet format");
+        STATS_INC(STAT_ARP_IN_ERRORS);
         return;
     }
 
     opcode = ntohs(hdr->opcode);
     arp_data = (struct arp_ipv4 *)hdr->data;
 
-    // update ARP cache with sender's info regardless of packet type
-    arp_update_cache(arp_data->sip, arp_data->smac);
+    // a sender flooding the segment gets nothing out of us, no cache work and no replies
+    if (!arp_rate_ok(arp_data->sip)) {
+        arp_dbg("Sender over its rate, ignoring");
+        STATS_INC(STAT_ARP_RATE_LIMITED);
+        return;
+    }
+
+    // refresh what we know about the sender, a reply also resolves the entry arp_resolve left
+    // waiting. Only a request for our address creates one, we're about to talk to its sender
+    learn = opcode == ARP_OP_REQUEST && arp_data->dip == dev->addr;
+    if (!arp_learn(arp_data->sip, arp_data->smac, learn)) {
+        arp_dbg("Not learning unsolicited sender");
+        STATS_INC(STAT_ARP_NOT_LEARNED);
+    }
 
     arp_dbg("Processed ARP packet, opcode: %d", opcode);
 
+    if (opcode == ARP_OP_REPLY) {
+        STATS_INC(STAT_ARP_IN_REPLIES);
+    }
+
     if (opcode == ARP_OP_REQUEST) {
+        STATS_INC(STAT_ARP_IN_REQUESTS);
+
         // char our_ip_str[INET_ADDRSTRLEN], target_ip_str[INET_ADDRSTRLEN];
         // inet_ntop(AF_INET, &dev->addr, our_ip_str, INET_ADDRSTRLEN);
         // inet_ntop(AF_INET, &arp_data->dip, target_ip_str, INET_ADDRSTRLEN);
@@ -240,39 +373,224 @@ void arp_process(struct arp_header *hdr, int len) {
         reply_data->dip = arp_data->sip;
 
         // send the ARP reply directly to requester
+        STATS_INC(STAT_ARP_OUT_REPLIES);
         ethernet_tx(pkt, arp_data->smac, ETH_P_ARP);
     }
 }
 
 int arp_resolve(uint32_t ip, uint8_t *mac) {
+    unsigned int gen = atomic_load_explicit(&arp_cache_gen, memory_order_acquire);
+    unsigned int slot = (ntohl(ip) * 0x9e3779b1) >> (32 - ARP_REPLICA_BITS);
     struct arp_cache_entry *entry;
 
+    // the hot path only reads this thread's replica, the shared cache is for misses and changes
+    if (arp_replica.gen != gen) {
+        memset(arp_replica.slots, 0, sizeof(arp_replica.slots));
+        arp_replica.gen = gen;
+    }
+    if (ip && arp_replica.slots[slot].ip == ip) {
+        memcpy(mac, arp_replica.slots[slot].mac, 6);
+        return 0;
+    }
+
     // lock cache while accessing it
     pthread_mutex_lock(&arp_cache_lock);
 
     entry = arp_cache_lookup(ip);
 
-    if (entry && entry->state == ARP_RESOLVED) {
+    if (entry && entry->state != ARP_WAITING) {
+        int probe = entry->state == ARP_STALE;
+
+        // spared by the next pass of the eviction hand. Replicas refetch after every change, so
+        // entries in use keep getting marked
+        entry->referenced = 1;
+
         // copy the MAC
         memcpy(mac, entry->mac, 6);
+
+        // a change that raced with the copy bumped the generation, the next call refetches
+        arp_replica.slots[slot].ip = ip;
+        memcpy(arp_replica.slots[slot].mac, entry->mac, 6);
+
+        // a mapping from before the restart carries traffic right away, and has until the
+        // request's answer is due to get confirmed. The answer resolves it, silence expires it
+        if (probe) {
+            entry->state = ARP_PROBE;
+            entry->ttl = ARP_WAIT_TTL;
+        }
         pthread_mutex_unlock(&arp_cache_lock); // dont forget to unlock
+
+        if (probe) {
+            STATS_INC(STAT_ARP_STALE_PROBES);
+            arp_request(ip);
+        }
         return 0;
     }
 
+    // remember asking, only the reply to a request of ours may add an entry
+    if (!entry) {
+        static const uint8_t unknown[6];
+        arp_cache_entry_create(ip, unknown, ARP_WAITING);
+    }
+
     pthread_mutex_unlock(&arp_cache_lock); // dont forget to unlock
 
     // if not found or waiting, send ARP request
+    STATS_INC(STAT_ARP_UNRESOLVED);
+    PROBE1(arp_miss, ip);
     arp_request(ip);
 
     return -1; // not resolved yet
 }
 
+/* Cache snapshot state, set by arp_snapshot_start */
+static struct {
+    const char *path;
+    int interval; // seconds between writes, 0 for only at stop
+    int stopping; // the last write is arp_snapshot_stop's, ticks neither write nor re-arm
+    struct timer timer;
+    pthread_mutex_t lock; // a tick's write and re-arm against arp_snapshot_stop
+} arp_snapshot = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Read the snapshot at path into the cache as stale entries, a missing file is an empty cache */
+static int arp_snapshot_load(const char *path) {
+    struct arp_snapshot_header hdr;
+    struct arp_snapshot_rec rec;
+    uint32_t i, loaded = 0;
+    FILE *f;
+
+    f = fopen(path, "rb");
+    if (!f) {
+        if (errno == ENOENT) {
+            arp_dbg("No ARP snapshot at %s, starting cold", path);
+            return 0;
+        }
+        perror("Failed to open ARP snapshot");
+        return -1;
+    }
+
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != ARP_SNAPSHOT_MAGIC ||
+        hdr.version != ARP_SNAPSHOT_VERSION) {
+        fprintf(stderr, "%s is not an ARP snapshot, ignoring it\n", path);
+        fclose(f);
+        return 0;
+    }
+
+    pthread_mutex_lock(&arp_cache_lock);
+    for (i = 0; i < hdr.count && i < ARP_CACHE_SIZE; i++) {
+        if (fread(&rec, sizeof(rec), 1, f) != 1) {
+            break; // cut short, keep what made it
+        }
+        if (rec.ip && !arp_cache_lookup(rec.ip)) {
+            arp_cache_entry_create(rec.ip, rec.mac, ARP_STALE);
+            loaded++;
+        }
+    }
+    atomic_fetch_add(&arp_cache_gen, 1);
+    pthread_mutex_unlock(&arp_cache_lock);
+
+    fclose(f);
+    STATS_ADD(STAT_ARP_STALE_LOADED, loaded);
+    arp_dbg("Loaded %u stale ARP entries from %s", loaded, path);
+    return 0;
+}
+
+/* Write the resolved entries to the snapshot file, through a temporary file so a crash leaves the old one */
+static int arp_snapshot_save(const char *path) {
+    struct arp_snapshot_header hdr = { .magic = ARP_SNAPSHOT_MAGIC, .version = ARP_SNAPSHOT_VERSION };
+    struct arp_snapshot_rec *recs;
+    char tmp[PATH_MAX];
+    FILE *f;
+    int i, ok;
+
+    recs = malloc(ARP_CACHE_SIZE * sizeof(*recs));
+    if (!recs) {
+        perror("Failed to allocate ARP snapshot");
+        return -1;
+    }
+
+    // copy out under the lock, write without it
+    pthread_mutex_lock(&arp_cache_lock);
+    for (i = 0; i < ARP_CACHE_SIZE; i++) {
+        if (arp_table[i].state == ARP_RESOLVED) {
+            recs[hdr.count].ip = arp_table[i].ip;
+            memcpy(recs[hdr.count].mac, arp_table[i].mac, 6);
+            hdr.count++;
+        }
+    }
+    pthread_mutex_unlock(&arp_cache_lock);
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    f = fopen(tmp, "wb");
+    if (!f) {
+        perror("Failed to create ARP snapshot");
+        free(recs);
+        return -1;
+    }
+    ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+         fwrite(recs, sizeof(*recs), hdr.count, f) == hdr.count;
+    ok = fclose(f) == 0 && ok;
+    free(recs);
+
+    if (!ok || rename(tmp, path) < 0) {
+        perror("Failed to write ARP snapshot");
+        unlink(tmp);
+        return -1;
+    }
+
+    arp_dbg("Saved %u ARP entries to %s", hdr.count, path);
+    return 0;
+}
+
+static void arp_snapshot_tick(struct timer *t) {
+    // timer_del doesn't wait for a running handler, so a tick may still come after stop began
+    pthread_mutex_lock(&arp_snapshot.lock);
+    if (!arp_snapshot.stopping) {
+        arp_snapshot_save(arp_snapshot.path);
+        timer_mod(t, clock_ns() + arp_snapshot.interval * 1000000000ULL);
+    }
+    pthread_mutex_unlock(&arp_snapshot.lock);
+}
+
+int arp_snapshot_start(const char *path, int interval) {
+    if (arp_snapshot_load(path) < 0) {
+        return -1;
+    }
+
+    arp_snapshot.path = path;
+    arp_snapshot.interval = interval;
+    arp_snapshot.stopping = 0;
+    if (interval > 0) {
+        timer_init(&arp_snapshot.timer, arp_snapshot_tick, NULL);
+        timer_mod(&arp_snapshot.timer, clock_ns() + interval * 1000000000ULL);
+    }
+    return 0;
+}
+
+void arp_snapshot_stop(void) {
+    if (!arp_snapshot.path) {
+        return;
+    }
+
+    // a tick writing right now finishes first, any later one finds stopping set
+    pthread_mutex_lock(&arp_snapshot.lock);
+    arp_snapshot.stopping = 1;
+    pthread_mutex_unlock(&arp_snapshot.lock);
+    if (arp_snapshot.interval > 0) {
+        timer_del(&arp_snapshot.timer);
+    }
+
+    arp_snapshot_save(arp_snapshot.path);
+    arp_snapshot.path = NULL;
+}
+
 void arp_recv(struct pktbuf *pkt) {
     struct arp_header *hdr;
 
     // ensure packet is valid
     if (!pkt || pkt->len < sizeof(struct arp_header)) {
         arp_dbg("Invalid ARP packet received");
+        STATS_INC(STAT_ARP_IN_ERRORS);
         if (pkt) free_pktbuf(pkt);
         return;
     }
@@ -0,0 +1,466 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sched.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/utsname.h>
+#include <arpa/inet.h>
+
+#include "arp.h"
+#include "ethernet.h"
+#include "icmp.h"
+#include "ip.h"
+#include "netdev.h"
+#include "pktbuf.h"
+#include "utils.h"
+
+/*
+ * Micro-benchmarks of the stack's hot-path primitives, built by `make bench` and run without a TAP
+ * device: frames come from memory and replies are written to /dev/null. Every benchmark is first
+ * calibrated to an iteration count that takes about one sample period, warmed up, then timed for a
+ * number of samples on a pinned CPU. Each result is the per-operation time over those samples as
+ * JSON, so two runs can be diffed.
+ */
+
+#define BENCH_SAMPLES   31         // timed samples per benchmark
+#define BENCH_SAMPLE_NS 2000000ULL // target length of one sample
+#define BENCH_WARMUP_NS 50000000ULL // run untimed this long first, to settle caches, branch predictors and clocks
+#define BENCH_MAX_NAME  64
+
+/* Runs the operation iters times */
+typedef void (*bench_fn)(void *arg, uint64_t iters);
+
+/* Options of this run */
+static struct {
+    int samples;
+    uint64_t sample_ns;
+    const char *filter; // only run benchmarks whose name contains this
+    FILE *out;
+    int cpu;
+    int nresults;
+} bench;
+
+/* Results go here so the compiler can't drop the work */
+static volatile uint64_t bench_sink;
+
+/* Debug output for the benchmarks */
+#define bench_dbg(fmt, ...) \
+    fprintf(stderr, "BENCH: " fmt "\n", ##__VA_ARGS__)
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t bench_time(bench_fn fn, void *arg, uint64_t iters) {
+    uint64_t start = clock_ns();
+
+    fn(arg, iters);
+    return clock_ns() - start;
+}
+
+/*
+ * Calibrate, warm up and time one benchmark, then print its result. bytes is what one operation
+ * processes, for a throughput figure, 0 if that means nothing for it
+ */
+static void bench_run(const char *name, bench_fn fn, void *arg, uint64_t bytes) {
+    double ns[bench.samples], sum = 0, var = 0, mean, median, stddev;
+    uint64_t iters = 1, elapsed, deadline;
+    int i;
+
+    if (bench.filter && !strstr(name, bench.filter)) {
+        return;
+    }
+
+    // iterations for one sample period, and a first look at how long the thing takes
+    while ((elapsed = bench_time(fn, arg, iters)) < bench.sample_ns / 4 && iters < (1ULL << 40)) {
+        iters *= 2;
+    }
+    iters = iters * bench.sample_ns / (elapsed ? elapsed : 1);
+    if (iters == 0) iters = 1;
+
+    deadline = clock_ns() + BENCH_WARMUP_NS;
+    while (clock_ns() < deadline) {
+        bench_time(fn, arg, iters);
+    }
+
+    for (i = 0; i < bench.samples; i++) {
+        ns[i] = (double)bench_time(fn, arg, iters) / iters;
+        sum += ns[i];
+    }
+    mean = sum / bench.samples;
+    for (i = 0; i < bench.samples; i++) {
+        var += (ns[i] - mean) * (ns[i] - mean);
+    }
+    stddev = bench.samples > 1 ? sqrt(var / (bench.samples - 1)) : 0;
+    qsort(ns, bench.samples, sizeof(ns[0]), cmp_double);
+    median = bench.samples % 2 ? ns[bench.samples / 2]
+                               : (ns[bench.samples / 2 - 1] + ns[bench.samples / 2]) / 2;
+
+    // the mean's 95% confidence interval, samples are plenty for the normal approximation
+    fprintf(bench.out,
+            "%s    {\"name\": \"%s\", \"iters\": %llu, \"min_ns\": %.2f, \"median_ns\": %.2f, "
+            "\"mean_ns\": %.2f, \"stddev_ns\": %.2f, \"ci95_ns\": %.2f, \"max_ns\": %.2f",
+            bench.nresults++ ? ",\n" : "", name, (unsigned long long)iters, ns[0], median, mean,
+            stddev, 1.96 * stddev / sqrt(bench.samples), ns[bench.samples - 1]);
+    if (bytes) {
+        fprintf(bench.out, ", \"mb_per_s\": %.1f", bytes * 1000.0 / median);
+    }
+    fprintf(bench.out, "}");
+    fflush(bench.out);
+
+    bench_dbg("%-32s %10.2f ns/op (+- %.2f)", name, median, 1.96 * stddev / sqrt(bench.samples));
+}
+
+/* checksum() over a buffer of some size starting at some offset from a cache line */
+struct checksum_arg {
+    uint8_t *buf;
+    int len;
+};
+
+static void bench_checksum(void *arg, uint64_t iters) {
+    struct checksum_arg *a = arg;
+    uint64_t sum = 0;
+
+    while (iters--) {
+        sum += checksum(a->buf, a->len);
+    }
+    bench_sink = sum;
+}
+
+static void bench_checksums(void) {
+    static const int sizes[] = { 20, 64, 576, 1500, 9000 };
+    static const int offsets[] = { 0, 1, 2 };
+    uint8_t *mem = aligned_alloc(CACHELINE_SIZE, 9000 + CACHELINE_SIZE);
+    char name[BENCH_MAX_NAME];
+    size_t s, o;
+
+    if (!mem) {
+        perror("Failed to allocate checksum buffer");
+        return;
+    }
+    for (s = 0; s < 9000 + CACHELINE_SIZE; s++) {
+        mem[s] = (uint8_t)(s * 7);
+    }
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        for (o = 0; o < sizeof(offsets) / sizeof(offsets[0]); o++) {
+            struct checksum_arg a = { .buf = mem + offsets[o], .len = sizes[s] };
+
+            snprintf(name, sizeof(name), "checksum/%d/off%d", sizes[s], offsets[o]);
+            bench_run(name, bench_checksum, &a, sizes[s]);
+        }
+    }
+    free(mem);
+}
+
+/* One alloc_pktbuf and free_pktbuf of a receive-sized buffer */
+static void bench_alloc_free(void *arg, uint64_t iters) {
+    uintptr_t sum = 0;
+
+    while (iters--) {
+        struct pktbuf *pkt = alloc_pktbuf(NETDEV_MTU + 100);
+
+        sum += (uintptr_t)pkt;
+        free_pktbuf(pkt);
+    }
+    bench_sink = sum;
+}
+
+/* Prepending and stripping a header, as each layer does */
+static void bench_push_pull(void *arg, uint64_t iters) {
+    struct pktbuf *pkt = arg;
+    uintptr_t sum = 0;
+
+    while (iters--) {
+        sum += (uintptr_t)pktbuf_push(pkt, sizeof(struct ip_header));
+        sum += (uintptr_t)pktbuf_pull(pkt, sizeof(struct ip_header));
+    }
+    bench_sink = sum;
+}
+
+static void bench_pktbufs(void) {
+    struct pktbuf *pkt;
+
+    // the stack's threads all have pools, but malloc is what a thread without one pays
+    bench_run("pktbuf/alloc_free/malloc", bench_alloc_free, NULL, 0);
+    pktbuf_pool_enable();
+    bench_run("pktbuf/alloc_free/pool", bench_alloc_free, NULL, 0);
+
+    pkt = alloc_pktbuf(NETDEV_MTU + 100);
+    if (!pkt) {
+        fprintf(stderr, "Failed to allocate packet buffer\n");
+        return;
+    }
+    pktbuf_reserve(pkt, 128);
+    bench_run("pktbuf/push_pull", bench_push_pull, pkt, 0);
+    free_pktbuf(pkt);
+}
+
+/* ip_validate_packet on a good header */
+static void bench_ip_validate(void *arg, uint64_t iters) {
+    struct ip_header *hdr = arg;
+    uint64_t sum = 0;
+
+    while (iters--) {
+        sum += ip_validate_packet(hdr, 84);
+    }
+    bench_sink = sum;
+}
+
+/* Lookups cycling through addresses, all of them in the cache */
+struct arp_arg {
+    uint32_t *ips;
+    int n;
+    int next; // carries on from here in the next sample
+};
+
+static void bench_arp_resolve(void *arg, uint64_t iters) {
+    struct arp_arg *a = arg;
+    uint8_t mac[6];
+    uint64_t sum = 0;
+    int i = a->next;
+
+    while (iters--) {
+        sum += arp_resolve(a->ips[i], mac) + mac[5];
+        if (++i == a->n) i = 0;
+    }
+    a->next = i;
+    bench_sink = sum;
+}
+
+/*
+ * arp_resolve hits with the cache holding 10, 1k and nearly ARP_CACHE_SIZE entries (the rest are
+ * left for the other benchmarks' peers): one address over and over, which the thread's replica
+ * serves, and every address in turn, which mostly misses the replica
+ */
+static void bench_arps(void) {
+    static const int sizes[] = { 10, 1000, ARP_CACHE_SIZE - 64 };
+    uint32_t *ips = malloc(sizes[2] * sizeof(*ips));
+    uint8_t mac[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x00 };
+    char name[BENCH_MAX_NAME];
+    int filled = 0, i, j;
+    size_t s;
+
+    if (!ips) {
+        perror("Failed to allocate ARP addresses");
+        return;
+    }
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        struct arp_arg hot, spread;
+
+        snprintf(name, sizeof(name), "arp_resolve/%d", sizes[s]);
+        if (bench.filter && !strstr(name, bench.filter)) {
+            continue;
+        }
+
+        for (; filled < sizes[s]; filled++) {
+            ips[filled] = htonl(0x0a010000 + filled); // 10.1.0.0 onwards
+            memcpy(mac + 2, &filled, 4);
+            arp_update_cache(ips[filled], mac);
+        }
+
+        // visit them in random order so neither the replica nor the prefetcher gets it easy
+        for (i = filled - 1; i > 0; i--) {
+            uint32_t t = ips[i];
+
+            j = rand() % (i + 1);
+            ips[i] = ips[j];
+            ips[j] = t;
+        }
+
+        hot = (struct arp_arg){ .ips = ips, .n = 1 };
+        spread = (struct arp_arg){ .ips = ips, .n = filled };
+        snprintf(name, sizeof(name), "arp_resolve/%d/hot", sizes[s]);
+        bench_run(name, bench_arp_resolve, &hot, 0);
+        snprintf(name, sizeof(name), "arp_resolve/%d/spread", sizes[s]);
+        bench_run(name, bench_arp_resolve, &spread, 0);
+    }
+    free(ips);
+}
+
+/* A whole frame through ethernet_rx, as netdev_poll would hand it over */
+struct frame_arg {
+    uint8_t *frame;
+    int len;
+};
+
+static void bench_ethernet_rx(void *arg, uint64_t iters) {
+    struct frame_arg *a = arg;
+
+    while (iters--) {
+        struct pktbuf *pkt = alloc_pktbuf(NETDEV_MTU + 100);
+
+        memcpy(pkt->data, a->frame, a->len);
+        pkt->len = a->len;
+        pkt->dev = netdev_get();
+        ethernet_rx(pkt);
+    }
+}
+
+/*
+ * An ICMP echo request from 10.0.0.2 with ping's default 56 bytes of data, answered all the way
+ * down to the device write. Also gives ip_validate_packet its header
+ */
+static void bench_icmp_echo(void) {
+    struct netdev *dev = netdev_get();
+    uint8_t frame[sizeof(struct eth_header) + 84];
+    uint8_t peer_mac[6] = { 0x02, 0x42, 0xac, 0x11, 0x00, 0x03 };
+    struct eth_header *eth = (struct eth_header *)frame;
+    struct ip_header *ip = (struct ip_header *)(eth + 1);
+    struct icmp_v4 *icmp = (struct icmp_v4 *)(ip + 1);
+    struct icmp_v4_echo *echo = (struct icmp_v4_echo *)icmp->data;
+    struct frame_arg a = { .frame = frame, .len = sizeof(frame) };
+    uint32_t peer;
+    int i;
+
+    memset(frame, 0, sizeof(frame));
+    inet_pton(AF_INET, "10.0.0.2", &peer);
+    arp_update_cache(peer, peer_mac);
+
+    memcpy(eth->dest_mac, dev->hwaddr, 6);
+    memcpy(eth->src_mac, peer_mac, 6);
+    eth->eth_type = htons(ETH_P_IP);
+
+    ip->version = IPV4;
+    ip->ihl = 5;
+    ip->len = htons(84);
+    ip->ttl = 64;
+    ip->proto = IP_P_ICMP;
+    ip->saddr = peer;
+    ip->daddr = dev->addr;
+    ip->csum = checksum(ip, sizeof(*ip));
+
+    icmp->type = ICMP_ECHO_REQUEST;
+    echo->id = htons(1234);
+    echo->seq = htons(1);
+    for (i = 0; i < 56; i++) {
+        echo->data[i] = i;
+    }
+    icmp->csum = checksum(icmp, 64);
+
+    bench_run("ip_validate_packet", bench_ip_validate, ip, 0);
+    bench_run("ethernet_rx/icmp_echo", bench_ethernet_rx, &a, 0);
+}
+
+/* Stand in for the TAP device: our addresses as usual, and a single queue writing to /dev/null */
+static int bench_netdev_init(void) {
+    netdev_init();
+    tap.nqueues = 1;
+    tap.queues[0].fd = open("/dev/null", O_WRONLY);
+    if (tap.queues[0].fd < 0) {
+        perror("Failed to open /dev/null");
+        return -1;
+    }
+    return 0;
+}
+
+static void bench_pin(void) {
+    cpu_set_t set;
+
+    if (bench.cpu < 0) {
+        bench.cpu = sched_getcpu();
+    }
+    CPU_ZERO(&set);
+    CPU_SET(bench.cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        perror("Failed to pin to CPU");
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [-o file] [-c cpu] [-n samples] [-t sample_ms] [-f filter]\n"
+        "  -o file     write the JSON results to file instead of stdout\n"
+        "  -c cpu      pin to this CPU (default: the one we start on)\n"
+        "  -n samples  timed samples per benchmark (default: %d)\n"
+        "  -t ms       length of one sample (default: %llu)\n"
+        "  -f filter   only run benchmarks whose name contains filter\n",
+        prog, BENCH_SAMPLES, BENCH_SAMPLE_NS / 1000000);
+}
+
+int main(int argc, char **argv) {
+    struct utsname uts;
+    char stamp[32];
+    time_t now = time(NULL);
+    int opt;
+
+    bench.samples = BENCH_SAMPLES;
+    bench.sample_ns = BENCH_SAMPLE_NS;
+    bench.out = stdout;
+    bench.cpu = -1;
+
+    while ((opt = getopt(argc, argv, "o:c:n:t:f:h")) != -1) {
+        switch (opt) {
+            case 'o':
+                bench.out = fopen(optarg, "w");
+                if (!bench.out) {
+                    perror("Failed to open output file");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'c':
+                bench.cpu = atoi(optarg);
+                break;
+            case 'n':
+                bench.samples = atoi(optarg);
+                break;
+            case 't':
+                bench.sample_ns = strtoull(optarg, NULL, 10) * 1000000ULL;
+                break;
+            case 'f':
+                bench.filter = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (bench.samples < 1 || bench.sample_ns == 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    verbose = 0;
+    srand(1);
+    bench_pin();
+    if (bench_netdev_init() < 0) {
+        return EXIT_FAILURE;
+    }
+    ethernet_init();
+    arp_init();
+    ip_init();
+
+    uname(&uts);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+    fprintf(bench.out,
+            "{\n  \"timestamp\": \"%s\",\n  \"host\": \"%s\",\n  \"kernel\": \"%s\",\n"
+            "  \"machine\": \"%s\",\n  \"cpu\": %d,\n  \"samples\": %d,\n  \"sample_ns\": %llu,\n"
+            "  \"trace\": %s,\n  \"results\": [\n",
+            stamp, uts.nodename, uts.release, uts.machine, bench.cpu, bench.samples,
+            (unsigned long long)bench.sample_ns,
+#ifdef PKT_TRACE
+            "true"
+#else
+            "false"
+#endif
+            );
+
+    bench_checksums();
+    bench_pktbufs();
+    bench_icmp_echo();
+    bench_arps();
+
+    fprintf(bench.out, "\n  ]\n}\n");
+    if (bench.out != stdout) {
+        fclose(bench.out);
+    }
+    close(tap.queues[0].fd);
+    return EXIT_SUCCESS;
+}
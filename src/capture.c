@@ -0,0 +1,399 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+
+#include "capture.h"
+#include "ring.h"
+#include "netdev.h"
+#include "ethernet.h"
+#include "arp.h"
+#include "ip.h"
+#include "utils.h"
+
+#define cap_dbg(fmt, ...) \
+    do { if (verbose) printf("CAPTURE: " fmt "\n", ##__VA_ARGS__); } while (0)
+
+/* pcapng block types and options */
+#define PCAPNG_SHB        0x0A0D0D0A
+#define PCAPNG_IDB        0x00000001
+#define PCAPNG_EPB        0x00000006
+#define PCAPNG_MAGIC      0x1A2B3C4D
+#define PCAPNG_LINK_ETH   1
+#define PCAPNG_OPT_END    0
+#define PCAPNG_IF_NAME    2
+#define PCAPNG_IF_TSRESOL 9
+#define PCAPNG_EPB_FLAGS  2
+
+#define PAD4(n) (((n) + 3) & ~3u)
+
+/* A copied frame waiting for the writer */
+struct capture_rec {
+    uint64_t ts_ns;   // wall clock, what readers of the file expect
+    uint32_t caplen;
+    uint32_t origlen;
+    uint32_t dir;
+    uint8_t data[];
+};
+
+/* Parsed filter, zero fields match anything */
+struct capture_filter {
+    uint16_t ethertype;
+    uint8_t proto;  // IP protocol, implies ethertype IP
+    uint32_t host;  // network order
+};
+
+_Atomic int capture_on = 0;
+
+static struct {
+    struct capture_filter filter;
+    struct ring *ring;
+    int efd;           // wakes the writer up
+    pthread_t thread;
+    _Atomic int stop;
+    int open;          // a file is open, capture_toggle may resume it
+    int fd;
+    uint8_t *map;
+    size_t map_len;    // how much of the file exists and is mapped
+    size_t off;        // how much of it is written
+    uint64_t frames;
+    atomic_ullong drops;
+} cap = { .efd = -1, .fd = -1 };
+
+static int capture_parse_filter(const char *expr, struct capture_filter *f) {
+    char *copy, *tok, *save;
+    struct in_addr addr;
+    int ret = 0;
+
+    memset(f, 0, sizeof(*f));
+    if (!expr) {
+        return 0;
+    }
+
+    copy = strdup(expr);
+    if (!copy) {
+        return -1;
+    }
+    for (tok = strtok_r(copy, " ", &save); tok; tok = strtok_r(NULL, " ", &save)) {
+        if (strcmp(tok, "ip") == 0) {
+            f->ethertype = ETH_P_IP;
+        } else if (strcmp(tok, "arp") == 0) {
+            f->ethertype = ETH_P_ARP;
+        } else if (strcmp(tok, "icmp") == 0) {
+            f->ethertype = ETH_P_IP;
+            f->proto = IP_P_ICMP;
+        } else if (strcmp(tok, "tcp") == 0) {
+            f->ethertype = ETH_P_IP;
+            f->proto = IP_P_TCP;
+        } else if (strcmp(tok, "udp") == 0) {
+            f->ethertype = ETH_P_IP;
+            f->proto = IP_P_UDP;
+        } else if (strcmp(tok, "host") == 0) {
+            tok = strtok_r(NULL, " ", &save);
+            if (!tok || inet_pton(AF_INET, tok, &addr) != 1) {
+                fprintf(stderr, "Capture filter: host needs an IPv4 address\n");
+                ret = -1;
+                break;
+            }
+            f->host = addr.s_addr;
+        } else {
+            fprintf(stderr, "Capture filter: unknown term %s\n", tok);
+            ret = -1;
+            break;
+        }
+    }
+
+    // ARP carries no IP protocol
+    if (ret == 0 && f->proto && f->ethertype != ETH_P_IP) {
+        fprintf(stderr, "Capture filter: arp doesn't mix with icmp, tcp or udp\n");
+        ret = -1;
+    }
+    free(copy);
+    return ret;
+}
+
+static int capture_match(const uint8_t *frame, uint32_t len) {
+    const struct capture_filter *f = &cap.filter;
+    const struct eth_header *eh = (const struct eth_header *)frame;
+    uint16_t type;
+
+    if (len < sizeof(*eh)) {
+        return !f->ethertype && !f->host;
+    }
+    type = ntohs(eh->eth_type);
+    if (f->ethertype && type != f->ethertype) {
+        return 0;
+    }
+
+    if (type == ETH_P_IP && len >= sizeof(*eh) + sizeof(struct ip_header)) {
+        const struct ip_header *iph = (const struct ip_header *)(frame + sizeof(*eh));
+
+        if (f->proto && iph->proto != f->proto) {
+            return 0;
+        }
+        return !f->host || iph->saddr == f->host || iph->daddr == f->host;
+    }
+    if (type == ETH_P_ARP && len >= sizeof(*eh) + sizeof(struct arp_header) + sizeof(struct arp_ipv4)) {
+        const struct arp_ipv4 *arp = (const struct arp_ipv4 *)(frame + sizeof(*eh) + sizeof(struct arp_header));
+
+        return !f->host || arp->sip == f->host || arp->dip == f->host;
+    }
+    return !f->proto && !f->host;
+}
+
+void capture_frame(struct pktbuf *pkt, enum capture_dir dir) {
+    uint32_t len = pktbuf_total_len(pkt);
+    uint32_t caplen = len < CAPTURE_SNAPLEN ? len : CAPTURE_SNAPLEN;
+    struct capture_rec *rec;
+    struct timespec ts;
+
+    if (!capture_match(pkt->data, pkt->len)) {
+        return;
+    }
+
+    // a copy, the buffer's reference count is for the thread that owns it
+    rec = malloc(sizeof(*rec) + caplen);
+    if (!rec) {
+        atomic_fetch_add_explicit(&cap.drops, 1, memory_order_relaxed);
+        return;
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec->ts_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    rec->caplen = caplen;
+    rec->origlen = len;
+    rec->dir = dir;
+    pktbuf_copy(pkt, rec->data, caplen);
+
+    if (ring_mp_enqueue_burst(cap.ring, (void *const *)&rec, 1) == 0) {
+        atomic_fetch_add_explicit(&cap.drops, 1, memory_order_relaxed);
+        free(rec);
+        return;
+    }
+
+    // the first frame in wakes the writer, it also looks on its own now and then
+    if (ring_count(cap.ring) == 1) {
+        eventfd_write(cap.efd, 1);
+    }
+}
+
+/* Make room for len more bytes, growing the file and its mapping a step at a time */
+static int capture_reserve(size_t len) {
+    size_t size = cap.map_len;
+    void *map;
+
+    if (cap.off + len <= cap.map_len) {
+        return 0;
+    }
+    while (size < cap.off + len) {
+        size += CAPTURE_FILE_STEP;
+    }
+
+    if (ftruncate(cap.fd, size) < 0) {
+        perror("Failed to grow capture file");
+        return -1;
+    }
+    if (cap.map) {
+        map = mremap(cap.map, cap.map_len, size, MREMAP_MAYMOVE);
+    } else {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, cap.fd, 0);
+    }
+    if (map == MAP_FAILED) {
+        perror("Failed to map capture file");
+        return -1;
+    }
+    cap.map = map;
+    cap.map_len = size;
+    return 0;
+}
+
+static void capture_put(const void *p, size_t len) {
+    memcpy(cap.map + cap.off, p, len);
+    cap.off += len;
+}
+
+static void capture_put32(uint32_t v) {
+    capture_put(&v, sizeof(v));
+}
+
+/* An option: code, length, value padded to 32 bits */
+static void capture_put_opt(uint16_t code, const void *val, uint16_t len) {
+    static const uint8_t zero[4];
+
+    capture_put(&code, sizeof(code));
+    capture_put(&len, sizeof(len));
+    capture_put(val, len);
+    capture_put(zero, PAD4(len) - len);
+}
+
+/* Section header and the one interface, nanosecond timestamps */
+static int capture_write_header(const char *ifname) {
+    uint32_t shb_len = 28, idb_len;
+    uint16_t name_len = strlen(ifname);
+    uint8_t tsresol = 9;
+    int64_t section_len = -1;
+
+    idb_len = 20 + 4 + PAD4(name_len) + 4 + PAD4(1) + 4;
+    if (capture_reserve(shb_len + idb_len) < 0) {
+        return -1;
+    }
+
+    capture_put32(PCAPNG_SHB);
+    capture_put32(shb_len);
+    capture_put32(PCAPNG_MAGIC);
+    capture_put32(1); // version 1.0, major then minor as 16 bit halves
+    capture_put(&section_len, sizeof(section_len));
+    capture_put32(shb_len);
+
+    capture_put32(PCAPNG_IDB);
+    capture_put32(idb_len);
+    capture_put32(PCAPNG_LINK_ETH); // link type and a reserved zero
+    capture_put32(CAPTURE_SNAPLEN);
+    capture_put_opt(PCAPNG_IF_NAME, ifname, name_len);
+    capture_put_opt(PCAPNG_IF_TSRESOL, &tsresol, 1);
+    capture_put_opt(PCAPNG_OPT_END, NULL, 0);
+    capture_put32(idb_len);
+    return 0;
+}
+
+/* An Enhanced Packet Block with the frame's direction */
+static int capture_write_frame(struct capture_rec *rec) {
+    uint32_t len = 28 + PAD4(rec->caplen) + 8 + 4 + 4;
+
+    if (capture_reserve(len) < 0) {
+        return -1;
+    }
+    capture_put32(PCAPNG_EPB);
+    capture_put32(len);
+    capture_put32(0); // interface
+    capture_put32(rec->ts_ns >> 32);
+    capture_put32(rec->ts_ns & 0xffffffff);
+    capture_put32(rec->caplen);
+    capture_put32(rec->origlen);
+    capture_put(rec->data, rec->caplen);
+    capture_put("\0\0\0", PAD4(rec->caplen) - rec->caplen);
+    capture_put_opt(PCAPNG_EPB_FLAGS, &rec->dir, sizeof(rec->dir));
+    capture_put_opt(PCAPNG_OPT_END, NULL, 0);
+    capture_put32(len);
+    cap.frames++;
+    return 0;
+}
+
+/* Writer thread: moves frames from the ring into the file */
+static void *capture_writer(void *arg) {
+    struct capture_rec *recs[32];
+    struct pollfd pfd = { .fd = cap.efd, .events = POLLIN };
+    eventfd_t val;
+    uint32_t i, n;
+
+    for (;;) {
+        n = ring_sc_dequeue_burst(cap.ring, (void **)recs, 32);
+        for (i = 0; i < n; i++) {
+            if (capture_write_frame(recs[i]) < 0) {
+                atomic_fetch_add_explicit(&cap.drops, 1, memory_order_relaxed);
+            }
+            free(recs[i]);
+        }
+        if (n) {
+            continue;
+        }
+
+        // stop only once drained, capture_stop turns the hooks off first
+        if (atomic_load(&cap.stop)) {
+            break;
+        }
+        if (poll(&pfd, 1, 100) > 0) {
+            eventfd_read(cap.efd, &val);
+        }
+    }
+    return NULL;
+}
+
+int capture_start(const char *path, const char *filter) {
+    struct capture_rec *rec;
+
+    if (cap.open) {
+        fprintf(stderr, "Already capturing\n");
+        return -1;
+    }
+    if (capture_parse_filter(filter, &cap.filter) < 0) {
+        return -1;
+    }
+
+    // the ring and eventfd outlive a capture, a hook that saw it on a moment ago may still use them
+    if (!cap.ring && !(cap.ring = ring_create(CAPTURE_RING_SIZE))) {
+        fprintf(stderr, "Failed to allocate capture ring\n");
+        return -1;
+    }
+    if (cap.efd < 0 && (cap.efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+        perror("Failed to create capture eventfd");
+        return -1;
+    }
+    while (ring_sc_dequeue_burst(cap.ring, (void **)&rec, 1)) {
+        free(rec); // late arrivals from the previous capture
+    }
+
+    cap.fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (cap.fd < 0) {
+        perror("Failed to open capture file");
+        return -1;
+    }
+    cap.map = NULL;
+    cap.map_len = 0;
+    cap.off = 0;
+    cap.frames = 0;
+    atomic_store(&cap.drops, 0);
+    atomic_store(&cap.stop, 0);
+
+    if (capture_write_header(netdev_get()->name) < 0 ||
+        pthread_create(&cap.thread, NULL, capture_writer, NULL) != 0) {
+        fprintf(stderr, "Failed to start capture\n");
+        if (cap.map) {
+            munmap(cap.map, cap.map_len);
+        }
+        close(cap.fd);
+        cap.fd = -1;
+        return -1;
+    }
+
+    cap.open = 1;
+    atomic_store(&capture_on, 1);
+    printf("Capturing to %s%s%s\n", path, filter ? ", filter " : "", filter ? filter : "");
+    return 0;
+}
+
+void capture_toggle(void) {
+    if (cap.open) {
+        atomic_fetch_xor(&capture_on, 1);
+    }
+}
+
+void capture_stop(void) {
+    if (!cap.open) {
+        return;
+    }
+    atomic_store(&capture_on, 0);
+    atomic_store(&cap.stop, 1);
+    eventfd_write(cap.efd, 1);
+    pthread_join(cap.thread, NULL);
+
+    // the file ends where the data does, not at the last growth step
+    munmap(cap.map, cap.map_len);
+    if (ftruncate(cap.fd, cap.off) < 0) {
+        perror("Failed to trim capture file");
+    }
+    close(cap.fd);
+    cap.fd = -1;
+    cap.open = 0;
+
+    printf("Captured %llu frames, %llu dropped\n", (unsigned long long)cap.frames,
+           (unsigned long long)atomic_load(&cap.drops));
+    cap_dbg("Capture file is %zu bytes", cap.off);
+}
@@ -7,10 +7,14 @@
 #include "arp.h"
 #include "netdev.h"
 #include "ip.h"
+#include "gso.h"
+#include "stats.h"
+#include "probe.h"
+#include "utils.h"
 
 /* debug output macro */
 #define eth_dbg(fmt, ...) \
-    printf("ETH: " fmt "\n", ##__VA_ARGS__)
+    do { if (verbose) printf("ETH: " fmt "\n", ##__VA_ARGS__); } while (0)
 
 /* print Ethernet address (MAC) */
 static void print_eth_addr(const char *name, const uint8_t *addr) {
@@ -48,19 +52,29 @@ int ethernet_tx(struct pktbuf *pkt, const uint8_t *dst_mac, uint16_t ethertype)
         eth_debug_header(hdr);
     }
 
+    // a super-frame the device can't take gets cut to wire size here, as late as possible
+    if (pkt->gso_size && !(dev->features & NETDEV_F_GSO)) {
+        return gso_xmit(pkt);
+    }
+
     // transmit frame using network device
     return netdev_tx(pkt);
 }
 
-void ethernet_rx(struct pktbuf *pkt) {
+int ethernet_parse(struct pktbuf *pkt) {
     struct eth_header *hdr;
     uint16_t ethertype;
 
+    TRACE_NOW(now);
+    TRACE_STAMP_AT(pkt, TRACE_ETH_RX, now);
+    TRACE_SINCE(TRACE_STAGE_DEV_ETH, pkt, TRACE_DEV_RX, now);
+
     // make sure we have at least enough data for an Eth header
     if (pkt->len < sizeof(struct eth_header)) {
         eth_dbg("Packet too short for Ethernet header (%d bytes)", pkt->len);
+        STATS_INC(STAT_LINK_IN_RUNTS);
         free_pktbuf(pkt);
-        return;
+        return -1;
     }
 
     hdr = (struct eth_header *)pkt->data;
@@ -71,14 +85,26 @@ void ethernet_rx(struct pktbuf *pkt) {
         eth_debug_header(hdr);
     }
 
+    if (ethertype != ETH_P_ARP && ethertype != ETH_P_IP) {
+        eth_dbg("Unsupported ethertype 0x%04x", ethertype);
+        STATS_INC(STAT_LINK_IN_UNKNOWN_TYPES);
+        free_pktbuf(pkt);
+        return -1;
+    }
+
     // remove the Eth header 
     pktbuf_pull(pkt, sizeof(struct eth_header));
 
     // set the protocol based on ethertype
     pkt->protocol = ethertype;
+    return 0;
+}
+
+void ethernet_deliver(struct pktbuf *pkt) {
+    PROBE2(eth_deliver, pkt->protocol, pkt->len);
 
     // dispatch to the appropriate protocol handler
-    switch (ethertype) {
+    switch (pkt->protocol) {
         case ETH_P_ARP:
             eth_dbg("Dispatching ARP packet");
             arp_recv(pkt);
@@ -88,12 +114,15 @@ void ethernet_rx(struct pktbuf *pkt) {
             ip_recv(pkt);
             break;
         default:
-            eth_dbg("Unsupported ethertype 0x%04x", ethertype);
             free_pktbuf(pkt);
             break;
-            
     }
+}
 
+void ethernet_rx(struct pktbuf *pkt) {
+    if (ethernet_parse(pkt) == 0) {
+        ethernet_deliver(pkt);
+    }
 }
 
 void ethernet_init(void) {
@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+
+#include "gro.h"
+#include "ethernet.h"
+#include "ip.h"
+#include "tcp.h"
+#include "utils.h"
+
+#define gro_dbg(fmt, ...) \
+    do { if (verbose) printf("GRO: " fmt "\n", ##__VA_ARGS__); } while (0)
+
+/* Segments of one flow held back, the first one carrying the others' payload as pieces */
+struct gro_flow {
+    struct pktbuf *pkt;
+    uint32_t next_seq; // where the next segment has to start to join
+    uint16_t mss;      // payload of the first segment, every one but the last has to match it
+    uint16_t segs;
+};
+
+static _Atomic int gro_on = 1;
+
+/* The calling thread's held flows */
+static __thread struct {
+    struct gro_flow flows[GRO_MAX_FLOWS];
+    int victim; // flow pushed out next when they're all taken
+} gro;
+
+void gro_disable(void) {
+    atomic_store(&gro_on, 0);
+}
+
+static int gro_same_flow(struct pktbuf *a, struct pktbuf *b) {
+    struct ip_header *ia = (struct ip_header *)a->nh, *ib = (struct ip_header *)b->nh;
+    struct tcp_header *ta = (struct tcp_header *)a->th, *tb = (struct tcp_header *)b->th;
+
+    return ia->saddr == ib->saddr && ia->daddr == ib->daddr &&
+           ta->sport == tb->sport && ta->dport == tb->dport;
+}
+
+/* Send what a flow holds up to TCP, with its IP length covering all of it */
+static void gro_flush_flow(struct gro_flow *f) {
+    struct pktbuf *pkt = f->pkt;
+    struct ip_header *iph = (struct ip_header *)pkt->nh;
+    uint16_t old = iph->len;
+
+    f->pkt = NULL;
+    if (f->segs > 1) {
+        iph->len = htons(iph->ihl * 4 + pktbuf_total_len(pkt));
+        iph->csum = checksum_adjust(iph->csum, old, iph->len);
+        pkt->gso_size = f->mss;
+        pkt->gso_segs = f->segs;
+        gro_dbg("Coalesced %d segments, %d bytes", f->segs, pktbuf_total_len(pkt));
+    }
+    tcp_recv(pkt);
+}
+
+/* Can seg go behind what f holds: next in sequence, same ACK, window and options, and not bigger */
+static int gro_can_merge(struct gro_flow *f, struct pktbuf *seg, uint32_t plen) {
+    struct ip_header *hi = (struct ip_header *)f->pkt->nh, *si = (struct ip_header *)seg->nh;
+    struct tcp_header *ht = (struct tcp_header *)f->pkt->th, *st = (struct tcp_header *)seg->th;
+
+    return ntohl(st->seq) == f->next_seq &&
+           st->ack_seq == ht->ack_seq && st->win == ht->win && st->doff == ht->doff &&
+           memcmp(st->options, ht->options, st->doff * 4 - sizeof(*st)) == 0 &&
+           si->tos == hi->tos && si->ttl == hi->ttl &&
+           plen <= f->mss && f->segs < UINT16_MAX &&
+           hi->ihl * 4 + pktbuf_total_len(f->pkt) + plen <= GRO_MAX_SIZE;
+}
+
+void gro_receive(struct pktbuf *pkt) {
+    struct ip_header *iph = (struct ip_header *)pkt->nh;
+    struct tcp_header *th = (struct tcp_header *)pkt->data;
+    struct gro_flow *f = NULL, *free_slot = NULL;
+    uint32_t hlen, plen;
+    uint16_t frag;
+    int i;
+
+    // too broken to even tell the flow, TCP drops it and counts why
+    if (!atomic_load_explicit(&gro_on, memory_order_relaxed) || pkt->len < sizeof(*th) ||
+        th->doff * 4 < sizeof(*th) || th->doff * 4 > pkt->len) {
+        tcp_recv(pkt);
+        return;
+    }
+    hlen = th->doff * 4;
+    plen = pkt->len - hlen;
+
+    for (i = 0; i < GRO_MAX_FLOWS; i++) {
+        if (!gro.flows[i].pkt) {
+            if (!free_slot) free_slot = &gro.flows[i];
+        } else if (gro_same_flow(gro.flows[i].pkt, pkt)) {
+            f = &gro.flows[i];
+            break;
+        }
+    }
+
+    // only plain data segments coalesce, anything else goes up right behind what the flow holds
+    memcpy(&frag, (const uint8_t *)&iph->id + 2, 2); // flags and offset, the bitfields don't match the wire
+    if (plen == 0 || th->flags & ~(TCP_ACK | TCP_PSH) || !(th->flags & TCP_ACK) || iph->ihl != 5 ||
+        (ntohs(frag) & (IP_MF | 0x1fff)) ||
+        ip_pseudo_checksum(iph->saddr, iph->daddr, IP_P_TCP, th, pkt->len) != 0) {
+        if (f) gro_flush_flow(f);
+        tcp_recv(pkt);
+        return;
+    }
+    pkt->l4_csum_ok = 1;
+
+    // the payload stays where it arrived, the held segment references it as its next piece
+    if (f && gro_can_merge(f, pkt, plen) && pktbuf_add_piece(f->pkt, pkt, pkt->data + hlen, plen, NULL) == 0) {
+        ((struct tcp_header *)f->pkt->th)->flags |= th->flags;
+        f->next_seq += plen;
+        f->segs++;
+        free_pktbuf(pkt);
+
+        // a short segment or a push ends the run, nothing more would join
+        if (plen < f->mss || th->flags & TCP_PSH) {
+            gro_flush_flow(f);
+        }
+        return;
+    }
+
+    if (f) {
+        gro_flush_flow(f);
+    } else if (!(f = free_slot)) {
+        f = &gro.flows[gro.victim];
+        gro.victim = (gro.victim + 1) % GRO_MAX_FLOWS;
+        gro_flush_flow(f);
+    }
+
+    // a push has nothing following it to wait for
+    if (th->flags & TCP_PSH) {
+        tcp_recv(pkt);
+        return;
+    }
+    f->pkt = pkt;
+    f->next_seq = ntohl(th->seq) + plen;
+    f->mss = plen;
+    f->segs = 1;
+}
+
+void gro_flush(void) {
+    int i;
+
+    for (i = 0; i < GRO_MAX_FLOWS; i++) {
+        if (gro.flows[i].pkt) {
+            gro_flush_flow(&gro.flows[i]);
+        }
+    }
+}
@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "gso.h"
+#include "netdev.h"
+#include "ethernet.h"
+#include "ip.h"
+#include "tcp.h"
+#include "utils.h"
+
+/* debug output macro */
+#define gso_dbg(fmt, ...) \
+    do { if (verbose) printf("GSO: " fmt "\n", ##__VA_ARGS__); } while (0)
+
+/* One stretch of the super-frame's payload, and the buffer keeping it alive */
+struct gso_piece {
+    uint8_t *data;
+    uint32_t len;
+    struct pktbuf *owner;
+    uint32_t csum;
+    int csum_ok;
+};
+
+/* The 16-bit header word at off, the way checksum_partial adds it */
+static inline uint16_t gso_word(const void *hdr, int off) {
+    uint16_t w;
+
+    memcpy(&w, (const uint8_t *)hdr + off, 2);
+    return w;
+}
+
+int gso_xmit(struct pktbuf *pkt) {
+    struct ip_header *iph = (struct ip_header *)(pkt->data + sizeof(struct eth_header));
+    int iphlen = iph->ihl * 4;
+    struct tcp_header *th = (struct tcp_header *)((uint8_t *)iph + iphlen);
+    int thlen = th->doff * 4;
+    int hlen = sizeof(struct eth_header) + iphlen + thlen;
+    uint32_t seq = ntohl(th->seq);
+    uint16_t id = ntohs(iph->id);
+    int left = pktbuf_total_len(pkt) - hlen;
+    struct gso_piece pieces[PKTBUF_MAX_PIECES + 2];
+    int npieces = 0, p = 0, sent = 0, i;
+    uint32_t off = 0, hsum;
+
+    gso_dbg("Segmenting %d bytes into %d byte frames", left, pkt->gso_size);
+
+    // the payload in wire order: behind the headers, the fragment, then the pieces
+    if ((int)pkt->len > hlen) {
+        pieces[npieces++] = (struct gso_piece){ pkt->data + hlen, pkt->len - hlen, pkt, 0, 0 };
+    }
+    if (pkt->frag_len) {
+        pieces[npieces++] = (struct gso_piece){ pkt->frag, pkt->frag_len, pkt, 0, 0 };
+    }
+    for (i = 0; pkt->pieces && i < pkt->pieces->count; i++) {
+        struct pktbuf_piece *pp = &pkt->pieces->piece[i];
+        pieces[npieces++] = (struct gso_piece){ pp->data, pp->len, pp->owner, pp->csum, pp->csum_ok };
+    }
+
+    // every segment's header is the template's with another seq and flags: sum it once without
+    // those, each segment adds its own (the word at 12 holds doff and the flags)
+    th->csum = 0;
+    hsum = checksum_partial(th, thlen, 0);
+    hsum += (uint16_t)~gso_word(th, 4) + (uint16_t)~gso_word(th, 6) + (uint16_t)~gso_word(th, 12);
+
+    while (left > 0 && p < npieces) {
+        int seglen = left > pkt->gso_size ? pkt->gso_size : left;
+        struct gso_piece *pc = &pieces[p];
+        struct pktbuf *seg;
+        struct ip_header *siph;
+        struct tcp_header *sth;
+        uint32_t psum, sum;
+        uint16_t old;
+
+        // a slice within one piece points at it, the queued segments of a super-frame line up
+        // with its slices exactly and bring their sums along. One spanning pieces is copied
+        if (pc->len - off >= (uint32_t)seglen) {
+            seg = alloc_pktbuf(hlen);
+            if (!seg) {
+                break; // the rest is lost on the wire as far as TCP can tell, it retransmits
+            }
+            memcpy(pktbuf_put(seg, hlen), pkt->data, hlen);
+            pktbuf_attach_pkt(seg, pc->data + off, seglen, pc->owner);
+            if (off == 0 && (uint32_t)seglen == pc->len && pc->csum_ok) {
+                psum = pc->csum;
+            } else {
+                psum = checksum_partial(pc->data + off, seglen, 0);
+            }
+            off += seglen;
+            if (off == pc->len) {
+                p++;
+                off = 0;
+            }
+        } else {
+            uint8_t *dst;
+            int copied = 0, n;
+
+            seg = alloc_pktbuf(hlen + seglen);
+            if (!seg) {
+                break;
+            }
+            memcpy(pktbuf_put(seg, hlen), pkt->data, hlen);
+            dst = pktbuf_put(seg, seglen);
+            while (copied < seglen && p < npieces) {
+                n = pieces[p].len - off < (uint32_t)(seglen - copied) ? (int)(pieces[p].len - off) : seglen - copied;
+                memcpy(dst + copied, pieces[p].data + off, n);
+                copied += n;
+                off += n;
+                if (off == pieces[p].len) {
+                    p++;
+                    off = 0;
+                }
+            }
+            psum = checksum_partial(dst, seglen, 0);
+        }
+        siph = (struct ip_header *)(seg->data + sizeof(struct eth_header));
+        sth = (struct tcp_header *)((uint8_t *)siph + iphlen);
+
+        // IP length and id change per segment, patch the header checksum rather than redo it
+        old = siph->len;
+        siph->len = htons(pktbuf_total_len(seg) - sizeof(struct eth_header));
+        siph->csum = checksum_adjust(siph->csum, old, siph->len);
+        old = siph->id;
+        siph->id = htons(id);
+        siph->csum = checksum_adjust(siph->csum, old, siph->id);
+
+        // FIN and PSH belong to the last segment only, CWR to the first
+        sth->seq = htonl(seq);
+        if (left > seglen) {
+            sth->flags &= ~(TCP_FIN | TCP_PSH);
+        }
+        if (sent) {
+            sth->flags &= ~TCP_CWR;
+        }
+
+        // the template's sum with this segment's words, its payload's, and the pseudo header
+        sum = hsum + gso_word(sth, 4) + gso_word(sth, 6) + gso_word(sth, 12) + psum;
+        sum += ip_pseudo_sum(siph->saddr, siph->daddr, IP_P_TCP, thlen + seglen);
+        sth->csum = checksum_fold(sum);
+
+        seg->protocol = pkt->protocol;
+        if (netdev_tx(seg) < 0) {
+            break;
+        }
+
+        left -= seglen;
+        seq += seglen;
+        id++;
+        sent++;
+    }
+
+    free_pktbuf(pkt);
+    return sent ? 0 : -1;
+}
@@ -0,0 +1,85 @@
+#include <string.h>
+
+#include "histogram.h"
+
+/* Map a value to its bucket index */
+static inline int hist_index(uint64_t value) {
+    if (value < HIST_SUB_BUCKETS) {
+        return value; // small values are stored exactly
+    }
+
+    int msb = 63 - __builtin_clzll(value);
+    if (msb >= HIST_MAX_BITS) {
+        return HIST_BUCKETS - 1; // clamp anything too large into the last bucket
+    }
+
+    // keep the top HIST_SUB_BITS + 1 bits, the leading one selects the power of two
+    int shift = msb - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB_BUCKETS + (int)((value >> shift) - HIST_SUB_BUCKETS);
+}
+
+/* Largest value that maps to the given bucket index */
+static uint64_t hist_bucket_upper(int idx) {
+    if (idx < 2 * HIST_SUB_BUCKETS) {
+        return idx;
+    }
+
+    int shift = idx / HIST_SUB_BUCKETS - 1;
+    uint64_t sub = idx % HIST_SUB_BUCKETS + HIST_SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+}
+
+void hist_init(struct histogram *h) {
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+void hist_record(struct histogram *h, uint64_t value) {
+    h->buckets[hist_index(value)]++;
+    h->count++;
+    h->sum += value;
+
+    if (value < h->min) h->min = value;
+    if (value > h->max) h->max = value;
+}
+
+void hist_merge(struct histogram *dst, const struct histogram *src) {
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        dst->buckets[i] += src->buckets[i];
+    }
+
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->min < dst->min) dst->min = src->min;
+    if (src->max > dst->max) dst->max = src->max;
+}
+
+uint64_t hist_percentile(const struct histogram *h, double pct) {
+    uint64_t target, seen = 0;
+    int i;
+
+    if (h->count == 0) {
+        return 0;
+    }
+
+    // rank of the value we're after, at least the first one
+    target = (uint64_t)(pct / 100.0 * h->count + 0.5);
+    if (target < 1) target = 1;
+    if (target > h->count) target = h->count;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= target) {
+            uint64_t upper = hist_bucket_upper(i);
+            return upper > h->max ? h->max : upper; // never report more than we actually saw
+        }
+    }
+
+    return h->max;
+}
+
+uint64_t hist_mean(const struct histogram *h) {
+    return h->count ? h->sum / h->count : 0;
+}
@@ -4,9 +4,13 @@
 
 #include "icmp.h"
 #include "ip.h"
+#include "ethernet.h"
+#include "ping.h"
+#include "stats.h"
+#include "utils.h"
 
 #define icmp_dbg(fmt, ...) \
-    printf("ICMP: " fmt "\n", ##__VA_ARGS__)
+    do { if (verbose) printf("ICMP: " fmt "\n", ##__VA_ARGS__); } while (0)
 
 /* Process an echo request and send back an echo reply */
 static int icmp_echo_reply(struct pktbuf *pkt) {
@@ -20,8 +24,8 @@ static int icmp_echo_reply(struct pktbuf *pkt) {
     icmp_request = (struct icmp_v4 *)pkt->data;
     echo_request = (struct icmp_v4_echo *)icmp_request->data;
 
-    // extract source address from the incoming packet
-    src_addr = *((uint32_t *)(pkt->data - 8)); // minus 8 bytes to get source IP
+    // extract source address from the incoming packet's IP header
+    src_addr = ((struct ip_header *)pkt->nh)->saddr;
 
     // calculate data length (total len - ICMP header - echo header)
     data_len = pkt->len - sizeof(struct icmp_v4) - sizeof(struct icmp_v4_echo);
@@ -54,15 +58,22 @@ static int icmp_echo_reply(struct pktbuf *pkt) {
 
     icmp_dbg("Sending ICMP Echo Reply, id=%d seq=%d", ntohs(echo_reply->id), ntohs(echo_reply->seq));
 
-    // send ICMP reply
-    return ip_send(src_addr, IP_P_ICMP, reply->data, reply->len);
+    // send ICMP reply, ip_send copies the data so we're done with our buffer
+    STATS_INC(STAT_ICMP_OUT_MSGS);
+    STATS_INC(STAT_ICMP_OUT_ECHO_REPS);
+    int ret = ip_send(src_addr, IP_P_ICMP, reply->data, reply->len);
+    free_pktbuf(reply);
+    return ret;
 }
 
 void icmp_recv(struct pktbuf *pkt) {
     struct icmp_v4 *icmp;
 
+    STATS_INC(STAT_ICMP_IN_MSGS);
+
     if (!pkt || pkt->len < sizeof(struct icmp_v4)) {
         icmp_dbg("Packet too small for ICMP header");
+        STATS_INC(STAT_ICMP_IN_ERRORS);
         if (pkt) free_pktbuf(pkt);
         return;
     }
@@ -74,6 +85,8 @@ void icmp_recv(struct pktbuf *pkt) {
     icmp->csum = 0;
     if (checksum(icmp, pkt->len) != csum) {
         icmp_dbg("Invalid ICMP checksum");
+        STATS_INC(STAT_ICMP_IN_ERRORS);
+        STATS_INC(STAT_ICMP_IN_CSUM_ERRORS);
         free_pktbuf(pkt);
         return;
     }
@@ -82,19 +95,24 @@ void icmp_recv(struct pktbuf *pkt) {
     switch (icmp->type) {
         case ICMP_ECHO_REQUEST:
             icmp_dbg("Received ICMP Echo Request");
+            STATS_INC(STAT_ICMP_IN_ECHOS);
             if (icmp_echo_reply(pkt) < 0) {
                 icmp_dbg("Failed to send ICMP Echo Reply");
             }
             break;
         
         case ICMP_ECHO_REPLY:
-            // we'd handle logic to match the reply with requests here (for when we send out ping requests). 
-            // can just Wireshark to test for now
+            // hand it to the ping tool, which matches replies to its requests by id/seq
             icmp_dbg("Received ICMP Echo Reply");
+            STATS_INC(STAT_ICMP_IN_ECHO_REPS);
+            if (pkt->len >= sizeof(struct icmp_v4) + sizeof(struct icmp_v4_echo)) {
+                ping_recv_reply((struct icmp_v4_echo *)icmp->data, pkt->len - sizeof(struct icmp_v4) - sizeof(struct icmp_v4_echo));
+            }
             break;
 
         case ICMP_DEST_UNREACHABLE:
             icmp_dbg("Received ICMP Destination Unreachable");
+            STATS_INC(STAT_ICMP_IN_DEST_UNREACHS);
             // could notify upper layer protocols
             break;
         default:
@@ -104,20 +122,19 @@ void icmp_recv(struct pktbuf *pkt) {
     free_pktbuf(pkt);
 }
 
-int icmp_send_echo_request(uint32_t dst_addr, uint16_t id, uint16_t seq) {
+int icmp_send_echo(uint32_t dst_addr, uint16_t id, uint16_t seq, const void *data, int data_len) {
     struct pktbuf *pkt;
     struct icmp_v4 *icmp;
     struct icmp_v4_echo *echo;
-    char *data;
-    int data_len = 56; // which is std ping data size
     int len = sizeof(struct icmp_v4) + sizeof(struct icmp_v4_echo) + data_len;
 
-    // alloc packet buffer
-    pkt = alloc_pktbuf(len);
+    // alloc packet buffer with room for the lower layer headers, so we can hand it straight to ip_output
+    pkt = alloc_pktbuf(sizeof(struct eth_header) + sizeof(struct ip_header) + len);
     if (!pkt) {
         icmp_dbg("Failed to allocate packet for Echo Request");
         return -1;
     }
+    pktbuf_reserve(pkt, sizeof(struct eth_header) + sizeof(struct ip_header));
 
     // fill in ICMP header
     icmp = (struct icmp_v4 *)pktbuf_put(pkt, sizeof(struct icmp_v4));
@@ -130,18 +147,68 @@ int icmp_send_echo_request(uint32_t dst_addr, uint16_t id, uint16_t seq) {
     echo->id = htons(id);
     echo->seq = htons(seq);
 
-    // add data - simple pattern
-    data = pktbuf_put(pkt, data_len);
-    int i;
-    for (i = 0; i < data_len; i++) {
-        data[i] = 'a' + (i % 26);
-    }
+    // copy the caller's payload
+    memcpy(pktbuf_put(pkt, data_len), data, data_len);
 
     // calc checksum
     icmp->csum = checksum(icmp, len);
 
     icmp_dbg("Sending ICMP Echo Request to 0x%x, id=%d seq=%d", dst_addr, id, seq);
 
-    // send ICMP packet
-    return ip_send(dst_addr, IP_P_ICMP, pkt->data, pkt->len);
-}
\ No newline at end of file
+    // send ICMP packet, ip_output takes ownership of the buffer
+    STATS_INC(STAT_ICMP_OUT_MSGS);
+    STATS_INC(STAT_ICMP_OUT_ECHOS);
+    return ip_output(pkt, dst_addr, IP_P_ICMP);
+}
+
+int icmp_send_echo_request(uint32_t dst_addr, uint16_t id, uint16_t seq) {
+    char data[56]; // which is std ping data size
+    int i;
+
+    // add data - simple pattern
+    for (i = 0; i < sizeof(data); i++) {
+        data[i] = 'a' + (i % 26);
+    }
+
+    return icmp_send_echo(dst_addr, id, seq, data, sizeof(data));
+}
+
+int icmp_send_dest_unreachable(struct pktbuf *orig, uint8_t code) {
+    struct ip_header *orig_ip = (struct ip_header *)orig->nh;
+    struct pktbuf *pkt;
+    struct icmp_v4 *icmp;
+    struct icmp_v4_dst_unreachable *unreach;
+    int orig_len, len;
+
+    // quote the original IP header plus the first 8 bytes of its payload (enough for the ports)
+    orig_len = orig_ip->ihl * 4 + 8;
+    if (orig_len > ntohs(orig_ip->len)) {
+        orig_len = ntohs(orig_ip->len);
+    }
+    len = sizeof(struct icmp_v4) + sizeof(struct icmp_v4_dst_unreachable) + orig_len;
+
+    pkt = alloc_pktbuf(sizeof(struct eth_header) + sizeof(struct ip_header) + len);
+    if (!pkt) {
+        icmp_dbg("Failed to allocate packet for Destination Unreachable");
+        return -1;
+    }
+    pktbuf_reserve(pkt, sizeof(struct eth_header) + sizeof(struct ip_header));
+
+    icmp = (struct icmp_v4 *)pktbuf_put(pkt, sizeof(struct icmp_v4));
+    icmp->type = ICMP_DEST_UNREACHABLE;
+    icmp->code = code;
+    icmp->csum = 0;
+
+    unreach = (struct icmp_v4_dst_unreachable *)pktbuf_put(pkt, sizeof(struct icmp_v4_dst_unreachable));
+    unreach->unused = 0;
+    unreach->len = 0;
+    unreach->var = 0;
+    memcpy(pktbuf_put(pkt, orig_len), orig_ip, orig_len);
+
+    icmp->csum = checksum(icmp, len);
+
+    icmp_dbg("Sending ICMP Destination Unreachable, code %d", code);
+    STATS_INC(STAT_ICMP_OUT_MSGS);
+    STATS_INC(STAT_ICMP_OUT_DEST_UNREACHS);
+    return ip_output(pkt, orig_ip->saddr, IP_P_ICMP);
+}
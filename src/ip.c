@@ -3,10 +3,11 @@
 #include <arpa/inet.h>
 
 #include "ip.h"
+#include "stats.h"
+#include "probe.h"
 
-uint16_t checksum(void *addr, int count) {
-    uint32_t sum = 0;
-    uint16_t *ptr = addr;
+uint32_t checksum_partial(const void *addr, int count, uint32_t sum) {
+    const uint16_t *ptr = addr;
 
     // add all 16-bit words
     while (count > 1) {
@@ -19,6 +20,10 @@ uint16_t checksum(void *addr, int count) {
         sum += *((uint8_t*)ptr);
     }
 
+    return sum;
+}
+
+uint16_t checksum_fold(uint32_t sum) {
     // Fold 32-bit sum into 16 bits
     while (sum >> 16) {
         sum = (sum & 0xffff) + (sum >> 16);
@@ -28,16 +33,72 @@ uint16_t checksum(void *addr, int count) {
     return ~sum;
 }
 
+uint16_t checksum(void *addr, int count) {
+    return checksum_fold(checksum_partial(addr, count, 0));
+}
+
+uint16_t checksum_adjust(uint16_t csum, uint16_t old, uint16_t new) {
+    // HC' = ~(~HC + ~m + m')
+    uint32_t sum = (uint16_t)~csum + (uint16_t)~old + new;
+
+    return checksum_fold(sum);
+}
+
+uint32_t ip_pseudo_sum(uint32_t saddr, uint32_t daddr, uint8_t proto, int len) {
+    uint32_t sum = 0;
+
+    // pseudo header: source, destination, zero + protocol, L4 length. All in network byte order
+    sum += saddr & 0xffff;
+    sum += saddr >> 16;
+    sum += daddr & 0xffff;
+    sum += daddr >> 16;
+    sum += htons(proto);
+    sum += htons(len);
+
+    return sum;
+}
+
+uint16_t ip_pseudo_checksum(uint32_t saddr, uint32_t daddr, uint8_t proto, const void *data, int len) {
+    return checksum_fold(checksum_partial(data, len, ip_pseudo_sum(saddr, daddr, proto, len)));
+}
+
+uint16_t ip_pseudo_checksum_pkt(uint32_t saddr, uint32_t daddr, uint8_t proto, struct pktbuf *pkt) {
+    uint32_t sum = ip_pseudo_sum(saddr, daddr, proto, pktbuf_total_len(pkt));
+    uint32_t off = pkt->len;
+    int i;
+
+    sum = checksum_partial(pkt->data, pkt->len, sum);
+    if (pkt->frag_len) {
+        sum = checksum_partial(pkt->frag, pkt->frag_len, sum);
+        off += pkt->frag_len;
+    }
+    for (i = 0; pkt->pieces && i < pkt->pieces->count; i++) {
+        struct pktbuf_piece *p = &pkt->pieces->piece[i];
+        uint32_t part = p->csum_ok ? p->csum : checksum_partial(p->data, p->len, 0);
+
+        // a piece starting at an odd offset has its bytes the other way round in every word
+        if (off & 1) {
+            part = (uint16_t)~checksum_fold(part);
+            part = ((part & 0xff) << 8) | (part >> 8);
+        }
+        sum += part;
+        off += p->len;
+    }
+    return checksum_fold(sum);
+}
+
 int ip_validate_packet(struct ip_header *hdr, int len) {
     // check min length, make sure we have at least enough for basic header structure
     if (len < sizeof(struct ip_header)) {
         ip_dbg("Packet too short for IP header");
+        PROBE4(ip_drop, IP_DROP_SHORT, 0, 0, len);
         return -1;
     }
 
     // verify versiom
     if (hdr->version != IPV4) {
         ip_dbg("Unsupported IP version %d", hdr->version);
+        PROBE4(ip_drop, IP_DROP_VERSION, hdr->saddr, hdr->daddr, len);
         return -1;
     }
 
@@ -45,6 +106,7 @@ int ip_validate_packet(struct ip_header *hdr, int len) {
     if (hdr->ihl < 5) {
         // standard size of IPv4 header with all required and no optional fields is 5 (4-bit) words
         ip_dbg("IP header length too small: %d", hdr->ihl);
+        PROBE4(ip_drop, IP_DROP_IHL, hdr->saddr, hdr->daddr, len);
         return -1;
     }
 
@@ -52,6 +114,14 @@ int ip_validate_packet(struct ip_header *hdr, int len) {
     uint16_t total_len = ntohs(hdr->len); 
     if (total_len > len) {
         ip_dbg("IP packet truncated, expected %d, got %d", total_len, len);
+        PROBE4(ip_drop, IP_DROP_TRUNCATED, hdr->saddr, hdr->daddr, len);
+        return -1;
+    }
+
+    // and that the header fits inside the packet it claims to be part of
+    if (hdr->ihl * 4 > total_len) {
+        ip_dbg("IP header length %d exceeds total length %d", hdr->ihl * 4, total_len);
+        PROBE4(ip_drop, IP_DROP_HDR_LEN, hdr->saddr, hdr->daddr, len);
         return -1;
     }
 
@@ -63,6 +133,8 @@ int ip_validate_packet(struct ip_header *hdr, int len) {
 
     if (orig_csum != calc_csum) {
         ip_dbg("IP checksum mismatch: expected 0x%04x, calculated 0x%04x", ntohs(orig_csum), ntohs(calc_csum));
+        STATS_INC(STAT_IP_IN_CSUM_ERRORS); // the caller counts it as a header error too
+        PROBE4(ip_drop, IP_DROP_CSUM, hdr->saddr, hdr->daddr, len);
         return -1;
     }
 
@@ -5,15 +5,28 @@
 #include "ip.h"
 #include "netdev.h"
 #include "icmp.h"
+#include "udp.h"
+#include "tcp.h"
+#include "gro.h"
+#include "stats.h"
+#include "probe.h"
 
 
 void ip_recv(struct pktbuf *pkt) {
     struct ip_header *hdr;
     struct netdev *dev = netdev_get();
 
+    STATS_INC(STAT_IP_IN_RECEIVES);
+
+    TRACE_NOW(now);
+    TRACE_STAMP_AT(pkt, TRACE_IP_RX, now);
+    TRACE_SINCE(TRACE_STAGE_ETH_IP, pkt, TRACE_ETH_RX, now);
+
     // make sure we have at least a basic IP header
     if (pkt->len < sizeof(struct ip_header)) {
         ip_dbg("Packet too short for IP header");
+        STATS_INC(STAT_IP_IN_HDR_ERRORS);
+        PROBE4(ip_drop, IP_DROP_SHORT, 0, 0, pkt->len);
         free_pktbuf(pkt);
         return;
     }
@@ -23,6 +36,7 @@ void ip_recv(struct pktbuf *pkt) {
     // validate IP packet
     if (ip_validate_packet(hdr, pkt->len)) {
         ip_dbg("Invalid IP packet received");
+        STATS_INC(STAT_IP_IN_HDR_ERRORS);
         free_pktbuf(pkt);
         return;
     }
@@ -34,30 +48,49 @@ void ip_recv(struct pktbuf *pkt) {
     if (dst_addr != ntohl(dev->addr)) {
         // if we were a router we could implement forwarding here
         ip_dbg("IP packet not for us, ignoring");
+        STATS_INC(STAT_IP_IN_ADDR_ERRORS);
+        PROBE4(ip_drop, IP_DROP_NOT_FOR_US, hdr->saddr, hdr->daddr, pkt->len);
         free_pktbuf(pkt);
         return;
     }
 
-    // remove IP header
+    // drop any Ethernet padding, the IP length is what counts from here on
+    pkt->len = ntohs(hdr->len);
+
+    // remove IP header, keeping a pointer to it for the upper layers
+    pkt->nh = pkt->data;
     pktbuf_pull(pkt, hdr->ihl * 4);
+    pkt->th = pkt->data;
+
+    TRACE_NOW(l4);
+    TRACE_SINCE(TRACE_STAGE_IP_L4, pkt, TRACE_IP_RX, l4);
+    TRACE_SINCE(TRACE_STAGE_RX_TOTAL, pkt, TRACE_DEV_RX, l4);
 
     // process pkt based on the protocol
     switch (hdr->proto) {
         case IP_P_ICMP:
             ip_dbg("Dispatching ICMP packet");
+            STATS_INC(STAT_IP_IN_DELIVERS);
             icmp_recv(pkt);
             break;
         case IP_P_TCP:
-            ip_dbg("no TCP yet, drop");
-            free_pktbuf(pkt);
+            ip_dbg("Dispatching TCP packet");
+            STATS_INC(STAT_IP_IN_DELIVERS);
+            gro_receive(pkt);
             break;
         case IP_P_UDP:
-            ip_dbg("no UDP yet, drop");
-            free_pktbuf(pkt);
+            ip_dbg("Dispatching UDP packet");
+            STATS_INC(STAT_IP_IN_DELIVERS);
+            udp_recv(pkt);
             break;
         default:
             ip_dbg("Unsupported protocol %d, dropping packet", hdr->proto);
+            STATS_INC(STAT_IP_IN_UNKNOWN_PROTOS);
+            PROBE4(ip_drop, IP_DROP_PROTO, hdr->saddr, hdr->daddr, pkt->len);
             free_pktbuf(pkt);
-            break;
+            return;
     }
+
+    // the handler may have freed the buffer, the start is in l4
+    TRACE_RECORD(TRACE_STAGE_L4, trace_now() - l4);
 }   
\ No newline at end of file
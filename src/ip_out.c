@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <string.h> 
+#include <stdatomic.h>
 #include <arpa/inet.h>
 
 #include "ip.h"
@@ -7,17 +8,21 @@
 #include "icmp.h"
 #include "ethernet.h"
 #include "arp.h"
+#include "stats.h"
 
 int ip_output(struct pktbuf *pkt, uint32_t dst_addr, uint8_t proto) {
     struct ip_header *iphdr;
     struct netdev *dev = netdev_get();
-    static uint16_t ip_id = 0;
+    static _Atomic uint16_t ip_id = 0; // shared by every thread that sends
     uint8_t dst_mac[6];
+
+    STATS_INC(STAT_IP_OUT_REQUESTS);
     
     // create space for IP header
     iphdr = pktbuf_push(pkt, sizeof(struct ip_header));
     if (!iphdr) {
         ip_dbg("Failed to allocate space for IP header");
+        STATS_INC(STAT_IP_OUT_DISCARDS);
         free_pktbuf(pkt);
         return -1;
     }
@@ -28,8 +33,9 @@ int ip_output(struct pktbuf *pkt, uint32_t dst_addr, uint8_t proto) {
     iphdr->version = IPV4; 
     iphdr->ihl = 5; // 5 words, 20 bytes (standard IPV4 header), no options
     iphdr->tos = 0; // 0 is standard value for normal traffic
-    iphdr->len = htons(pkt->len);
-    iphdr->id = htons(ip_id++);
+    iphdr->len = htons(pktbuf_total_len(pkt));
+    // a super-frame's segments take consecutive ids, reserved in one go so no other thread's overlap
+    iphdr->id = htons(atomic_fetch_add_explicit(&ip_id, pkt->gso_segs ? pkt->gso_segs : 1, memory_order_relaxed));
     iphdr->flags = 0;
     iphdr->frag_offset = 0;
     iphdr->ttl = IP_DEFAULT_TTL;
@@ -51,6 +57,7 @@ int ip_output(struct pktbuf *pkt, uint32_t dst_addr, uint8_t proto) {
     if (arp_resolve(dst_addr, dst_mac) < 0) {
         ip_dbg("MAC resolution failed for %s, packet queued", dip_str);
         // TODO: queue packet and retry later
+        STATS_INC(STAT_IP_OUT_DISCARDS);
         free_pktbuf(pkt);
         return -1;
     }
@@ -0,0 +1,190 @@
+#include "itree.h"
+
+static inline int node_height(struct itree_node *n) {
+    return n ? n->height : 0;
+}
+
+static inline uint32_t seq_max(uint32_t a, uint32_t b) {
+    return seq_after(a, b) ? a : b;
+}
+
+/* Recompute a node's height and max_end from its children */
+static void node_update(struct itree_node *n) {
+    int hl = node_height(n->left), hr = node_height(n->right);
+
+    n->height = (hl > hr ? hl : hr) + 1;
+    n->max_end = n->end;
+    if (n->left) n->max_end = seq_max(n->max_end, n->left->max_end);
+    if (n->right) n->max_end = seq_max(n->max_end, n->right->max_end);
+}
+
+static struct itree_node *rotate_right(struct itree_node *n) {
+    struct itree_node *l = n->left;
+
+    n->left = l->right;
+    l->right = n;
+    node_update(n);
+    node_update(l);
+    return l;
+}
+
+static struct itree_node *rotate_left(struct itree_node *n) {
+    struct itree_node *r = n->right;
+
+    n->right = r->left;
+    r->left = n;
+    node_update(n);
+    node_update(r);
+    return r;
+}
+
+/* Restore the AVL property at n after one of its subtrees changed height by one */
+static struct itree_node *rebalance(struct itree_node *n) {
+    int balance;
+
+    node_update(n);
+    balance = node_height(n->left) - node_height(n->right);
+
+    if (balance > 1) {
+        if (node_height(n->left->left) < node_height(n->left->right)) {
+            n->left = rotate_left(n->left); // left-right case
+        }
+        return rotate_right(n);
+    }
+
+    if (balance < -1) {
+        if (node_height(n->right->right) < node_height(n->right->left)) {
+            n->right = rotate_right(n->right); // right-left case
+        }
+        return rotate_left(n);
+    }
+
+    return n;
+}
+
+static struct itree_node *insert_node(struct itree_node *root, struct itree_node *node) {
+    if (!root) {
+        return node;
+    }
+
+    if (seq_before(node->start, root->start)) {
+        root->left = insert_node(root->left, node);
+    } else {
+        root->right = insert_node(root->right, node);
+    }
+
+    return rebalance(root);
+}
+
+/* Detach the lowest node of a subtree, returning the new subtree root and the node in *min */
+static struct itree_node *remove_min(struct itree_node *root, struct itree_node **min) {
+    if (!root->left) {
+        *min = root;
+        return root->right;
+    }
+
+    root->left = remove_min(root->left, min);
+    return rebalance(root);
+}
+
+static struct itree_node *remove_node(struct itree_node *root, struct itree_node *node) {
+    struct itree_node *succ;
+
+    if (!root) {
+        return NULL; // not in the tree
+    }
+
+    if (root == node) {
+        if (!root->left) return root->right;
+        if (!root->right) return root->left;
+
+        // replace with the in-order successor
+        succ = NULL;
+        root->right = remove_min(root->right, &succ);
+        succ->left = root->left;
+        succ->right = root->right;
+        return rebalance(succ);
+    }
+
+    if (seq_before(node->start, root->start)) {
+        root->left = remove_node(root->left, node);
+    } else {
+        root->right = remove_node(root->right, node);
+    }
+
+    return rebalance(root);
+}
+
+void itree_insert(struct itree *tree, struct itree_node *node) {
+    node->left = node->right = NULL;
+    node->height = 1;
+    node->max_end = node->end;
+
+    tree->root = insert_node(tree->root, node);
+    tree->count++;
+}
+
+void itree_remove(struct itree *tree, struct itree_node *node) {
+    tree->root = remove_node(tree->root, node);
+    node->left = node->right = NULL;
+    tree->count--;
+}
+
+struct itree_node *itree_first(struct itree *tree) {
+    struct itree_node *n = tree->root;
+
+    while (n && n->left) {
+        n = n->left;
+    }
+    return n;
+}
+
+struct itree_node *itree_last(struct itree *tree) {
+    struct itree_node *n = tree->root;
+
+    while (n && n->right) {
+        n = n->right;
+    }
+    return n;
+}
+
+struct itree_node *itree_next(struct itree *tree, struct itree_node *node) {
+    struct itree_node *n = tree->root, *succ = NULL;
+
+    // no parent pointers, so search down for the smallest start after ours
+    while (n) {
+        if (seq_after(n->start, node->start)) {
+            succ = n;
+            n = n->left;
+        } else {
+            n = n->right;
+        }
+    }
+
+    return succ;
+}
+
+struct itree_node *itree_first_overlap(struct itree *tree, uint32_t start, uint32_t end) {
+    struct itree_node *n = tree->root, *found = NULL;
+
+    while (n) {
+        // nothing in the left subtree reaches past start, so no overlap there
+        if (n->left && seq_after(n->left->max_end, start)) {
+            n = n->left;
+            continue;
+        }
+
+        if (seq_before(n->start, end) && seq_after(n->end, start)) {
+            found = n;
+            break;
+        }
+
+        // everything to the right starts even later
+        if (seq_geq(n->start, end)) {
+            break;
+        }
+        n = n->right;
+    }
+
+    return found;
+}
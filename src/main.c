@@ -1,9 +1,9 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <signal.h>
 #include <unistd.h>
 #include <pthread.h>
-#include <time.h>
 #include <arpa/inet.h>
 
 #include "netdev.h"
@@ -11,10 +11,25 @@
 #include "arp.h"
 #include "ip.h"
 #include "icmp.h"
+#include "ping.h"
+#include "udp.h"
+#include "tcp.h"
+#include "timer.h"
+#include "shm_server.h"
+#include "rss.h"
+#include "pipeline.h"
+#include "stats.h"
+#include "capture.h"
+#include "replay.h"
+#include "gro.h"
+#include "mem.h"
+#include "utils.h"
 
 // flag to control program execution
-static int running = 1;
+static volatile int running = 1;
 static int seq = 0;
+static int zerocopy = 0; // echo services send with the zero-copy API
+static int workers = 1;  // echo service threads, each with its own socket on the shared port
 
 // sig handler for graceful shutdown
 static void signal_handler(int signal) {
@@ -22,25 +37,438 @@ static void signal_handler(int signal) {
     running = 0;
 }
 
+// SIGUSR1 pauses and resumes a capture
+static void capture_signal(int signal) {
+    capture_toggle();
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-q] [-d dst] [-f] [-r rate] [-w window] [-c count] [-s size] [-u port] [-t port] [-C algo] [-G] [-g] [-Z] [-W workers] [-S path] [-R workers] [-Q queues] [-P] [-N path] [-M low,high] [-A file] [-a secs] [-p file] [-F filter]\n"
+        "       %s [options] -X file [-l loops] [-b rate] [-x rewrite]\n"
+        "       %s -n path\n"
+        "  -q         quiet, no per-packet debug output\n"
+        "  -d dst     ping destination (default 10.0.0.2)\n"
+        "  -f         flood: send as fast as the window allows\n"
+        "  -r rate    echo requests per second\n"
+        "  -w window  max outstanding echo requests\n"
+        "  -c count   stop after count requests\n"
+        "  -s size    echo payload size in bytes\n"
+        "  -u port    run a UDP echo service on port\n"
+        "  -t port    run a TCP echo service on port\n"
+        "  -C algo    TCP congestion control: reno, cubic or bbr\n"
+        "  -G         segment TCP super-frames in software even if the device could\n"
+        "  -g         hand TCP every received segment on its own, no receive coalescing (GRO)\n"
+        "  -Z         echo services send zero-copy, straight from the buffer the data arrived in\n"
+        "  -W workers echo service threads, each with its own socket sharing the port\n"
+        "  -S path    serve sockets to other processes over shared memory, path is the daemon's Unix socket\n"
+        "  -R workers spread protocol processing over worker threads by flow hash (software RSS)\n"
+        "  -Q queues  open the device with this many queues, each run to completion by a pinned worker\n"
+        "  -P         pipeline: RX, protocol processing and TX each on their own thread, joined by rings\n"
+        "  -N path    serve the stack's counters on the Unix socket at path\n"
+        "  -n path    print the counters of the stack serving them at path and exit\n"
+        "  -M low,high memory watermarks in bytes (K/M/G), past high the stack sheds load until back under low\n"
+        "  -A file    load the ARP cache from a snapshot at file on startup and save it there on shutdown\n"
+        "  -a secs    also save the ARP snapshot every secs seconds\n"
+        "  -p file    capture what the stack receives and sends to a pcapng file, SIGUSR1 pauses/resumes\n"
+        "  -F filter  capture only frames matching all of: ip, arp, icmp, tcp, udp, host A.B.C.D\n"
+        "  -X file    replay the frames of a pcap or pcapng file into the stack and report the rate\n"
+        "  -l loops   passes over the replay file, 0 = until interrupted (default 1)\n"
+        "  -b rate    replay this many frames per second (default: as fast as the stack takes them)\n"
+        "  -x rewrite replay with rewritten addresses, comma separated: dst (aim at the stack), src=A.B.C.D\n"
+        "Any of -f/-r/-w/-c runs the latency test instead of the periodic ping\n", prog, prog, prog);
+}
+
+/* Default mode: age the ARP cache every second and ping every third, from the stack's timer wheel */
+static struct {
+    struct timer timer;
+    const char *dst;
+    uint32_t dst_addr;
+    int ticks;
+} periodic;
+
+static void periodic_tick(struct timer *t) {
+    arp_cache_timer();
+
+    if (periodic.ticks++ % 3 == 0) {
+        printf("Sending ping to %s (seq=%d)\n", periodic.dst, seq);
+        icmp_send_echo_request(periodic.dst_addr, 1234, seq++);
+    }
+    timer_mod(t, clock_ns() + 1000000000ULL);
+}
+
+/* UDP echo worker, bounces every datagram back to its sender */
+static void *udp_echo_worker(void *arg) {
+    struct udp_sock *sk = arg;
+    struct udp_dgram dgrams[32];
+    struct zc_queue *cq = NULL;
+    uint64_t done[32];
+    int i, n, pending;
+
+    if (zerocopy && !(cq = zc_queue_create())) {
+        return NULL;
+    }
+
+    while (running) {
+        n = udp_recv_batch(sk, dgrams, 32);
+        if (n == 0) {
+            usleep(100);
+            continue;
+        }
+
+        if (!cq) {
+            for (i = 0; i < n; i++) {
+                udp_sendto(sk, dgrams[i].saddr, dgrams[i].sport, dgrams[i].data, dgrams[i].len);
+                udp_release(&dgrams[i]);
+            }
+            continue;
+        }
+
+        // send each payload from the receive buffer it sits in, and give that back once it's out
+        for (i = 0, pending = 0; i < n; i++) {
+            // one that failed on the way out still completes, and gets released then
+            if (udp_sendto_zc(sk, dgrams[i].saddr, dgrams[i].sport, dgrams[i].data, dgrams[i].len, cq, i) < 0 &&
+                errno != EIO) {
+                udp_release(&dgrams[i]);
+                continue;
+            }
+            pending++;
+        }
+        while (pending > 0) {
+            int k, got = zc_wait(cq, done, 32);
+
+            for (k = 0; k < got; k++) {
+                udp_release(&dgrams[done[k]]);
+            }
+            pending -= got;
+        }
+    }
+
+    zc_queue_destroy(cq);
+    return NULL;
+}
+
+/* UDP echo service, one socket per worker sharing the port */
+static int udp_echo_run(uint16_t port) {
+    struct udp_sock *sks[REUSEPORT_MAX];
+    pthread_t threads[REUSEPORT_MAX];
+    int i, n;
+
+    for (n = 0; n < workers; n++) {
+        sks[n] = workers > 1 ? udp_bind_reuseport(0, port) : udp_bind(0, port);
+        if (!sks[n]) {
+            fprintf(stderr, "Failed to bind UDP port %d\n", port);
+            break;
+        }
+    }
+
+    if (n == workers) {
+        printf("UDP echo listening on port %d, %d worker%s\n", port, workers, workers > 1 ? "s" : "");
+
+        // worker 0 runs right here
+        for (i = 1; i < n; i++) {
+            if (pthread_create(&threads[i], NULL, udp_echo_worker, sks[i]) != 0) {
+                perror("Failed to create worker thread");
+                break;
+            }
+        }
+        udp_echo_worker(sks[0]);
+        while (--i > 0) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        udp_close(sks[i]);
+    }
+    return n == workers ? 0 : -1;
+}
+
+/* Echo one TCP connection until the peer closes it */
+static void *tcp_echo_conn(void *arg) {
+    struct tcp_sock *sk = arg;
+    char buf[16384];
+    int n;
+
+    while ((n = tcp_recv_data(sk, buf, sizeof(buf))) > 0) {
+        if (tcp_send(sk, buf, n) < 0) {
+            break;
+        }
+    }
+
+    tcp_close(sk);
+    return NULL;
+}
+
+#define ZC_ECHO_BUFS 16
+
+/* Echo one TCP connection with zero-copy sends, each buffer waits for its ACK before being reused */
+static void *tcp_echo_conn_zc(void *arg) {
+    struct tcp_sock *sk = arg;
+    char (*bufs)[16384] = malloc(ZC_ECHO_BUFS * sizeof(*bufs));
+    struct zc_queue *cq = zc_queue_create();
+    uint64_t free_bufs[ZC_ECHO_BUFS];
+    int nfree = ZC_ECHO_BUFS, inflight = 0, got, n, sent;
+
+    if (!bufs || !cq) {
+        tcp_close(sk);
+        free(bufs);
+        zc_queue_destroy(cq);
+        return NULL;
+    }
+    for (n = 0; n < ZC_ECHO_BUFS; n++) {
+        free_bufs[n] = n;
+    }
+
+    while (1) {
+        uint64_t b;
+
+        // collect buffers the peer has ACKed, wait for one if all are in flight
+        if (nfree == 0) {
+            got = zc_wait(cq, free_bufs, ZC_ECHO_BUFS);
+        } else {
+            got = zc_poll(cq, free_bufs + nfree, ZC_ECHO_BUFS - nfree);
+        }
+        nfree += got;
+        inflight -= got;
+
+        b = free_bufs[--nfree];
+        n = tcp_recv_data(sk, bufs[b], sizeof(bufs[b]));
+        if (n <= 0) {
+            break;
+        }
+        sent = tcp_send_zc(sk, bufs[b], n, cq, b);
+        if (sent > 0) {
+            inflight++;
+        }
+        if (sent < n) {
+            break;
+        }
+    }
+
+    // the connection lets go of its segments eventually, acknowledged or not, and every buffer comes back
+    tcp_close(sk);
+    while (inflight > 0) {
+        inflight -= zc_wait(cq, free_bufs, ZC_ECHO_BUFS);
+    }
+    zc_queue_destroy(cq);
+    free(bufs);
+    return NULL;
+}
+
+/* TCP echo worker, accepts on its own listener and runs a thread per connection */
+static void *tcp_echo_worker(void *arg) {
+    struct tcp_sock *lsk = arg, *sk;
+    pthread_t thread;
+
+    while (running) {
+        sk = tcp_accept(lsk);
+        if (!sk) {
+            break;
+        }
+
+        if (pthread_create(&thread, NULL, zerocopy ? tcp_echo_conn_zc : tcp_echo_conn, sk) != 0) {
+            perror("Failed to create connection thread");
+            tcp_close(sk);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    return NULL;
+}
+
+/*
+ * TCP echo service, one listener per worker sharing the port. The workers sleep in tcp_accept,
+ * which no signal interrupts, so this thread waits for the signal and closes the listeners,
+ * which makes their accepts fail
+ */
+static int tcp_echo_run(uint16_t port) {
+    struct tcp_sock *lsks[REUSEPORT_MAX];
+    pthread_t threads[REUSEPORT_MAX];
+    int i = 0, j, n;
+
+    for (n = 0; n < workers; n++) {
+        lsks[n] = workers > 1 ? tcp_listen_reuseport(0, port, 128) : tcp_listen(0, port, 128);
+        if (!lsks[n]) {
+            fprintf(stderr, "Failed to listen on TCP port %d\n", port);
+            break;
+        }
+        tcp_sock_hold(lsks[n]); // a worker may still be inside tcp_accept when we close it
+    }
+
+    if (n == workers) {
+        printf("TCP echo listening on port %d, %d worker%s\n", port, workers, workers > 1 ? "s" : "");
+
+        for (i = 0; i < n; i++) {
+            if (pthread_create(&threads[i], NULL, tcp_echo_worker, lsks[i]) != 0) {
+                perror("Failed to create worker thread");
+                break;
+            }
+        }
+        while (running && i == n) {
+            pause();
+        }
+    }
+
+    for (j = 0; j < n; j++) {
+        tcp_close(lsks[j]);
+    }
+    while (--i >= 0) {
+        pthread_join(threads[i], NULL);
+    }
+    for (j = 0; j < n; j++) {
+        tcp_sock_put(lsks[j]);
+    }
+    tcp_print_stats();
+    return n == workers ? 0 : -1;
+}
+
+/*
+ * Stop the device and wait for the RX thread, so no timer runs anymore, then close what hangs
+ * off the stack. Turns ret, the mode's result, into the exit status
+ */
+static int stack_shutdown(pthread_t rx_thread, int ret) {
+    netdev_close();
+    pthread_join(rx_thread, NULL);
+    stats_server_stop();
+    capture_stop();
+    arp_snapshot_stop();
+    return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
 int main(int argc, char *argv[]) {
     pthread_t rx_thread;
+    struct ping_config ping_cfg = {
+        .id = getpid() & 0xffff,
+        .size = 56,
+    };
+    char *dst = "10.0.0.2"; // IP of TAP interface
+    char *cong = NULL;
+    char *shm_path = NULL;
+    char *stats_path = NULL;
+    char *capture_path = NULL, *capture_filter = NULL;
+    char *arp_path = NULL;
+    int arp_interval = 0;
+    struct replay_config replay_cfg = { .loops = 1 };
+    int latency_mode = 0, flood = 0, udp_echo_port = 0, tcp_echo_port = 0;
+    int dev_features = NETDEV_F_GSO;
+    int rss_workers = 0, queues = 1, pipelined = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "qd:fr:w:c:s:u:t:C:GgZW:S:R:Q:PN:n:M:A:a:p:F:X:l:b:x:")) != -1) {
+        switch (opt) {
+            case 'q': verbose = 0; break;
+            case 'd': dst = optarg; break;
+            case 'f': flood = 1; latency_mode = 1; break;
+            case 'r': ping_cfg.rate = atoi(optarg); latency_mode = 1; break;
+            case 'w': ping_cfg.window = atoi(optarg); latency_mode = 1; break;
+            case 'c': ping_cfg.count = strtoull(optarg, NULL, 10); latency_mode = 1; break;
+            case 's': ping_cfg.size = atoi(optarg); break;
+            case 'u': udp_echo_port = atoi(optarg); break;
+            case 't': tcp_echo_port = atoi(optarg); break;
+            case 'C': cong = optarg; break;
+            case 'G': dev_features &= ~NETDEV_F_GSO; break;
+            case 'g': gro_disable(); break;
+            case 'Z': zerocopy = 1; break;
+            case 'W': workers = atoi(optarg); break;
+            case 'S': shm_path = optarg; break;
+            case 'R': rss_workers = atoi(optarg); break;
+            case 'Q': queues = atoi(optarg); break;
+            case 'P': pipelined = 1; break;
+            case 'N': stats_path = optarg; break;
+            case 'A': arp_path = optarg; break;
+            case 'a': arp_interval = atoi(optarg); break;
+            case 'p': capture_path = optarg; break;
+            case 'F': capture_filter = optarg; break;
+            case 'X': replay_cfg.path = optarg; break;
+            case 'l': replay_cfg.loops = strtoull(optarg, NULL, 10); break;
+            case 'b': replay_cfg.rate = strtoull(optarg, NULL, 10); break;
+            case 'x':
+                if (replay_parse_rewrite(&replay_cfg, optarg) < 0) return EXIT_FAILURE;
+                break;
+            case 'M':
+                if (mem_parse_watermarks(optarg) < 0) return EXIT_FAILURE;
+                break;
+            case 'n': return stats_query(optarg) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (inet_pton(AF_INET, dst, &ping_cfg.dst_addr) <= 0) {
+        fprintf(stderr, "Invalid destination address %s\n", dst);
+        return EXIT_FAILURE;
+    }
+
+    // queue workers already spread flows by hash, there's nothing for RSS to add
+    if (rss_workers && queues > 1) {
+        fprintf(stderr, "-R and -Q don't mix\n");
+        return EXIT_FAILURE;
+    }
+
+    // each of these decides on its own which thread runs the protocol layers
+    if (pipelined && (rss_workers || queues > 1)) {
+        fprintf(stderr, "-P doesn't mix with -R or -Q\n");
+        return EXIT_FAILURE;
+    }
+
+    if (workers < 1 || workers > REUSEPORT_MAX) {
+        fprintf(stderr, "Workers must be between 1 and %d\n", REUSEPORT_MAX);
+        return EXIT_FAILURE;
+    }
+
+    // flood ignores any rate and keeps a bounded number of requests in flight
+    if (flood) {
+        ping_cfg.rate = 0;
+        if (ping_cfg.window == 0) ping_cfg.window = PING_FLOOD_WINDOW;
+    }
 
     // set up sig handling
     signal(SIGINT, signal_handler);
+    signal(SIGUSR1, capture_signal);
 
     printf("Starting TCP/IP stack...\n");
+    trace_init();
 
     netdev_init();
     ethernet_init();
     arp_init();
     ip_init();
+    udp_init();
+    tcp_init();
+
+    if (cong && tcp_cong_set_default(cong) < 0) {
+        fprintf(stderr, "Unknown congestion control %s\n", cong);
+        return EXIT_FAILURE;
+    }
 
     // create and config TAP device
-    if (tapdev_init("tap0") < 0) {
+    if (tapdev_init("tap0", dev_features, queues) < 0) {
         fprintf(stderr, "Failed to initialize TAP device\n");
         return EXIT_FAILURE;
     }
 
+    // the RX thread turns into a dispatcher once there are workers to feed
+    if (rss_workers && rss_start(rss_workers) < 0) {
+        return EXIT_FAILURE;
+    }
+    if (pipelined && pipeline_start() < 0) {
+        return EXIT_FAILURE;
+    }
+    if (stats_path && stats_server_start(stats_path) < 0) {
+        return EXIT_FAILURE;
+    }
+    if (capture_path && capture_start(capture_path, capture_filter) < 0) {
+        return EXIT_FAILURE;
+    }
+    if (replay_cfg.path && replay_start(&replay_cfg) < 0) {
+        return EXIT_FAILURE;
+    }
+    if (arp_path && arp_snapshot_start(arp_path, arp_interval) < 0) {
+        return EXIT_FAILURE;
+    }
+
     // start packet rx thread
     if (pthread_create(&rx_thread, NULL, netdev_rx_loop, NULL) != 0) {
         perror("Failed to create RX thread");
@@ -49,31 +477,41 @@ int main(int argc, char *argv[]) {
 
     printf("TCP/IP stack initialized, press Ctrl+C to cancel\n");
 
-    // MAIN LOOP
-    while (running) {
-        // run ARP cache cleanup periodically
-        arp_cache_timer();
+    // replay mode, the RX thread feeds the file to the stack, report and exit when it's through
+    if (replay_cfg.path) {
+        return stack_shutdown(rx_thread, replay_run(&running));
+    }
 
-        // ping test - send a ping every 3 seconds
-        static time_t last_ping = 0;
-        time_t now = time(NULL);
-        
-        if (now - last_ping >= 3) {
-            char dst_str[INET_ADDRSTRLEN];
-            uint32_t dst_addr = inet_addr("10.0.0.2");  // IP of TAP interface
-            inet_ntop(AF_INET, &dst_addr, dst_str, INET_ADDRSTRLEN);
-            
-            printf("Sending ping to %s (seq=%d)\n", dst_str, seq);
-            icmp_send_echo_request(dst_addr, 1234, seq++);
-            last_ping = now;
-        }
+    // latency test mode, report and exit when done
+    if (latency_mode) {
+        return stack_shutdown(rx_thread, ping_run(&ping_cfg, &running));
+    }
+
+    if (udp_echo_port) {
+        return stack_shutdown(rx_thread, udp_echo_run(udp_echo_port));
+    }
+
+    if (tcp_echo_port) {
+        return stack_shutdown(rx_thread, tcp_echo_run(tcp_echo_port));
+    }
+
+    if (shm_path) {
+        return stack_shutdown(rx_thread, shm_server_run(shm_path, &running));
+    }
+
+    // MAIN LOOP: the RX thread's reactor runs the timer, all that's left here is waiting for a signal
+    periodic.dst = dst;
+    periodic.dst_addr = ping_cfg.dst_addr;
+    timer_init(&periodic.timer, periodic_tick, NULL);
+    timer_mod(&periodic.timer, clock_ns());
 
-        // sleep for a while to avoid busy waiting
-        sleep(1);
+    while (running) {
+        pause();
     }
+    timer_del(&periodic.timer);
 
     // ♫ clean up, everybody clean up ♪
-    netdev_close();
+    stack_shutdown(rx_thread, 0);
 
     printf("TCP/IP stack shut down\n");
     return EXIT_SUCCESS;
@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "mem.h"
+#include "utils.h"
+
+#define mem_dbg(fmt, ...) \
+    do { if (verbose) printf("MEM: " fmt "\n", ##__VA_ARGS__); } while (0)
+
+__thread struct mem_local mem_local;
+_Atomic int mem_under_pressure;
+
+/* Stack-wide totals, made of every thread's folded deltas */
+static struct {
+    _Atomic int64_t bytes[MEM_MAX];
+    _Atomic int64_t objs[MEM_MAX];
+    _Atomic int64_t peak;       // highest total seen at a fold
+    _Atomic uint64_t pressures; // times the high watermark was crossed
+    uint64_t low, high;
+} mem = { .low = MEM_DEFAULT_LOW, .high = MEM_DEFAULT_HIGH };
+
+static pthread_key_t mem_key;
+static pthread_once_t mem_key_once = PTHREAD_ONCE_INIT;
+
+/* Thread exit: whatever it hasn't folded yet would be lost otherwise */
+static void mem_local_retire(void *arg) {
+    (void)arg;
+    mem_fold();
+    mem_local.registered = 0;
+}
+
+static void mem_key_create(void) {
+    pthread_key_create(&mem_key, mem_local_retire);
+}
+
+/* Buffers and ARP entries, the socket queues are part of the buffers */
+static int64_t mem_total(void) {
+    return atomic_load_explicit(&mem.bytes[MEM_PKTBUF], memory_order_relaxed) +
+           atomic_load_explicit(&mem.bytes[MEM_ARP], memory_order_relaxed);
+}
+
+void mem_fold(void) {
+    int64_t total, peak;
+    int c;
+
+    if (!mem_local.registered) {
+        pthread_once(&mem_key_once, mem_key_create);
+        pthread_setspecific(mem_key, &mem_local);
+        mem_local.registered = 1;
+    }
+
+    for (c = 0; c < MEM_MAX; c++) {
+        if (mem_local.bytes[c] || mem_local.objs[c]) {
+            atomic_fetch_add_explicit(&mem.bytes[c], mem_local.bytes[c], memory_order_relaxed);
+            atomic_fetch_add_explicit(&mem.objs[c], mem_local.objs[c], memory_order_relaxed);
+            mem_local.bytes[c] = mem_local.objs[c] = 0;
+        }
+    }
+
+    total = mem_total();
+    peak = atomic_load_explicit(&mem.peak, memory_order_relaxed);
+    while (total > peak && !atomic_compare_exchange_weak(&mem.peak, &peak, total)) {
+    }
+
+    // hysteresis between the two marks, so the state doesn't flap with every fold around one of them
+    if (!mem_pressure() && total >= (int64_t)mem.high) {
+        if (!atomic_exchange(&mem_under_pressure, 1)) {
+            atomic_fetch_add_explicit(&mem.pressures, 1, memory_order_relaxed);
+            mem_dbg("Under pressure at %lld bytes", (long long)total);
+        }
+    } else if (mem_pressure() && total <= (int64_t)mem.low) {
+        if (atomic_exchange(&mem_under_pressure, 0)) {
+            mem_dbg("Pressure relieved at %lld bytes", (long long)total);
+        }
+    }
+}
+
+/* A byte count with an optional K, M or G suffix */
+static int mem_parse_size(const char *s, char **end, uint64_t *out) {
+    uint64_t v = strtoull(s, end, 10);
+
+    if (*end == s) {
+        return -1;
+    }
+    switch (**end) {
+        case 'k': case 'K': v <<= 10; (*end)++; break;
+        case 'm': case 'M': v <<= 20; (*end)++; break;
+        case 'g': case 'G': v <<= 30; (*end)++; break;
+    }
+    *out = v;
+    return 0;
+}
+
+int mem_parse_watermarks(const char *spec) {
+    uint64_t low, high;
+    char *end;
+
+    if (mem_parse_size(spec, &end, &low) < 0 || *end != ',' ||
+        mem_parse_size(end + 1, &end, &high) < 0 || *end || !high || low > high) {
+        fprintf(stderr, "Invalid memory watermarks %s, expected low,high with low <= high\n", spec);
+        return -1;
+    }
+
+    mem.low = low;
+    mem.high = high;
+    return 0;
+}
+
+void mem_dump(FILE *f) {
+    fprintf(f, "Mem: PktbufBytes Pktbufs ArpBytes ArpEntries SockRcvBytes TotalBytes PeakBytes LowWater HighWater Pressure Pressures\n");
+    fprintf(f, "Mem: %lld %lld %lld %lld %lld %lld %lld %llu %llu %d %llu\n",
+            (long long)atomic_load(&mem.bytes[MEM_PKTBUF]), (long long)atomic_load(&mem.objs[MEM_PKTBUF]),
+            (long long)atomic_load(&mem.bytes[MEM_ARP]), (long long)atomic_load(&mem.objs[MEM_ARP]),
+            (long long)atomic_load(&mem.bytes[MEM_SOCK_RCV]), (long long)mem_total(),
+            (long long)atomic_load(&mem.peak), (unsigned long long)mem.low,
+            (unsigned long long)mem.high, mem_pressure(), (unsigned long long)atomic_load(&mem.pressures));
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,8 +7,11 @@
 #include <sys/ioctl.h>
 #include <pthread.h>
 #include <linux/if_tun.h>
+#include <linux/virtio_net.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <sched.h>
 
 #include "netdev.h"
 #include "tap.h"
@@ -15,6 +19,16 @@
 #include "pktbuf.h"
 #include "arp.h"
 #include "utils.h"
+#include "timer.h"
+#include "tcp.h"
+#include "gro.h"
+#include "ip.h"
+#include "rss.h"
+#include "pipeline.h"
+#include "stats.h"
+#include "capture.h"
+#include "probe.h"
+#include "mem.h"
 
 /* Global TAP device instance */
 struct tapdev tap;
@@ -22,9 +36,21 @@ struct tapdev tap;
 /* Flag to control RX loop */
 static int running = 0;
 
+/* Keeps netdev_close from waking a queue's reactor while the RX thread closes it */
+static pthread_mutex_t netdev_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Frames queue 0 takes besides the device's, see netdev_set_feed */
+static struct {
+    int (*fill)(void *arg);
+    void *arg;
+} netdev_feed;
+
+/* Queue owned by the calling thread, if it's a queue worker */
+static __thread struct netdev_queue *netdev_local_queue;
+
 /* Debug output for network devices */
 #define netdev_dbg(fmt, ...) \
-    printf("NETDEV: " fmt "\n", ##__VA_ARGS__)
+    do { if (verbose) printf("NETDEV: " fmt "\n", ##__VA_ARGS__); } while (0)
 
 void netdev_init(void) {
     memset(&tap, 0, sizeof(tap));
@@ -56,19 +82,66 @@ void netdev_init(void) {
 }
 
 /* Initialize and open the TAP interface */
-int tapdev_init(const char *name) {
+int tapdev_init(const char *name, int features, int nqueues) {
     char *cidr = "10.0.0.2/24";
     char dev[IFNAMSIZ];
+    int vnet_hdr = !!(features & NETDEV_F_GSO);
+    int i;
+
+    if (nqueues < 1 || nqueues > NETDEV_MAX_QUEUES) {
+        fprintf(stderr, "Device queues must be between 1 and %d\n", NETDEV_MAX_QUEUES);
+        return -1;
+    }
 
     // copy name to buffer 
     strncpy(dev, name, IFNAMSIZ - 1);
     dev[IFNAMSIZ - 1] = '\0';
 
+    for (i = 0; i < NETDEV_MAX_QUEUES; i++) {
+        tap.queues[i].id = i;
+        tap.queues[i].fd = -1;
+    }
 
-    tap.fd = setup_network_if(dev, 0, cidr);
-    if (tap.fd < 0) {
+    tap.queues[0].fd = setup_network_if(dev, 0, cidr, &vnet_hdr, nqueues > 1);
+    if (tap.queues[0].fd < 0) {
         return -1;
     }
+    tap.nqueues = 1;
+
+    for (i = 1; i < nqueues; i++) {
+        tap.queues[i].fd = tap_open_queue(dev, vnet_hdr);
+        if (tap.queues[i].fd < 0) {
+            fprintf(stderr, "Failed to open TAP queue %d\n", i);
+            return -1;
+        }
+        tap.nqueues++;
+    }
+
+    // frames leave on the queue their flow hashes to, see netdev_tx_queue
+    if (nqueues > 1) {
+        rss_init();
+    }
+
+    // GSO super-frames ride on the virtio_net_hdr, without it TCP segments in software
+    tap.vnet_hdr = vnet_hdr;
+    if (vnet_hdr) {
+        tap.dev.features |= NETDEV_F_GSO;
+    }
+    netdev_dbg("Device GSO %s", vnet_hdr ? "on" : "off");
+
+    // netdev_poll expects reads to return EAGAIN when the device is drained
+    for (i = 0; i < tap.nqueues; i++) {
+        if (fcntl(tap.queues[i].fd, F_SETFL, fcntl(tap.queues[i].fd, F_GETFL) | O_NONBLOCK) < 0) {
+            perror("Failed to make TAP device non-blocking");
+            return -1;
+        }
+    }
+
+    for (i = 0; i < tap.nqueues; i++) {
+        if (reactor_init(&tap.queues[i].reactor) < 0) {
+            return -1;
+        }
+    }
 
     // set up networking device structure
     strncpy(tap.dev.name, dev, IFNAMSIZ - 1);
@@ -77,26 +150,204 @@ int tapdev_init(const char *name) {
     return 0;
 }
 
+/* Describe a frame to the kernel: plain, or a TCP super-frame for it to segment and checksum */
+static void netdev_vnet_hdr(struct pktbuf *pkt, struct virtio_net_hdr *vh) {
+    memset(vh, 0, sizeof(*vh));
+
+    if (pkt->gso_size) {
+        struct ip_header *iph = (struct ip_header *)(pkt->data + sizeof(struct eth_header));
+        uint16_t l4 = sizeof(struct eth_header) + iph->ihl * 4;
+        struct tcp_header *th = (struct tcp_header *)(pkt->data + l4);
+
+        vh->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        vh->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+        vh->hdr_len = l4 + th->doff * 4;
+        vh->gso_size = pkt->gso_size;
+        vh->csum_start = l4;
+        vh->csum_offset = offsetof(struct tcp_header, csum);
+    }
+}
+
+/*
+ * The queue a frame leaves on. The kernel sends a flow's incoming frames to whichever queue it
+ * last saw the flow on, so picking by flow hash keeps each flow, both ways, on one worker
+ */
+static struct netdev_queue *netdev_tx_queue(struct pktbuf *pkt) {
+    uint32_t hash;
+
+    if (tap.nqueues == 1) {
+        return &tap.queues[0];
+    }
+    hash = rss_hash(pkt->data, pkt->len);
+    if (hash) {
+        return &tap.queues[hash % tap.nqueues];
+    }
+    return netdev_local_queue ? netdev_local_queue : &tap.queues[0];
+}
+
 int netdev_tx(struct pktbuf *pkt) {
+    if (pkt) {
+        PROBE3(netdev_tx, pkt->data, pkt->len, pkt->gso_segs);
+        TRACE_STAMP(pkt, TRACE_TX_QUEUE);
+        capture_tx(pkt);
+    }
+
+    // in pipeline mode the TX thread does the writing
+    if (pipeline_enabled() && pkt) {
+        return pipeline_tx(pkt);
+    }
+    return netdev_xmit(pkt);
+}
+
+int netdev_xmit(struct pktbuf *pkt) {
+    struct netdev_queue *q;
+    struct virtio_net_hdr vh;
+    struct iovec iov[3 + PKTBUF_MAX_PIECES];
+    int iovcnt = 0, ret, i;
+
     if (!pkt || !pkt->data || pkt->len == 0) {
         netdev_dbg("Invalid packet for transmission");
+        STATS_INC(STAT_LINK_OUT_ERRORS);
+        free_pktbuf(pkt);
         return -1;
     }
 
-    netdev_dbg("Transmitting packet of %d bytes", pkt->len);
+    netdev_dbg("Transmitting packet of %d bytes", pktbuf_total_len(pkt));
+    q = netdev_tx_queue(pkt);
 
-    // write the packet to TAP device
-    int ret = tap_write(tap.fd, pkt->data, pkt->len);
+    TRACE_NOW(start);
+    TRACE_SINCE(TRACE_STAGE_TX_QUEUE, pkt, TRACE_TX_QUEUE, start);
+
+    // write the packet to TAP device, a zero-copy payload goes straight from application memory
+    if (tap.vnet_hdr) {
+        netdev_vnet_hdr(pkt, &vh);
+        iov[iovcnt++] = (struct iovec){ .iov_base = &vh, .iov_len = sizeof(vh) };
+    }
+    iov[iovcnt++] = (struct iovec){ .iov_base = pkt->data, .iov_len = pkt->len };
+    if (pkt->frag_len) {
+        iov[iovcnt++] = (struct iovec){ .iov_base = pkt->frag, .iov_len = pkt->frag_len };
+    }
+    for (i = 0; pkt->pieces && i < pkt->pieces->count; i++) {
+        iov[iovcnt++] = (struct iovec){ .iov_base = pkt->pieces->piece[i].data, .iov_len = pkt->pieces->piece[i].len };
+    }
+
+    if (iovcnt == 1) {
+        ret = tap_write(q->fd, pkt->data, pkt->len);
+    } else {
+        ret = writev(q->fd, iov, iovcnt);
+        if (ret > 0 && tap.vnet_hdr) ret -= sizeof(vh);
+    }
+
+    TRACE_RECORD(TRACE_STAGE_TX_WRITE, trace_now() - start);
 
     if (ret < 0) {
         perror("Error writing to TAP device");
+        STATS_INC(STAT_LINK_OUT_ERRORS);
+    } else {
+        STATS_INC(STAT_LINK_OUT_FRAMES);
+        atomic_fetch_add_explicit(&q->tx_packets, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&q->tx_bytes, ret, memory_order_relaxed);
     }
 
     netdev_dbg("Successfully transmitted %d bytes", ret);
+    free_pktbuf(pkt);
     return ret;
 }
 
-int netdev_poll(void) {
+/*
+ * Shed a frame while memory is short, looking at its headers only. ARP allocates nothing lasting
+ * and goes through. TCP segments lose their payload but keep going as pure ACKs: their ACKs and
+ * windows are what frees send queues, and an echoing peer has data riding on all of them. Anything
+ * else is dropped. Returns -1 to drop the frame
+ */
+static int netdev_rx_shed(struct pktbuf *pkt) {
+    struct eth_header *eth = (struct eth_header *)pkt->data;
+    struct ip_header *iph = (struct ip_header *)(eth + 1);
+    struct tcp_header *th;
+    uint32_t ihl, len, hlen;
+    uint16_t frag, old;
+
+    if (pkt->len < sizeof(*eth)) {
+        return -1;
+    }
+    if (eth->eth_type == htons(ETH_P_ARP)) {
+        return 0;
+    }
+    if (eth->eth_type != htons(ETH_P_IP) || pkt->len < sizeof(*eth) + sizeof(*iph) || iph->proto != IP_P_TCP) {
+        return -1;
+    }
+
+    ihl = iph->ihl * 4;
+    len = ntohs(iph->len);
+    th = (struct tcp_header *)((uint8_t *)iph + ihl);
+    memcpy(&frag, (const uint8_t *)&iph->id + 2, 2); // flags and offset, the bitfields don't match the wire
+    if (ihl < sizeof(*iph) || len < ihl + sizeof(*th) || len > pkt->len - sizeof(*eth) ||
+        (ntohs(frag) & (IP_MF | 0x1fff))) {
+        return -1;
+    }
+    hlen = ihl + th->doff * 4;
+    if (th->doff * 4 < sizeof(*th) || hlen > len) {
+        return -1;
+    }
+    if (hlen == len) {
+        return 0; // nothing to take off
+    }
+
+    // the ACK is only worth acting on if it's genuine, the trimmed segment can't be checked anymore
+    if (ip_pseudo_checksum(iph->saddr, iph->daddr, IP_P_TCP, th, len - ihl) != 0) {
+        return -1;
+    }
+    pkt->l4_csum_ok = 1;
+
+    // a FIN behind data we drop would close the stream early
+    th->flags &= ~TCP_FIN;
+    old = iph->len;
+    iph->len = htons(hlen);
+    iph->csum = checksum_adjust(iph->csum, old, iph->len);
+    pkt->len = sizeof(*eth) + hlen;
+    STATS_INC(STAT_LINK_IN_PRESSURE_TRIMS);
+    return 0;
+}
+
+void netdev_rx(struct pktbuf *pkt, int queue) {
+    STATS_INC(STAT_LINK_IN_FRAMES);
+    PROBE3(netdev_rx, queue, pkt->data, pkt->len);
+    TRACE_STAMP(pkt, TRACE_DEV_RX);
+
+    // short of memory, shed load before spending any work on it
+    if (mem_pressure() && netdev_rx_shed(pkt) < 0) {
+        STATS_INC(STAT_LINK_IN_PRESSURE_DROPS);
+        free_pktbuf(pkt);
+        return;
+    }
+
+    // set the device
+    pkt->dev = &tap.dev;
+    capture_rx(pkt);
+
+    // process the Ethernet frame, or leave that to the flow's worker or the protocol thread
+    if (rss_enabled()) {
+        rss_dispatch(pkt);
+    } else if (pipeline_enabled()) {
+        pipeline_rx(pkt);
+    } else {
+        ethernet_rx(pkt);
+    }
+}
+
+void netdev_rx_flush(void) {
+    // one coalesced ACK per connection for the whole burst
+    if (rss_enabled()) {
+        rss_kick();
+    } else if (pipeline_enabled()) {
+        pipeline_kick();
+    } else {
+        gro_flush();
+        tcp_flush_acks();
+    }
+}
+
+int netdev_poll(struct netdev_queue *q) {
     // allocate a packet buffer with extra room for headers
     struct pktbuf *pkt = alloc_pktbuf(NETDEV_MTU + 100); 
     if (!pkt) {
@@ -105,20 +356,23 @@ int netdev_poll(void) {
     }
 
     // read directly into pktbuf data 
-    int nread = tap_read(tap.fd, pkt->data, pkt->size);
+    int nread = tap_read(q->fd, pkt->data, pkt->size);
 
     if (nread > 0) {
         netdev_dbg("Received %d bytes", nread);
+        atomic_fetch_add_explicit(&q->rx_packets, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&q->rx_bytes, nread, memory_order_relaxed);
 
         // update the length field to match what we read
         pkt->len = nread;
 
-        // set the device
-        pkt->dev = &tap.dev;
-
-        // process the Ethernet frame
-        ethernet_rx(pkt);
+        // we never enable receive offloads, so the virtio_net_hdr carries nothing we need
+        if (tap.vnet_hdr && !pktbuf_pull(pkt, sizeof(struct virtio_net_hdr))) {
+            free_pktbuf(pkt);
+            return 1;
+        }
 
+        netdev_rx(pkt, q->id);
         return 1;
     } else {
         // no data or some error occurred
@@ -126,6 +380,7 @@ int netdev_poll(void) {
 
         if (nread < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
             perror("Error reading from TAP device");
+            STATS_INC(STAT_LINK_IN_ERRORS);
             return -1;
         }
 
@@ -133,29 +388,169 @@ int netdev_poll(void) {
     }
 }
 
+/* The queue's device is readable: take a burst of frames through the stack */
+static void netdev_queue_rx(void *arg) {
+    struct netdev_queue *q = arg;
+    int burst = 0;
+
+    // bounded, so timers and ACKs don't starve under load; the reactor comes back while frames remain
+    while (burst < NETDEV_RX_BURST && netdev_poll(q) > 0) {
+        burst++;
+    }
+    netdev_rx_flush();
+
+    if (burst < NETDEV_RX_BURST) {
+        tcp_flow_gc(); // drained, a good moment to tidy up
+    }
+}
+
+/* Receive and process frames from one queue until the stack shuts down */
+static void netdev_queue_run(struct netdev_queue *q) {
+    struct reactor_source rx = { .fd = q->fd, .handler = netdev_queue_rx, .arg = q };
+
+    // in pipeline mode the protocol thread has the timers
+    if (!pipeline_enabled() && reactor_timers_start(&q->reactor) < 0) {
+        return;
+    }
+    if (reactor_add(&q->reactor, &rx) < 0) {
+        reactor_timers_stop(&q->reactor);
+        return;
+    }
+
+    while (running) {
+        int feeding = q->id == 0 && netdev_feed.fill;
+
+        // a feed keeps queue 0 busy, the device and the timers get a look in after every burst of it
+        if (feeding) {
+            if (netdev_feed.fill(netdev_feed.arg) < 0) {
+                netdev_feed.fill = NULL;
+                feeding = 0;
+            } else {
+                netdev_rx_flush();
+            }
+        }
+        if (reactor_poll(&q->reactor, feeding ? 0 : -1) < 0) {
+            break;
+        }
+    }
+
+    reactor_timers_stop(&q->reactor);
+}
+
+/* Pin the calling thread to the n-th CPU it may run on, wrapping around */
+static void netdev_pin(int n) {
+    cpu_set_t allowed, one;
+    int cpu;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        return;
+    }
+    n %= CPU_COUNT(&allowed);
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && n-- == 0) {
+            CPU_ZERO(&one);
+            CPU_SET(cpu, &one);
+            if (pthread_setaffinity_np(pthread_self(), sizeof(one), &one) == 0) {
+                netdev_dbg("Pinned to CPU %d", cpu);
+            }
+            return;
+        }
+    }
+}
+
+/* Set up the per-core state a queue worker keeps: its TX queue, buffer pool and timer wheel */
+static void netdev_queue_enter(struct netdev_queue *q) {
+    netdev_pin(q->id);
+    netdev_local_queue = q;
+    pktbuf_pool_enable();
+
+    // queue 0 stays on the shared wheel, connections opened by applications keep their timers there
+    if (q->id > 0 && timer_wheel_local() < 0) {
+        fprintf(stderr, "Queue %d keeps its timers on the shared wheel\n", q->id);
+    }
+}
+
+static void netdev_queue_exit(void) {
+    timer_wheel_local_exit();
+    tcp_flow_flush();
+    pktbuf_pool_drain();
+    netdev_local_queue = NULL;
+}
+
+static void *netdev_queue_worker(void *arg) {
+    struct netdev_queue *q = arg;
+
+    netdev_dbg("Queue %d worker starting", q->id);
+    netdev_queue_enter(q);
+    netdev_queue_run(q);
+    netdev_queue_exit();
+    netdev_dbg("Queue %d worker exiting", q->id);
+    return NULL;
+}
+
 void *netdev_rx_loop(void *arg){
+    int i, started;
+
     netdev_dbg("RX thread starting");
 
-    while (running) {
-        // poll for packets
-        netdev_poll();
+    // start the other queues first, so they don't inherit this thread's pinning
+    for (started = 1; started < tap.nqueues; started++) {
+        if (pthread_create(&tap.queues[started].thread, NULL, netdev_queue_worker, &tap.queues[started]) != 0) {
+            perror("Failed to create queue worker");
+            break;
+        }
+    }
+    if (tap.nqueues > 1) {
+        netdev_queue_enter(&tap.queues[0]);
+    }
+
+    netdev_queue_run(&tap.queues[0]);
 
-        // sleep to avoid consuming too much CPU
-        usleep(1000);
-        
+    for (i = 1; i < started; i++) {
+        pthread_join(tap.queues[i].thread, NULL);
     }
+
+    // the workers only ever get frames from here
+    rss_stop();
+    pipeline_stop();
+
+    pthread_mutex_lock(&netdev_lock);
+    for (i = 0; i < tap.nqueues; i++) {
+        reactor_close(&tap.queues[i].reactor);
+    }
+    pthread_mutex_unlock(&netdev_lock);
+    if (tap.nqueues > 1) {
+        netdev_queue_exit();
+        netdev_print_stats();
+    }
+    tcp_flow_flush();
     netdev_dbg("RX thread exiting");
     return NULL;
 }
 
+void netdev_set_feed(int (*fill)(void *arg), void *arg) {
+    netdev_feed.fill = fill;
+    netdev_feed.arg = arg;
+}
+
 void netdev_close(void) {
-    // signal RX thread to stop
+    int i;
+
+    // signal RX thread to stop, and every queue worker sleeping in its reactor
     running = 0;
+    pthread_mutex_lock(&netdev_lock);
+    for (i = 0; i < tap.nqueues; i++) {
+        reactor_wake(&tap.queues[i].reactor);
+    }
+    pthread_mutex_unlock(&netdev_lock);
 
-    // close TAP dev 
-    if (tap.fd >= 0) {
-        close_tap(tap.fd);
-        tap.fd = -1;
+    // close TAP dev, every queue of it
+    for (i = 0; i < tap.nqueues; i++) {
+        if (tap.queues[i].fd >= 0) {
+            close_tap(tap.queues[i].fd);
+            tap.queues[i].fd = -1;
+        }
     }
 
     netdev_dbg("Network device resources cleaned up");
@@ -163,4 +558,16 @@ void netdev_close(void) {
 
 struct netdev *netdev_get(void) {
     return &tap.dev;
-}
\ No newline at end of file
+}
+
+void netdev_print_stats(void) {
+    struct netdev_queue *q;
+    int i;
+
+    for (i = 0; i < tap.nqueues; i++) {
+        q = &tap.queues[i];
+        printf("NETDEV: queue %d: %llu packets %llu bytes in, %llu packets %llu bytes out\n", i,
+            atomic_load(&q->rx_packets), atomic_load(&q->rx_bytes),
+            atomic_load(&q->tx_packets), atomic_load(&q->tx_bytes));
+    }
+}
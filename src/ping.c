@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "ping.h"
+#include "arp.h"
+#include "ip.h"
+#include "netdev.h"
+#include "histogram.h"
+#include "utils.h"
+
+/* Slot states */
+#define PING_SLOT_FREE  0
+#define PING_SLOT_SENT  1 // request sent, waiting for its reply
+#define PING_SLOT_ACKED 2 // reply received
+
+/* Tracking info for one outstanding request, indexed by seq % PING_SLOTS */
+struct ping_slot {
+    uint64_t seq;
+    uint64_t tx_ns;
+    int state;
+};
+
+/* State of the current run, shared between the sender and the RX thread */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t reply_cond; // signalled by the RX thread when the window opens up
+    int active;
+    uint16_t id;
+
+    uint64_t next_seq;   // next sequence number to send
+    uint64_t tail;       // oldest request still counted against the window
+    uint64_t max_rx_seq; // highest sequence number answered so far
+
+    uint64_t sent;
+    uint64_t received;
+    uint64_t duplicates;
+    uint64_t reordered;
+    uint64_t late;       // replies for requests whose slot was already reused
+    uint64_t errors;     // requests the stack refused to send
+
+    struct histogram rtt; // round trip times in ns
+    struct ping_slot slots[PING_SLOTS];
+} ping = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+#define ping_dbg(fmt, ...) \
+    printf("PING: " fmt "\n", ##__VA_ARGS__)
+
+/* Advance the window tail past answered or expired requests, returns requests in flight. Call with lock held */
+static uint64_t ping_inflight(uint64_t now) {
+    while (ping.tail < ping.next_seq) {
+        struct ping_slot *slot = &ping.slots[ping.tail % PING_SLOTS];
+
+        if (slot->state != PING_SLOT_ACKED && now - slot->tx_ns < PING_TIMEOUT_MS * 1000000ULL) {
+            break; // still waiting for this one
+        }
+        ping.tail++;
+    }
+
+    return ping.next_seq - ping.tail;
+}
+
+void ping_recv_reply(struct icmp_v4_echo *echo, int data_len) {
+    struct ping_stamp stamp;
+    struct ping_slot *slot;
+    uint64_t now = clock_ns();
+
+    if (data_len < sizeof(stamp)) {
+        return; // not one of ours
+    }
+    memcpy(&stamp, echo->data, sizeof(stamp)); // payload has no alignment guarantees
+
+    pthread_mutex_lock(&ping.lock);
+
+    if (!ping.active || ntohs(echo->id) != ping.id || (uint16_t)stamp.seq != ntohs(echo->seq)) {
+        pthread_mutex_unlock(&ping.lock);
+        return;
+    }
+
+    slot = &ping.slots[stamp.seq % PING_SLOTS];
+
+    if (slot->state == PING_SLOT_FREE || slot->seq != stamp.seq) {
+        ping.late++; // slot was reused, too old to match
+    } else if (slot->state == PING_SLOT_ACKED) {
+        ping.duplicates++;
+    } else {
+        slot->state = PING_SLOT_ACKED;
+        ping.received++;
+        hist_record(&ping.rtt, now - stamp.tx_ns);
+
+        // an answer for an older request than one already answered means the network reordered them
+        if (ping.received > 1 && stamp.seq < ping.max_rx_seq) {
+            ping.reordered++;
+        } else {
+            ping.max_rx_seq = stamp.seq;
+        }
+
+        pthread_cond_signal(&ping.reply_cond);
+    }
+
+    pthread_mutex_unlock(&ping.lock);
+}
+
+/* Wait until the sender may go again (window open or deadline reached). Call with lock held */
+static void ping_wait(uint64_t deadline_ns) {
+    struct timespec ts;
+
+    ts.tv_sec = deadline_ns / 1000000000ULL;
+    ts.tv_nsec = deadline_ns % 1000000000ULL;
+    pthread_cond_timedwait(&ping.reply_cond, &ping.lock, &ts);
+}
+
+/* Make sure the destination MAC is known before we start timing, so the first requests aren't lost to ARP */
+static int ping_resolve(uint32_t dst_addr) {
+    uint8_t mac[6];
+    int tries;
+
+    for (tries = 0; tries < 300; tries++) {
+        if (arp_resolve(dst_addr, mac) == 0) {
+            return 0;
+        }
+        usleep(10000);
+    }
+
+    return -1;
+}
+
+static void ping_report(const struct ping_config *cfg, uint64_t elapsed_ns) {
+    char dst_str[INET_ADDRSTRLEN];
+    double loss = ping.sent ? 100.0 * (ping.sent - ping.received) / ping.sent : 0.0;
+    double secs = elapsed_ns / 1e9;
+
+    inet_ntop(AF_INET, &cfg->dst_addr, dst_str, INET_ADDRSTRLEN);
+
+    printf("--- %s ping statistics ---\n", dst_str);
+    printf("%lu transmitted, %lu received, %.3f%% loss, %lu duplicates, %lu reordered, %lu late, %lu send errors\n",
+        ping.sent, ping.received, loss, ping.duplicates, ping.reordered, ping.late, ping.errors);
+    printf("time %.3fs, %.0f requests/s, %.0f replies/s\n",
+        secs, secs > 0 ? ping.sent / secs : 0.0, secs > 0 ? ping.received / secs : 0.0);
+
+    if (ping.rtt.count) {
+        printf("rtt min/p50/p99/p99.9/max/mean = %.1f/%.1f/%.1f/%.1f/%.1f/%.1f us\n",
+            ping.rtt.min / 1e3,
+            hist_percentile(&ping.rtt, 50.0) / 1e3,
+            hist_percentile(&ping.rtt, 99.0) / 1e3,
+            hist_percentile(&ping.rtt, 99.9) / 1e3,
+            ping.rtt.max / 1e3,
+            hist_mean(&ping.rtt) / 1e3);
+    }
+}
+
+int ping_run(const struct ping_config *cfg, volatile int *running) {
+    char payload[NETDEV_MTU - sizeof(struct ip_header) - sizeof(struct icmp_v4) - sizeof(struct icmp_v4_echo)];
+    struct ping_stamp stamp;
+    pthread_condattr_t attr;
+    uint64_t interval = cfg->rate > 0 ? 1000000000ULL / cfg->rate : 0;
+    uint64_t window = cfg->window;
+    uint64_t start, next_tx, drain_deadline;
+    int size = cfg->size;
+
+    if (size < (int)sizeof(stamp)) size = sizeof(stamp);
+    if (size > (int)sizeof(payload)) size = sizeof(payload);
+    if (window == 0 || window > PING_MAX_WINDOW) window = PING_MAX_WINDOW; // never reuse a slot that's in flight
+
+    // fill the rest of the payload with the same pattern as regular pings
+    for (int i = 0; i < size; i++) {
+        payload[i] = 'a' + (i % 26);
+    }
+
+    if (ping_resolve(cfg->dst_addr) < 0) {
+        ping_dbg("Could not resolve destination MAC, giving up");
+        return -1;
+    }
+
+    // reset shared state, replies are matched from now on
+    pthread_mutex_lock(&ping.lock);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ping.reply_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    memset(ping.slots, 0, sizeof(ping.slots));
+    hist_init(&ping.rtt);
+    ping.id = cfg->id;
+    ping.next_seq = ping.tail = ping.max_rx_seq = 0;
+    ping.sent = ping.received = ping.duplicates = ping.reordered = ping.late = ping.errors = 0;
+    ping.active = 1;
+    pthread_mutex_unlock(&ping.lock);
+
+    ping_dbg("Sending %d byte echo requests, rate %d/s, window %lu", size, cfg->rate, window);
+
+    start = next_tx = clock_ns();
+
+    while (*running && (cfg->count == 0 || ping.sent < cfg->count)) {
+        uint64_t now = clock_ns();
+        uint64_t seq;
+
+        pthread_mutex_lock(&ping.lock);
+
+        // window full, wait for a reply or for the oldest request to time out
+        if (ping_inflight(now) >= window) {
+            ping_wait(ping.slots[ping.tail % PING_SLOTS].tx_ns + PING_TIMEOUT_MS * 1000000ULL);
+            pthread_mutex_unlock(&ping.lock);
+            continue;
+        }
+
+        // not time for the next request yet
+        if (interval && now < next_tx) {
+            ping_wait(next_tx);
+            pthread_mutex_unlock(&ping.lock);
+            continue;
+        }
+
+        // claim a slot for this request
+        seq = ping.next_seq++;
+        ping.slots[seq % PING_SLOTS] = (struct ping_slot){ .seq = seq, .tx_ns = now, .state = PING_SLOT_SENT };
+        ping.sent++;
+        pthread_mutex_unlock(&ping.lock);
+
+        stamp.tx_ns = now;
+        stamp.seq = seq;
+        memcpy(payload, &stamp, sizeof(stamp));
+
+        if (icmp_send_echo(cfg->dst_addr, cfg->id, (uint16_t)seq, payload, size) < 0) {
+            pthread_mutex_lock(&ping.lock);
+            ping.errors++;
+            pthread_mutex_unlock(&ping.lock);
+        }
+
+        // schedule the next one, but don't burst to catch up after a stall
+        next_tx += interval;
+        if (next_tx + 1000000000ULL < now) {
+            next_tx = now;
+        }
+    }
+
+    // give the outstanding requests until the timeout to come back
+    drain_deadline = clock_ns() + PING_TIMEOUT_MS * 1000000ULL;
+    pthread_mutex_lock(&ping.lock);
+    while (*running && ping.received < ping.sent && clock_ns() < drain_deadline) {
+        ping_wait(drain_deadline);
+    }
+    ping.active = 0;
+    ping_report(cfg, clock_ns() - start);
+    pthread_mutex_unlock(&ping.lock);
+
+    return 0;
+}
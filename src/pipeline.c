@@ -0,0 +1,294 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/membarrier.h>
+
+#include "pipeline.h"
+#include "ring.h"
+#include "reactor.h"
+#include "ethernet.h"
+#include "netdev.h"
+#include "tcp.h"
+#include "gro.h"
+#include "stats.h"
+#include "utils.h"
+
+#define pipe_dbg(fmt, ...) \
+    do { if (verbose) printf("PIPELINE: " fmt "\n", ##__VA_ARGS__); } while (0)
+
+/* A stage thread and the ring feeding it */
+struct pipeline_stage {
+    const char *name;
+    pthread_t thread;
+    struct ring *ring;
+    int efd;               // wakes the stage up while it sleeps
+    int started;
+    _Atomic int sleeping;  // set by the stage before it waits on efd
+    int membarrier;        // the stage fences its producers with membarrier, they only load sleeping
+    _Atomic int stop;
+    atomic_ullong drops;   // frames dropped because the ring was full
+};
+
+static struct pipeline_stage proto_stage = { .name = "protocol", .efd = -1 };
+static struct pipeline_stage tx_stage = { .name = "TX", .efd = -1 };
+static _Atomic int pipeline_on = 0;
+
+/* Frames parsed this burst, queued in one go by pipeline_kick. Only touched by the RX thread */
+static int rx_nstaged;
+static struct pktbuf *rx_staged[NETDEV_RX_BURST];
+
+/* Wake a stage if it's asleep or about to be, after something was queued for it */
+static void pipeline_wake(struct pipeline_stage *st) {
+    // pairs with the stage setting sleeping before its last look at the ring
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_exchange(&st->sleeping, 0)) {
+        eventfd_write(st->efd, 1);
+    }
+}
+
+/* Sleep until the stage is woken up, unless its ring has work */
+static void pipeline_sleep(struct pipeline_stage *st) {
+    struct pollfd pfd = { .fd = st->efd, .events = POLLIN };
+    uint64_t val;
+
+    atomic_store(&st->sleeping, 1);
+    // a producer that saw us awake skipped its fence, so every other thread gets one here: a frame
+    // it queued before that is in the ring, one queued after finds the flag set and wakes us
+    if (!st->membarrier || syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0) < 0) {
+        atomic_thread_fence(memory_order_seq_cst);
+    }
+    if (ring_count(st->ring) == 0 && !atomic_load(&st->stop)) {
+        if (poll(&pfd, 1, -1) > 0) {
+            eventfd_read(st->efd, &val);
+        }
+    }
+    atomic_store(&st->sleeping, 0);
+}
+
+/* Woken up by RX or pipeline_stop, the loop looks at the ring next */
+static void pipeline_woken(void *arg) {
+    struct pipeline_stage *st = arg;
+    uint64_t val;
+
+    eventfd_read(st->efd, &val);
+}
+
+/* Protocol thread: IP and up for every frame RX hands over, plus the timers */
+static void *pipeline_proto_loop(void *arg) {
+    struct pipeline_stage *st = arg;
+    struct reactor_source wake = { .fd = st->efd, .handler = pipeline_woken, .arg = st };
+    struct pktbuf *pkts[NETDEV_RX_BURST];
+    struct reactor r;
+    uint32_t i, n;
+
+    pipe_dbg("Protocol thread starting");
+
+    // the reactor sleeps until frames come in or a timer is due
+    if (reactor_init(&r) < 0) {
+        return NULL;
+    }
+    if (reactor_timers_start(&r) < 0 || reactor_add(&r, &wake) < 0) {
+        reactor_timers_stop(&r);
+        reactor_close(&r);
+        return NULL;
+    }
+
+    while (!atomic_load(&st->stop)) {
+        n = ring_sc_dequeue_burst(st->ring, (void **)pkts, NETDEV_RX_BURST);
+        for (i = 0; i < n; i++) {
+            ethernet_deliver(pkts[i]);
+        }
+
+        // one coalesced ACK per connection per burst
+        gro_flush();
+        tcp_flush_acks();
+
+        if (n) {
+            continue;
+        }
+        tcp_flow_gc();
+
+        // announce the nap before the last look at the ring, pipeline_kick checks the flag after queueing
+        atomic_store(&st->sleeping, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (ring_count(st->ring) == 0 && !atomic_load(&st->stop)) {
+            reactor_poll(&r, -1);
+        }
+        atomic_store(&st->sleeping, 0);
+    }
+
+    while ((n = ring_sc_dequeue_burst(st->ring, (void **)pkts, NETDEV_RX_BURST))) {
+        for (i = 0; i < n; i++) {
+            free_pktbuf(pkts[i]);
+        }
+    }
+    gro_flush();
+    tcp_flush_acks();
+    tcp_flow_flush();
+    reactor_timers_stop(&r);
+    reactor_close(&r);
+
+    pipe_dbg("Protocol thread exiting");
+    return NULL;
+}
+
+/* TX thread: writes out everything queued for the device, a batch at a time */
+static void *pipeline_tx_loop(void *arg) {
+    struct pipeline_stage *st = arg;
+    struct pktbuf *pkts[NETDEV_RX_BURST];
+    uint32_t i, n;
+
+    pipe_dbg("TX thread starting");
+
+    for (;;) {
+        n = ring_sc_dequeue_burst(st->ring, (void **)pkts, NETDEV_RX_BURST);
+        for (i = 0; i < n; i++) {
+            netdev_xmit(pkts[i]);
+        }
+        if (n) {
+            continue;
+        }
+
+        // stop only once drained, pipeline_stop stops the producers first
+        if (atomic_load(&st->stop)) {
+            break;
+        }
+        pipeline_sleep(st);
+    }
+
+    pipe_dbg("TX thread exiting");
+    return NULL;
+}
+
+static int pipeline_stage_start(struct pipeline_stage *st, void *(*loop)(void *)) {
+    st->ring = ring_create(PIPELINE_RING_SIZE);
+    if (!st->ring) {
+        fprintf(stderr, "Failed to allocate pipeline %s ring\n", st->name);
+        return -1;
+    }
+    st->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (st->efd < 0) {
+        perror("Failed to create pipeline eventfd");
+        goto fail;
+    }
+    if (pthread_create(&st->thread, NULL, loop, st) != 0) {
+        perror("Failed to create pipeline thread");
+        goto fail;
+    }
+    st->started = 1;
+    return 0;
+
+fail:
+    if (st->efd >= 0) {
+        close(st->efd);
+        st->efd = -1;
+    }
+    ring_free(st->ring);
+    st->ring = NULL;
+    return -1;
+}
+
+static void pipeline_stage_stop(struct pipeline_stage *st) {
+    struct pktbuf *pkt;
+
+    if (!st->started) {
+        return;
+    }
+    atomic_store(&st->stop, 1);
+    eventfd_write(st->efd, 1);
+    pthread_join(st->thread, NULL);
+    st->started = 0;
+
+    // the ring and eventfd stay, a sender that saw the pipeline enabled a moment ago may still use them
+    while (ring_sc_dequeue_burst(st->ring, (void **)&pkt, 1)) {
+        free_pktbuf(pkt);
+    }
+    pipe_dbg("%s thread dropped %llu frames", st->name, atomic_load(&st->drops));
+}
+
+int pipeline_start(void) {
+    // every sender transmits through the TX ring, spare them a full fence per frame where the kernel can
+    tx_stage.membarrier = syscall(__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0;
+
+    // TX first, the protocol thread starts transmitting as soon as it runs
+    if (pipeline_stage_start(&tx_stage, pipeline_tx_loop) < 0 ||
+        pipeline_stage_start(&proto_stage, pipeline_proto_loop) < 0) {
+        pipeline_stop();
+        return -1;
+    }
+
+    atomic_store(&pipeline_on, 1);
+    pipe_dbg("RX, protocol processing and TX on their own threads");
+    return 0;
+}
+
+int pipeline_enabled(void) {
+    return atomic_load_explicit(&pipeline_on, memory_order_relaxed);
+}
+
+void pipeline_rx(struct pktbuf *pkt) {
+    if (ethernet_parse(pkt) < 0) {
+        return;
+    }
+    if (rx_nstaged == NETDEV_RX_BURST) {
+        pipeline_kick();
+    }
+    rx_staged[rx_nstaged++] = pkt;
+}
+
+void pipeline_kick(void) {
+    uint32_t n;
+
+    if (!rx_nstaged) {
+        return;
+    }
+
+    n = ring_sp_enqueue_burst(proto_stage.ring, (void *const *)rx_staged, rx_nstaged);
+    if ((int)n < rx_nstaged) {
+        atomic_fetch_add_explicit(&proto_stage.drops, rx_nstaged - n, memory_order_relaxed);
+        STATS_ADD(STAT_LINK_IN_DROPS, rx_nstaged - n);
+        while ((int)n < rx_nstaged) {
+            free_pktbuf(rx_staged[n++]);
+        }
+    }
+    rx_nstaged = 0;
+    pipeline_wake(&proto_stage);
+}
+
+int pipeline_tx(struct pktbuf *pkt) {
+    int len = pktbuf_total_len(pkt);
+
+    if (ring_mp_enqueue_burst(tx_stage.ring, (void *const *)&pkt, 1) == 0) {
+        atomic_fetch_add_explicit(&tx_stage.drops, 1, memory_order_relaxed);
+        STATS_INC(STAT_LINK_OUT_DROPS);
+        free_pktbuf(pkt);
+        return -1;
+    }
+
+    // while frames keep coming the TX thread is awake, and seeing that costs a plain load
+    if (tx_stage.membarrier) {
+        atomic_signal_fence(memory_order_seq_cst); // the load stays after the enqueue
+        if (!atomic_load_explicit(&tx_stage.sleeping, memory_order_acquire)) {
+            return len;
+        }
+    }
+    pipeline_wake(&tx_stage);
+    return len;
+}
+
+void pipeline_stop(void) {
+    // from here on senders write to the device themselves
+    atomic_store(&pipeline_on, 0);
+
+    pipeline_stage_stop(&proto_stage);
+    while (rx_nstaged) {
+        free_pktbuf(rx_staged[--rx_nstaged]);
+    }
+    pipeline_stage_stop(&tx_stage);
+}
@@ -2,34 +2,95 @@
 #include <stdlib.h>
 #include <string.h>
 #include "pktbuf.h"
+#include "mem.h"
+#include "zerocopy.h"
 
+/* The calling thread's buffer pool, if it has one */
+static __thread struct {
+    int enabled;
+    int count;
+    list_head free;
+} pktbuf_pool;
 
-struct pktbuf *alloc_pktbuf(uint32_t size) {
-    struct pktbuf *pkt = malloc(sizeof(struct pktbuf));
+/* Memory a buffer really takes, pooled ones always have the full data room */
+static inline int64_t pktbuf_truesize(struct pktbuf *pkt) {
+    return sizeof(struct pktbuf) + (pkt->pooled ? PKTBUF_POOL_BUF : pkt->size);
+}
 
-    if (!pkt) {
-        perror("Failed to allocate packet buffer");
+/* A buffer with room for size bytes from the thread's pool, NULL if the thread has none */
+static struct pktbuf *pktbuf_pool_get(uint32_t size) {
+    struct pktbuf *pkt;
+
+    if (!pktbuf_pool.enabled || size > PKTBUF_POOL_BUF) {
         return NULL;
     }
 
-    // initialize the packet structure 
-    memset(pkt, 0, sizeof(struct pktbuf)); // zero out
-    list_init(&pkt->list); // initialize list field
+    if (!list_empty(&pktbuf_pool.free)) {
+        pkt = list_first_entry(&pktbuf_pool.free, struct pktbuf, list);
+        list_del(&pkt->list);
+        pktbuf_pool.count--;
+    } else if (!(pkt = malloc(sizeof(struct pktbuf) + PKTBUF_POOL_BUF))) {
+        return NULL;
+    }
+
+    memset(pkt, 0, sizeof(struct pktbuf));
+    pkt->head = (uint8_t *)(pkt + 1);
+    pkt->pooled = 1;
+    return pkt;
+}
+
+void pktbuf_pool_enable(void) {
+    list_init(&pktbuf_pool.free);
+    pktbuf_pool.count = 0;
+    pktbuf_pool.enabled = 1;
+}
+
+void pktbuf_pool_drain(void) {
+    struct pktbuf *pkt;
+
+    if (!pktbuf_pool.enabled) {
+        return;
+    }
+    pktbuf_pool.enabled = 0;
 
-    // allocate memory for the buffer 
-    pkt->head = malloc(size);
-    if (!pkt->head) {
+    while (!list_empty(&pktbuf_pool.free)) {
+        pkt = list_first_entry(&pktbuf_pool.free, struct pktbuf, list);
+        list_del(&pkt->list);
         free(pkt);
-        return NULL;
     }
+    pktbuf_pool.count = 0;
+}
+
+struct pktbuf *alloc_pktbuf(uint32_t size) {
+    struct pktbuf *pkt = pktbuf_pool_get(size);
+
+    if (!pkt) {
+        pkt = malloc(sizeof(struct pktbuf));
+        if (!pkt) {
+            perror("Failed to allocate packet buffer");
+            return NULL;
+        }
+
+        // initialize the packet structure
+        memset(pkt, 0, sizeof(struct pktbuf)); // zero out
+
+        // allocate memory for the buffer
+        pkt->head = malloc(size);
+        if (!pkt->head) {
+            free(pkt);
+            return NULL;
+        }
+    }
+    list_init(&pkt->list); // initialize list field
 
     // initialize fields
     pkt->data = pkt->head;
     pkt->size = size;
     pkt->len = 0;
-    pkt->refcnt = 1;
+    atomic_init(&pkt->refcnt, 1);
     pkt->end = pkt->head + size;
 
+    mem_charge(MEM_PKTBUF, pktbuf_truesize(pkt), 1);
     return pkt;
 }
 
@@ -38,13 +99,39 @@ void free_pktbuf(struct pktbuf *pkt) {
         return;
     }
 
-    pkt->refcnt--;
+    // the only reference, nearly always the case, goes without an atomic operation
+    if (atomic_load_explicit(&pkt->refcnt, memory_order_acquire) == 1 ||
+        atomic_fetch_sub_explicit(&pkt->refcnt, 1, memory_order_acq_rel) == 1) {
+        mem_charge(MEM_PKTBUF, -pktbuf_truesize(pkt), -1);
+
+        if (pkt->ubuf) {
+            zc_ubuf_put(pkt->ubuf);
+        }
+        if (pkt->frag_owner) {
+            free_pktbuf(pkt->frag_owner);
+        }
+        if (pkt->pieces) {
+            for (int i = 0; i < pkt->pieces->count; i++) {
+                free_pktbuf(pkt->pieces->piece[i].owner);
+            }
+            mem_charge(MEM_PKTBUF, -(int64_t)sizeof(struct pktbuf_pieces), 0);
+            free(pkt->pieces);
+        }
+
+        if (pkt->pooled) {
+            // back to this thread's pool, whichever thread it came from
+            if (pktbuf_pool.enabled && pktbuf_pool.count < PKTBUF_POOL_MAX) {
+                list_add(&pktbuf_pool.free, &pkt->list);
+                pktbuf_pool.count++;
+            } else {
+                free(pkt);
+            }
+            return;
+        }
 
-    if (pkt->refcnt == 0) {
         if (pkt->head) {
             free(pkt->head);
         }
-
         free(pkt);
     }
 
@@ -53,7 +140,7 @@ void free_pktbuf(struct pktbuf *pkt) {
 
 void pktbuf_hold(struct pktbuf *pkt) {
     if (pkt) {
-        pkt->refcnt++;
+        atomic_fetch_add_explicit(&pkt->refcnt, 1, memory_order_relaxed);
     }
 }
 
@@ -103,21 +190,177 @@ void *pktbuf_put(struct pktbuf *pkt, uint32_t len) {
 
 struct pktbuf *pktbuf_clone(struct pktbuf *pkt) {
     if (!pkt) return NULL;
-    
-    struct pktbuf *clone = alloc_pktbuf(pkt->size);
+
+    uint32_t headroom = pkt->data - pkt->head;
+
+    // only the headroom is the clone's own. A buffer with a fragment already keeps little more
+    // than headers in data, so that much is copied
+    struct pktbuf *clone = alloc_pktbuf(headroom + (pkt->frag ? pkt->len : 0));
     if (!clone) return NULL;
+    pktbuf_reserve(clone, headroom);
 
     // copy packet metadata 
-    clone->len = pkt->len;
     clone->protocol = pkt->protocol;
     clone->dev = pkt->dev;
+    clone->gso_size = pkt->gso_size;
+    clone->gso_segs = pkt->gso_segs;
+    memcpy(clone->cb, pkt->cb, sizeof(pkt->cb));
+
+    if (pkt->frag) {
+        memcpy(pktbuf_put(clone, pkt->len), pkt->data, pkt->len);
+        pktbuf_attach_pkt(clone, pkt->frag, pkt->frag_len, pkt);
+    } else if (pkt->len) {
+        pktbuf_attach_pkt(clone, pkt->data, pkt->len, pkt);
+    }
 
-    // calculate the data offset 
-    uint32_t offset = pkt->data - pkt->head;
-    clone->data = clone->head + offset;
+    if (pkt->pieces) {
+        for (int i = 0; i < pkt->pieces->count; i++) {
+            struct pktbuf_piece *p = &pkt->pieces->piece[i];
 
-    // Copy the actual data 
-    memcpy(clone->head, pkt->head, pkt->size);
+            // a clone missing payload would go out short under a checksum covering all of it
+            if (pktbuf_add_piece(clone, p->owner, p->data, p->len, p->csum_ok ? &p->csum : NULL) < 0) {
+                free_pktbuf(clone);
+                return NULL;
+            }
+        }
+    }
 
     return clone;
-}
\ No newline at end of file
+}
+
+void pktbuf_attach(struct pktbuf *pkt, uint8_t *frag, uint32_t len, struct zc_ubuf *ubuf) {
+    pkt->frag = frag;
+    pkt->frag_len = len;
+    pkt->ubuf = ubuf;
+    zc_ubuf_get(ubuf);
+}
+
+void pktbuf_attach_pkt(struct pktbuf *pkt, uint8_t *frag, uint32_t len, struct pktbuf *owner) {
+    pkt->frag = frag;
+    pkt->frag_len = len;
+    pkt->frag_owner = owner;
+    pktbuf_hold(owner);
+}
+
+int pktbuf_add_piece(struct pktbuf *pkt, struct pktbuf *owner, uint8_t *data, uint32_t len, const uint32_t *csum) {
+    struct pktbuf_piece *p;
+
+    if (!pkt->pieces) {
+        pkt->pieces = malloc(sizeof(struct pktbuf_pieces));
+        if (!pkt->pieces) {
+            return -1;
+        }
+        pkt->pieces->len = 0;
+        pkt->pieces->count = 0;
+        mem_charge(MEM_PKTBUF, sizeof(struct pktbuf_pieces), 0);
+    }
+    if (pkt->pieces->count == PKTBUF_MAX_PIECES) {
+        return -1;
+    }
+
+    p = &pkt->pieces->piece[pkt->pieces->count++];
+    p->data = data;
+    p->len = len;
+    p->owner = owner;
+    p->csum = csum ? *csum : 0;
+    p->csum_ok = csum != NULL;
+    pkt->pieces->len += len;
+    pktbuf_hold(owner);
+    return 0;
+}
+
+/* Copy from one stretch of the frame, returns the bytes taken */
+static uint32_t pktbuf_copy_from(uint8_t **to, uint32_t *left, const uint8_t *from, uint32_t len) {
+    if (len > *left) {
+        len = *left;
+    }
+    memcpy(*to, from, len);
+    *to += len;
+    *left -= len;
+    return len;
+}
+
+uint32_t pktbuf_copy(struct pktbuf *pkt, void *to, uint32_t len) {
+    uint8_t *p = to;
+    uint32_t left = len;
+
+    pktbuf_copy_from(&p, &left, pkt->data, pkt->len);
+    if (pkt->frag_len) {
+        pktbuf_copy_from(&p, &left, pkt->frag, pkt->frag_len);
+    }
+    for (int i = 0; pkt->pieces && i < pkt->pieces->count && left; i++) {
+        pktbuf_copy_from(&p, &left, pkt->pieces->piece[i].data, pkt->pieces->piece[i].len);
+    }
+    return len - left;
+}
+
+void pktbuf_frag_pull(struct pktbuf *pkt, uint32_t len) {
+    if (len > pkt->frag_len) {
+        len = pkt->frag_len;
+    }
+    pkt->frag += len;
+    pkt->frag_len -= len;
+}
+/* Release n pieces starting at from, moving the ones behind them up */
+static void pktbuf_drop_pieces(struct pktbuf_pieces *pieces, int from, int n) {
+    for (int i = from; i < from + n; i++) {
+        pieces->len -= pieces->piece[i].len;
+        free_pktbuf(pieces->piece[i].owner);
+    }
+    memmove(&pieces->piece[from], &pieces->piece[from + n], (pieces->count - from - n) * sizeof(pieces->piece[0]));
+    pieces->count -= n;
+}
+
+void pktbuf_pull_all(struct pktbuf *pkt, uint32_t len) {
+    struct pktbuf_pieces *pieces = pkt->pieces;
+    uint32_t n = len < pkt->len ? len : pkt->len;
+    int i;
+
+    pktbuf_pull(pkt, n);
+    len -= n;
+    n = len < pkt->frag_len ? len : pkt->frag_len;
+    pktbuf_frag_pull(pkt, n);
+    len -= n;
+    if (!len || !pieces) {
+        return;
+    }
+
+    for (i = 0; i < pieces->count && len >= pieces->piece[i].len; i++) {
+        len -= pieces->piece[i].len;
+    }
+    pktbuf_drop_pieces(pieces, 0, i);
+    if (len && pieces->count) {
+        pieces->piece[0].data += len;
+        pieces->piece[0].len -= len;
+        pieces->piece[0].csum_ok = 0;
+        pieces->len -= len;
+    }
+}
+
+void pktbuf_trim(struct pktbuf *pkt, uint32_t len) {
+    struct pktbuf_pieces *pieces = pkt->pieces;
+    int i;
+
+    if (len < pkt->len) {
+        pkt->len = len;
+    }
+    len -= pkt->len;
+    if (len < pkt->frag_len) {
+        pkt->frag_len = len;
+    }
+    len -= pkt->frag_len;
+    if (!pieces) {
+        return;
+    }
+
+    for (i = 0; i < pieces->count && len >= pieces->piece[i].len; i++) {
+        len -= pieces->piece[i].len;
+    }
+    if (i < pieces->count && len) {
+        pieces->len -= pieces->piece[i].len - len;
+        pieces->piece[i].len = len;
+        pieces->piece[i].csum_ok = 0;
+        i++;
+    }
+    pktbuf_drop_pieces(pieces, i, pieces->count - i);
+}
@@ -0,0 +1,153 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "reactor.h"
+#include "timer.h"
+#include "mem.h"
+#include "utils.h"
+
+#define reactor_dbg(fmt, ...) \
+    do { if (verbose) printf("REACTOR: " fmt "\n", ##__VA_ARGS__); } while (0)
+
+/* The wheel's next deadline came up */
+static void reactor_timers(void *arg) {
+    struct reactor *r = arg;
+    uint64_t expirations;
+
+    // nonblocking, timer_mod may have moved the deadline out again since epoll saw it fire
+    if (read(r->tfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+        perror("Failed to read timerfd");
+    }
+    timers_run();
+}
+
+/* Another thread wants the loop to come around */
+static void reactor_woken(void *arg) {
+    struct reactor *r = arg;
+    eventfd_t val;
+
+    eventfd_read(r->efd, &val);
+}
+
+int reactor_init(struct reactor *r) {
+    memset(r, 0, sizeof(*r));
+    r->tfd = -1;
+    r->efd = -1;
+
+    r->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (r->epfd < 0) {
+        perror("Failed to create epoll instance");
+        return -1;
+    }
+
+    r->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (r->efd < 0) {
+        perror("Failed to create reactor eventfd");
+        reactor_close(r);
+        return -1;
+    }
+    r->wake_src = (struct reactor_source){ .fd = r->efd, .handler = reactor_woken, .arg = r };
+    if (reactor_add(r, &r->wake_src) < 0) {
+        reactor_close(r);
+        return -1;
+    }
+    return 0;
+}
+
+int reactor_timers_start(struct reactor *r) {
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+
+    if (tfd < 0) {
+        perror("Failed to create timerfd");
+        return -1;
+    }
+    r->timer_src = (struct reactor_source){ .fd = tfd, .handler = reactor_timers, .arg = r };
+    if (reactor_add(r, &r->timer_src) < 0) {
+        close(tfd);
+        return -1;
+    }
+    if (timers_set_timerfd(tfd) < 0) {
+        fprintf(stderr, "Timer wheel already runs from another reactor\n");
+        reactor_del(r, &r->timer_src);
+        close(tfd);
+        return -1;
+    }
+    r->tfd = tfd;
+    return 0;
+}
+
+void reactor_timers_stop(struct reactor *r) {
+    if (r->tfd < 0) {
+        return;
+    }
+    timers_set_timerfd(-1);
+    reactor_del(r, &r->timer_src);
+    close(r->tfd);
+    r->tfd = -1;
+}
+
+int reactor_add(struct reactor *r, struct reactor_source *src) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = src };
+
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, src->fd, &ev) < 0) {
+        perror("Failed to add fd to reactor");
+        return -1;
+    }
+    return 0;
+}
+
+int reactor_del(struct reactor *r, struct reactor_source *src) {
+    if (epoll_ctl(r->epfd, EPOLL_CTL_DEL, src->fd, NULL) < 0) {
+        perror("Failed to remove fd from reactor");
+        return -1;
+    }
+    return 0;
+}
+
+int reactor_poll(struct reactor *r, int timeout_ms) {
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    struct reactor_source *src;
+    int i, n;
+
+    // about to sleep maybe, leave nothing counted only locally meanwhile
+    if (timeout_ms) {
+        mem_fold();
+    }
+    n = epoll_wait(r->epfd, events, REACTOR_MAX_EVENTS, timeout_ms);
+    if (n < 0) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        perror("Failed to wait for events");
+        return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        src = events[i].data.ptr;
+        reactor_dbg("fd %d ready", src->fd);
+        src->handler(src->arg);
+    }
+    return n;
+}
+
+void reactor_wake(struct reactor *r) {
+    if (r->efd >= 0) {
+        eventfd_write(r->efd, 1);
+    }
+}
+
+void reactor_close(struct reactor *r) {
+    if (r->efd >= 0) {
+        close(r->efd);
+        r->efd = -1;
+    }
+    if (r->epfd >= 0) {
+        close(r->epfd);
+        r->epfd = -1;
+    }
+}
@@ -0,0 +1,470 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "replay.h"
+#include "netdev.h"
+#include "ethernet.h"
+#include "arp.h"
+#include "ip.h"
+#include "udp.h"
+#include "tcp.h"
+#include "pktbuf.h"
+#include "stats.h"
+#include "utils.h"
+
+#define replay_dbg(fmt, ...) \
+    printf("REPLAY: " fmt "\n", ##__VA_ARGS__)
+
+/* Classic pcap magics, as read on a host of the writer's byte order, and of the other one */
+#define PCAP_MAGIC_US         0xa1b2c3d4
+#define PCAP_MAGIC_NS         0xa1b23c4d
+#define PCAP_MAGIC_US_SWAPPED 0xd4c3b2a1
+#define PCAP_MAGIC_NS_SWAPPED 0x4d3cb2a1
+#define PCAP_LINK_ETH 1
+
+/* pcapng block types */
+#define PCAPNG_SHB      0x0A0D0D0A
+#define PCAPNG_IDB      0x00000001
+#define PCAPNG_SPB      0x00000003
+#define PCAPNG_EPB      0x00000006
+#define PCAPNG_MAGIC    0x1A2B3C4D
+#define PCAPNG_LINK_ETH 1
+#define PCAPNG_MAX_IFS  64
+
+/* A frame of the file, in the file's buffer */
+struct replay_frame {
+    uint8_t *data;
+    uint32_t len;
+};
+
+static struct {
+    struct replay_config cfg;
+    uint8_t *file;
+    struct replay_frame *frames;
+    uint64_t nframes;
+    uint64_t skipped;       // not Ethernet
+    uint64_t pass;          // passes done
+    uint64_t next;          // frame to send next in this pass
+    uint64_t sent;
+    uint64_t bytes;
+    uint64_t nomem;         // frames lost because no buffer could be had
+    uint64_t start_ns, end_ns;
+    uint64_t cpu_start, cpu_end;
+    uint64_t stats_start[STAT_MAX];
+    _Atomic int stop;       // asked to end early
+    _Atomic int done;       // the RX thread won't touch the replay anymore
+} replay;
+
+/* CPU time of the whole process, every thread of the stack included */
+static uint64_t replay_cpu_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int replay_parse_rewrite(struct replay_config *cfg, const char *spec) {
+    char *copy, *tok, *save;
+    struct in_addr addr;
+    int ret = 0;
+
+    copy = strdup(spec);
+    if (!copy) {
+        return -1;
+    }
+    for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (strcmp(tok, "dst") == 0) {
+            cfg->rewrite_dst = 1;
+        } else if (strncmp(tok, "src=", 4) == 0 && inet_pton(AF_INET, tok + 4, &addr) == 1) {
+            cfg->rewrite_src = addr.s_addr;
+        } else {
+            fprintf(stderr, "Replay rewrite: unknown term %s\n", tok);
+            ret = -1;
+            break;
+        }
+    }
+    free(copy);
+    return ret;
+}
+
+static int replay_add(uint8_t *data, uint32_t len) {
+    static uint64_t cap;
+
+    if (replay.nframes == cap) {
+        struct replay_frame *frames;
+
+        cap = cap ? cap * 2 : 1024;
+        frames = realloc(replay.frames, cap * sizeof(*frames));
+        if (!frames) {
+            perror("Failed to allocate replay frames");
+            return -1;
+        }
+        replay.frames = frames;
+    }
+    replay.frames[replay.nframes++] = (struct replay_frame){ .data = data, .len = len };
+    return 0;
+}
+
+static uint32_t replay_u32(const uint8_t *p, int swap) {
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return swap ? __builtin_bswap32(v) : v;
+}
+
+static uint16_t replay_u16(const uint8_t *p, int swap) {
+    uint16_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return swap ? __builtin_bswap16(v) : v;
+}
+
+/* Classic pcap: a 24 byte file header, then a 16 byte header before each frame */
+static int replay_parse_pcap(uint8_t *buf, size_t len) {
+    uint32_t magic;
+    size_t off = 24;
+    int swap;
+
+    if (len < 24) {
+        fprintf(stderr, "Truncated pcap header\n");
+        return -1;
+    }
+    magic = replay_u32(buf, 0);
+    if (magic == PCAP_MAGIC_US || magic == PCAP_MAGIC_NS) {
+        swap = 0;
+    } else if (magic == PCAP_MAGIC_US_SWAPPED || magic == PCAP_MAGIC_NS_SWAPPED) {
+        swap = 1;
+    } else {
+        fprintf(stderr, "Not a pcap or pcapng file (magic 0x%08x)\n", magic);
+        return -1;
+    }
+    if (replay_u32(buf + 20, swap) != PCAP_LINK_ETH) {
+        fprintf(stderr, "Not an Ethernet capture (link type %u)\n", replay_u32(buf + 20, swap));
+        return -1;
+    }
+
+    while (off + 16 <= len) {
+        uint32_t caplen = replay_u32(buf + off + 8, swap);
+
+        off += 16;
+        if (caplen > len - off) {
+            fprintf(stderr, "Truncated frame at offset %zu, stopping there\n", off - 16);
+            break;
+        }
+        if (replay_add(buf + off, caplen) < 0) {
+            return -1;
+        }
+        off += caplen;
+    }
+    return 0;
+}
+
+/* pcapng: blocks of type, length, body, length. Frames from interfaces other than Ethernet are skipped */
+static int replay_parse_pcapng(uint8_t *buf, size_t len) {
+    uint16_t linktype[PCAPNG_MAX_IFS];
+    int nifs = 0, swap = 0;
+    size_t off = 0;
+
+    while (off + 12 <= len) {
+        uint32_t type = replay_u32(buf + off, swap), blen, ifid, caplen;
+        uint8_t *body = buf + off + 8;
+
+        // a section header sets the byte order of everything up to the next one
+        if (type == PCAPNG_SHB) {
+            swap = replay_u32(buf + off + 8, 0) != PCAPNG_MAGIC;
+            nifs = 0;
+        }
+        blen = replay_u32(buf + off + 4, swap);
+        if (blen < 12 || blen % 4 || blen > len - off) {
+            fprintf(stderr, "Bad pcapng block at offset %zu, stopping there\n", off);
+            break;
+        }
+
+        switch (type) {
+            case PCAPNG_IDB:
+                if (nifs < PCAPNG_MAX_IFS && blen >= 20) {
+                    linktype[nifs++] = replay_u16(body, swap);
+                }
+                break;
+            case PCAPNG_EPB:
+                if (blen < 32) break;
+                ifid = replay_u32(body, swap);
+                caplen = replay_u32(body + 12, swap);
+                if (caplen > blen - 32) break;
+                if (ifid >= nifs || linktype[ifid] != PCAPNG_LINK_ETH) {
+                    replay.skipped++;
+                } else if (replay_add(body + 20, caplen) < 0) {
+                    return -1;
+                }
+                break;
+            case PCAPNG_SPB:
+                // always interface 0, the captured length is whatever the block has room for
+                if (blen < 16) break;
+                caplen = replay_u32(body, swap);
+                if (caplen > blen - 16) caplen = blen - 16;
+                if (nifs == 0 || linktype[0] != PCAPNG_LINK_ETH) {
+                    replay.skipped++;
+                } else if (replay_add(body + 4, caplen) < 0) {
+                    return -1;
+                }
+                break;
+            default:
+                break;
+        }
+        off += blen;
+    }
+    return 0;
+}
+
+/* Point an address in an IP header somewhere else, keeping the IP and the TCP/UDP checksum valid */
+static void replay_set_addr(struct ip_header *iph, void *field, uint32_t addr, uint16_t *l4csum) {
+    uint16_t old[2], new[2];
+    int i;
+
+    memcpy(old, field, 4);
+    memcpy(new, &addr, 4);
+    for (i = 0; i < 2; i++) {
+        iph->csum = checksum_adjust(iph->csum, old[i], new[i]);
+        if (l4csum) {
+            *l4csum = checksum_adjust(*l4csum, old[i], new[i]);
+        }
+    }
+    memcpy(field, &addr, 4);
+}
+
+/* Apply the configured rewrites to a frame in place, once at load time */
+static void replay_rewrite(uint8_t *frame, uint32_t len) {
+    struct netdev *dev = netdev_get();
+    struct eth_header *eh = (struct eth_header *)frame;
+    uint8_t *l3 = frame + sizeof(*eh);
+    uint32_t l3len;
+
+    if (len < sizeof(*eh)) {
+        return;
+    }
+    l3len = len - sizeof(*eh);
+
+    if (replay.cfg.rewrite_dst && !(eh->dest_mac[0] & 1)) {
+        memcpy(eh->dest_mac, dev->hwaddr, 6);
+    }
+
+    if (ntohs(eh->eth_type) == ETH_P_IP && l3len >= sizeof(struct ip_header)) {
+        struct ip_header *iph = (struct ip_header *)l3;
+        uint32_t hlen = iph->ihl * 4;
+        uint16_t frag, *l4csum = NULL;
+        uint8_t *l4 = l3 + hlen;
+
+        if (hlen < sizeof(*iph) || hlen > l3len) {
+            return; // malformed, replayed as it is
+        }
+
+        // only the first fragment has the transport header, its checksum covers the addresses
+        memcpy(&frag, l3 + 6, sizeof(frag));
+        if ((ntohs(frag) & 0x1fff) == 0) {
+            if (iph->proto == IP_P_TCP && l3len - hlen >= sizeof(struct tcp_header)) {
+                l4csum = (uint16_t *)(l4 + offsetof(struct tcp_header, csum));
+            } else if (iph->proto == IP_P_UDP && l3len - hlen >= sizeof(struct udp_header)) {
+                l4csum = (uint16_t *)(l4 + offsetof(struct udp_header, csum));
+                if (*l4csum == 0) l4csum = NULL; // not computed, stays that way
+            }
+        }
+
+        if (replay.cfg.rewrite_dst) {
+            replay_set_addr(iph, l3 + offsetof(struct ip_header, daddr), dev->addr, l4csum);
+        }
+        if (replay.cfg.rewrite_src) {
+            replay_set_addr(iph, l3 + offsetof(struct ip_header, saddr), replay.cfg.rewrite_src, l4csum);
+        }
+        if (l4csum && iph->proto == IP_P_UDP && *l4csum == 0) {
+            *l4csum = 0xffff; // a computed zero is sent as all ones
+        }
+    } else if (ntohs(eh->eth_type) == ETH_P_ARP &&
+               l3len >= sizeof(struct arp_header) + sizeof(struct arp_ipv4)) {
+        struct arp_ipv4 *ad = (struct arp_ipv4 *)((struct arp_header *)l3)->data;
+
+        if (replay.cfg.rewrite_dst) {
+            ad->dip = dev->addr;
+        }
+        if (replay.cfg.rewrite_src) {
+            ad->sip = replay.cfg.rewrite_src;
+        }
+    }
+}
+
+static void replay_finish(void) {
+    replay.end_ns = clock_ns();
+    replay.cpu_end = replay_cpu_ns();
+    atomic_store(&replay.done, 1);
+}
+
+/* Queue 0's feed: the next burst of frames, fewer or none if the rate says they aren't due yet */
+static int replay_fill(void *arg) {
+    uint64_t now = clock_ns(), due = REPLAY_BURST;
+    int n;
+
+    if (replay.start_ns == 0) {
+        stats_snapshot(replay.stats_start);
+        replay.cpu_start = replay_cpu_ns();
+        replay.start_ns = now = clock_ns();
+    }
+    if (atomic_load(&replay.stop) || (replay.cfg.loops && replay.pass == replay.cfg.loops)) {
+        replay_finish();
+        return -1;
+    }
+
+    if (replay.cfg.rate) {
+        due = (now - replay.start_ns) * replay.cfg.rate / 1000000000ULL + 1 - replay.sent;
+        if ((int64_t)due <= 0) {
+            // nothing due yet, don't sleep so long the device and the timers go unattended
+            uint64_t wait = (replay.sent * 1000000000ULL / replay.cfg.rate) - (now - replay.start_ns);
+            struct timespec ts = { .tv_nsec = wait < 1000000 ? wait : 1000000 };
+
+            nanosleep(&ts, NULL);
+            return 0;
+        }
+        if (due > REPLAY_BURST) due = REPLAY_BURST;
+    }
+
+    for (n = 0; n < due; n++) {
+        struct replay_frame *f = &replay.frames[replay.next];
+        struct pktbuf *pkt = alloc_pktbuf(f->len > NETDEV_MTU + 100 ? f->len : NETDEV_MTU + 100);
+
+        if (!pkt) {
+            replay.nomem++;
+        } else {
+            memcpy(pkt->data, f->data, f->len);
+            pkt->len = f->len;
+            netdev_rx(pkt, 0); // fed from queue 0's thread
+        }
+        replay.sent++;
+        replay.bytes += f->len;
+
+        if (++replay.next == replay.nframes) {
+            replay.next = 0;
+            if (++replay.pass == replay.cfg.loops) {
+                n++;
+                break;
+            }
+        }
+    }
+    return n;
+}
+
+int replay_start(const struct replay_config *cfg) {
+    struct stat st;
+    size_t got = 0;
+    ssize_t r;
+    uint64_t i;
+    int fd, ret;
+
+    replay.cfg = *cfg;
+
+    fd = open(cfg->path, O_RDONLY);
+    if (fd < 0) {
+        perror("Failed to open replay file");
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < 4) {
+        fprintf(stderr, "Replay file %s is empty or unreadable\n", cfg->path);
+        close(fd);
+        return -1;
+    }
+    replay.file = malloc(st.st_size);
+    if (!replay.file) {
+        perror("Failed to allocate replay buffer");
+        close(fd);
+        return -1;
+    }
+    while (got < st.st_size && (r = read(fd, replay.file + got, st.st_size - got)) > 0) {
+        got += r;
+    }
+    close(fd);
+    if (got < st.st_size) {
+        perror("Failed to read replay file");
+        return -1;
+    }
+
+    if (got >= 4 && replay_u32(replay.file, 0) == PCAPNG_SHB) {
+        ret = replay_parse_pcapng(replay.file, got);
+    } else {
+        ret = replay_parse_pcap(replay.file, got);
+    }
+    if (ret < 0) {
+        return -1;
+    }
+    if (replay.nframes == 0) {
+        fprintf(stderr, "No Ethernet frames in %s\n", cfg->path);
+        return -1;
+    }
+
+    if (cfg->rewrite_dst || cfg->rewrite_src) {
+        for (i = 0; i < replay.nframes; i++) {
+            replay_rewrite(replay.frames[i].data, replay.frames[i].len);
+        }
+    }
+
+    replay_dbg("Loaded %lu frames (%lu skipped) from %s", replay.nframes, replay.skipped, cfg->path);
+    netdev_set_feed(replay_fill, NULL);
+    return 0;
+}
+
+static void replay_report(void) {
+    uint64_t now[STAT_MAX], *then = replay.stats_start;
+    double secs = (replay.end_ns - replay.start_ns) / 1e9;
+    double cpu = (replay.cpu_end - replay.cpu_start) / 1e9;
+    uint64_t out;
+
+    stats_snapshot(now);
+    out = now[STAT_LINK_OUT_FRAMES] - then[STAT_LINK_OUT_FRAMES];
+
+    printf("--- %s replay statistics ---\n", replay.cfg.path);
+    printf("%lu frames, %lu bytes, %lu passes in %.3fs: %.0f frames/s, %.1f Mbit/s\n",
+        replay.sent, replay.bytes, replay.pass, secs,
+        secs > 0 ? replay.sent / secs : 0.0, secs > 0 ? replay.bytes * 8 / secs / 1e6 : 0.0);
+    printf("cpu %.3fs, %.0f ns/frame, %.0f%% of a core\n",
+        cpu, replay.sent ? cpu * 1e9 / replay.sent : 0.0, secs > 0 ? 100 * cpu / secs : 0.0);
+    printf("stack sent %lu frames (%.0f/s), dropped %lu at RX, %lu runts or unknown types, "
+           "%lu IP header errors, %lu not for us, %lu without a buffer\n",
+        out, secs > 0 ? out / secs : 0.0,
+        now[STAT_LINK_IN_DROPS] - then[STAT_LINK_IN_DROPS],
+        now[STAT_LINK_IN_RUNTS] - then[STAT_LINK_IN_RUNTS] +
+            now[STAT_LINK_IN_UNKNOWN_TYPES] - then[STAT_LINK_IN_UNKNOWN_TYPES],
+        now[STAT_IP_IN_HDR_ERRORS] - then[STAT_IP_IN_HDR_ERRORS],
+        now[STAT_IP_IN_ADDR_ERRORS] - then[STAT_IP_IN_ADDR_ERRORS],
+        replay.nomem);
+}
+
+int replay_run(volatile int *running) {
+    uint64_t deadline, out, last = 0;
+    uint64_t now[STAT_MAX];
+
+    while (!atomic_load(&replay.done)) {
+        if (!*running) {
+            atomic_store(&replay.stop, 1);
+        }
+        usleep(10000);
+    }
+
+    // the pipeline's TX thread and the workers may still be sending what the last frames caused
+    deadline = clock_ns() + REPLAY_DRAIN_MS * 1000000ULL;
+    while (*running && clock_ns() < deadline) {
+        stats_snapshot(now);
+        out = now[STAT_LINK_OUT_FRAMES];
+        if (out == last) {
+            break;
+        }
+        last = out;
+        usleep(50000);
+    }
+
+    replay_report();
+    return 0;
+}
@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/random.h>
+
+#include "reuseport.h"
+#include "utils.h"
+
+static uint32_t reuseport_secret;
+static pthread_once_t reuseport_once = PTHREAD_ONCE_INIT;
+
+static void reuseport_key(void) {
+    if (getrandom(&reuseport_secret, sizeof(reuseport_secret), 0) != sizeof(reuseport_secret)) {
+        reuseport_secret = (uint32_t)clock_ns();
+    }
+}
+
+struct reuseport *reuseport_alloc(void *sk) {
+    struct reuseport *group = malloc(sizeof(struct reuseport));
+
+    pthread_once(&reuseport_once, reuseport_key); // nothing hashes before a group exists
+
+    if (!group) {
+        perror("Failed to allocate reuseport group");
+        return NULL;
+    }
+
+    group->num = 1;
+    group->socks[0] = sk;
+    return group;
+}
+
+int reuseport_add(struct reuseport *group, void *sk) {
+    if (group->num == REUSEPORT_MAX) {
+        return -1;
+    }
+    group->socks[group->num++] = sk;
+    return 0;
+}
+
+int reuseport_remove(struct reuseport *group, void *sk) {
+    int i, left;
+
+    for (i = 0; i < group->num; i++) {
+        if (group->socks[i] == sk) {
+            // order doesn't matter, the last member fills the hole
+            group->socks[i] = group->socks[--group->num];
+            break;
+        }
+    }
+
+    left = group->num;
+    if (left == 0) {
+        free(group);
+    }
+    return left;
+}
+
+uint32_t reuseport_hash(uint32_t saddr, uint16_t sport, uint32_t daddr, uint16_t dport) {
+    uint32_t h;
+
+    // murmur3 finalizer over the tuple
+    h = saddr ^ (daddr * 0x9e3779b1) ^ (((uint32_t)sport << 16) | dport) ^ reuseport_secret;
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
@@ -0,0 +1,279 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+
+#include "rss.h"
+#include "ring.h"
+#include "ethernet.h"
+#include "netdev.h"
+#include "ip.h"
+#include "tcp.h"
+#include "gro.h"
+#include "stats.h"
+#include "utils.h"
+
+#define rss_dbg(fmt, ...) \
+    do { if (verbose) printf("RSS: " fmt "\n", ##__VA_ARGS__); } while (0)
+
+/*
+ * Toeplitz key with a 16 bit period. Swapping the addresses shifts the input by 32 bits and
+ * swapping the ports by 16, so either direction of a flow sees the same key bits and hashes the same
+ */
+static const uint8_t rss_key[] = {
+    0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a,
+};
+
+#define RSS_INPUT_LEN 12 // saddr, daddr, sport, dport
+
+/* A protocol processing thread and the frames queued for it */
+struct rss_worker {
+    pthread_t thread;
+    int id;
+    int efd;               // wakes the worker up while it sleeps
+    uint64_t drops;        // frames dropped because the ring was full
+    _Atomic int sleeping;  // set by the worker before it waits on efd
+    _Atomic int stop;
+    struct ring *ring;     // frames for the worker, the dispatcher is the only producer
+
+    /* Frames dispatched this burst, queued in one go by rss_kick. Only touched by the dispatcher */
+    int nstaged;
+    struct pktbuf *staged[NETDEV_RX_BURST];
+};
+
+static struct rss_worker *rss_workers[RSS_MAX_WORKERS];
+static int rss_nworkers = 0;
+static uint8_t rss_reta[RSS_RETA_SIZE];
+
+/* Toeplitz contribution of every byte value at every input position, so hashing is a lookup per byte */
+static uint32_t rss_table[RSS_INPUT_LEN][256];
+
+/* The 32 key bits starting at bit n */
+static uint32_t rss_key_window(int n) {
+    uint32_t k = 0;
+    int i;
+
+    for (i = 0; i < 32; i++) {
+        k = (k << 1) | ((rss_key[(n + i) / 8] >> (7 - (n + i) % 8)) & 1);
+    }
+    return k;
+}
+
+void rss_init(void) {
+    int pos, val, bit;
+
+    for (pos = 0; pos < RSS_INPUT_LEN; pos++) {
+        for (val = 0; val < 256; val++) {
+            uint32_t h = 0;
+
+            for (bit = 0; bit < 8; bit++) {
+                if (val & (0x80 >> bit)) {
+                    h ^= rss_key_window(pos * 8 + bit);
+                }
+            }
+            rss_table[pos][val] = h;
+        }
+    }
+}
+
+uint32_t rss_hash(const uint8_t *frame, uint32_t len) {
+    const struct eth_header *eth = (const struct eth_header *)frame;
+    const struct ip_header *iph;
+    uint8_t input[RSS_INPUT_LEN];
+    uint16_t frag;
+    uint32_t h = 0;
+    int i, n = 8, hlen;
+
+    if (len < sizeof(*eth) + sizeof(*iph) || eth->eth_type != htons(ETH_P_IP)) {
+        return 0;
+    }
+    iph = (const struct ip_header *)(frame + sizeof(*eth));
+    hlen = iph->ihl * 4;
+
+    memcpy(input, &iph->saddr, 4);
+    memcpy(input + 4, &iph->daddr, 4);
+
+    // the ports only count when this is the whole datagram, fragments must all hash alike
+    memcpy(&frag, (const uint8_t *)&iph->id + 2, 2); // flags and offset, the bitfields don't match the wire
+    if ((iph->proto == IP_P_TCP || iph->proto == IP_P_UDP) && !(ntohs(frag) & (IP_MF | 0x1fff)) &&
+        len >= sizeof(*eth) + hlen + 4) {
+        memcpy(input + 8, frame + sizeof(*eth) + hlen, 4);
+        n = RSS_INPUT_LEN;
+    }
+
+    for (i = 0; i < n; i++) {
+        h ^= rss_table[i][input[i]];
+    }
+    return h;
+}
+
+static void *rss_worker_loop(void *arg) {
+    struct rss_worker *w = arg;
+    struct pktbuf *pkts[NETDEV_RX_BURST];
+    uint64_t val;
+    uint32_t i, n;
+
+    rss_dbg("Worker %d starting", w->id);
+
+    while (!atomic_load(&w->stop)) {
+        n = ring_sc_dequeue_burst(w->ring, (void **)pkts, NETDEV_RX_BURST);
+        for (i = 0; i < n; i++) {
+            ethernet_rx(pkts[i]);
+        }
+
+        // same as the single threaded RX loop: one coalesced ACK per connection per burst
+        gro_flush();
+        tcp_flush_acks();
+
+        if (n) {
+            continue;
+        }
+        tcp_flow_gc();
+
+        // announce the nap before the last look at the ring, the dispatcher checks the flag after queueing
+        atomic_store(&w->sleeping, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (ring_count(w->ring) == 0 && !atomic_load(&w->stop)) {
+            eventfd_read(w->efd, &val);
+        }
+        atomic_store(&w->sleeping, 0);
+    }
+
+    while ((n = ring_sc_dequeue_burst(w->ring, (void **)pkts, NETDEV_RX_BURST))) {
+        for (i = 0; i < n; i++) {
+            free_pktbuf(pkts[i]);
+        }
+    }
+    gro_flush();
+    tcp_flush_acks();
+    tcp_flow_flush();
+
+    rss_dbg("Worker %d exiting, %lu frames dropped", w->id, (unsigned long)w->drops);
+    return NULL;
+}
+
+int rss_start(int nworkers) {
+    struct rss_worker *w;
+    int i;
+
+    if (nworkers < 1 || nworkers > RSS_MAX_WORKERS) {
+        fprintf(stderr, "RSS workers must be between 1 and %d\n", RSS_MAX_WORKERS);
+        return -1;
+    }
+
+    rss_init();
+    for (i = 0; i < RSS_RETA_SIZE; i++) {
+        rss_reta[i] = i % nworkers;
+    }
+
+    for (i = 0; i < nworkers; i++) {
+        w = aligned_alloc(CACHELINE_SIZE, sizeof(struct rss_worker));
+        if (!w) {
+            perror("Failed to allocate RSS worker");
+            goto fail;
+        }
+        memset(w, 0, sizeof(*w));
+        w->id = i;
+
+        w->ring = ring_create(RSS_RING_SIZE);
+        if (!w->ring) {
+            perror("Failed to allocate RSS worker ring");
+            free(w);
+            goto fail;
+        }
+        w->efd = eventfd(0, EFD_CLOEXEC);
+        if (w->efd < 0) {
+            perror("Failed to create RSS worker eventfd");
+            ring_free(w->ring);
+            free(w);
+            goto fail;
+        }
+        if (pthread_create(&w->thread, NULL, rss_worker_loop, w) != 0) {
+            perror("Failed to create RSS worker");
+            close(w->efd);
+            ring_free(w->ring);
+            free(w);
+            goto fail;
+        }
+        rss_workers[rss_nworkers++] = w;
+    }
+
+    rss_dbg("Spreading received frames over %d workers", nworkers);
+    return 0;
+
+fail:
+    rss_stop();
+    return -1;
+}
+
+int rss_enabled(void) {
+    return rss_nworkers > 0;
+}
+
+/* Queue a worker's staged frames, whatever doesn't fit is dropped like a full NIC queue would */
+static void rss_flush(struct rss_worker *w) {
+    uint32_t n = ring_sp_enqueue_burst(w->ring, (void *const *)w->staged, w->nstaged);
+
+    while ((int)n < w->nstaged) {
+        w->drops++;
+        STATS_INC(STAT_LINK_IN_DROPS);
+        free_pktbuf(w->staged[n++]);
+    }
+    w->nstaged = 0;
+}
+
+void rss_dispatch(struct pktbuf *pkt) {
+    struct rss_worker *w;
+
+    pkt->hash = rss_hash(pkt->data, pkt->len);
+    w = rss_workers[rss_reta[pkt->hash % RSS_RETA_SIZE]];
+
+    if (w->nstaged == NETDEV_RX_BURST) {
+        rss_flush(w);
+    }
+    w->staged[w->nstaged++] = pkt;
+}
+
+void rss_kick(void) {
+    struct rss_worker *w;
+    int i;
+
+    for (i = 0; i < rss_nworkers; i++) {
+        w = rss_workers[i];
+        if (!w->nstaged) {
+            continue;
+        }
+        rss_flush(w);
+
+        // pairs with the worker setting sleeping before its last look at the ring
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_exchange(&w->sleeping, 0)) {
+            eventfd_write(w->efd, 1);
+        }
+    }
+}
+
+void rss_stop(void) {
+    struct rss_worker *w;
+    int i, n = rss_nworkers;
+
+    rss_nworkers = 0; // frames go straight up the stack again
+
+    for (i = 0; i < n; i++) {
+        w = rss_workers[i];
+        atomic_store(&w->stop, 1);
+        eventfd_write(w->efd, 1);
+        pthread_join(w->thread, NULL);
+        while (w->nstaged) {
+            free_pktbuf(w->staged[--w->nstaged]);
+        }
+        close(w->efd);
+        ring_free(w->ring);
+        free(w);
+        rss_workers[i] = NULL;
+    }
+}
@@ -0,0 +1,718 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+#include "tenstack.h"
+#include "shm.h"
+
+/*
+ * Client side of the shared-memory sockets, built into libtenstack.a rather than the daemon. It
+ * mustn't depend on anything in the stack, only on the wire layout in shm.h.
+ *
+ * The eventfds are only ever touched through eventfd_read/eventfd_write: the preload shim hands
+ * the completion eventfd out as the socket's descriptor and intercepts plain read and write.
+ *
+ * Every read goes through one read slot: a RECV, RECVFROM or ACCEPT sized for a whole buffer
+ * is posted, and its result is handed out from the slot until used up. A polled socket keeps
+ * that read posted ahead of time, so readiness is simply "the read completed".
+ */
+
+struct ts_sock {
+    char *path;          // daemon socket, accepted connections open their own channel there
+    int ctl;
+    int sq_efd;          // we write it when the daemon sleeps on the submission ring
+    int cq_efd;          // the daemon writes it when we sleep on the completion ring
+    struct ts_shm *shm;
+    uint64_t next_id;    // user_data of the next request
+    int outstanding;     // requests without a completion yet, never more than the rings hold
+    int err;             // a failed send nobody was told about yet
+    int nfree;
+    uint16_t free_bufs[TS_NBUFS];
+
+    int read_op;         // what a read is on this socket: TS_OP_RECV, TS_OP_RECVFROM, TS_OP_ACCEPT or 0
+    int nonblock;        // reads return EAGAIN instead of waiting
+    int polled;          // ts_fd was handed out, keep a read posted and the fd's readiness current
+    int efd_set;         // we made cq_efd readable ourselves
+    int poll_out;        // ts_set_poll_out: cq_efd is also readable while a send would go through
+    int rd_shutdown;     // ts_shutdown: reads return end of stream
+    int wr_shutdown;     // ts_shutdown: sends fail with EPIPE
+
+    // the read slot
+    uint64_t rx_id;      // the read in flight, 0 if none
+    int rx_done;         // rx_* holds a completed read not fully handed out
+    int rx_buf;          // buffer it was read into, -1 once given back
+    int32_t rx_res;
+    uint32_t rx_off;     // bytes already handed out
+    uint32_t rx_addr;
+    uint16_t rx_port;
+};
+
+static uint64_t ts_clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Receive the channel's memory and eventfds from the daemon */
+static int ts_attach(ts_sock *sk) {
+    char token;
+    struct iovec iov = { .iov_base = &token, .iov_len = 1 };
+    union {
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } ctrl;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = ctrl.buf,
+        .msg_controllen = sizeof(ctrl.buf),
+    };
+    struct cmsghdr *cmsg;
+    int fds[3];
+
+    if (recvmsg(sk->ctl, &msg, MSG_CMSG_CLOEXEC) <= 0) {
+        return -1;
+    }
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        errno = EPROTO;
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    sk->sq_efd = fds[1];
+    sk->cq_efd = fds[2];
+
+    sk->shm = mmap(NULL, sizeof(struct ts_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    close(fds[0]);
+    if (sk->shm == MAP_FAILED) {
+        sk->shm = NULL;
+        return -1;
+    }
+    if (sk->shm->magic != TS_SHM_MAGIC || sk->shm->version != TS_SHM_VERSION) {
+        errno = EPROTO;
+        return -1;
+    }
+    return 0;
+}
+
+static void ts_free(ts_sock *sk) {
+    int saved = errno;
+
+    if (sk->shm) munmap(sk->shm, sizeof(struct ts_shm));
+    if (sk->sq_efd >= 0) close(sk->sq_efd);
+    if (sk->cq_efd >= 0) close(sk->cq_efd);
+    if (sk->ctl >= 0) close(sk->ctl);
+    free(sk->path);
+    free(sk);
+    errno = saved;
+}
+
+ts_sock *ts_socket(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    ts_sock *sk;
+    int i;
+
+    if (!path) {
+        path = TS_SOCK_PATH;
+    }
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    strcpy(addr.sun_path, path);
+
+    sk = calloc(1, sizeof(ts_sock));
+    if (!sk) {
+        return NULL;
+    }
+    sk->ctl = sk->sq_efd = sk->cq_efd = -1;
+    sk->next_id = 1; // 0 never matches, see ts_reap_one
+    sk->rx_buf = -1;
+    sk->path = strdup(path);
+    for (i = 0; i < TS_NBUFS; i++) {
+        sk->free_bufs[i] = TS_NBUFS - 1 - i;
+    }
+    sk->nfree = TS_NBUFS;
+
+    sk->ctl = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (!sk->path || sk->ctl < 0 ||
+        connect(sk->ctl, (struct sockaddr *)&addr, sizeof(addr)) < 0 || ts_attach(sk) < 0) {
+        ts_free(sk);
+        return NULL;
+    }
+    return sk;
+}
+
+/* Queue a request, the caller made sure a ring slot is free */
+static uint64_t ts_submit(ts_sock *sk, struct ts_sqe *sqe) {
+    struct ts_sq *sq = &sk->shm->sq;
+    uint32_t head = atomic_load_explicit(&sq->head, memory_order_relaxed);
+
+    sqe->user_data = sk->next_id++;
+    sq->entries[head & (TS_RING_SIZE - 1)] = *sqe;
+    atomic_store(&sq->head, head + 1);
+    sk->outstanding++;
+
+    // the daemon only needs a kick if it went to sleep on an empty ring
+    if (atomic_exchange(&sq->sleeping, 0)) {
+        if (eventfd_write(sk->sq_efd, 1) < 0) {
+            return sqe->user_data; // the daemon's gone, the wait for the completion finds out
+        }
+    }
+    return sqe->user_data;
+}
+
+static int ts_cq_ready(ts_sock *sk) {
+    struct ts_cq *cq = &sk->shm->cq;
+
+    return atomic_load_explicit(&cq->head, memory_order_acquire) != atomic_load_explicit(&cq->tail, memory_order_relaxed);
+}
+
+/* Wait for the next completion. Spins a while before sleeping, -1 if the daemon went away */
+static int ts_reap(ts_sock *sk, struct ts_cqe *cqe) {
+    struct ts_cq *cq = &sk->shm->cq;
+    uint32_t tail = atomic_load_explicit(&cq->tail, memory_order_relaxed);
+    uint64_t deadline = ts_clock_ns() + TS_SPIN_NS;
+    struct pollfd pfds[2] = {
+        { .fd = sk->cq_efd, .events = POLLIN },
+        { .fd = sk->ctl, .events = POLLIN },
+    };
+    eventfd_t count;
+
+    while (atomic_load_explicit(&cq->head, memory_order_acquire) == tail) {
+        if (ts_clock_ns() < deadline) {
+            continue;
+        }
+
+        // same handshake as the daemon: flag first, then one more look before blocking
+        atomic_store(&cq->sleeping, 1);
+        if (atomic_load(&cq->head) != tail) {
+            atomic_store(&cq->sleeping, 0);
+            break;
+        }
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (pfds[1].revents) {
+            errno = EPIPE;
+            return -1;
+        }
+        if (eventfd_read(sk->cq_efd, &count) < 0 && errno != EAGAIN) {
+            return -1;
+        }
+        sk->efd_set = 0;
+        atomic_store(&cq->sleeping, 0);
+        deadline = ts_clock_ns() + TS_SPIN_NS;
+    }
+
+    *cqe = cq->entries[tail & (TS_RING_SIZE - 1)];
+    atomic_store_explicit(&cq->tail, tail + 1, memory_order_release);
+    sk->outstanding--;
+    return 0;
+}
+
+static void ts_arm(ts_sock *sk);
+
+static void ts_put_buf(ts_sock *sk, int b) {
+    sk->free_bufs[sk->nfree++] = b;
+}
+
+/* Give the read slot's buffer back, the result stays */
+static void ts_rx_release(ts_sock *sk) {
+    if (sk->rx_buf >= 0) {
+        ts_put_buf(sk, sk->rx_buf);
+        sk->rx_buf = -1;
+    }
+}
+
+/*
+ * Collect one completion. A read lands in the read slot and returns 2, a send gives its buffer
+ * back and returns 1, and 0 means it was the request id. Requests complete in order apart from
+ * the read, so anything else that shows up first was a send
+ */
+static int ts_reap_one(ts_sock *sk, struct ts_cqe *cqe, uint64_t id) {
+    if (ts_reap(sk, cqe) < 0) {
+        return -1;
+    }
+
+    if (cqe->user_data == sk->rx_id) {
+        sk->rx_id = 0;
+        sk->rx_done = 1;
+        sk->rx_res = cqe->result;
+        sk->rx_off = 0;
+        sk->rx_addr = cqe->addr;
+        sk->rx_port = cqe->port;
+        if (sk->rx_res <= 0) {
+            ts_rx_release(sk); // nothing in it
+        }
+        return 2;
+    }
+    if (cqe->user_data != id) {
+        ts_put_buf(sk, cqe->buf);
+        if (cqe->result < 0 && !sk->err) {
+            sk->err = -cqe->result;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Make room for one more request, and a free buffer if it needs one, by collecting completions.
+ * A nonblocking socket fails with EAGAIN instead of waiting for them
+ */
+static int ts_make_room(ts_sock *sk, int need_buf) {
+    struct ts_cqe cqe;
+
+    while (sk->outstanding == TS_RING_SIZE || (need_buf && sk->nfree == 0)) {
+        if (sk->nonblock && !ts_cq_ready(sk)) {
+            errno = EAGAIN;
+            return -1;
+        }
+        if (ts_reap_one(sk, &cqe, 0) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Same, but for requests whose result we wait for anyway */
+static int ts_reserve(ts_sock *sk, int need_buf) {
+    struct ts_cqe cqe;
+
+    while (sk->outstanding == TS_RING_SIZE || (need_buf && sk->nfree == 0)) {
+        if (ts_reap_one(sk, &cqe, 0) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Post a read into the read slot unless one is in flight or waiting to be handed out */
+static int ts_rx_start(ts_sock *sk) {
+    struct ts_sqe sqe = { .op = sk->read_op, .len = TS_BUF_SIZE };
+    int b = -1;
+
+    if (!sk->read_op) {
+        errno = ENOTCONN;
+        return -1;
+    }
+    if (sk->rx_id || sk->rx_done) {
+        return 0;
+    }
+
+    if (ts_make_room(sk, sk->read_op != TS_OP_ACCEPT) < 0) {
+        return -1;
+    }
+    // reaping for room above may have completed an earlier read
+    if (sk->rx_done) {
+        return 0;
+    }
+    if (sk->read_op != TS_OP_ACCEPT) {
+        b = sk->free_bufs[--sk->nfree];
+    }
+    sqe.buf = b < 0 ? 0 : b;
+    sk->rx_buf = b;
+    sk->rx_id = ts_submit(sk, &sqe);
+    return 0;
+}
+
+/* Get a completed read into the slot, waiting for it unless the socket is nonblocking */
+static int ts_rx_wait(ts_sock *sk) {
+    struct ts_cqe cqe;
+
+    if (sk->err) {
+        errno = sk->err;
+        return -1;
+    }
+    if (ts_rx_start(sk) < 0) {
+        if (errno == EAGAIN) {
+            ts_arm(sk);
+            errno = EAGAIN;
+        }
+        return -1;
+    }
+    while (!sk->rx_done) {
+        if (sk->nonblock && !ts_cq_ready(sk)) {
+            ts_arm(sk); // make sure the completion wakes whoever polls us
+            errno = EAGAIN;
+            return -1;
+        }
+        if (ts_reap_one(sk, &cqe, 0) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* A send would take at least some data without waiting */
+static int ts_writable(ts_sock *sk) {
+    return sk->read_op != TS_OP_ACCEPT && !sk->wr_shutdown && sk->nfree > 0 && sk->outstanding < TS_RING_SIZE;
+}
+
+/*
+ * Bring a polled socket's fd up to date: readable while a read has completed or completions
+ * are waiting, with the next read already posted. The fd is the completion eventfd, which the
+ * daemon writes when it completes something while we're flagged asleep. Costs no syscall unless
+ * the readiness actually changes
+ */
+static void ts_arm(ts_sock *sk) {
+    struct ts_cq *cq = &sk->shm->cq;
+    eventfd_t count;
+
+    if (!sk->polled) {
+        return;
+    }
+    if (sk->read_op && !sk->rx_done && !sk->rd_shutdown) {
+        ts_rx_start(sk); // a failure shows up on the next read
+    }
+
+    if (sk->rx_done || sk->rd_shutdown || ts_cq_ready(sk) || (sk->poll_out && ts_writable(sk))) {
+        if (!sk->efd_set && eventfd_write(sk->cq_efd, 1) == 0) {
+            sk->efd_set = 1;
+        }
+        return;
+    }
+
+    // nothing to read: clear the counter if we or the daemon may have set it, and go back to sleep
+    if (sk->efd_set || !atomic_load(&cq->sleeping)) {
+        eventfd_read(sk->cq_efd, &count);
+        sk->efd_set = 0;
+        atomic_store(&cq->sleeping, 1);
+        if (ts_cq_ready(sk) && eventfd_write(sk->cq_efd, 1) == 0) {
+            sk->efd_set = 1;
+        }
+    }
+}
+
+/* Issue a request and wait for its result. Sends queued before it complete on the way */
+static int ts_call(ts_sock *sk, struct ts_sqe *sqe, struct ts_cqe *cqe) {
+    uint64_t id;
+    int ret;
+
+    if (sk->err) {
+        errno = sk->err;
+        return -1;
+    }
+    if (ts_reserve(sk, 0) < 0) {
+        return -1;
+    }
+
+    id = ts_submit(sk, sqe);
+    while ((ret = ts_reap_one(sk, cqe, id)) > 0)
+        ;
+    if (ret < 0) {
+        return -1;
+    }
+    ts_arm(sk);
+
+    // a send that failed right before us takes precedence, our request ran after it
+    if (sk->err) {
+        errno = sk->err;
+        return -1;
+    }
+    if (cqe->result < 0) {
+        errno = -cqe->result;
+        return -1;
+    }
+    return cqe->result;
+}
+
+int ts_listen(ts_sock *sk, uint16_t port, int backlog, int reuseport) {
+    struct ts_sqe sqe = { .op = TS_OP_LISTEN, .arg0 = port, .arg1 = backlog, .arg2 = !!reuseport };
+    struct ts_cqe cqe;
+
+    if (ts_call(sk, &sqe, &cqe) < 0) {
+        return -1;
+    }
+    sk->read_op = TS_OP_ACCEPT;
+    ts_arm(sk);
+    return 0;
+}
+
+ts_sock *ts_accept(ts_sock *lsk, uint32_t *addr, uint16_t *port) {
+    struct ts_sqe sqe = { .op = TS_OP_ADOPT, .arg0 = lsk->shm->id };
+    struct ts_cqe cqe;
+    ts_sock *sk;
+
+    if (lsk->read_op != TS_OP_ACCEPT) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (ts_rx_wait(lsk) < 0) {
+        return NULL;
+    }
+
+    // the connection is parked in the daemon under a token until a channel of its own adopts it
+    lsk->rx_done = 0;
+    if (lsk->rx_res < 0) {
+        errno = -lsk->rx_res;
+        ts_arm(lsk);
+        return NULL;
+    }
+    sqe.arg1 = lsk->rx_res;
+    if (addr) *addr = lsk->rx_addr;
+    if (port) *port = lsk->rx_port;
+    ts_arm(lsk);
+
+    sk = ts_socket(lsk->path);
+    if (!sk) {
+        return NULL;
+    }
+    if (ts_call(sk, &sqe, &cqe) < 0) {
+        ts_free(sk);
+        return NULL;
+    }
+    sk->read_op = TS_OP_RECV;
+    return sk;
+}
+
+int ts_connect(ts_sock *sk, uint32_t addr, uint16_t port) {
+    struct ts_sqe sqe = { .op = TS_OP_CONNECT, .addr = addr, .arg0 = port };
+    struct ts_cqe cqe;
+
+    if (ts_call(sk, &sqe, &cqe) < 0) {
+        return -1;
+    }
+    sk->read_op = TS_OP_RECV;
+    ts_arm(sk);
+    return 0;
+}
+
+int ts_send(ts_sock *sk, const void *buf, int len) {
+    struct ts_sqe sqe = { .op = TS_OP_SEND };
+    int off, n, b;
+
+    for (off = 0; off < len; off += n) {
+        if (sk->err || sk->wr_shutdown) {
+            errno = sk->err ? sk->err : EPIPE;
+            return -1;
+        }
+        if (ts_make_room(sk, 1) < 0) {
+            if (errno == EAGAIN) {
+                ts_arm(sk); // a completion makes room, let it wake whoever polls us
+                if (off > 0) {
+                    return off;
+                }
+                errno = EAGAIN;
+            }
+            return -1;
+        }
+
+        b = sk->free_bufs[--sk->nfree];
+        n = len - off < TS_BUF_SIZE ? len - off : TS_BUF_SIZE;
+        memcpy(sk->shm->bufs[b], (const uint8_t *)buf + off, n);
+        sqe.buf = b;
+        sqe.len = n;
+        ts_submit(sk, &sqe); // no waiting, the completion just returns the buffer
+    }
+    ts_arm(sk);
+    return len;
+}
+
+int ts_recv(ts_sock *sk, void *buf, int len) {
+    int n;
+
+    if (sk->read_op != TS_OP_RECV) {
+        errno = ENOTCONN;
+        return -1;
+    }
+    if (sk->rd_shutdown) {
+        return 0;
+    }
+    if (ts_rx_wait(sk) < 0) {
+        return -1;
+    }
+
+    // end of stream and errors stay in the slot for every later read
+    if (sk->rx_res <= 0) {
+        if (sk->rx_res < 0) {
+            errno = -sk->rx_res;
+            return -1;
+        }
+        return 0;
+    }
+
+    n = (int)(sk->rx_res - sk->rx_off) < len ? (int)(sk->rx_res - sk->rx_off) : len;
+    memcpy(buf, sk->shm->bufs[sk->rx_buf] + sk->rx_off, n);
+    sk->rx_off += n;
+    if (sk->rx_off == (uint32_t)sk->rx_res) {
+        ts_rx_release(sk);
+        sk->rx_done = 0;
+    }
+    ts_arm(sk);
+    return n;
+}
+
+int ts_bind(ts_sock *sk, uint16_t port, int reuseport) {
+    struct ts_sqe sqe = { .op = TS_OP_BIND, .arg0 = port, .arg2 = !!reuseport };
+    struct ts_cqe cqe;
+
+    if (ts_call(sk, &sqe, &cqe) < 0) {
+        return -1;
+    }
+    sk->read_op = TS_OP_RECVFROM;
+    ts_arm(sk);
+    return cqe.port;
+}
+
+int ts_sendto(ts_sock *sk, const void *buf, int len, uint32_t addr, uint16_t port) {
+    struct ts_sqe sqe = { .op = TS_OP_SENDTO, .addr = addr, .arg0 = port };
+    struct ts_cqe cqe;
+    int b, n;
+
+    if (len > TS_BUF_SIZE) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (ts_reserve(sk, 1) < 0) {
+        return -1;
+    }
+    b = sk->free_bufs[--sk->nfree];
+    memcpy(sk->shm->bufs[b], buf, len);
+    sqe.buf = b;
+    sqe.len = len;
+
+    n = ts_call(sk, &sqe, &cqe);
+    ts_put_buf(sk, b);
+    return n;
+}
+
+int ts_recvfrom(ts_sock *sk, void *buf, int len, uint32_t *addr, uint16_t *port) {
+    int n;
+
+    if (sk->read_op != TS_OP_RECVFROM) {
+        errno = EDESTADDRREQ;
+        return -1;
+    }
+    if (ts_rx_wait(sk) < 0) {
+        return -1;
+    }
+
+    // one datagram per read, whatever doesn't fit in buf is dropped
+    n = sk->rx_res;
+    if (n >= 0) {
+        n = n < len ? n : len;
+        memcpy(buf, sk->shm->bufs[sk->rx_buf], n);
+        if (addr) *addr = sk->rx_addr;
+        if (port) *port = sk->rx_port;
+    } else {
+        errno = -n;
+        n = -1;
+    }
+    ts_rx_release(sk);
+    sk->rx_done = 0;
+    ts_arm(sk);
+    return n;
+}
+
+int ts_setsockopt(ts_sock *sk, int opt, int val) {
+    struct ts_sqe sqe = { .op = TS_OP_SETOPT, .arg0 = opt, .arg1 = val };
+    struct ts_cqe cqe;
+
+    return ts_call(sk, &sqe, &cqe) < 0 ? -1 : 0;
+}
+
+int ts_shutdown(ts_sock *sk, int how) {
+    struct ts_sqe sqe = { .op = TS_OP_SHUTDOWN, .arg0 = how };
+    struct ts_cqe cqe;
+
+    if (how != SHUT_RD && how != SHUT_WR && how != SHUT_RDWR) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (sk->read_op != TS_OP_RECV) {
+        errno = ENOTCONN;
+        return -1;
+    }
+    if (ts_call(sk, &sqe, &cqe) < 0) {
+        return -1;
+    }
+    sk->rd_shutdown |= how != SHUT_WR;
+    sk->wr_shutdown |= how != SHUT_RD;
+    ts_arm(sk);
+    return 0;
+}
+
+int ts_poll(ts_sock *sk) {
+    struct ts_cqe cqe;
+    int mask = 0;
+
+    // completions waiting give back send buffers and fill the read slot
+    while (ts_cq_ready(sk)) {
+        if (ts_reap_one(sk, &cqe, 0) < 0) {
+            return TS_POLLERR;
+        }
+    }
+    ts_arm(sk);
+
+    if (sk->rx_done || sk->rd_shutdown) {
+        mask |= TS_POLLIN;
+    }
+    if (sk->rd_shutdown || (sk->rx_done && sk->read_op == TS_OP_RECV && sk->rx_res == 0)) {
+        mask |= TS_POLLRDHUP;
+    }
+    if (sk->err || (sk->rx_done && sk->rx_res < 0)) {
+        mask |= TS_POLLERR;
+    }
+    if (sk->err || ts_writable(sk)) {
+        mask |= TS_POLLOUT; // a send reports the error
+    }
+    return mask;
+}
+
+void ts_set_poll_out(ts_sock *sk, int on) {
+    sk->poll_out = !!on;
+    ts_arm(sk);
+}
+
+void ts_set_nonblock(ts_sock *sk, int on) {
+    sk->nonblock = !!on;
+}
+
+int ts_fd(ts_sock *sk) {
+    if (!sk->polled) {
+        // reads of the counter must never wait, the daemon only ever writes it
+        if (fcntl(sk->cq_efd, F_SETFL, fcntl(sk->cq_efd, F_GETFL) | O_NONBLOCK) < 0) {
+            return -1;
+        }
+        sk->polled = 1;
+        ts_arm(sk);
+    }
+    return sk->cq_efd;
+}
+
+int ts_close(ts_sock *sk) {
+    struct ts_sqe sqe = { .op = TS_OP_CLOSE };
+    struct ts_cqe cqe;
+    int err;
+
+    // queued sends complete before the close does, a read still in flight is dropped
+    err = sk->err;
+    sk->err = 0;
+    sk->polled = 0;
+    ts_call(sk, &sqe, &cqe);
+    if (!err) {
+        err = sk->err;
+    }
+    ts_free(sk);
+
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,877 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "tenstack.h"
+
+/*
+ * LD_PRELOAD shim (libtenstack_preload.so) that moves an unmodified program's AF_INET sockets onto
+ * the stack's shared-memory sockets:
+ *
+ *     LD_PRELOAD=./libtenstack_preload.so TENSTACK_SOCK=/tmp/tenstack.sock ./server
+ *
+ * Each socket is backed by a ts_sock, and the descriptor the program gets is the socket's ts_fd,
+ * a real eventfd. poll and select work on it unchanged: readable means a read would return, and
+ * it's always writable. epoll is intercepted so that EPOLLOUT waits for a free send buffer and
+ * EPOLLRDHUP and EPOLLERR are reported, see epoll_ctl. The socket calls and read/write style I/O
+ * on these descriptors are intercepted too, everything else goes to libc untouched.
+ *
+ * The ts_socks themselves are always nonblocking. A blocking call waits by polling the descriptor
+ * without holding the socket's lock, so one thread can sit in recv while another sends.
+ *
+ * When the daemon can't be reached, socket() falls back to a kernel socket. Not covered:
+ * TCP bind to port 0, shutdown of UDP sockets, fork with open sockets, epoll_pwait2, one socket in
+ * several epoll sets with different events, and socket options other than TCP_NODELAY and
+ * SO_REUSEPORT, which are accepted and ignored.
+ */
+
+#define TS_PRELOAD_MAX_FD 65536
+
+/*
+ * What the shim knows about one of its sockets. The table holds a reference, and so does every
+ * call using it; the last one closes the ts_sock, so a thread still in recv or send when another
+ * closes the descriptor finds it closed rather than freed
+ */
+struct ts_file {
+    pthread_mutex_t lock;
+    int refs;            // atomic
+    int closed;          // close() was called, under lock; calls still using it fail with EBADF
+    ts_sock *sk;
+    int type;            // SOCK_STREAM or SOCK_DGRAM
+    int nonblock;
+    int reuseport;
+    int nodelay;         // TCP_NODELAY to apply once connected
+    int bound;           // UDP: bound in the stack
+    uint16_t port;       // local port, host byte order
+    uint32_t peer_addr;  // connected peer, UDP default destination
+    uint16_t peer_port;
+    uint32_t ep_events;  // what epoll_ctl asked for, and the data to report it with
+    epoll_data_t ep_data;
+};
+
+static struct ts_file *ts_files[TS_PRELOAD_MAX_FD];
+static pthread_rwlock_t ts_files_lock = PTHREAD_RWLOCK_INITIALIZER; // taking a reference against close
+
+/* The libc functions we stand in front of */
+#define REAL(name) ({                                                       \
+    static __typeof__(name) *real_##name;                                   \
+    if (!real_##name) real_##name = (__typeof__(name) *)dlsym(RTLD_NEXT, #name); \
+    real_##name; })
+
+/* Our socket behind fd with a reference taken, or NULL if it's not one of ours */
+static struct ts_file *ts_file_get(int fd) {
+    struct ts_file *f;
+
+    // descriptors that aren't ours, most of them, get by without the lock
+    if (fd < 0 || fd >= TS_PRELOAD_MAX_FD || !__atomic_load_n(&ts_files[fd], __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    pthread_rwlock_rdlock(&ts_files_lock);
+    f = ts_files[fd];
+    if (f) {
+        __atomic_fetch_add(&f->refs, 1, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&ts_files_lock);
+    return f;
+}
+
+/* Drop a reference, the last one closes the socket and returns what ts_close did */
+static int ts_file_release(struct ts_file *f) {
+    int ret;
+
+    if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+        return 0;
+    }
+    ret = ts_close(f->sk);
+    pthread_mutex_destroy(&f->lock);
+    free(f);
+    return ret;
+}
+
+/* Done with a reference from ts_file_get, leaving errno alone for the caller's result */
+static void ts_file_put(struct ts_file *f) {
+    int saved = errno;
+
+    ts_file_release(f);
+    errno = saved;
+}
+
+/* Take the socket's lock, unless it was closed meanwhile: then fail with EBADF */
+static int ts_file_lock(struct ts_file *f) {
+    pthread_mutex_lock(&f->lock);
+    if (f->closed) {
+        pthread_mutex_unlock(&f->lock);
+        errno = EBADF;
+        return -1;
+    }
+    return 0;
+}
+
+/* Wrap a fresh ts_sock, returns its descriptor or -1 */
+static int ts_file_add(ts_sock *sk, int type, int nonblock) {
+    struct ts_file *f = calloc(1, sizeof(struct ts_file));
+    int fd = f ? ts_fd(sk) : -1;
+
+    if (fd < 0 || fd >= TS_PRELOAD_MAX_FD) {
+        ts_close(sk);
+        free(f);
+        errno = EMFILE;
+        return -1;
+    }
+
+    pthread_mutex_init(&f->lock, NULL);
+    f->refs = 1; // the table's
+    f->sk = sk;
+    f->type = type;
+    f->nonblock = nonblock;
+    ts_set_nonblock(sk, 1);
+    __atomic_store_n(&ts_files[fd], f, __ATOMIC_RELEASE);
+    return fd;
+}
+
+/*
+ * Block until the socket may have made progress: a read completed, a send buffer came back, or
+ * it was closed. Callers check for the last under the lock first, close makes the fd readable after
+ */
+static void ts_file_wait(int fd) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+    poll(&pfd, 1, -1);
+}
+
+static void ts_fill_addr(struct sockaddr *addr, socklen_t *len, uint32_t ip, uint16_t port) {
+    struct sockaddr_in sin = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = ip };
+
+    if (addr && len) {
+        memcpy(addr, &sin, *len < sizeof(sin) ? *len : sizeof(sin));
+        *len = sizeof(sin);
+    }
+}
+
+/* A UDP socket needs a local port before it can send, pick one like the kernel would */
+static int ts_udp_autobind(struct ts_file *f) {
+    int port;
+
+    if (f->bound) {
+        return 0;
+    }
+    port = ts_bind(f->sk, f->port, f->reuseport);
+    if (port < 0) {
+        return -1;
+    }
+    f->port = port;
+    f->bound = 1;
+    return 0;
+}
+
+static ssize_t ts_file_send(struct ts_file *f, const void *buf, size_t len, const struct sockaddr *to) {
+    const struct sockaddr_in *sin = (const struct sockaddr_in *)to;
+
+    if (f->type == SOCK_STREAM) {
+        return ts_send(f->sk, buf, len);
+    }
+    if (ts_udp_autobind(f) < 0) {
+        return -1;
+    }
+    if (sin) {
+        return ts_sendto(f->sk, buf, len, sin->sin_addr.s_addr, ntohs(sin->sin_port));
+    }
+    if (!f->peer_port) {
+        errno = EDESTADDRREQ;
+        return -1;
+    }
+    return ts_sendto(f->sk, buf, len, f->peer_addr, f->peer_port);
+}
+
+/* Send all of buf unless the socket is nonblocking, waiting for buffers outside the lock */
+static ssize_t ts_file_send_all(int fd, struct ts_file *f, const void *buf, size_t len, int flags, const struct sockaddr *to) {
+    size_t off = 0;
+    ssize_t n;
+
+    while (1) {
+        if (ts_file_lock(f) < 0) {
+            return off > 0 ? (ssize_t)off : -1;
+        }
+        n = ts_file_send(f, (const uint8_t *)buf + off, len - off, to);
+        pthread_mutex_unlock(&f->lock);
+
+        if (n > 0) {
+            off += n;
+        }
+        if (off == len || (n < 0 && errno != EAGAIN)) {
+            break;
+        }
+        if (f->nonblock || (flags & MSG_DONTWAIT)) {
+            if (off == 0) {
+                errno = EAGAIN;
+                return -1;
+            }
+            break;
+        }
+        ts_file_wait(fd);
+    }
+    return off > 0 || len == 0 ? (ssize_t)off : -1;
+}
+
+static ssize_t ts_file_recv(int fd, struct ts_file *f, void *buf, size_t len, int flags, struct sockaddr *from, socklen_t *fromlen) {
+    uint32_t addr;
+    uint16_t port;
+    ssize_t n;
+
+    while (1) {
+        if (ts_file_lock(f) < 0) {
+            return -1;
+        }
+        if (f->type == SOCK_STREAM) {
+            n = ts_recv(f->sk, buf, len);
+            addr = f->peer_addr;
+            port = f->peer_port;
+        } else {
+            n = ts_recvfrom(f->sk, buf, len, &addr, &port);
+        }
+        pthread_mutex_unlock(&f->lock);
+
+        if (n >= 0) {
+            ts_fill_addr(from, fromlen, addr, port);
+            return n;
+        }
+        if (errno != EAGAIN || f->nonblock || (flags & MSG_DONTWAIT)) {
+            return -1;
+        }
+        ts_file_wait(fd);
+    }
+}
+
+int socket(int domain, int type, int protocol) {
+    int kind = type & ~(SOCK_NONBLOCK | SOCK_CLOEXEC);
+    ts_sock *sk;
+
+    if (domain != AF_INET || (kind != SOCK_STREAM && kind != SOCK_DGRAM)) {
+        return REAL(socket)(domain, type, protocol);
+    }
+
+    sk = ts_socket(getenv("TENSTACK_SOCK"));
+    if (!sk) {
+        return REAL(socket)(domain, type, protocol); // no daemon, stay on the kernel stack
+    }
+    return ts_file_add(sk, kind, !!(type & SOCK_NONBLOCK));
+}
+
+int bind(int fd, const struct sockaddr *addr, socklen_t len) {
+    struct ts_file *f = ts_file_get(fd);
+    const struct sockaddr_in *sin = (const struct sockaddr_in *)addr;
+    int ret = 0;
+
+    if (!f) {
+        return REAL(bind)(fd, addr, len);
+    }
+    if (len < sizeof(*sin) || sin->sin_family != AF_INET) {
+        errno = EINVAL;
+        ret = -1;
+    } else if ((ret = ts_file_lock(f)) == 0) {
+        f->port = ntohs(sin->sin_port);
+        if (f->type == SOCK_DGRAM) {
+            ret = ts_udp_autobind(f);
+        }
+        pthread_mutex_unlock(&f->lock);
+    }
+    ts_file_put(f);
+    return ret; // a TCP socket binds when it starts listening
+}
+
+int listen(int fd, int backlog) {
+    struct ts_file *f = ts_file_get(fd);
+    int ret;
+
+    if (!f) {
+        return REAL(listen)(fd, backlog);
+    }
+    if (f->type != SOCK_STREAM || !f->port) {
+        errno = f->type != SOCK_STREAM ? EOPNOTSUPP : EINVAL;
+        ret = -1;
+    } else if ((ret = ts_file_lock(f)) == 0) {
+        ret = ts_listen(f->sk, f->port, backlog > 0 ? backlog : 128, f->reuseport);
+        pthread_mutex_unlock(&f->lock);
+    }
+    ts_file_put(f);
+    return ret;
+}
+
+int accept4(int fd, struct sockaddr *addr, socklen_t *len, int flags) {
+    struct ts_file *f = ts_file_get(fd), *nf;
+    uint32_t peer_addr;
+    uint16_t peer_port;
+    ts_sock *sk;
+    int nfd;
+
+    if (!f) {
+        return REAL(accept4)(fd, addr, len, flags);
+    }
+
+    while (1) {
+        if (ts_file_lock(f) < 0) {
+            ts_file_put(f);
+            return -1;
+        }
+        sk = ts_accept(f->sk, &peer_addr, &peer_port);
+        if (sk && f->nodelay) {
+            ts_setsockopt(sk, 1, 1); // inherited from the listener, like the kernel does
+        }
+        pthread_mutex_unlock(&f->lock);
+
+        if (sk) {
+            break;
+        }
+        if (errno != EAGAIN || f->nonblock) {
+            ts_file_put(f);
+            return -1;
+        }
+        ts_file_wait(fd);
+    }
+
+    nfd = ts_file_add(sk, SOCK_STREAM, !!(flags & SOCK_NONBLOCK));
+    nf = nfd >= 0 ? ts_file_get(nfd) : NULL;
+    if (nf) {
+        nf->nodelay = f->nodelay;
+        nf->port = f->port;
+        nf->peer_addr = peer_addr;
+        nf->peer_port = peer_port;
+        ts_file_put(nf);
+        ts_fill_addr(addr, len, peer_addr, peer_port);
+    }
+    ts_file_put(f);
+    return nfd;
+}
+
+int accept(int fd, struct sockaddr *addr, socklen_t *len) {
+    struct ts_file *f = ts_file_get(fd);
+
+    if (!f) {
+        return REAL(accept)(fd, addr, len);
+    }
+    ts_file_put(f);
+    return accept4(fd, addr, len, 0);
+}
+
+int connect(int fd, const struct sockaddr *addr, socklen_t len) {
+    struct ts_file *f = ts_file_get(fd);
+    const struct sockaddr_in *sin = (const struct sockaddr_in *)addr;
+    int ret = 0;
+
+    if (!f) {
+        return REAL(connect)(fd, addr, len);
+    }
+    if (len < sizeof(*sin) || sin->sin_family != AF_INET) {
+        errno = EAFNOSUPPORT;
+        ret = -1;
+    } else if ((ret = ts_file_lock(f)) == 0) {
+        f->peer_addr = sin->sin_addr.s_addr;
+        f->peer_port = ntohs(sin->sin_port);
+        if (f->type == SOCK_DGRAM) {
+            ret = ts_udp_autobind(f);
+        } else {
+            // completes before returning even on a nonblocking socket, which callers must accept anyway
+            ret = ts_connect(f->sk, f->peer_addr, f->peer_port);
+            if (ret == 0 && f->nodelay) {
+                ts_setsockopt(f->sk, 1, 1);
+            }
+        }
+        pthread_mutex_unlock(&f->lock);
+    }
+    ts_file_put(f);
+    return ret;
+}
+
+ssize_t send(int fd, const void *buf, size_t len, int flags) {
+    struct ts_file *f = ts_file_get(fd);
+    ssize_t n;
+
+    if (!f) {
+        return REAL(send)(fd, buf, len, flags);
+    }
+    n = ts_file_send_all(fd, f, buf, len, flags, NULL);
+    ts_file_put(f);
+    return n;
+}
+
+ssize_t sendto(int fd, const void *buf, size_t len, int flags, const struct sockaddr *to, socklen_t tolen) {
+    struct ts_file *f = ts_file_get(fd);
+    ssize_t n;
+
+    if (!f) {
+        return REAL(sendto)(fd, buf, len, flags, to, tolen);
+    }
+    n = ts_file_send_all(fd, f, buf, len, flags, f->type == SOCK_DGRAM ? to : NULL);
+    ts_file_put(f);
+    return n;
+}
+
+ssize_t write(int fd, const void *buf, size_t len) {
+    struct ts_file *f = ts_file_get(fd);
+    ssize_t n;
+
+    if (!f) {
+        return REAL(write)(fd, buf, len);
+    }
+    n = ts_file_send_all(fd, f, buf, len, 0, NULL);
+    ts_file_put(f);
+    return n;
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {
+    struct ts_file *f = ts_file_get(fd);
+    ssize_t n, total = 0;
+    int i;
+
+    if (!f) {
+        return REAL(writev)(fd, iov, iovcnt);
+    }
+    for (i = 0; i < iovcnt; i++) {
+        n = ts_file_send_all(fd, f, iov[i].iov_base, iov[i].iov_len, 0, NULL);
+        if (n < 0) {
+            total = total ? total : -1;
+            break;
+        }
+        total += n;
+        if ((size_t)n < iov[i].iov_len) {
+            break; // nonblocking and out of buffers
+        }
+    }
+    ts_file_put(f);
+    return total;
+}
+
+ssize_t sendmsg(int fd, const struct msghdr *msg, int flags) {
+    struct ts_file *f = ts_file_get(fd);
+    ssize_t n, total = 0;
+    size_t i;
+
+    if (!f) {
+        return REAL(sendmsg)(fd, msg, flags);
+    }
+    if (f->type == SOCK_DGRAM && msg->msg_iovlen > 1) {
+        errno = EMSGSIZE; // a datagram is sent from one buffer
+        ts_file_put(f);
+        return -1;
+    }
+    for (i = 0; i < msg->msg_iovlen; i++) {
+        n = ts_file_send_all(fd, f, msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len, flags,
+                             f->type == SOCK_DGRAM ? msg->msg_name : NULL);
+        if (n < 0) {
+            total = total ? total : -1;
+            break;
+        }
+        total += n;
+        if ((size_t)n < msg->msg_iov[i].iov_len) {
+            break;
+        }
+    }
+    ts_file_put(f);
+    return total;
+}
+
+ssize_t recv(int fd, void *buf, size_t len, int flags) {
+    struct ts_file *f = ts_file_get(fd);
+    ssize_t n;
+
+    if (!f) {
+        return REAL(recv)(fd, buf, len, flags);
+    }
+    n = ts_file_recv(fd, f, buf, len, flags, NULL, NULL);
+    ts_file_put(f);
+    return n;
+}
+
+ssize_t recvfrom(int fd, void *buf, size_t len, int flags, struct sockaddr *from, socklen_t *fromlen) {
+    struct ts_file *f = ts_file_get(fd);
+    ssize_t n;
+
+    if (!f) {
+        return REAL(recvfrom)(fd, buf, len, flags, from, fromlen);
+    }
+    n = ts_file_recv(fd, f, buf, len, flags, from, fromlen);
+    ts_file_put(f);
+    return n;
+}
+
+ssize_t read(int fd, void *buf, size_t len) {
+    struct ts_file *f = ts_file_get(fd);
+    ssize_t n;
+
+    if (!f) {
+        return REAL(read)(fd, buf, len);
+    }
+    n = ts_file_recv(fd, f, buf, len, 0, NULL, NULL);
+    ts_file_put(f);
+    return n;
+}
+
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt) {
+    struct ts_file *f = ts_file_get(fd);
+    ssize_t n = 0;
+    int i;
+
+    if (!f) {
+        return REAL(readv)(fd, iov, iovcnt);
+    }
+    // fill the first buffer with room, a short read is always allowed
+    for (i = 0; i < iovcnt && iov[i].iov_len == 0; i++)
+        ;
+    if (i < iovcnt) {
+        n = ts_file_recv(fd, f, iov[i].iov_base, iov[i].iov_len, 0, NULL, NULL);
+    }
+    ts_file_put(f);
+    return n;
+}
+
+ssize_t recvmsg(int fd, struct msghdr *msg, int flags) {
+    struct ts_file *f = ts_file_get(fd);
+    ssize_t n = 0;
+    size_t i;
+
+    if (!f) {
+        return REAL(recvmsg)(fd, msg, flags);
+    }
+    for (i = 0; i < msg->msg_iovlen && msg->msg_iov[i].iov_len == 0; i++)
+        ;
+    msg->msg_controllen = 0;
+    msg->msg_flags = 0;
+    if (i < msg->msg_iovlen) {
+        n = ts_file_recv(fd, f, msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len, flags,
+                         msg->msg_name, msg->msg_name ? &msg->msg_namelen : NULL);
+    }
+    ts_file_put(f);
+    return n;
+}
+
+int close(int fd) {
+    struct ts_file *f = NULL;
+
+    // out of the table first, which hands its reference to us; ts_close closes the descriptor
+    // through here again
+    if (fd >= 0 && fd < TS_PRELOAD_MAX_FD && __atomic_load_n(&ts_files[fd], __ATOMIC_ACQUIRE)) {
+        pthread_rwlock_wrlock(&ts_files_lock);
+        f = ts_files[fd];
+        __atomic_store_n(&ts_files[fd], NULL, __ATOMIC_RELEASE);
+        pthread_rwlock_unlock(&ts_files_lock);
+    }
+    if (!f) {
+        return REAL(close)(fd);
+    }
+
+    // wake anyone blocked on the socket, the descriptor stays ours until their references are gone
+    pthread_mutex_lock(&f->lock);
+    f->closed = 1;
+    pthread_mutex_unlock(&f->lock);
+    eventfd_write(fd, 1);
+    return ts_file_release(f);
+}
+
+int shutdown(int fd, int how) {
+    struct ts_file *f = ts_file_get(fd);
+    int ret;
+
+    if (!f) {
+        return REAL(shutdown)(fd, how);
+    }
+    if (f->type != SOCK_STREAM) {
+        errno = ENOTCONN; // no connected UDP in the stack, nothing to shut down
+        ret = -1;
+    } else if ((ret = ts_file_lock(f)) == 0) {
+        ret = ts_shutdown(f->sk, how); // also wakes a reader blocked on the descriptor
+        pthread_mutex_unlock(&f->lock);
+    }
+    ts_file_put(f);
+    return ret;
+}
+
+int setsockopt(int fd, int level, int opt, const void *val, socklen_t len) {
+    struct ts_file *f = ts_file_get(fd);
+    int v = len >= sizeof(int) ? *(const int *)val : 0;
+    int ret = 0;
+
+    if (!f) {
+        return REAL(setsockopt)(fd, level, opt, val, len);
+    }
+
+    if ((ret = ts_file_lock(f)) == 0) {
+        if (level == SOL_SOCKET && opt == SO_REUSEPORT) {
+            f->reuseport = !!v;
+        } else if (level == IPPROTO_TCP && opt == TCP_NODELAY) {
+            f->nodelay = !!v;
+            if (f->peer_port) {
+                ret = ts_setsockopt(f->sk, 1, f->nodelay);
+            }
+        }
+        pthread_mutex_unlock(&f->lock);
+    }
+    ts_file_put(f);
+    return ret;
+}
+
+int getsockopt(int fd, int level, int opt, void *val, socklen_t *len) {
+    struct ts_file *f = ts_file_get(fd);
+    int v = 0;
+
+    if (!f) {
+        return REAL(getsockopt)(fd, level, opt, val, len);
+    }
+
+    // SO_ERROR after a "nonblocking" connect is always 0, it already completed
+    if (level == SOL_SOCKET && opt == SO_TYPE) {
+        v = f->type;
+    } else if (level == SOL_SOCKET && opt == SO_REUSEPORT) {
+        v = f->reuseport;
+    } else if (level == IPPROTO_TCP && opt == TCP_NODELAY) {
+        v = f->nodelay;
+    }
+    if (*len >= sizeof(int)) {
+        *(int *)val = v;
+        *len = sizeof(int);
+    }
+    ts_file_put(f);
+    return 0;
+}
+
+int getsockname(int fd, struct sockaddr *addr, socklen_t *len) {
+    struct ts_file *f = ts_file_get(fd);
+
+    if (!f) {
+        return REAL(getsockname)(fd, addr, len);
+    }
+    ts_fill_addr(addr, len, INADDR_ANY, f->port);
+    ts_file_put(f);
+    return 0;
+}
+
+int getpeername(int fd, struct sockaddr *addr, socklen_t *len) {
+    struct ts_file *f = ts_file_get(fd);
+
+    if (!f) {
+        return REAL(getpeername)(fd, addr, len);
+    }
+    if (!f->peer_port) {
+        ts_file_put(f);
+        errno = ENOTCONN;
+        return -1;
+    }
+    ts_fill_addr(addr, len, f->peer_addr, f->peer_port);
+    ts_file_put(f);
+    return 0;
+}
+
+/* The eventfd itself must stay nonblocking, so O_NONBLOCK only changes how our reads behave */
+static int ts_fcntl(struct ts_file *f, int fd, int cmd, void *arg, int (*real)(int, int, ...)) {
+    int flags;
+
+    switch (cmd) {
+        case F_GETFL:
+            flags = real(fd, F_GETFL);
+            if (flags < 0) {
+                return flags;
+            }
+            return (flags & ~O_NONBLOCK) | (f->nonblock ? O_NONBLOCK : 0);
+
+        case F_SETFL:
+            f->nonblock = !!((long)arg & O_NONBLOCK);
+            return 0;
+
+        default:
+            return real(fd, cmd, arg);
+    }
+}
+
+int fcntl(int fd, int cmd, ...) {
+    struct ts_file *f = ts_file_get(fd);
+    va_list ap;
+    void *arg;
+    int ret;
+
+    va_start(ap, cmd);
+    arg = va_arg(ap, void *);
+    va_end(ap);
+
+    if (!f) {
+        return REAL(fcntl)(fd, cmd, arg);
+    }
+    ret = ts_fcntl(f, fd, cmd, arg, REAL(fcntl));
+    ts_file_put(f);
+    return ret;
+}
+
+// 64-bit file offset builds call this one
+int fcntl64(int fd, int cmd, ...) {
+    struct ts_file *f = ts_file_get(fd);
+    va_list ap;
+    void *arg;
+    int ret;
+
+    va_start(ap, cmd);
+    arg = va_arg(ap, void *);
+    va_end(ap);
+
+    if (!f) {
+        return REAL(fcntl64)(fd, cmd, arg);
+    }
+    ret = ts_fcntl(f, fd, cmd, arg, REAL(fcntl64));
+    ts_file_put(f);
+    return ret;
+}
+
+int ioctl(int fd, unsigned long req, ...) {
+    struct ts_file *f = ts_file_get(fd);
+    va_list ap;
+    void *arg;
+
+    va_start(ap, req);
+    arg = va_arg(ap, void *);
+    va_end(ap);
+
+    if (!f) {
+        return REAL(ioctl)(fd, req, arg);
+    }
+    if (req != FIONBIO) {
+        ts_file_put(f);
+        return REAL(ioctl)(fd, req, arg);
+    }
+    f->nonblock = !!*(int *)arg;
+    ts_file_put(f);
+    return 0;
+}
+
+/*
+ * Our sockets go into the epoll set registered for EPOLLIN only, whatever was asked for, and tagged
+ * with their descriptor. With EPOLLOUT asked for, the socket keeps the eventfd readable while a send
+ * would go through. epoll_wait then swaps in what ts_poll says the socket is ready for, with the
+ * program's data, and drops wakeups that turn out to be for nothing
+ */
+#define TS_EPOLL_TAG 0x7473000000000000ULL // "ts" in the top bits: neither pointers nor small numbers look like it
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *ev) {
+    struct ts_file *f = ts_file_get(fd);
+    struct epoll_event tev;
+    int ret;
+
+    if (!f) {
+        return REAL(epoll_ctl)(epfd, op, fd, ev);
+    }
+    if (op == EPOLL_CTL_DEL) {
+        ret = REAL(epoll_ctl)(epfd, op, fd, ev);
+    } else if (!ev) {
+        errno = EFAULT;
+        ret = -1;
+    } else if ((ret = ts_file_lock(f)) == 0) {
+        tev.events = EPOLLIN | (ev->events & (EPOLLET | EPOLLONESHOT | EPOLLEXCLUSIVE | EPOLLWAKEUP));
+        tev.data.u64 = TS_EPOLL_TAG | (uint32_t)fd;
+        ret = REAL(epoll_ctl)(epfd, op, fd, &tev);
+        if (ret == 0) {
+            f->ep_events = ev->events;
+            f->ep_data = ev->data;
+            ts_set_poll_out(f->sk, !!(ev->events & EPOLLOUT));
+        }
+        pthread_mutex_unlock(&f->lock);
+    }
+    ts_file_put(f);
+    return ret;
+}
+
+/* What one of our sockets is ready for in epoll's terms, limited to what was asked for */
+static uint32_t ts_epoll_events(struct ts_file *f) {
+    int mask = ts_poll(f->sk);
+    uint32_t events = 0;
+
+    if (mask & TS_POLLIN) events |= EPOLLIN | EPOLLRDNORM;
+    if (mask & TS_POLLOUT) events |= EPOLLOUT | EPOLLWRNORM;
+    if (mask & TS_POLLRDHUP) events |= EPOLLRDHUP;
+    if (mask & TS_POLLERR) events |= EPOLLERR;
+    return events & (f->ep_events | EPOLLERR | EPOLLHUP);
+}
+
+/* Rewrite the events epoll returned for our sockets, returns how many are left */
+static int ts_epoll_fixup(int epfd, struct epoll_event *events, int n) {
+    struct epoll_event tev;
+    struct ts_file *f;
+    uint32_t ready;
+    int i, fd, out = 0;
+
+    for (i = 0; i < n; i++) {
+        if ((events[i].data.u64 & ~0xffffffffULL) != TS_EPOLL_TAG) {
+            events[out++] = events[i];
+            continue;
+        }
+        fd = (int)(uint32_t)events[i].data.u64;
+        f = ts_file_get(fd);
+        if (!f) {
+            continue; // closed since
+        }
+        if (ts_file_lock(f) == 0) {
+            ready = ts_epoll_events(f);
+            if (ready) {
+                events[out].events = ready;
+                events[out].data = f->ep_data;
+                out++;
+            } else if (f->ep_events & EPOLLONESHOT) {
+                // the kernel disarmed it for a wakeup we're not passing on, arm it again
+                tev.events = EPOLLIN | (f->ep_events & (EPOLLET | EPOLLONESHOT | EPOLLWAKEUP));
+                tev.data.u64 = TS_EPOLL_TAG | (uint32_t)fd;
+                REAL(epoll_ctl)(epfd, EPOLL_CTL_MOD, fd, &tev);
+            }
+            pthread_mutex_unlock(&f->lock);
+        }
+        ts_file_put(f);
+    }
+    return out;
+}
+
+static uint64_t ts_clock_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int epoll_pwait(int epfd, struct epoll_event *events, int maxevents, int timeout, const sigset_t *sigmask) {
+    uint64_t deadline = timeout > 0 ? ts_clock_ms() + timeout : 0;
+    uint64_t now;
+    int n;
+
+    while (1) {
+        n = REAL(epoll_pwait)(epfd, events, maxevents, timeout, sigmask);
+        if (n <= 0) {
+            return n;
+        }
+        n = ts_epoll_fixup(epfd, events, n);
+        if (n > 0 || timeout == 0) {
+            return n;
+        }
+
+        // only wakeups for nothing, don't return before the timeout is up
+        if (timeout > 0) {
+            now = ts_clock_ms();
+            if (now >= deadline) {
+                return 0;
+            }
+            timeout = (int)(deadline - now);
+        }
+    }
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout) {
+    return epoll_pwait(epfd, events, maxevents, timeout, NULL);
+}
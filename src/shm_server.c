@@ -0,0 +1,714 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+
+#include "shm_server.h"
+#include "tcp.h"
+#include "udp.h"
+#include "list.h"
+#include "utils.h"
+
+#define shm_dbg(fmt, ...) \
+    do { if (verbose) printf("SHM: " fmt "\n", ##__VA_ARGS__); } while (0)
+
+/*
+ * A connection accepted on a listener channel, waiting for the channel that adopts it. The token
+ * is random and only the process that accepted may adopt, so other clients can't take it over
+ */
+struct shm_parked {
+    list_head list;
+    uint32_t token;
+    struct ucred owner;   // the listener channel's client
+    struct tcp_sock *sk;
+};
+
+/* Daemon side of a channel */
+struct shm_chan {
+    list_head hash_list;   // linkage in the id table
+    uint32_t id;
+    int ctl;               // Unix connection to the client, hangs up when the client goes away
+    int sq_efd;            // client -> daemon wakeups
+    int cq_efd;            // daemon -> client wakeups
+    struct ts_shm *shm;
+    struct tcp_sock *tsk;  // set once the channel is a TCP socket, we hold a reference
+    struct udp_sock *usk;  // set once the channel is a UDP socket
+    list_head parked;      // listener: accepted connections nobody adopted yet, under shm_chan_lock
+    struct ucred peer;     // the client process, as the kernel saw it connect
+
+    pthread_mutex_t cq_lock; // the request thread and the reader both complete
+
+    /*
+     * Reads and TCP sends can wait on the network for as long as the peer likes, so each gets a
+     * thread of its own and the request thread never blocks on them: a send stuck on a full
+     * window must not keep the read that would drain the other direction from being started.
+     */
+    pthread_mutex_t rlock;   // protects everything below
+    pthread_cond_t rwait;
+    pthread_cond_t wwait;
+    pthread_t rthread;
+    pthread_t wthread;
+    int rstarted;
+    int wstarted;
+    int rbusy;             // rsqe holds a read that hasn't completed yet
+    atomic_int closing;    // the socket is going away, reads give up
+    struct ts_sqe rsqe;
+    struct ts_sqe wq[TS_RING_SIZE]; // sends in order, the client never has more outstanding
+    uint32_t whead, wtail;
+    int wbusy;             // the writer is in the middle of a send
+};
+
+static list_head shm_chan_hash[SHM_CHAN_HASH];
+static pthread_mutex_t shm_chan_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t shm_next_id = 1;
+
+/* Map errno to a completion result. Not every layer sets errno, so don't trust a stale one */
+static int shm_err(void) {
+    return errno ? -errno : -EIO;
+}
+
+static void shm_chan_free(struct shm_chan *ch) {
+    if (ch->shm) {
+        munmap(ch->shm, sizeof(struct ts_shm));
+    }
+    if (ch->sq_efd >= 0) close(ch->sq_efd);
+    if (ch->cq_efd >= 0) close(ch->cq_efd);
+    if (ch->ctl >= 0) close(ch->ctl);
+    pthread_mutex_destroy(&ch->cq_lock);
+    pthread_mutex_destroy(&ch->rlock);
+    pthread_cond_destroy(&ch->rwait);
+    pthread_cond_destroy(&ch->wwait);
+    free(ch);
+}
+
+/* Set up the shared region and eventfds of a new channel and hand them to the client */
+static struct shm_chan *shm_chan_create(int ctl) {
+    struct shm_chan *ch = calloc(1, sizeof(struct shm_chan));
+    char token = 0;
+    struct iovec iov = { .iov_base = &token, .iov_len = 1 };
+    union {
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } ctrl;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = ctrl.buf,
+        .msg_controllen = sizeof(ctrl.buf),
+    };
+    struct cmsghdr *cmsg;
+    socklen_t credlen = sizeof(ch->peer);
+    int fds[3], memfd;
+
+    if (!ch) {
+        perror("Failed to allocate channel");
+        close(ctl);
+        return NULL;
+    }
+    ch->ctl = ctl;
+    ch->sq_efd = ch->cq_efd = -1;
+    list_init(&ch->parked);
+    pthread_mutex_init(&ch->cq_lock, NULL);
+    pthread_mutex_init(&ch->rlock, NULL);
+    pthread_cond_init(&ch->rwait, NULL);
+    pthread_cond_init(&ch->wwait, NULL);
+
+    if (getsockopt(ctl, SOL_SOCKET, SO_PEERCRED, &ch->peer, &credlen) < 0) {
+        perror("Failed to get client credentials");
+        shm_chan_free(ch);
+        return NULL;
+    }
+
+    memfd = memfd_create("tenstack", MFD_CLOEXEC);
+    if (memfd < 0) {
+        perror("Failed to create channel memory");
+        shm_chan_free(ch);
+        return NULL;
+    }
+    if (ftruncate(memfd, sizeof(struct ts_shm)) < 0 ||
+        (ch->shm = mmap(NULL, sizeof(struct ts_shm), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0)) == MAP_FAILED) {
+        perror("Failed to map channel memory");
+        ch->shm = NULL;
+        close(memfd);
+        shm_chan_free(ch);
+        return NULL;
+    }
+
+    ch->sq_efd = eventfd(0, EFD_CLOEXEC);
+    ch->cq_efd = eventfd(0, EFD_CLOEXEC);
+    if (ch->sq_efd < 0 || ch->cq_efd < 0) {
+        perror("Failed to create channel eventfd");
+        close(memfd);
+        shm_chan_free(ch);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&shm_chan_lock);
+    ch->id = shm_next_id++;
+    list_add_tail(&shm_chan_hash[ch->id & (SHM_CHAN_HASH - 1)], &ch->hash_list);
+    pthread_mutex_unlock(&shm_chan_lock);
+
+    // the memfd starts out zeroed, so the rings are empty and nobody sleeps
+    ch->shm->magic = TS_SHM_MAGIC;
+    ch->shm->version = TS_SHM_VERSION;
+    ch->shm->id = ch->id;
+
+    fds[0] = memfd;
+    fds[1] = ch->sq_efd;
+    fds[2] = ch->cq_efd;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(ctl, &msg, MSG_NOSIGNAL) < 0) {
+        perror("Failed to pass channel to client");
+        close(memfd);
+        pthread_mutex_lock(&shm_chan_lock);
+        list_del(&ch->hash_list);
+        pthread_mutex_unlock(&shm_chan_lock);
+        shm_chan_free(ch);
+        return NULL;
+    }
+    close(memfd); // the mapping keeps the memory alive
+
+    shm_dbg("Channel %u open", ch->id);
+    return ch;
+}
+
+static void shm_chan_destroy(struct shm_chan *ch) {
+    list_head *elem, *tmp;
+
+    // out of the table first, so nobody adopts from it anymore
+    pthread_mutex_lock(&shm_chan_lock);
+    list_del(&ch->hash_list);
+    pthread_mutex_unlock(&shm_chan_lock);
+
+    // closing wakes a reader waiting in accept. Closing the socket queues our FIN, which a writer
+    // blocked in send gives up on, and shutting its read side ends a recv right away instead of
+    // whenever the peer gets round to sending something. A UDP recvfrom ends the same way
+    pthread_mutex_lock(&ch->rlock);
+    atomic_store(&ch->closing, 1);
+    pthread_cond_signal(&ch->rwait);
+    pthread_cond_broadcast(&ch->wwait);
+    pthread_mutex_unlock(&ch->rlock);
+    tcp_close(ch->tsk);
+    tcp_shutdown(ch->tsk, SHUT_RD); // the channel still holds a reference
+    udp_shutdown(ch->usk);
+    if (ch->rstarted) {
+        pthread_join(ch->rthread, NULL);
+    }
+    if (ch->wstarted) {
+        pthread_join(ch->wthread, NULL);
+    }
+
+    if (ch->tsk) {
+        tcp_sock_put(ch->tsk);
+    }
+    udp_close(ch->usk);
+    list_for_each_safe(elem, tmp, &ch->parked) {
+        struct shm_parked *p = list_entry(elem, struct shm_parked, list);
+
+        tcp_close(p->sk);
+        free(p);
+    }
+
+    shm_dbg("Channel %u closed", ch->id);
+    shm_chan_free(ch);
+}
+
+/* Make this channel own a TCP socket, keeping a reference until the channel goes */
+static void shm_chan_set_tcp(struct shm_chan *ch, struct tcp_sock *sk) {
+    tcp_sock_hold(sk);
+    ch->tsk = sk;
+}
+
+/* Take the connection a listener channel parked under token, if ch belongs to the client that accepted it */
+static struct tcp_sock *shm_adopt(struct shm_chan *ch, uint32_t id, uint32_t token) {
+    struct tcp_sock *sk = NULL;
+    list_head *elem, *pelem;
+
+    pthread_mutex_lock(&shm_chan_lock);
+    list_for_each(elem, &shm_chan_hash[id & (SHM_CHAN_HASH - 1)]) {
+        struct shm_chan *lch = list_entry(elem, struct shm_chan, hash_list);
+
+        if (lch->id != id) {
+            continue;
+        }
+        list_for_each(pelem, &lch->parked) {
+            struct shm_parked *p = list_entry(pelem, struct shm_parked, list);
+
+            if (p->token == token) {
+                // anyone else guessing the token doesn't get it, nor take it from its owner
+                if (p->owner.pid != ch->peer.pid || p->owner.uid != ch->peer.uid) {
+                    shm_dbg("Channel %u may not adopt from channel %u", ch->id, id);
+                    break;
+                }
+                list_del(&p->list);
+                sk = p->sk;
+                free(p);
+                break;
+            }
+        }
+        break;
+    }
+    pthread_mutex_unlock(&shm_chan_lock);
+    return sk;
+}
+
+/* Wait for the next request. Returns 0 once there is one, -1 if the client went away */
+static int shm_wait_sq(struct shm_chan *ch) {
+    struct ts_sq *sq = &ch->shm->sq;
+    uint32_t tail = atomic_load_explicit(&sq->tail, memory_order_relaxed);
+    uint64_t deadline = clock_ns() + TS_SPIN_NS;
+    struct pollfd pfds[2] = {
+        { .fd = ch->sq_efd, .events = POLLIN },
+        { .fd = ch->ctl, .events = POLLIN },
+    };
+    uint64_t count;
+
+    while (1) {
+        if (atomic_load_explicit(&sq->head, memory_order_acquire) != tail) {
+            return 0;
+        }
+        if (clock_ns() < deadline) {
+            continue;
+        }
+
+        // announce the nap, then look once more: a request posted in between sees the flag
+        atomic_store(&sq->sleeping, 1);
+        if (atomic_load(&sq->head) != tail) {
+            atomic_store(&sq->sleeping, 0);
+            return 0;
+        }
+
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Channel poll failed");
+            return -1;
+        }
+        if (pfds[1].revents) {
+            return -1;
+        }
+        if (read(ch->sq_efd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+            perror("Channel eventfd read failed");
+            return -1;
+        }
+        atomic_store(&sq->sleeping, 0);
+        deadline = clock_ns() + TS_SPIN_NS;
+    }
+}
+
+/* Post a completion, the client never has more requests outstanding than the ring holds */
+static void shm_complete(struct shm_chan *ch, struct ts_cqe *cqe) {
+    struct ts_cq *cq = &ch->shm->cq;
+    uint32_t head;
+    uint64_t one = 1;
+
+    // two threads complete, but the client still sees a single producer
+    pthread_mutex_lock(&ch->cq_lock);
+    head = atomic_load_explicit(&cq->head, memory_order_relaxed);
+    cq->entries[head & (TS_RING_SIZE - 1)] = *cqe;
+    atomic_store(&cq->head, head + 1);
+    pthread_mutex_unlock(&ch->cq_lock);
+
+    // only a sleeping client needs the syscall, and only the first completion after it dozed off
+    if (atomic_exchange(&cq->sleeping, 0)) {
+        if (write(ch->cq_efd, &one, sizeof(one)) < 0) {
+            perror("Channel eventfd write failed");
+        }
+    }
+}
+
+static int shm_do_recvfrom(struct shm_chan *ch, uint8_t *buf, uint32_t len, struct ts_cqe *cqe) {
+    struct udp_dgram dgram;
+    int n;
+
+    // channel teardown shuts the socket down, which ends the wait
+    while (!udp_recv_zc(ch->usk, &dgram)) {
+        if (udp_wait(ch->usk) < 0) {
+            return -EPIPE;
+        }
+    }
+
+    n = dgram.len < (int)len ? dgram.len : (int)len; // the rest of a long datagram is dropped
+    memcpy(buf, dgram.data, n);
+    cqe->addr = dgram.saddr;
+    cqe->port = dgram.sport;
+    udp_release(&dgram);
+    return n;
+}
+
+static int shm_do_accept(struct shm_chan *ch, struct ts_cqe *cqe) {
+    struct shm_parked *p = malloc(sizeof(struct shm_parked));
+    struct tcp_sock *sk;
+
+    if (!p) {
+        return -ENOMEM;
+    }
+    if (getrandom(&p->token, sizeof(p->token), 0) != sizeof(p->token)) {
+        free(p);
+        return shm_err();
+    }
+    p->token &= 0x7fffffff; // the result has to stay positive
+    p->owner = ch->peer;
+
+    sk = tcp_accept(ch->tsk);
+    if (!sk) {
+        free(p);
+        return shm_err();
+    }
+
+    // the client picks it up on a channel of its own
+    p->sk = sk;
+    cqe->addr = sk->daddr;
+    cqe->port = sk->dport;
+    pthread_mutex_lock(&shm_chan_lock);
+    list_add_tail(&ch->parked, &p->list);
+    pthread_mutex_unlock(&shm_chan_lock);
+    return p->token;
+}
+
+/* Execute one read on the reader thread, returns its result */
+static int shm_execute_read(struct shm_chan *ch, const struct ts_sqe *sqe, struct ts_cqe *cqe) {
+    uint8_t *buf = ch->shm->bufs[sqe->buf];
+    int ret;
+
+    errno = 0;
+    switch (sqe->op) {
+        case TS_OP_ACCEPT:
+            return shm_do_accept(ch, cqe);
+
+        case TS_OP_RECV:
+            ret = tcp_recv_data(ch->tsk, buf, sqe->len);
+            return ret < 0 ? shm_err() : ret;
+
+        case TS_OP_RECVFROM:
+            return shm_do_recvfrom(ch, buf, sqe->len, cqe);
+
+        default:
+            return -EOPNOTSUPP;
+    }
+}
+
+static void *shm_reader_thread(void *arg) {
+    struct shm_chan *ch = arg;
+    struct ts_sqe sqe;
+    struct ts_cqe cqe;
+
+    while (1) {
+        pthread_mutex_lock(&ch->rlock);
+        while (!ch->rbusy && !atomic_load(&ch->closing)) {
+            pthread_cond_wait(&ch->rwait, &ch->rlock);
+        }
+        if (!ch->rbusy) {
+            pthread_mutex_unlock(&ch->rlock);
+            break;
+        }
+        sqe = ch->rsqe;
+        pthread_mutex_unlock(&ch->rlock);
+
+        memset(&cqe, 0, sizeof(cqe));
+        cqe.user_data = sqe.user_data;
+        cqe.buf = sqe.buf;
+        cqe.result = shm_execute_read(ch, &sqe, &cqe);
+
+        // free the slot before the client can see the completion and post the next read
+        pthread_mutex_lock(&ch->rlock);
+        ch->rbusy = 0;
+        pthread_mutex_unlock(&ch->rlock);
+        shm_complete(ch, &cqe);
+    }
+    return NULL;
+}
+
+/* Hand a read to the reader thread, 0 if it took it, else the request's result */
+static int shm_start_read(struct shm_chan *ch, const struct ts_sqe *sqe) {
+    int ret = 0;
+
+    pthread_mutex_lock(&ch->rlock);
+    if (ch->rbusy) {
+        ret = -EBUSY; // one read at a time
+    } else if (!ch->rstarted && pthread_create(&ch->rthread, NULL, shm_reader_thread, ch) != 0) {
+        perror("Failed to create reader thread");
+        ret = -EAGAIN;
+    } else {
+        ch->rstarted = 1;
+        ch->rsqe = *sqe;
+        ch->rbusy = 1;
+        pthread_cond_signal(&ch->rwait);
+    }
+    pthread_mutex_unlock(&ch->rlock);
+    return ret;
+}
+
+static void *shm_writer_thread(void *arg) {
+    struct shm_chan *ch = arg;
+    struct ts_sqe sqe;
+    struct ts_cqe cqe;
+    int ret;
+
+    while (1) {
+        pthread_mutex_lock(&ch->rlock);
+        while (ch->whead == ch->wtail && !atomic_load(&ch->closing)) {
+            pthread_cond_wait(&ch->wwait, &ch->rlock);
+        }
+        if (atomic_load(&ch->closing)) {
+            pthread_mutex_unlock(&ch->rlock);
+            break; // the client is gone, nobody waits for the rest
+        }
+        sqe = ch->wq[ch->wtail++ & (TS_RING_SIZE - 1)];
+        ch->wbusy = 1;
+        pthread_mutex_unlock(&ch->rlock);
+
+        memset(&cqe, 0, sizeof(cqe));
+        cqe.user_data = sqe.user_data;
+        cqe.buf = sqe.buf;
+        errno = 0;
+        ret = tcp_send(ch->tsk, ch->shm->bufs[sqe.buf], sqe.len);
+        cqe.result = ret < 0 ? shm_err() : ret;
+        shm_complete(ch, &cqe);
+
+        pthread_mutex_lock(&ch->rlock);
+        ch->wbusy = 0;
+        pthread_cond_broadcast(&ch->wwait); // shm_drain_sends may be waiting
+        pthread_mutex_unlock(&ch->rlock);
+    }
+    return NULL;
+}
+
+/* Queue a TCP send for the writer thread, 0 if it took it */
+static int shm_queue_send(struct shm_chan *ch, const struct ts_sqe *sqe) {
+    int ret = 0;
+
+    pthread_mutex_lock(&ch->rlock);
+    if (ch->whead - ch->wtail == TS_RING_SIZE) {
+        ret = -ENOBUFS; // more than the client may have outstanding
+    } else if (!ch->wstarted && pthread_create(&ch->wthread, NULL, shm_writer_thread, ch) != 0) {
+        perror("Failed to create writer thread");
+        ret = -EAGAIN;
+    } else {
+        ch->wstarted = 1;
+        ch->wq[ch->whead++ & (TS_RING_SIZE - 1)] = *sqe;
+        pthread_cond_broadcast(&ch->wwait);
+    }
+    pthread_mutex_unlock(&ch->rlock);
+    return ret;
+}
+
+/* Wait until every queued send went into the stack, a close must come after them */
+static void shm_drain_sends(struct shm_chan *ch) {
+    pthread_mutex_lock(&ch->rlock);
+    while ((ch->whead != ch->wtail || ch->wbusy) && !atomic_load(&ch->closing)) {
+        pthread_cond_wait(&ch->wwait, &ch->rlock);
+    }
+    pthread_mutex_unlock(&ch->rlock);
+}
+
+/* Execute one request, returns its result. Sets *queued for a read handed to the reader, which completes it */
+static int shm_execute(struct shm_chan *ch, const struct ts_sqe *sqe, struct ts_cqe *cqe, int *queued) {
+    struct tcp_sock *sk;
+    uint8_t *buf = NULL;
+    int ret;
+
+    if (sqe->op == TS_OP_SEND || sqe->op == TS_OP_RECV || sqe->op == TS_OP_SENDTO || sqe->op == TS_OP_RECVFROM) {
+        // the client owns the memory, so check everything it hands us
+        if (sqe->buf >= TS_NBUFS || sqe->len > TS_BUF_SIZE) {
+            return -EINVAL;
+        }
+        buf = ch->shm->bufs[sqe->buf];
+    }
+
+    // the socket kind is settled by the first LISTEN, CONNECT, ADOPT or BIND
+    if (sqe->op == TS_OP_LISTEN || sqe->op == TS_OP_ADOPT || sqe->op == TS_OP_CONNECT || sqe->op == TS_OP_BIND) {
+        if (ch->tsk || ch->usk) {
+            return -EISCONN;
+        }
+    } else if (sqe->op == TS_OP_SENDTO || sqe->op == TS_OP_RECVFROM) {
+        if (!ch->usk) {
+            return -EDESTADDRREQ;
+        }
+    } else if (sqe->op != TS_OP_CLOSE && !ch->tsk) {
+        return -ENOTCONN;
+    }
+
+    errno = 0;
+    switch (sqe->op) {
+        case TS_OP_LISTEN:
+            sk = sqe->arg2 ? tcp_listen_reuseport(0, sqe->arg0, sqe->arg1) : tcp_listen(0, sqe->arg0, sqe->arg1);
+            if (!sk) {
+                return shm_err();
+            }
+            shm_chan_set_tcp(ch, sk);
+            cqe->port = sqe->arg0;
+            return 0;
+
+        case TS_OP_ADOPT:
+            sk = shm_adopt(ch, sqe->arg0, sqe->arg1);
+            if (!sk) {
+                return -ENOENT;
+            }
+            shm_chan_set_tcp(ch, sk);
+            return 0;
+
+        case TS_OP_CONNECT:
+            sk = tcp_connect(sqe->addr, sqe->arg0);
+            if (!sk) {
+                return shm_err();
+            }
+            shm_chan_set_tcp(ch, sk);
+            return 0;
+
+        case TS_OP_ACCEPT:
+            if (ch->tsk->state != TCP_LISTEN) {
+                return -EINVAL;
+            }
+            // fall through
+        case TS_OP_RECV:
+        case TS_OP_RECVFROM:
+            ret = shm_start_read(ch, sqe);
+            *queued = ret == 0;
+            return ret;
+
+        case TS_OP_SEND:
+            ret = shm_queue_send(ch, sqe);
+            *queued = ret == 0;
+            return ret;
+
+        case TS_OP_BIND:
+            ch->usk = sqe->arg2 ? udp_bind_reuseport(0, sqe->arg0) : udp_bind(0, sqe->arg0);
+            if (!ch->usk) {
+                return shm_err();
+            }
+            cqe->port = ch->usk->port;
+            return 0;
+
+        case TS_OP_SENDTO:
+            ret = udp_sendto(ch->usk, sqe->addr, sqe->arg0, buf, sqe->len);
+            return ret < 0 ? shm_err() : ret;
+
+        case TS_OP_SETOPT:
+            ret = tcp_setsockopt(ch->tsk, sqe->arg0, sqe->arg1);
+            return ret < 0 ? shm_err() : 0;
+
+        case TS_OP_SHUTDOWN:
+            if (sqe->arg0 != SHUT_RD) {
+                shm_drain_sends(ch);
+            }
+            ret = tcp_shutdown(ch->tsk, sqe->arg0);
+            return ret < 0 ? shm_err() : 0;
+
+        case TS_OP_CLOSE:
+            shm_drain_sends(ch);
+            return 0; // the channel thread tears everything down after completing it
+
+        default:
+            return -EOPNOTSUPP;
+    }
+}
+
+static void *shm_chan_thread(void *arg) {
+    struct shm_chan *ch = arg;
+    struct ts_sq *sq = &ch->shm->sq;
+    struct ts_sqe sqe;
+    struct ts_cqe cqe;
+    uint32_t tail;
+    int closing = 0, queued;
+
+    while (!closing && shm_wait_sq(ch) == 0) {
+        // copy the entry out, the client may scribble over shared memory at any time
+        tail = atomic_load_explicit(&sq->tail, memory_order_relaxed);
+        sqe = sq->entries[tail & (TS_RING_SIZE - 1)];
+        atomic_store_explicit(&sq->tail, tail + 1, memory_order_release);
+
+        memset(&cqe, 0, sizeof(cqe));
+        cqe.user_data = sqe.user_data;
+        cqe.buf = sqe.buf;
+        queued = 0;
+        cqe.result = shm_execute(ch, &sqe, &cqe, &queued);
+        closing = sqe.op == TS_OP_CLOSE;
+
+        if (!queued) {
+            shm_complete(ch, &cqe);
+        }
+    }
+
+    shm_chan_destroy(ch);
+    return NULL;
+}
+
+int shm_server_run(const char *path, volatile int *running) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct pollfd pfd;
+    struct shm_chan *ch;
+    pthread_t thread;
+    int i, fd, ctl;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    for (i = 0; i < SHM_CHAN_HASH; i++) {
+        list_init(&shm_chan_hash[i]);
+    }
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Failed to create control socket");
+        return -1;
+    }
+    unlink(path); // left behind by an earlier run
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 128) < 0) {
+        perror("Failed to bind control socket");
+        close(fd);
+        return -1;
+    }
+
+    printf("Serving shared-memory sockets on %s\n", path);
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (*running) {
+        // wake up now and then to notice a shutdown
+        if (poll(&pfd, 1, 1000) <= 0) {
+            continue;
+        }
+
+        ctl = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+        if (ctl < 0) {
+            if (errno != EINTR) {
+                perror("Failed to accept client");
+            }
+            continue;
+        }
+
+        ch = shm_chan_create(ctl);
+        if (!ch) {
+            continue;
+        }
+        if (pthread_create(&thread, NULL, shm_chan_thread, ch) != 0) {
+            perror("Failed to create channel thread");
+            shm_chan_destroy(ch);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    close(fd);
+    unlink(path);
+    return 0;
+}
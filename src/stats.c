@@ -0,0 +1,392 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "stats.h"
+#include "mem.h"
+#include "utils.h"
+
+#define stats_dbg(fmt, ...) \
+    do { if (verbose) printf("STATS: " fmt "\n", ##__VA_ARGS__); } while (0)
+
+/* Group and name of each counter, consecutive counters of a group print together */
+static const struct {
+    const char *mib;
+    const char *name;
+} stat_names[STAT_MAX] = {
+    [STAT_LINK_IN_FRAMES]         = { "Link", "InFrames" },
+    [STAT_LINK_IN_RUNTS]          = { "Link", "InRunts" },
+    [STAT_LINK_IN_UNKNOWN_TYPES]  = { "Link", "InUnknownTypes" },
+    [STAT_LINK_IN_ERRORS]         = { "Link", "InErrors" },
+    [STAT_LINK_IN_DROPS]          = { "Link", "InDrops" },
+    [STAT_LINK_IN_PRESSURE_DROPS] = { "Link", "InPressureDrops" },
+    [STAT_LINK_IN_PRESSURE_TRIMS] = { "Link", "InPressureTrims" },
+    [STAT_LINK_OUT_FRAMES]        = { "Link", "OutFrames" },
+    [STAT_LINK_OUT_ERRORS]        = { "Link", "OutErrors" },
+    [STAT_LINK_OUT_DROPS]         = { "Link", "OutDrops" },
+
+    [STAT_ARP_IN_REQUESTS]        = { "Arp", "InRequests" },
+    [STAT_ARP_IN_REPLIES]         = { "Arp", "InReplies" },
+    [STAT_ARP_IN_ERRORS]          = { "Arp", "InErrors" },
+    [STAT_ARP_OUT_REQUESTS]       = { "Arp", "OutRequests" },
+    [STAT_ARP_OUT_REPLIES]        = { "Arp", "OutReplies" },
+    [STAT_ARP_UNRESOLVED]         = { "Arp", "Unresolved" },
+    [STAT_ARP_NOT_LEARNED]        = { "Arp", "NotLearned" },
+    [STAT_ARP_RATE_LIMITED]       = { "Arp", "InRateLimited" },
+    [STAT_ARP_EVICTIONS]          = { "Arp", "Evictions" },
+    [STAT_ARP_STALE_LOADED]       = { "Arp", "StaleLoaded" },
+    [STAT_ARP_STALE_PROBES]       = { "Arp", "StaleProbes" },
+
+    [STAT_IP_IN_RECEIVES]         = { "Ip", "InReceives" },
+    [STAT_IP_IN_HDR_ERRORS]       = { "Ip", "InHdrErrors" },
+    [STAT_IP_IN_CSUM_ERRORS]      = { "Ip", "InCsumErrors" },
+    [STAT_IP_IN_ADDR_ERRORS]      = { "Ip", "InAddrErrors" },
+    [STAT_IP_IN_UNKNOWN_PROTOS]   = { "Ip", "InUnknownProtos" },
+    [STAT_IP_IN_DELIVERS]         = { "Ip", "InDelivers" },
+    [STAT_IP_OUT_REQUESTS]        = { "Ip", "OutRequests" },
+    [STAT_IP_OUT_DISCARDS]        = { "Ip", "OutDiscards" },
+
+    [STAT_ICMP_IN_MSGS]           = { "Icmp", "InMsgs" },
+    [STAT_ICMP_IN_ERRORS]         = { "Icmp", "InErrors" },
+    [STAT_ICMP_IN_CSUM_ERRORS]    = { "Icmp", "InCsumErrors" },
+    [STAT_ICMP_IN_DEST_UNREACHS]  = { "Icmp", "InDestUnreachs" },
+    [STAT_ICMP_IN_ECHOS]          = { "Icmp", "InEchos" },
+    [STAT_ICMP_IN_ECHO_REPS]      = { "Icmp", "InEchoReps" },
+    [STAT_ICMP_OUT_MSGS]          = { "Icmp", "OutMsgs" },
+    [STAT_ICMP_OUT_DEST_UNREACHS] = { "Icmp", "OutDestUnreachs" },
+    [STAT_ICMP_OUT_ECHOS]         = { "Icmp", "OutEchos" },
+    [STAT_ICMP_OUT_ECHO_REPS]     = { "Icmp", "OutEchoReps" },
+
+    [STAT_TCP_ACTIVE_OPENS]       = { "Tcp", "ActiveOpens" },
+    [STAT_TCP_PASSIVE_OPENS]      = { "Tcp", "PassiveOpens" },
+    [STAT_TCP_IN_SEGS]            = { "Tcp", "InSegs" },
+    [STAT_TCP_OUT_SEGS]           = { "Tcp", "OutSegs" },
+    [STAT_TCP_RETRANS_SEGS]       = { "Tcp", "RetransSegs" },
+    [STAT_TCP_IN_ERRS]            = { "Tcp", "InErrs" },
+    [STAT_TCP_OUT_RSTS]           = { "Tcp", "OutRsts" },
+    [STAT_TCP_IN_CSUM_ERRORS]     = { "Tcp", "InCsumErrors" },
+
+    [STAT_UDP_IN_DATAGRAMS]       = { "Udp", "InDatagrams" },
+    [STAT_UDP_NO_PORTS]           = { "Udp", "NoPorts" },
+    [STAT_UDP_IN_ERRORS]          = { "Udp", "InErrors" },
+    [STAT_UDP_OUT_DATAGRAMS]      = { "Udp", "OutDatagrams" },
+    [STAT_UDP_RCVBUF_ERRORS]      = { "Udp", "RcvbufErrors" },
+    [STAT_UDP_IN_CSUM_ERRORS]     = { "Udp", "InCsumErrors" },
+
+    [STAT_TCP_SYN_RECV]           = { "TcpExt", "SynRecv" },
+    [STAT_TCP_SYNCOOKIES_SENT]    = { "TcpExt", "SyncookiesSent" },
+    [STAT_TCP_SYNCOOKIES_RECV]    = { "TcpExt", "SyncookiesRecv" },
+    [STAT_TCP_SYNCOOKIES_FAILED]  = { "TcpExt", "SyncookiesFailed" },
+    [STAT_TCP_SYNACK_TIMEOUTS]    = { "TcpExt", "TCPSynAckTimeouts" },
+    [STAT_TCP_LISTEN_DROPS]       = { "TcpExt", "ListenDrops" },
+    [STAT_TCP_RCVQ_DROP]          = { "TcpExt", "TCPRcvQDrop" },
+    [STAT_TCP_OFO_DROP]           = { "TcpExt", "TCPOFODrop" },
+    [STAT_TCP_OFO_PRUNED]         = { "TcpExt", "OfoPruned" },
+};
+
+__thread struct stats_block *stats_local;
+
+/* Live blocks, and what the threads that exited had counted */
+static LIST_HEAD(stats_blocks);
+static uint64_t stats_retired[STAT_MAX];
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t stats_key;
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+
+#ifdef PKT_TRACE
+static const char *trace_stage_names[TRACE_STAGE_MAX] = {
+    [TRACE_STAGE_DEV_ETH]  = "DevToEth",
+    [TRACE_STAGE_ETH_IP]   = "EthToIp",
+    [TRACE_STAGE_IP_L4]    = "IpToL4",
+    [TRACE_STAGE_L4]       = "L4",
+    [TRACE_STAGE_RX_TOTAL] = "RxTotal",
+    [TRACE_STAGE_TX_QUEUE] = "TxQueue",
+    [TRACE_STAGE_TX_WRITE] = "TxWrite",
+};
+
+static struct histogram trace_retired[TRACE_STAGE_MAX];
+static uint64_t trace_tsc0, trace_ns0;
+#endif
+
+/* Thread exit: keep its counts, drop its block */
+static void stats_block_retire(void *arg) {
+    struct stats_block *b = arg;
+    int i;
+
+    pthread_mutex_lock(&stats_lock);
+    for (i = 0; i < STAT_MAX; i++) {
+        stats_retired[i] += atomic_load_explicit(&b->v[i], memory_order_relaxed);
+    }
+#ifdef PKT_TRACE
+    for (i = 0; i < TRACE_STAGE_MAX; i++) {
+        hist_merge(&trace_retired[i], &b->lat[i]);
+    }
+#endif
+    list_del(&b->list);
+    pthread_mutex_unlock(&stats_lock);
+
+    stats_local = NULL;
+    free(b);
+}
+
+static void stats_key_create(void) {
+#ifdef PKT_TRACE
+    for (int i = 0; i < TRACE_STAGE_MAX; i++) {
+        hist_init(&trace_retired[i]);
+    }
+#endif
+    pthread_key_create(&stats_key, stats_block_retire);
+}
+
+struct stats_block *stats_block_new(void) {
+    struct stats_block *b = aligned_alloc(CACHELINE_SIZE, sizeof(struct stats_block));
+
+    if (!b) {
+        return NULL;
+    }
+    memset(b, 0, sizeof(*b));
+#ifdef PKT_TRACE
+    for (int i = 0; i < TRACE_STAGE_MAX; i++) {
+        hist_init(&b->lat[i]);
+    }
+#endif
+
+    // the key's destructor is how we hear about the thread exiting
+    pthread_once(&stats_key_once, stats_key_create);
+    pthread_setspecific(stats_key, b);
+
+    pthread_mutex_lock(&stats_lock);
+    list_add_tail(&stats_blocks, &b->list);
+    pthread_mutex_unlock(&stats_lock);
+
+    stats_local = b;
+    return b;
+}
+
+void stats_snapshot(uint64_t out[STAT_MAX]) {
+    struct stats_block *b;
+    list_head *elem;
+    int i;
+
+    pthread_mutex_lock(&stats_lock);
+    memcpy(out, stats_retired, sizeof(stats_retired));
+    list_for_each(elem, &stats_blocks) {
+        b = list_entry(elem, struct stats_block, list);
+        for (i = 0; i < STAT_MAX; i++) {
+            out[i] += atomic_load_explicit(&b->v[i], memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+#ifdef PKT_TRACE
+void trace_init(void) {
+    trace_tsc0 = trace_now();
+    trace_ns0 = clock_ns();
+}
+
+double trace_cycles_per_ns(void) {
+    uint64_t ns = clock_ns() - trace_ns0;
+
+    return ns ? (double)(trace_now() - trace_tsc0) / ns : 1.0;
+}
+
+void trace_record(enum trace_stage stage, uint64_t cycles) {
+    struct stats_block *b = stats_local;
+
+    if (__builtin_expect(!b, 0) && !(b = stats_block_new())) {
+        return;
+    }
+    hist_record(&b->lat[stage], cycles);
+}
+
+/* One line per stage with its samples and percentiles in nanoseconds */
+static void trace_dump(FILE *f) {
+    struct histogram h;
+    struct stats_block *b;
+    list_head *elem;
+    double cpn = trace_cycles_per_ns();
+    int i;
+
+    fprintf(f, "Latency: Stage Samples MeanNs P50Ns P99Ns P999Ns MaxNs\n");
+    for (i = 0; i < TRACE_STAGE_MAX; i++) {
+        pthread_mutex_lock(&stats_lock);
+        h = trace_retired[i];
+        list_for_each(elem, &stats_blocks) {
+            b = list_entry(elem, struct stats_block, list);
+            hist_merge(&h, &b->lat[i]);
+        }
+        pthread_mutex_unlock(&stats_lock);
+
+        if (!h.count) {
+            fprintf(f, "Latency: %s 0 0 0 0 0 0\n", trace_stage_names[i]);
+            continue;
+        }
+        fprintf(f, "Latency: %s %llu %.0f %.0f %.0f %.0f %.0f\n", trace_stage_names[i],
+                (unsigned long long)h.count, hist_mean(&h) / cpn, hist_percentile(&h, 50) / cpn,
+                hist_percentile(&h, 99) / cpn, hist_percentile(&h, 99.9) / cpn, h.max / cpn);
+    }
+}
+#endif
+
+void stats_dump(FILE *f) {
+    uint64_t v[STAT_MAX];
+    int first, i, j;
+
+    stats_snapshot(v);
+
+    for (first = 0; first < STAT_MAX; first = j) {
+        j = first + 1;
+        while (j < STAT_MAX && strcmp(stat_names[j].mib, stat_names[first].mib) == 0) {
+            j++;
+        }
+
+        fprintf(f, "%s:", stat_names[first].mib);
+        for (i = first; i < j; i++) {
+            fprintf(f, " %s", stat_names[i].name);
+        }
+        fprintf(f, "\n%s:", stat_names[first].mib);
+        for (i = first; i < j; i++) {
+            fprintf(f, " %llu", (unsigned long long)v[i]);
+        }
+        fprintf(f, "\n");
+    }
+    mem_dump(f);
+
+#ifdef PKT_TRACE
+    trace_dump(f);
+#endif
+}
+
+/* The stats socket, served by a thread that wakes up now and then to notice a shutdown */
+static struct {
+    pthread_t thread;
+    int fd;
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    volatile int running;
+} stats_server = { .fd = -1 };
+
+static void *stats_server_loop(void *arg) {
+    struct pollfd pfd = { .fd = stats_server.fd, .events = POLLIN };
+    char *buf;
+    size_t len;
+    FILE *f;
+    int fd;
+
+    while (stats_server.running) {
+        if (poll(&pfd, 1, 1000) <= 0) {
+            continue;
+        }
+
+        fd = accept4(stats_server.fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EINTR) {
+                perror("Failed to accept stats client");
+            }
+            continue;
+        }
+
+        // one dump per connection, then hang up. A client gone already must not SIGPIPE the stack
+        f = open_memstream(&buf, &len);
+        if (f) {
+            stats_dump(f);
+            fclose(f);
+            if (send(fd, buf, len, MSG_NOSIGNAL) < 0) {
+                perror("Failed to send stats");
+            }
+            free(buf);
+            stats_dbg("Served a dump of %zu bytes", len);
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+int stats_server_start(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Failed to create stats socket");
+        return -1;
+    }
+    unlink(path); // left behind by an earlier run
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        perror("Failed to bind stats socket");
+        close(fd);
+        return -1;
+    }
+
+    stats_server.fd = fd;
+    strcpy(stats_server.path, path);
+    stats_server.running = 1;
+    if (pthread_create(&stats_server.thread, NULL, stats_server_loop, NULL) != 0) {
+        perror("Failed to create stats thread");
+        stats_server.running = 0;
+        stats_server.fd = -1;
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+
+    printf("Serving counters on %s\n", path);
+    return 0;
+}
+
+void stats_server_stop(void) {
+    if (!stats_server.running) {
+        return;
+    }
+    stats_server.running = 0;
+    pthread_join(stats_server.thread, NULL);
+    close(stats_server.fd);
+    stats_server.fd = -1;
+    unlink(stats_server.path);
+}
+
+int stats_query(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    char buf[4096];
+    ssize_t n;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Failed to create socket");
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("Failed to connect to stats socket");
+        close(fd);
+        return -1;
+    }
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        fwrite(buf, 1, n, stdout);
+    }
+    if (n < 0) {
+        perror("Failed to read stats");
+    }
+    close(fd);
+    return n < 0 ? -1 : 0;
+}
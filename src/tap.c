@@ -7,13 +7,15 @@
 
 #include <linux/if.h>
 #include <linux/if_tun.h>
+#include <linux/virtio_net.h>
 
 #include "ethernet.h"
 #include "utils.h"
 
 
-int alloc_tap(char *dev) {
+int alloc_tap(char *dev, int *vnet_hdr, int multi_queue) {
     struct ifreq ifr;
+    unsigned int features = 0;
     int tapfd;
 
     // open the tun/tap device
@@ -28,6 +30,20 @@ int alloc_tap(char *dev) {
      // IFF_TAP = Layer 2 (Ethernet) device, IFF_NO_PI = No extra packet info
     ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
 
+    // IFF_MULTI_QUEUE = every open of the same device adds a queue, the kernel spreads flows over them
+    if (multi_queue) {
+        ifr.ifr_flags |= IFF_MULTI_QUEUE;
+    }
+
+    // IFF_VNET_HDR = every frame carries a struct virtio_net_hdr, which lets us hand the kernel TCP super-frames
+    if (*vnet_hdr) {
+        if (ioctl(tapfd, TUNGETFEATURES, &features) < 0 || !(features & IFF_VNET_HDR)) {
+            *vnet_hdr = 0;
+        } else {
+            ifr.ifr_flags |= IFF_VNET_HDR;
+        }
+    }
+
     // copy device name to request, if one is provided
     if (*dev) {
         strncpy(ifr.ifr_name, dev, IFNAMSIZ);
@@ -40,6 +56,16 @@ int alloc_tap(char *dev) {
         return -1;
     }
     
+    // the kernel only sends us plain frames, but takes GSO frames from us (no TUNSETOFFLOAD needed for that direction)
+    if (*vnet_hdr) {
+        int hdrsz = sizeof(struct virtio_net_hdr);
+        if (ioctl(tapfd, TUNSETVNETHDRSZ, &hdrsz) < 0) {
+            perror("ERR: Could not set vnet header size");
+            close(tapfd);
+            return -1;
+        }
+    }
+
     // copy device name (handles case where device name not specified and kernel assigned one)
     strncpy(dev, ifr.ifr_name, IFNAMSIZ);
     return tapfd;
@@ -75,7 +101,7 @@ int configure_tap(char *dev, char *cidr) {
     return 0;
 }
 
-int setup_network_if(char *dev, int choose_name, char *cidr) {
+int setup_network_if(char *dev, int choose_name, char *cidr, int *vnet_hdr, int multi_queue) {
     int tapfd;
 
     // if specific name is requested, use it, or we just let kernel choose
@@ -84,7 +110,7 @@ int setup_network_if(char *dev, int choose_name, char *cidr) {
     }
 
     // create TAP interface
-    tapfd = alloc_tap(dev);
+    tapfd = alloc_tap(dev, vnet_hdr, multi_queue);
     if (tapfd < 0) {
         fprintf(stderr, "Failed to create TAP device\n");
         return -1;
@@ -102,6 +128,19 @@ int setup_network_if(char *dev, int choose_name, char *cidr) {
     return tapfd;
 }
 
+int tap_open_queue(char *dev, int vnet_hdr) {
+    int got = vnet_hdr;
+    int tapfd = alloc_tap(dev, &got, 1);
+
+    // every queue has to frame packets the same way
+    if (tapfd >= 0 && got != vnet_hdr) {
+        fprintf(stderr, "TAP queue came up with different framing\n");
+        close(tapfd);
+        return -1;
+    }
+    return tapfd;
+}
+
 int tap_read(int tapfd, unsigned char *buffer, int len) {
     return read(tapfd, buffer, len);
 }
@@ -0,0 +1,1027 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "tcp.h"
+#include "netdev.h"
+#include "stats.h"
+#include "mem.h"
+#include "utils.h"
+
+/* Established (4-tuple) and listening (port) hash tables. The RX threads only read them */
+static list_head tcp_ehash[TCP_EHASH_SIZE];
+static list_head tcp_lhash[TCP_LHASH_SIZE];
+static pthread_rwlock_t tcp_hash_lock = PTHREAD_RWLOCK_INITIALIZER;
+static uint32_t tcp_secret;  // keys the hash and the ISNs so they can't be predicted from outside
+static uint16_t tcp_next_ephemeral = 32768;
+
+
+#define tcp_dbg(fmt, ...) \
+    do { if (verbose) printf("TCP: " fmt "\n", ##__VA_ARGS__); } while (0)
+
+static const char *tcp_state_names[] = {
+    "CLOSED", "LISTEN", "SYN_SENT", "SYN_RECEIVED", "ESTABLISHED", "FIN_WAIT_1",
+    "FIN_WAIT_2", "CLOSE_WAIT", "CLOSING", "LAST_ACK", "TIME_WAIT",
+};
+
+/* Mix a 4-tuple into a bucket index (murmur3 finalizer) */
+static inline uint32_t tcp_ehashfn(uint32_t laddr, uint16_t lport, uint32_t raddr, uint16_t rport) {
+    uint32_t h = laddr ^ (raddr * 0x9e3779b1) ^ (((uint32_t)lport << 16) | rport) ^ tcp_secret;
+
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+static inline list_head *tcp_ebucket(uint32_t laddr, uint16_t lport, uint32_t raddr, uint16_t rport) {
+    return &tcp_ehash[tcp_ehashfn(laddr, lport, raddr, rport) & (TCP_EHASH_SIZE - 1)];
+}
+
+static inline list_head *tcp_lbucket(uint16_t port) {
+    return &tcp_lhash[port & (TCP_LHASH_SIZE - 1)];
+}
+
+void tcp_init(void) {
+    int i;
+
+    for (i = 0; i < TCP_EHASH_SIZE; i++) {
+        list_init(&tcp_ehash[i]);
+    }
+    for (i = 0; i < TCP_LHASH_SIZE; i++) {
+        list_init(&tcp_lhash[i]);
+    }
+
+    if (getrandom(&tcp_secret, sizeof(tcp_secret), 0) != sizeof(tcp_secret)) {
+        tcp_secret = (uint32_t)clock_ns();
+    }
+
+    tcp_cong_init();
+    tcp_synq_init();
+
+    tcp_dbg("TCP layer initialized");
+}
+
+struct tcp_sock *tcp_sock_alloc(void) {
+    struct tcp_sock *sk = calloc(1, sizeof(struct tcp_sock));
+
+    if (!sk) {
+        perror("Failed to allocate TCP socket");
+        return NULL;
+    }
+
+    pthread_mutex_init(&sk->lock, NULL);
+    pthread_cond_init(&sk->wait, NULL);
+    atomic_init(&sk->refcnt, 1); // the owner's reference: the application, or the listener until accepted
+    sk->state = TCP_CLOSED;
+
+    list_init(&sk->hash_list);
+    list_init(&sk->write_queue);
+    list_init(&sk->rcv_queue);
+    list_init(&sk->ack_list);
+    list_init(&sk->accept_queue);
+    list_init(&sk->accept_list);
+    itree_init(&sk->ooo_queue);
+
+    sk->sndbuf = TCP_SNDBUF;
+    sk->rcv_buf = TCP_RCVBUF;
+    sk->peer_mss = TCP_DEFAULT_MSS;
+    sk->mss = TCP_DEFAULT_MSS;
+    sk->rto_ms = TCP_RTO_INIT_MS;
+    sk->quickacks = TCP_QUICKACKS;
+
+    // smallest window scale that lets us advertise the whole receive buffer
+    while (sk->rcv_wscale < TCP_MAX_WSCALE && (sk->rcv_buf >> sk->rcv_wscale) > 0xffff) {
+        sk->rcv_wscale++;
+    }
+
+    timer_init(&sk->rto_timer, tcp_rto_handler, sk);
+    timer_init(&sk->delack_timer, tcp_delack_handler, sk);
+    timer_init(&sk->tw_timer, tcp_timewait_handler, sk);
+    timer_init(&sk->pacing_timer, tcp_pacing_handler, sk);
+    timer_init(&sk->rack_timer, tcp_rack_handler, sk);
+    timer_init(&sk->tlp_timer, tcp_tlp_handler, sk);
+
+    tcp_cong_assign(sk, tcp_cong_default());
+    return sk;
+}
+
+/* Free every buffer on a list of pktbufs */
+static void tcp_purge_queue(list_head *queue) {
+    list_head *elem, *tmp;
+
+    list_for_each_safe(elem, tmp, queue) {
+        list_del(elem);
+        free_pktbuf(list_entry(elem, struct pktbuf, list));
+    }
+}
+
+void tcp_sock_hold(struct tcp_sock *sk) {
+    atomic_fetch_add(&sk->refcnt, 1);
+}
+
+void tcp_sock_put(struct tcp_sock *sk) {
+    struct itree_node *node;
+
+    if (atomic_fetch_sub(&sk->refcnt, 1) != 1) {
+        return;
+    }
+
+    // last reference gone, nobody can reach the socket anymore
+    mem_charge(MEM_SOCK_RCV, -(int64_t)(sk->rcv_queue_bytes + sk->ooo_bytes), 0);
+    tcp_purge_queue(&sk->write_queue);
+    tcp_purge_queue(&sk->rcv_queue);
+    while ((node = itree_first(&sk->ooo_queue))) {
+        struct tcp_skb_cb *cb = container_of(node, struct tcp_skb_cb, ooo);
+        itree_remove(&sk->ooo_queue, node);
+        free_pktbuf(container_of((uint8_t *)cb, struct pktbuf, cb));
+    }
+
+    free(sk->syn_table);
+
+    pthread_mutex_destroy(&sk->lock);
+    pthread_cond_destroy(&sk->wait);
+    free(sk);
+}
+
+/* Find an established connection first, then a listener. Returns it with a reference held */
+struct tcp_sock *tcp_lookup(uint32_t laddr, uint16_t lport, uint32_t raddr, uint16_t rport) {
+    struct tcp_sock *sk;
+    list_head *elem;
+
+    pthread_rwlock_rdlock(&tcp_hash_lock);
+
+    list_for_each(elem, tcp_ebucket(laddr, lport, raddr, rport)) {
+        sk = list_entry(elem, struct tcp_sock, hash_list);
+        if (sk->sport == lport && sk->dport == rport && sk->saddr == laddr && sk->daddr == raddr) {
+            tcp_sock_hold(sk);
+            pthread_rwlock_unlock(&tcp_hash_lock);
+            return sk;
+        }
+    }
+
+    list_for_each(elem, tcp_lbucket(lport)) {
+        sk = list_entry(elem, struct tcp_sock, hash_list);
+        if (sk->sport == lport && (sk->saddr == 0 || sk->saddr == laddr)) {
+            if (sk->reuse) {
+                sk = reuseport_select(sk->reuse, reuseport_hash(raddr, rport, laddr, lport));
+            }
+            tcp_sock_hold(sk);
+            pthread_rwlock_unlock(&tcp_hash_lock);
+            return sk;
+        }
+    }
+
+    pthread_rwlock_unlock(&tcp_hash_lock);
+    return NULL;
+}
+
+/* This thread's flow table, see tcp_flow_gc in tcp.h */
+struct tcp_flow_table {
+    struct tcp_sock *slots[TCP_FLOW_SLOTS];
+    uint32_t gc_next; // where tcp_flow_gc picks up
+};
+
+static __thread struct tcp_flow_table *tcp_flows;
+
+struct tcp_sock *tcp_flow_lookup(uint32_t hash, uint32_t laddr, uint16_t lport, uint32_t raddr, uint16_t rport) {
+    struct tcp_sock **slot, *sk;
+
+    if (!tcp_flows && !(tcp_flows = calloc(1, sizeof(struct tcp_flow_table)))) {
+        return tcp_lookup(laddr, lport, raddr, rport);
+    }
+
+    // without RSS in front there's no hash on the packet yet
+    if (!hash) {
+        hash = tcp_ehashfn(laddr, lport, raddr, rport);
+    }
+    slot = &tcp_flows->slots[hash & (TCP_FLOW_SLOTS - 1)];
+
+    // the tuple never changes once hashed, and our reference keeps the socket around
+    sk = *slot;
+    if (sk && sk->hashed && sk->sport == lport && sk->dport == rport && sk->saddr == laddr && sk->daddr == raddr) {
+        tcp_sock_hold(sk);
+        return sk;
+    }
+
+    sk = tcp_lookup(laddr, lport, raddr, rport);
+    if (sk && sk->state != TCP_LISTEN) {
+        if (*slot) {
+            tcp_sock_put(*slot);
+        }
+        tcp_sock_hold(sk);
+        *slot = sk;
+    }
+    return sk;
+}
+
+void tcp_flow_gc(void) {
+    struct tcp_sock **slot;
+    int i;
+
+    if (!tcp_flows) {
+        return;
+    }
+
+    for (i = 0; i < TCP_FLOW_GC_SLOTS; i++) {
+        slot = &tcp_flows->slots[tcp_flows->gc_next++ & (TCP_FLOW_SLOTS - 1)];
+        if (*slot && !(*slot)->hashed) {
+            tcp_sock_put(*slot);
+            *slot = NULL;
+        }
+    }
+}
+
+void tcp_flow_flush(void) {
+    int i;
+
+    if (!tcp_flows) {
+        return;
+    }
+
+    for (i = 0; i < TCP_FLOW_SLOTS; i++) {
+        if (tcp_flows->slots[i]) {
+            tcp_sock_put(tcp_flows->slots[i]);
+        }
+    }
+    free(tcp_flows);
+    tcp_flows = NULL;
+}
+
+/* Find a listener a new one on addr and port would clash with. Call with tcp_hash_lock held */
+static struct tcp_sock *tcp_port_listener(uint32_t addr, uint16_t port) {
+    struct tcp_sock *sk;
+    list_head *elem;
+
+    list_for_each(elem, tcp_lbucket(port)) {
+        sk = list_entry(elem, struct tcp_sock, hash_list);
+        if (sk->sport == port && (sk->saddr == 0 || addr == 0 || sk->saddr == addr)) {
+            return sk;
+        }
+    }
+    return NULL;
+}
+
+/* Check if a 4-tuple is in use. Call with tcp_hash_lock held */
+static int tcp_tuple_used(uint32_t laddr, uint16_t lport, uint32_t raddr, uint16_t rport) {
+    struct tcp_sock *sk;
+    list_head *elem;
+
+    list_for_each(elem, tcp_ebucket(laddr, lport, raddr, rport)) {
+        sk = list_entry(elem, struct tcp_sock, hash_list);
+        if (sk->sport == lport && sk->dport == rport && sk->saddr == laddr && sk->daddr == raddr) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void tcp_hash_locked(struct tcp_sock *sk) {
+    if (sk->state == TCP_LISTEN) {
+        list_add(tcp_lbucket(sk->sport), &sk->hash_list);
+    } else {
+        list_add(tcp_ebucket(sk->saddr, sk->sport, sk->daddr, sk->dport), &sk->hash_list);
+    }
+    sk->hashed = 1;
+    tcp_sock_hold(sk); // the table's reference
+}
+
+void tcp_hash(struct tcp_sock *sk) {
+    pthread_rwlock_wrlock(&tcp_hash_lock);
+    tcp_hash_locked(sk);
+    pthread_rwlock_unlock(&tcp_hash_lock);
+}
+
+static void tcp_unhash(struct tcp_sock *sk) {
+    if (!sk->hashed) {
+        return;
+    }
+
+    pthread_rwlock_wrlock(&tcp_hash_lock);
+    list_del(&sk->hash_list);
+    list_init(&sk->hash_list);
+    sk->hashed = 0;
+    if (sk->reuse) {
+        reuseport_remove(sk->reuse, sk); // the rest of the group takes over its share of new flows
+        sk->reuse = NULL;
+    }
+    pthread_rwlock_unlock(&tcp_hash_lock);
+
+    tcp_sock_put(sk); // caller still holds its own reference, so this never frees
+}
+
+void tcp_set_state(struct tcp_sock *sk, int state) {
+    tcp_dbg("%d -> %s:%d %s -> %s", sk->sport, inet_ntoa((struct in_addr){ sk->daddr }), sk->dport,
+        tcp_state_names[sk->state], tcp_state_names[state]);
+    sk->state = state;
+}
+
+/* Pending timers hold a reference so the socket outlives any handler that's about to run */
+void tcp_reset_timer(struct tcp_sock *sk, struct timer *t, uint64_t expires) {
+    if (!timer_mod(t, expires)) {
+        tcp_sock_hold(sk);
+    }
+}
+
+void tcp_clear_timer(struct tcp_sock *sk, struct timer *t) {
+    if (timer_del(t)) {
+        tcp_sock_put(sk);
+    }
+}
+
+/* Tear the connection down. Call with sk->lock held and a reference held by the caller */
+void tcp_done(struct tcp_sock *sk) {
+    struct tcp_sock *parent = sk->parent;
+
+    tcp_set_state(sk, TCP_CLOSED);
+    tcp_clear_timer(sk, &sk->rto_timer);
+    tcp_clear_timer(sk, &sk->delack_timer);
+    tcp_clear_timer(sk, &sk->tw_timer);
+    tcp_clear_timer(sk, &sk->pacing_timer);
+    tcp_clear_timer(sk, &sk->rack_timer);
+    tcp_clear_timer(sk, &sk->tlp_timer);
+    tcp_unhash(sk);
+
+    // never accepted, take it off the listener's books
+    if (parent) {
+        pthread_mutex_lock(&parent->lock);
+        if (!list_empty(&sk->accept_list)) {
+            list_del(&sk->accept_list);
+            list_init(&sk->accept_list);
+            parent->accept_count--;
+        }
+        pthread_mutex_unlock(&parent->lock);
+
+        sk->parent = NULL;
+        tcp_sock_put(parent);
+    }
+
+    pthread_cond_broadcast(&sk->wait);
+
+    // nobody will call tcp_close on an orphan, so the owner reference goes here
+    if (sk->orphan) {
+        tcp_sock_put(sk);
+    }
+}
+
+uint32_t tcp_new_isn(uint32_t saddr, uint16_t sport, uint32_t daddr, uint16_t dport) {
+    // RFC 6528: keyed hash of the 4-tuple plus a clock ticking every 4 us
+    return tcp_ehashfn(saddr, sport, daddr, dport) + (uint32_t)(clock_ns() / 4000);
+}
+
+uint32_t tcp_time_stamp(void) {
+    return (uint32_t)(clock_ns() / 1000000ULL); // 1 ms timestamp clock
+}
+
+void tcp_rtt_sample(struct tcp_sock *sk, uint32_t rtt_us) {
+    uint32_t rto_us;
+
+    if (rtt_us == 0) {
+        rtt_us = 1;
+    }
+    if (!sk->min_rtt_us || rtt_us < sk->min_rtt_us) {
+        sk->min_rtt_us = rtt_us;
+    }
+
+    // RFC 6298 smoothing
+    if (sk->srtt_us == 0) {
+        sk->srtt_us = rtt_us;
+        sk->rttvar_us = rtt_us / 2;
+    } else {
+        uint32_t delta = sk->srtt_us > rtt_us ? sk->srtt_us - rtt_us : rtt_us - sk->srtt_us;
+        sk->rttvar_us = (3 * sk->rttvar_us + delta) / 4;
+        sk->srtt_us = (7 * sk->srtt_us + rtt_us) / 8;
+    }
+
+    rto_us = sk->srtt_us + (4 * sk->rttvar_us > 1000 ? 4 * sk->rttvar_us : 1000);
+    sk->rto_ms = rto_us / 1000;
+    if (sk->rto_ms < TCP_RTO_MIN_MS) sk->rto_ms = TCP_RTO_MIN_MS;
+    if (sk->rto_ms > TCP_RTO_MAX_MS) sk->rto_ms = TCP_RTO_MAX_MS;
+}
+
+/* Retransmission timeout: collapse the window and consider everything unSACKed lost */
+void tcp_enter_loss(struct tcp_sock *sk) {
+    list_head *elem;
+
+    sk->in_recovery = 0;
+    sk->dupacks = 0;
+    sk->tlp_high_seq = 0;
+    sk->high_seq = sk->snd_nxt;
+    sk->ca_ops->on_loss(sk, TCP_CA_LOSS);
+
+    sk->lost_out = 0;
+    sk->retrans_out = 0;
+    list_for_each(elem, &sk->write_queue) {
+        struct pktbuf *pkt = list_entry(elem, struct pktbuf, list);
+        struct tcp_skb_cb *cb = TCP_CB(pkt);
+
+        if (pkt == sk->send_head) {
+            break;
+        }
+
+        cb->sacked &= ~TCPCB_RETRANS;
+        if (!(cb->sacked & TCPCB_SACKED)) {
+            cb->sacked |= TCPCB_LOST;
+            sk->lost_out++;
+        }
+    }
+}
+
+void tcp_rto_handler(struct timer *t) {
+    struct tcp_sock *sk = t->arg;
+
+    pthread_mutex_lock(&sk->lock);
+
+    switch (sk->state) {
+        case TCP_CLOSED:
+        case TCP_TIME_WAIT:
+            break;
+
+        case TCP_LISTEN:
+            tcp_synq_timer(sk); // SYN-ACK retransmissions for half-open requests
+            break;
+
+        case TCP_SYN_SENT:
+        case TCP_SYN_RECEIVED:
+            if (++sk->retries > TCP_SYN_RETRIES) {
+                tcp_dbg("Handshake timed out");
+                sk->err = ETIMEDOUT;
+                tcp_done(sk);
+                break;
+            }
+            sk->backoff++;
+            if (sk->state == TCP_SYN_SENT) {
+                tcp_send_syn(sk);
+            } else {
+                tcp_send_synack(sk);
+            }
+            tcp_reset_timer(sk, &sk->rto_timer, clock_ns() + ((uint64_t)sk->rto_ms << sk->backoff) * 1000000ULL);
+            break;
+
+        default:
+            if (sk->packets_out == 0) {
+                // nothing in flight: the peer's window is closed, probe it
+                if (sk->send_head) {
+                    tcp_send_probe(sk);
+                    if (sk->backoff < 6) sk->backoff++;
+                    tcp_reset_timer(sk, &sk->rto_timer, clock_ns() + ((uint64_t)sk->rto_ms << sk->backoff) * 1000000ULL);
+                }
+                break;
+            }
+
+            if (++sk->retries > TCP_MAX_RETRIES) {
+                tcp_dbg("Too many retransmissions, giving up");
+                sk->err = ETIMEDOUT;
+                tcp_send_active_reset(sk);
+                tcp_done(sk);
+                break;
+            }
+
+            tcp_dbg("Retransmission timeout, rto %u ms backoff %d", sk->rto_ms, sk->backoff);
+            tcp_enter_loss(sk);
+            tcp_xmit_retransmit_queue(sk);
+
+            if (sk->backoff < 10) sk->backoff++;
+            uint64_t rto = (uint64_t)sk->rto_ms << sk->backoff;
+            if (rto > TCP_RTO_MAX_MS) rto = TCP_RTO_MAX_MS;
+            tcp_reset_timer(sk, &sk->rto_timer, clock_ns() + rto * 1000000ULL);
+            break;
+    }
+
+    pthread_mutex_unlock(&sk->lock);
+    tcp_sock_put(sk); // reference the timer held
+}
+
+void tcp_delack_handler(struct timer *t) {
+    struct tcp_sock *sk = t->arg;
+
+    pthread_mutex_lock(&sk->lock);
+    if (sk->ack_pending && sk->state != TCP_CLOSED) {
+        tcp_send_ack(sk);
+    }
+    pthread_mutex_unlock(&sk->lock);
+
+    tcp_sock_put(sk);
+}
+
+void tcp_pacing_handler(struct timer *t) {
+    struct tcp_sock *sk = t->arg;
+
+    pthread_mutex_lock(&sk->lock);
+    tcp_write_xmit(sk, 0);
+    pthread_mutex_unlock(&sk->lock);
+
+    tcp_sock_put(sk);
+}
+
+void tcp_timewait_handler(struct timer *t) {
+    struct tcp_sock *sk = t->arg;
+
+    pthread_mutex_lock(&sk->lock);
+    if (sk->state != TCP_CLOSED) {
+        tcp_done(sk);
+    }
+    pthread_mutex_unlock(&sk->lock);
+
+    tcp_sock_put(sk);
+}
+
+/* Wait for a state change or data, sk->lock must be held */
+static void tcp_wait(struct tcp_sock *sk) {
+    mem_fold(); // an application thread may sleep a long time, don't leave its counts behind
+    pthread_cond_wait(&sk->wait, &sk->lock);
+}
+
+static struct tcp_sock *tcp_listen_common(uint32_t addr, uint16_t port, int backlog, int reuseport) {
+    struct tcp_sock *sk = tcp_sock_alloc(), *other;
+
+    if (!sk) {
+        return NULL;
+    }
+
+    sk->saddr = addr;
+    sk->sport = port;
+    sk->backlog = backlog > 0 ? backlog : 128;
+    sk->state = TCP_LISTEN;
+
+    if (tcp_synq_alloc(sk) < 0) {
+        tcp_sock_put(sk);
+        return NULL;
+    }
+
+    pthread_rwlock_wrlock(&tcp_hash_lock);
+    other = tcp_port_listener(addr, port);
+    if (other) {
+        // only listeners that all asked for sharing, on exactly the same address, may join up
+        if (!reuseport || !other->reuse || other->saddr != addr || reuseport_add(other->reuse, sk) < 0) {
+            pthread_rwlock_unlock(&tcp_hash_lock);
+            tcp_dbg("Port %d already has a listener", port);
+            tcp_sock_put(sk);
+            return NULL;
+        }
+        sk->reuse = other->reuse;
+    } else if (reuseport && !(sk->reuse = reuseport_alloc(sk))) {
+        pthread_rwlock_unlock(&tcp_hash_lock);
+        tcp_sock_put(sk);
+        return NULL;
+    }
+    tcp_hash_locked(sk);
+    pthread_rwlock_unlock(&tcp_hash_lock);
+
+    tcp_dbg("Listening on port %d%s", port, sk->reuse ? ", shared" : "");
+    return sk;
+}
+
+struct tcp_sock *tcp_listen(uint32_t addr, uint16_t port, int backlog) {
+    return tcp_listen_common(addr, port, backlog, 0);
+}
+
+struct tcp_sock *tcp_listen_reuseport(uint32_t addr, uint16_t port, int backlog) {
+    return tcp_listen_common(addr, port, backlog, 1);
+}
+
+struct tcp_sock *tcp_accept(struct tcp_sock *lsk) {
+    struct tcp_sock *sk;
+    int accepted;
+
+    do {
+        pthread_mutex_lock(&lsk->lock);
+
+        while (list_empty(&lsk->accept_queue)) {
+            if (lsk->state != TCP_LISTEN) {
+                pthread_mutex_unlock(&lsk->lock);
+                errno = EINVAL;
+                return NULL;
+            }
+            if (lsk->nonblock) {
+                pthread_mutex_unlock(&lsk->lock);
+                errno = EAGAIN;
+                return NULL;
+            }
+            tcp_wait(lsk);
+        }
+
+        sk = list_first_entry(&lsk->accept_queue, struct tcp_sock, accept_list);
+        tcp_sock_hold(sk);
+        pthread_mutex_unlock(&lsk->lock);
+
+        // child -> parent lock order, same as the handshake completion path
+        pthread_mutex_lock(&sk->lock);
+        accepted = sk->parent == lsk; // a reset may have taken it off the queue in the meantime
+        if (accepted) {
+            pthread_mutex_lock(&lsk->lock);
+            list_del(&sk->accept_list);
+            list_init(&sk->accept_list);
+            lsk->accept_count--;
+            pthread_mutex_unlock(&lsk->lock);
+
+            sk->parent = NULL;
+            sk->orphan = 0; // the owner reference now belongs to the application
+            tcp_sock_put(lsk);
+        }
+        pthread_mutex_unlock(&sk->lock);
+        tcp_sock_put(sk);
+    } while (!accepted);
+
+    return sk;
+}
+
+struct tcp_sock *tcp_connect(uint32_t daddr, uint16_t dport) {
+    struct netdev *dev = netdev_get();
+    struct tcp_sock *sk = tcp_sock_alloc();
+    int tries;
+
+    if (!sk) {
+        return NULL;
+    }
+
+    sk->saddr = dev->addr;
+    sk->daddr = daddr;
+    sk->dport = dport;
+
+    // pick an ephemeral port nobody listens on and that's not used towards this destination
+    pthread_rwlock_wrlock(&tcp_hash_lock);
+    for (tries = 0; tries < 32768; tries++) {
+        uint16_t port = tcp_next_ephemeral++;
+        if (tcp_next_ephemeral < 32768) {
+            tcp_next_ephemeral = 32768;
+        }
+        if (!tcp_port_listener(sk->saddr, port) && !tcp_tuple_used(sk->saddr, port, daddr, dport)) {
+            sk->sport = port;
+            break;
+        }
+    }
+    if (sk->sport == 0) {
+        pthread_rwlock_unlock(&tcp_hash_lock);
+        tcp_sock_put(sk);
+        errno = EADDRNOTAVAIL;
+        return NULL;
+    }
+
+    pthread_mutex_lock(&sk->lock);
+    sk->iss = tcp_new_isn(sk->saddr, sk->sport, daddr, dport);
+    sk->snd_una = sk->iss;
+    sk->snd_nxt = sk->iss + 1;
+    sk->write_seq = sk->iss + 1;
+    tcp_set_state(sk, TCP_SYN_SENT);
+    tcp_hash_locked(sk);
+    pthread_rwlock_unlock(&tcp_hash_lock);
+
+    STATS_INC(STAT_TCP_ACTIVE_OPENS);
+    tcp_send_syn(sk);
+    tcp_reset_timer(sk, &sk->rto_timer, clock_ns() + sk->rto_ms * 1000000ULL);
+
+    while (sk->state == TCP_SYN_SENT || sk->state == TCP_SYN_RECEIVED) {
+        tcp_wait(sk);
+    }
+
+    if (sk->state != TCP_ESTABLISHED && sk->state != TCP_CLOSE_WAIT) {
+        errno = sk->err ? sk->err : ECONNREFUSED;
+        pthread_mutex_unlock(&sk->lock);
+        tcp_close(sk);
+        return NULL;
+    }
+
+    pthread_mutex_unlock(&sk->lock);
+    return sk;
+}
+
+/* Append application data to the send queue, referencing it instead of copying if there's a ubuf. Call with sk->lock held, returns bytes taken */
+static int tcp_queue_data(struct tcp_sock *sk, const uint8_t *buf, int len, struct zc_ubuf *ubuf) {
+    struct pktbuf *pkt;
+    int copied = 0;
+
+    while (copied < len) {
+        uint32_t space = sk->sndbuf - (sk->write_seq - sk->snd_una);
+        int chunk;
+
+        if ((int32_t)space <= 0) {
+            break;
+        }
+
+        // top up the last segment if it hasn't been sent yet, zero-copy segments each get their own
+        pkt = list_empty(&sk->write_queue) ? NULL : list_entry(sk->write_queue.prev, struct pktbuf, list);
+        if (ubuf || !pkt || !sk->send_head || pkt->ubuf || pkt->len >= sk->mss || (TCP_CB(pkt)->tcp_flags & TCP_FIN)) {
+            pkt = alloc_pktbuf(TCP_MAX_HEADER + (ubuf ? 0 : sk->mss));
+            if (!pkt) {
+                break;
+            }
+            pktbuf_reserve(pkt, TCP_MAX_HEADER);
+            TCP_CB(pkt)->seq = TCP_CB(pkt)->end_seq = sk->write_seq;
+            TCP_CB(pkt)->tcp_flags = TCP_ACK;
+            TCP_CB(pkt)->sacked = 0;
+            list_add_tail(&sk->write_queue, &pkt->list);
+            if (!sk->send_head) {
+                sk->send_head = pkt;
+            }
+        }
+
+        chunk = sk->mss - pkt->len;
+        if (chunk > len - copied) chunk = len - copied;
+        if (chunk > (int)space) chunk = space;
+
+        if (ubuf) {
+            pktbuf_attach(pkt, (uint8_t *)buf + copied, chunk, ubuf);
+        } else {
+            memcpy(pktbuf_put(pkt, chunk), buf + copied, chunk);
+        }
+        TCP_CB(pkt)->csum_ok = 0;
+        TCP_CB(pkt)->end_seq += chunk;
+        sk->write_seq += chunk;
+        copied += chunk;
+    }
+
+    return copied;
+}
+
+static int tcp_sendmsg(struct tcp_sock *sk, const void *buf, int len, struct zc_ubuf *ubuf) {
+    int copied = 0;
+
+    pthread_mutex_lock(&sk->lock);
+
+    while (copied < len) {
+        if (sk->err) {
+            errno = sk->err;
+            copied = copied ? copied : -1;
+            break;
+        }
+        if (sk->fin_queued || (sk->state != TCP_ESTABLISHED && sk->state != TCP_CLOSE_WAIT)) {
+            errno = EPIPE;
+            copied = copied ? copied : -1;
+            break;
+        }
+
+        copied += tcp_queue_data(sk, (const uint8_t *)buf + copied, len - copied, ubuf);
+        tcp_write_xmit(sk, 0);
+
+        if (copied < len) {
+            // send buffer full
+            if (sk->nonblock) {
+                if (copied == 0) {
+                    errno = EAGAIN;
+                    copied = -1;
+                }
+                break;
+            }
+            tcp_wait(sk);
+        }
+    }
+
+    pthread_mutex_unlock(&sk->lock);
+    return copied;
+}
+
+int tcp_send(struct tcp_sock *sk, const void *buf, int len) {
+    return tcp_sendmsg(sk, buf, len, NULL);
+}
+
+int tcp_send_zc(struct tcp_sock *sk, const void *buf, int len, struct zc_queue *cq, uint64_t cookie) {
+    struct zc_ubuf *ubuf = zc_ubuf_alloc(cq, cookie);
+    int queued;
+
+    if (!ubuf) {
+        return -1;
+    }
+
+    queued = tcp_sendmsg(sk, buf, len, ubuf);
+
+    // the segments hold their own references now, the completion comes when the last is ACKed
+    if (queued > 0) {
+        zc_ubuf_put(ubuf);
+    } else {
+        zc_ubuf_abort(ubuf);
+    }
+    return queued;
+}
+
+int tcp_recv_data(struct tcp_sock *sk, void *buf, int len) {
+    int copied = 0;
+
+    pthread_mutex_lock(&sk->lock);
+
+    while (list_empty(&sk->rcv_queue)) {
+        if (sk->rcv_shutdown) {
+            pthread_mutex_unlock(&sk->lock);
+            return 0;
+        }
+        if (sk->err || sk->state == TCP_CLOSED) {
+            errno = sk->err ? sk->err : ENOTCONN;
+            pthread_mutex_unlock(&sk->lock);
+            return -1;
+        }
+        if (sk->nonblock) {
+            errno = EAGAIN;
+            pthread_mutex_unlock(&sk->lock);
+            return -1;
+        }
+        tcp_wait(sk);
+    }
+
+    // copy out of the queued segments, freeing each one once it's drained
+    while (copied < len && !list_empty(&sk->rcv_queue)) {
+        struct pktbuf *pkt = list_first_entry(&sk->rcv_queue, struct pktbuf, list);
+        int n = pktbuf_copy(pkt, (uint8_t *)buf + copied, len - copied);
+
+        pktbuf_pull_all(pkt, n);
+        copied += n;
+
+        if (pktbuf_total_len(pkt) == 0) {
+            list_del(&pkt->list);
+            free_pktbuf(pkt);
+        }
+    }
+    sk->rcv_queue_bytes -= copied;
+    mem_charge(MEM_SOCK_RCV, -copied, 0);
+
+    // reading may have opened the window enough to tell the peer
+    tcp_rcv_space_update(sk);
+
+    pthread_mutex_unlock(&sk->lock);
+    return copied;
+}
+
+int tcp_setsockopt(struct tcp_sock *sk, int opt, int val) {
+    int ret = 0;
+
+    pthread_mutex_lock(&sk->lock);
+
+    switch (opt) {
+        case TCP_NODELAY:
+            sk->nodelay = !!val;
+            if (sk->nodelay) tcp_write_xmit(sk, 0); // whatever Nagle held back can go now
+            break;
+        case TCP_CORK:
+            sk->cork = !!val;
+            if (!sk->cork) tcp_write_xmit(sk, 0);
+            break;
+        case TCP_NONBLOCK:
+            sk->nonblock = !!val;
+            break;
+        default:
+            errno = ENOPROTOOPT;
+            ret = -1;
+            break;
+    }
+
+    pthread_mutex_unlock(&sk->lock);
+    return ret;
+}
+
+int tcp_set_congestion(struct tcp_sock *sk, const char *name) {
+    struct tcp_cong_ops *ops = tcp_cong_find(name);
+
+    if (!ops) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    pthread_mutex_lock(&sk->lock);
+    if (sk->ca_ops != ops) {
+        tcp_cong_assign(sk, ops);
+    }
+    pthread_mutex_unlock(&sk->lock);
+    return 0;
+}
+
+/* Reset everything waiting in a listener's accept queue */
+static void tcp_abort_accept_queue(struct tcp_sock *lsk) {
+    struct tcp_sock *child;
+
+    for (;;) {
+        pthread_mutex_lock(&lsk->lock);
+        if (list_empty(&lsk->accept_queue)) {
+            pthread_mutex_unlock(&lsk->lock);
+            break;
+        }
+        child = list_first_entry(&lsk->accept_queue, struct tcp_sock, accept_list);
+        tcp_sock_hold(child);
+        pthread_mutex_unlock(&lsk->lock);
+
+        pthread_mutex_lock(&child->lock);
+        if (child->state != TCP_CLOSED) {
+            tcp_send_active_reset(child);
+            tcp_done(child); // takes it off the accept queue
+        }
+        pthread_mutex_unlock(&child->lock);
+        tcp_sock_put(child);
+    }
+}
+
+int tcp_shutdown(struct tcp_sock *sk, int how) {
+    if (!sk) {
+        return 0;
+    }
+    if (how != SHUT_RD && how != SHUT_WR && how != SHUT_RDWR) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&sk->lock);
+
+    // readers get what's queued, then end of stream, whatever the peer does
+    if (how != SHUT_WR) {
+        sk->rcv_shutdown = 1;
+    }
+
+    // our FIN, the peer may keep sending
+    if (how != SHUT_RD && !sk->fin_queued) {
+        switch (sk->state) {
+            case TCP_SYN_RECEIVED:
+            case TCP_ESTABLISHED:
+                tcp_set_state(sk, TCP_FIN_WAIT_1);
+                tcp_queue_fin(sk);
+                break;
+
+            case TCP_CLOSE_WAIT:
+                tcp_set_state(sk, TCP_LAST_ACK);
+                tcp_queue_fin(sk);
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    // waiters in recv see the end of stream, ones in send the FIN
+    pthread_cond_broadcast(&sk->wait);
+    pthread_mutex_unlock(&sk->lock);
+    return 0;
+}
+
+void tcp_close(struct tcp_sock *sk) {
+    int was_closed;
+
+    if (!sk) {
+        return;
+    }
+
+    tcp_sock_hold(sk); // tcp_done may drop the owner reference while we're still in here
+    pthread_mutex_lock(&sk->lock);
+
+    was_closed = sk->state == TCP_CLOSED;
+    sk->orphan = 1;
+
+    switch (sk->state) {
+        case TCP_LISTEN:
+            tcp_done(sk);
+            tcp_synq_purge(sk);
+            pthread_mutex_unlock(&sk->lock);
+            tcp_abort_accept_queue(sk);
+            pthread_mutex_lock(&sk->lock);
+            break;
+
+        case TCP_SYN_SENT:
+            tcp_done(sk);
+            break;
+
+        case TCP_SYN_RECEIVED:
+        case TCP_ESTABLISHED:
+            if (!list_empty(&sk->rcv_queue)) {
+                // unread data gets the connection reset instead of a FIN (RFC 2525)
+                tcp_send_active_reset(sk);
+                tcp_done(sk);
+                break;
+            }
+            tcp_set_state(sk, TCP_FIN_WAIT_1);
+            tcp_queue_fin(sk);
+            break;
+
+        case TCP_CLOSE_WAIT:
+            tcp_set_state(sk, TCP_LAST_ACK);
+            tcp_queue_fin(sk);
+            break;
+
+        case TCP_FIN_WAIT_2:
+            // shut down for writing earlier, and the peer may never close its side
+            tcp_reset_timer(sk, &sk->tw_timer, clock_ns() + TCP_TIMEWAIT_MS * 1000000ULL);
+            break;
+
+        default:
+            break; // already shutting down
+    }
+
+    pthread_mutex_unlock(&sk->lock);
+
+    if (was_closed) {
+        tcp_sock_put(sk); // tcp_done already ran without an orphan, drop the owner reference here
+    }
+    tcp_sock_put(sk);
+}
+
+void tcp_print_stats(void) {
+    uint64_t v[STAT_MAX];
+
+    stats_snapshot(v);
+    printf("TCP: %llu SYNs, %llu cookies sent, %llu cookies validated, %llu bad ACKs to listeners, "
+        "%llu handshake timeouts, %llu listen drops\n",
+        (unsigned long long)v[STAT_TCP_SYN_RECV], (unsigned long long)v[STAT_TCP_SYNCOOKIES_SENT],
+        (unsigned long long)v[STAT_TCP_SYNCOOKIES_RECV], (unsigned long long)v[STAT_TCP_SYNCOOKIES_FAILED],
+        (unsigned long long)v[STAT_TCP_SYNACK_TIMEOUTS], (unsigned long long)v[STAT_TCP_LISTEN_DROPS]);
+}
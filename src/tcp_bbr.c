@@ -0,0 +1,357 @@
+#include "tcp.h"
+#include "utils.h"
+
+/*
+ * BBR-style model-based congestion control. Instead of reacting to loss it keeps a model of the
+ * path, the bottleneck bandwidth (windowed max of delivery rate samples) and the round trip
+ * propagation delay (windowed min RTT), and sends at the bandwidth with a window of about two
+ * BDPs. Pacing carries the rate, cwnd is just a safety cap. Modes follow BBRv1:
+ *
+ *   STARTUP    pace at 2/ln2 x bw until bw stops growing by 25% for three rounds
+ *   DRAIN      pace below bw until the queue STARTUP built is gone
+ *   PROBE_BW   cycle 1.25, 0.75, then six rounds of 1 x bw
+ *   PROBE_RTT  every 10 s without a new min RTT, shrink to 4 segments for 200 ms to re-measure
+ */
+#define BBR_HIGH_GAIN       2.885 // 2/ln(2), doubles the rate each round
+#define BBR_CWND_GAIN       2.0
+#define BBR_BW_WIN_ROUNDS   10    // bandwidth max filter length
+#define BBR_MIN_RTT_WIN_NS  (10 * 1000000000ULL)
+#define BBR_PROBE_RTT_NS    (200 * 1000000ULL)
+#define BBR_MIN_CWND        4
+#define BBR_FULL_BW_THRESH  1.25
+#define BBR_FULL_BW_ROUNDS  3
+#define BBR_CYCLE_LEN       8
+
+enum bbr_mode {
+    BBR_STARTUP,
+    BBR_DRAIN,
+    BBR_PROBE_BW,
+    BBR_PROBE_RTT,
+};
+
+static const double bbr_pacing_gain[BBR_CYCLE_LEN] = { 1.25, 0.75, 1, 1, 1, 1, 1, 1 };
+
+/* One entry of the windowed max filter */
+struct bbr_bw_sample {
+    uint32_t round;
+    double bw;               // segments per second
+};
+
+struct bbr {
+    struct bbr_bw_sample bw[3];   // best, second and third best in the window (Nichols' minmax)
+    double full_bw;               // bw at the last 25% growth step in STARTUP
+    uint64_t min_rtt_stamp_ns;    // when min_rtt_us was measured
+    uint64_t cycle_stamp_ns;      // start of the current PROBE_BW phase
+    uint64_t probe_rtt_done_ns;   // end of the PROBE_RTT dwell, 0 until the pipe drained
+    uint32_t min_rtt_us;          // 0 = no sample yet
+    uint32_t round_count;         // packet-timed round trips
+    uint32_t next_round_delivered;
+    uint32_t prior_cwnd;          // cwnd before recovery or PROBE_RTT, restored afterwards
+    uint32_t loss_high;           // recovery from a timeout ends once this is ACKed
+    uint32_t recovery_round;      // round in which fast recovery started
+    uint8_t mode;
+    uint8_t cycle_idx;
+    uint8_t full_bw_cnt;
+    uint8_t full_bw_reached;
+    uint8_t round_start;
+    uint8_t in_loss;
+    uint8_t was_in_recovery;
+    uint8_t probe_rtt_round_done;
+};
+
+_Static_assert(sizeof(struct bbr) <= TCP_CA_PRIV_SIZE, "BBR state doesn't fit in ca_priv");
+
+/* Windowed max over the last win rounds, keeping the three best candidates */
+static double bbr_max_filter(struct bbr_bw_sample *m, uint32_t win, uint32_t round, double bw) {
+    struct bbr_bw_sample val = { round, bw };
+    uint32_t dt;
+
+    if (bw >= m[0].bw || round - m[2].round > win) {
+        m[0] = m[1] = m[2] = val; // new best, or nothing left in the window
+        return m[0].bw;
+    }
+
+    if (bw >= m[1].bw) {
+        m[1] = m[2] = val;
+    } else if (bw >= m[2].bw) {
+        m[2] = val;
+    }
+
+    // age the best one out once it leaves the window, keep the others spread over it
+    dt = round - m[0].round;
+    if (dt > win) {
+        m[0] = m[1];
+        m[1] = m[2];
+        m[2] = val;
+        if (round - m[0].round > win) {
+            m[0] = m[1];
+            m[1] = m[2];
+            m[2] = val;
+        }
+    } else if (m[1].round == m[0].round && dt > win / 4) {
+        m[1] = m[2] = val;
+    } else if (m[2].round == m[1].round && dt > win / 2) {
+        m[2] = val;
+    }
+
+    return m[0].bw;
+}
+
+static inline double bbr_max_bw(struct bbr *bbr) {
+    return bbr->bw[0].bw;
+}
+
+/* Segments the pacer releases at once: one timer tick's worth at the pacing rate, 2 to 64KB */
+static uint32_t bbr_send_quantum(struct tcp_sock *sk) {
+    uint64_t segs = sk->pacing_rate * TIMER_TICK_NS / 1000000000ULL / sk->mss;
+
+    if (segs < 2) segs = 2;
+    if (segs > 65536 / sk->mss) segs = 65536 / sk->mss;
+    return segs;
+}
+
+/* Window that holds gain x the estimated bandwidth-delay product */
+static uint32_t bbr_target_cwnd(struct tcp_sock *sk, double gain) {
+    struct bbr *bbr = tcp_ca_priv(sk);
+    double bdp;
+
+    if (!bbr->min_rtt_us || bbr_max_bw(bbr) == 0) {
+        return TCP_INIT_CWND; // no model yet
+    }
+
+    bdp = bbr_max_bw(bbr) * bbr->min_rtt_us / 1e6;
+    // room for the pacer's bursts on top, or a sub-tick RTT would starve the pipe
+    return (uint32_t)(gain * bdp) + 3 * bbr_send_quantum(sk);
+}
+
+static double bbr_current_pacing_gain(struct bbr *bbr) {
+    switch (bbr->mode) {
+        case BBR_STARTUP: return BBR_HIGH_GAIN;
+        case BBR_DRAIN: return 1.0 / BBR_HIGH_GAIN;
+        case BBR_PROBE_BW: return bbr_pacing_gain[bbr->cycle_idx];
+        default: return 1.0;
+    }
+}
+
+static void bbr_set_pacing_rate(struct tcp_sock *sk) {
+    struct bbr *bbr = tcp_ca_priv(sk);
+    uint64_t rate;
+
+    if (bbr_max_bw(bbr) == 0) {
+        // no bandwidth sample yet, go by the initial window over the handshake RTT
+        if (!sk->srtt_us) return;
+        rate = (uint64_t)(BBR_HIGH_GAIN * sk->cwnd * sk->mss * 1e6 / sk->srtt_us);
+    } else {
+        rate = (uint64_t)(bbr_current_pacing_gain(bbr) * bbr_max_bw(bbr) * sk->mss);
+    }
+
+    // in STARTUP never slow down on a low sample, the filter will catch up
+    if (bbr->full_bw_reached || rate > sk->pacing_rate) {
+        sk->pacing_rate = rate;
+    }
+}
+
+static void bbr_enter_probe_bw(struct tcp_sock *sk) {
+    struct bbr *bbr = tcp_ca_priv(sk);
+
+    bbr->mode = BBR_PROBE_BW;
+    // start at a random phase other than the 0.75 drain one so flows don't probe in lockstep
+    bbr->cycle_idx = (clock_ns() >> 10) % (BBR_CYCLE_LEN - 1);
+    if (bbr->cycle_idx >= 1) bbr->cycle_idx++;
+    bbr->cycle_stamp_ns = clock_ns();
+}
+
+static void bbr_update_cycle(struct tcp_sock *sk, const struct tcp_rate_sample *rs) {
+    struct bbr *bbr = tcp_ca_priv(sk);
+    uint64_t now = clock_ns();
+    double gain = bbr_pacing_gain[bbr->cycle_idx];
+    // a phase lasts a min RTT, but at least a couple of pacer ticks or it never gets to send at its gain
+    uint64_t phase_ns = (uint64_t)bbr->min_rtt_us * 1000 > 2 * TIMER_TICK_NS ? (uint64_t)bbr->min_rtt_us * 1000 : 2 * TIMER_TICK_NS;
+    int elapsed = now - bbr->cycle_stamp_ns > phase_ns;
+    uint32_t in_flight = tcp_packets_in_flight(sk);
+    int advance;
+
+    if (gain > 1.0) {
+        // probing up: stay until the extra data is actually in the pipe
+        advance = elapsed && (sk->in_recovery || rs->prior_in_flight >= bbr_target_cwnd(sk, gain));
+    } else if (gain < 1.0) {
+        // draining: leave as soon as the queue is gone
+        advance = elapsed || in_flight <= bbr_target_cwnd(sk, 1.0);
+    } else {
+        advance = elapsed;
+    }
+
+    if (advance) {
+        bbr->cycle_idx = (bbr->cycle_idx + 1) % BBR_CYCLE_LEN;
+        bbr->cycle_stamp_ns = now;
+    }
+}
+
+static void bbr_check_full_bw(struct tcp_sock *sk, const struct tcp_rate_sample *rs) {
+    struct bbr *bbr = tcp_ca_priv(sk);
+
+    if (bbr->full_bw_reached || !bbr->round_start || rs->is_app_limited) {
+        return;
+    }
+
+    if (bbr_max_bw(bbr) >= bbr->full_bw * BBR_FULL_BW_THRESH) {
+        bbr->full_bw = bbr_max_bw(bbr);
+        bbr->full_bw_cnt = 0;
+        return;
+    }
+
+    if (++bbr->full_bw_cnt >= BBR_FULL_BW_ROUNDS) {
+        bbr->full_bw_reached = 1;
+    }
+}
+
+static void bbr_update_min_rtt(struct tcp_sock *sk, const struct tcp_rate_sample *rs) {
+    struct bbr *bbr = tcp_ca_priv(sk);
+    uint64_t now = clock_ns();
+    int expired = now - bbr->min_rtt_stamp_ns > BBR_MIN_RTT_WIN_NS;
+
+    if (rs->rtt_us >= 0 && (!bbr->min_rtt_us || rs->rtt_us <= bbr->min_rtt_us || expired)) {
+        bbr->min_rtt_us = rs->rtt_us ? rs->rtt_us : 1;
+        bbr->min_rtt_stamp_ns = now;
+    }
+
+    if (expired && bbr->mode != BBR_PROBE_RTT && bbr->min_rtt_us) {
+        bbr->mode = BBR_PROBE_RTT;
+        bbr->prior_cwnd = sk->cwnd > bbr->prior_cwnd ? sk->cwnd : bbr->prior_cwnd;
+        bbr->probe_rtt_done_ns = 0;
+    }
+
+    if (bbr->mode != BBR_PROBE_RTT) {
+        return;
+    }
+
+    // hold the window at the minimum for 200 ms and at least one round once the pipe drained
+    if (!bbr->probe_rtt_done_ns && tcp_packets_in_flight(sk) <= BBR_MIN_CWND) {
+        bbr->probe_rtt_done_ns = now + BBR_PROBE_RTT_NS;
+        bbr->probe_rtt_round_done = 0;
+        bbr->next_round_delivered = sk->delivered;
+    } else if (bbr->probe_rtt_done_ns) {
+        if (bbr->round_start) {
+            bbr->probe_rtt_round_done = 1;
+        }
+        if (bbr->probe_rtt_round_done && now > bbr->probe_rtt_done_ns) {
+            bbr->min_rtt_stamp_ns = now;
+            if (sk->cwnd < bbr->prior_cwnd) sk->cwnd = bbr->prior_cwnd;
+            if (bbr->full_bw_reached) {
+                bbr_enter_probe_bw(sk);
+            } else {
+                bbr->mode = BBR_STARTUP;
+            }
+        }
+    }
+}
+
+static void bbr_set_cwnd(struct tcp_sock *sk, const struct tcp_rate_sample *rs) {
+    struct bbr *bbr = tcp_ca_priv(sk);
+    uint32_t target = bbr_target_cwnd(sk, BBR_CWND_GAIN);
+    uint32_t acked = rs->acked;
+
+    // recovery: packet conservation for the first round, then grow back towards the target
+    if (sk->in_recovery) {
+        if (bbr->round_count == bbr->recovery_round) {
+            uint32_t in_flight = tcp_packets_in_flight(sk);
+            if (sk->cwnd < in_flight + acked) sk->cwnd = in_flight + acked;
+            return;
+        }
+    } else if (bbr->was_in_recovery) {
+        if (sk->cwnd < bbr->prior_cwnd) sk->cwnd = bbr->prior_cwnd; // recovery over
+    }
+    bbr->was_in_recovery = sk->in_recovery;
+
+    if (bbr->in_loss && !seq_before(sk->snd_una, bbr->loss_high)) {
+        bbr->in_loss = 0;
+        if (sk->cwnd < bbr->prior_cwnd) sk->cwnd = bbr->prior_cwnd;
+    }
+
+    if (bbr->full_bw_reached) {
+        sk->cwnd = sk->cwnd + acked < target ? sk->cwnd + acked : target;
+    } else if (sk->cwnd < target || sk->delivered < TCP_INIT_CWND) {
+        sk->cwnd += acked;
+    }
+
+    if (sk->cwnd < BBR_MIN_CWND) sk->cwnd = BBR_MIN_CWND;
+    if (bbr->mode == BBR_PROBE_RTT && sk->cwnd > BBR_MIN_CWND) sk->cwnd = BBR_MIN_CWND;
+}
+
+static void bbr_init(struct tcp_sock *sk) {
+    struct bbr *bbr = tcp_ca_priv(sk);
+
+    sk->cwnd = TCP_INIT_CWND;
+    sk->ssthresh = 0x7fffffff;
+    sk->cwnd_cnt = 0;
+
+    bbr->mode = BBR_STARTUP;
+    bbr->min_rtt_us = sk->srtt_us; // the handshake RTT, if there was one
+    bbr->min_rtt_stamp_ns = clock_ns();
+    bbr->next_round_delivered = sk->delivered;
+    bbr_set_pacing_rate(sk);
+}
+
+static void bbr_on_ack(struct tcp_sock *sk, const struct tcp_rate_sample *rs) {
+    struct bbr *bbr = tcp_ca_priv(sk);
+
+    // a round trip ends when a segment sent after the last round started is delivered
+    bbr->round_start = 0;
+    if (rs->interval_us && rs->prior_delivered >= bbr->next_round_delivered) {
+        bbr->next_round_delivered = sk->delivered;
+        bbr->round_count++;
+        bbr->round_start = 1;
+    }
+
+    // application limited samples only count if they raise the estimate
+    if (rs->interval_us && rs->delivered) {
+        double bw = (double)rs->delivered * 1e6 / rs->interval_us;
+        if (!rs->is_app_limited || bw >= bbr_max_bw(bbr)) {
+            bbr_max_filter(bbr->bw, BBR_BW_WIN_ROUNDS, bbr->round_count, bw);
+        }
+    }
+
+    bbr_check_full_bw(sk, rs);
+
+    if (bbr->mode == BBR_STARTUP && bbr->full_bw_reached) {
+        bbr->mode = BBR_DRAIN;
+        sk->ssthresh = bbr_target_cwnd(sk, 1.0);
+    }
+    if (bbr->mode == BBR_DRAIN && tcp_packets_in_flight(sk) <= bbr_target_cwnd(sk, 1.0)) {
+        bbr_enter_probe_bw(sk);
+    }
+    if (bbr->mode == BBR_PROBE_BW) {
+        bbr_update_cycle(sk, rs);
+    }
+
+    bbr_update_min_rtt(sk, rs);
+    bbr_set_pacing_rate(sk);
+    bbr_set_cwnd(sk, rs);
+}
+
+static void bbr_on_loss(struct tcp_sock *sk, int event) {
+    struct bbr *bbr = tcp_ca_priv(sk);
+
+    // loss isn't a congestion signal to BBR, only shrink long enough to repair it
+    if (!bbr->in_loss && !bbr->was_in_recovery) {
+        bbr->prior_cwnd = sk->cwnd;
+    }
+
+    if (event == TCP_CA_LOSS) {
+        bbr->in_loss = 1;
+        bbr->loss_high = sk->high_seq;
+        bbr->was_in_recovery = 0;
+        sk->cwnd = 1;
+    } else {
+        bbr->recovery_round = bbr->round_count;
+        bbr->was_in_recovery = 1;
+        sk->cwnd = tcp_packets_in_flight(sk) + 1;
+    }
+}
+
+struct tcp_cong_ops tcp_bbr_ops = {
+    .name = "bbr",
+    .init = bbr_init,
+    .on_ack = bbr_on_ack,
+    .on_loss = bbr_on_loss,
+};
@@ -0,0 +1,153 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "tcp.h"
+#include "utils.h"
+
+#define tcp_dbg(fmt, ...) \
+    do { if (verbose) printf("TCP: " fmt "\n", ##__VA_ARGS__); } while (0)
+
+/* Registered algorithms, written at startup and read when connections are created */
+static list_head tcp_cong_list = { &tcp_cong_list, &tcp_cong_list };
+static pthread_mutex_t tcp_cong_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tcp_cong_ops *tcp_cong_dflt = &tcp_reno_ops;
+
+void tcp_cong_init(void) {
+    tcp_cong_register(&tcp_reno_ops);
+    tcp_cong_register(&tcp_cubic_ops);
+    tcp_cong_register(&tcp_bbr_ops);
+}
+
+static struct tcp_cong_ops *tcp_cong_find_locked(const char *name) {
+    list_head *elem;
+
+    list_for_each(elem, &tcp_cong_list) {
+        struct tcp_cong_ops *ops = list_entry(elem, struct tcp_cong_ops, list);
+        if (strncmp(ops->name, name, TCP_CA_NAME_MAX) == 0) {
+            return ops;
+        }
+    }
+    return NULL;
+}
+
+int tcp_cong_register(struct tcp_cong_ops *ops) {
+    if (!ops->init || !ops->on_ack || !ops->on_loss) {
+        tcp_dbg("Congestion control %s is missing required ops", ops->name);
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&tcp_cong_lock);
+    if (tcp_cong_find_locked(ops->name)) {
+        pthread_mutex_unlock(&tcp_cong_lock);
+        errno = EEXIST;
+        return -1;
+    }
+    list_add_tail(&tcp_cong_list, &ops->list);
+    pthread_mutex_unlock(&tcp_cong_lock);
+
+    tcp_dbg("Registered congestion control %s", ops->name);
+    return 0;
+}
+
+struct tcp_cong_ops *tcp_cong_find(const char *name) {
+    struct tcp_cong_ops *ops;
+
+    pthread_mutex_lock(&tcp_cong_lock);
+    ops = tcp_cong_find_locked(name);
+    pthread_mutex_unlock(&tcp_cong_lock);
+    return ops;
+}
+
+int tcp_cong_set_default(const char *name) {
+    struct tcp_cong_ops *ops = tcp_cong_find(name);
+
+    if (!ops) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    pthread_mutex_lock(&tcp_cong_lock);
+    tcp_cong_dflt = ops;
+    pthread_mutex_unlock(&tcp_cong_lock);
+    return 0;
+}
+
+struct tcp_cong_ops *tcp_cong_default(void) {
+    struct tcp_cong_ops *ops;
+
+    pthread_mutex_lock(&tcp_cong_lock);
+    ops = tcp_cong_dflt;
+    pthread_mutex_unlock(&tcp_cong_lock);
+    return ops;
+}
+
+void tcp_cong_assign(struct tcp_sock *sk, struct tcp_cong_ops *ops) {
+    sk->ca_ops = ops;
+    sk->pacing_rate = 0;
+    memset(sk->ca_priv, 0, sizeof(sk->ca_priv));
+    ops->init(sk);
+}
+
+void tcp_rate_skb_sent(struct tcp_sock *sk, struct pktbuf *pkt) {
+    struct tcp_skb_cb *cb = TCP_CB(pkt);
+
+    // the first segment after an idle period starts a fresh interval
+    if (sk->packets_out == 0) {
+        sk->first_tx_ns = cb->tx_ns;
+        sk->delivered_ns = cb->tx_ns;
+    }
+
+    cb->tx.first_tx_ns = sk->first_tx_ns;
+    cb->tx.delivered_ns = sk->delivered_ns;
+    cb->tx.delivered = sk->delivered;
+    cb->tx.app_limited = sk->app_limited ? 1 : 0;
+}
+
+void tcp_rate_skb_delivered(struct tcp_sock *sk, struct pktbuf *pkt, struct tcp_rate_sample *rs) {
+    struct tcp_skb_cb *cb = TCP_CB(pkt);
+
+    sk->delivered++;
+    sk->delivered_ns = clock_ns();
+    rs->acked++;
+
+    // the most recently sent of the delivered segments defines the interval
+    if (cb->tx.delivered >= rs->prior_delivered) {
+        uint64_t send_elapsed = cb->tx_ns - cb->tx.first_tx_ns;
+        uint64_t ack_elapsed = sk->delivered_ns - cb->tx.delivered_ns;
+
+        rs->prior_delivered = cb->tx.delivered;
+        rs->is_app_limited = cb->tx.app_limited;
+
+        // the slower of the send and ACK rates bounds what the path really delivered
+        rs->interval_us = (send_elapsed > ack_elapsed ? send_elapsed : ack_elapsed) / 1000;
+        if (rs->interval_us == 0) rs->interval_us = 1;
+
+        sk->first_tx_ns = cb->tx_ns;
+    }
+}
+
+void tcp_rate_gen(struct tcp_sock *sk, struct tcp_rate_sample *rs) {
+    // the application limited period ends once everything sent during it is delivered
+    if (sk->app_limited && sk->delivered > sk->app_limited) {
+        sk->app_limited = 0;
+    }
+
+    if (!rs->acked || !rs->interval_us) {
+        rs->interval_us = 0;
+        rs->delivered = 0;
+        return;
+    }
+
+    rs->delivered = sk->delivered - rs->prior_delivered;
+}
+
+void tcp_rate_check_app_limited(struct tcp_sock *sk) {
+    // nothing left to send though the window has room: the rate samples measure the app, not the path
+    if (!sk->send_head && tcp_packets_in_flight(sk) < sk->cwnd) {
+        sk->app_limited = sk->delivered + tcp_packets_in_flight(sk);
+        if (!sk->app_limited) sk->app_limited = 1;
+    }
+}
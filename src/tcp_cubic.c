@@ -0,0 +1,129 @@
+#include "tcp.h"
+#include "utils.h"
+
+/*
+ * CUBIC (RFC 9438). After a loss the window follows W(t) = C * (t - K)^3 + W_max: it climbs back
+ * fast to the window where the loss happened, plateaus around it, then probes beyond. The growth
+ * depends on time since the loss rather than on the RTT, so long fat pipes refill in seconds
+ * where Reno would take minutes. Never grows slower than Reno would in the same situation.
+ */
+#define CUBIC_C        0.4 // scaling constant, segments / s^3
+#define CUBIC_BETA     0.7 // multiplicative decrease
+#define CUBIC_ALPHA    (3.0 * (1.0 - CUBIC_BETA) / (1.0 + CUBIC_BETA)) // Reno-friendly additive increase
+
+struct cubic {
+    double w_max;          // window before the last reduction
+    double w_last_max;     // previous w_max, for fast convergence
+    double k;              // seconds to climb back to w_max
+    double origin;         // plateau of the current curve
+    double w_est;          // what Reno would have by now
+    uint64_t epoch_ns;     // start of the current growth period, 0 = not started
+};
+
+_Static_assert(sizeof(struct cubic) <= TCP_CA_PRIV_SIZE, "CUBIC state doesn't fit in ca_priv");
+
+/* Cube root without pulling in libm, Newton's method is plenty for window sized numbers */
+static double cubic_cbrt(double x) {
+    double y = x > 1.0 ? x / 3.0 : 1.0;
+    int i;
+
+    if (x <= 0.0) {
+        return 0.0;
+    }
+    for (i = 0; i < 40; i++) {
+        double next = (2.0 * y + x / (y * y)) / 3.0;
+        if (next == y) break;
+        y = next;
+    }
+    return y;
+}
+
+static void cubic_init(struct tcp_sock *sk) {
+    sk->cwnd = TCP_INIT_CWND;
+    sk->ssthresh = 0x7fffffff;
+    sk->cwnd_cnt = 0;
+}
+
+static void cubic_on_ack(struct tcp_sock *sk, const struct tcp_rate_sample *rs) {
+    struct cubic *ca = tcp_ca_priv(sk);
+    uint32_t acked = rs->acked;
+    double t, target, need;
+    uint32_t cnt;
+
+    if (sk->in_recovery || !acked) {
+        return;
+    }
+
+    if (sk->cwnd < sk->ssthresh) {
+        sk->cwnd += acked;
+        if (sk->cwnd <= sk->ssthresh) {
+            return;
+        }
+        acked = sk->cwnd - sk->ssthresh;
+        sk->cwnd = sk->ssthresh;
+    }
+
+    if (!ca->epoch_ns) {
+        ca->epoch_ns = clock_ns();
+        ca->w_est = sk->cwnd;
+        if (sk->cwnd < ca->w_max) {
+            ca->k = cubic_cbrt((ca->w_max - sk->cwnd) / CUBIC_C);
+            ca->origin = ca->w_max;
+        } else {
+            ca->k = 0;
+            ca->origin = sk->cwnd;
+        }
+    }
+
+    // where the curve will be one RTT from now
+    t = (double)(clock_ns() - ca->epoch_ns) / 1e9 + (double)sk->srtt_us / 1e6 - ca->k;
+    target = ca->origin + CUBIC_C * t * t * t;
+
+    // ACKs needed per one segment increase. At or above the curve barely grow, which also caps
+    // it in double: just below the plateau target - cwnd gets tiny and the quotient huge
+    need = 100.0 * sk->cwnd;
+    if (target > sk->cwnd && sk->cwnd / (target - sk->cwnd) < need) {
+        need = sk->cwnd / (target - sk->cwnd);
+    }
+
+    // Reno-friendly region: never slower than standard TCP
+    ca->w_est += CUBIC_ALPHA * acked / sk->cwnd;
+    if (ca->w_est > sk->cwnd && sk->cwnd / (ca->w_est - sk->cwnd) < need) {
+        need = sk->cwnd / (ca->w_est - sk->cwnd);
+    }
+    cnt = need;
+
+    if (cnt < 2) cnt = 2; // at most 1.5x per RTT (RFC 9438 4.4)
+
+    sk->cwnd_cnt += acked;
+    if (sk->cwnd_cnt >= cnt) {
+        sk->cwnd += sk->cwnd_cnt / cnt;
+        sk->cwnd_cnt %= cnt;
+    }
+}
+
+static void cubic_on_loss(struct tcp_sock *sk, int event) {
+    struct cubic *ca = tcp_ca_priv(sk);
+
+    ca->epoch_ns = 0;
+
+    // fast convergence: a flow that lost before reaching its last peak gives up extra room
+    if (sk->cwnd < ca->w_last_max) {
+        ca->w_max = sk->cwnd * (1.0 + CUBIC_BETA) / 2.0;
+    } else {
+        ca->w_max = sk->cwnd;
+    }
+    ca->w_last_max = sk->cwnd;
+
+    sk->ssthresh = (uint32_t)(sk->cwnd * CUBIC_BETA);
+    if (sk->ssthresh < 2) sk->ssthresh = 2;
+    sk->cwnd = event == TCP_CA_LOSS ? 1 : sk->ssthresh;
+    sk->cwnd_cnt = 0;
+}
+
+struct tcp_cong_ops tcp_cubic_ops = {
+    .name = "cubic",
+    .init = cubic_init,
+    .on_ack = cubic_on_ack,
+    .on_loss = cubic_on_loss,
+};
@@ -0,0 +1,1037 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+
+#include "tcp.h"
+#include "stats.h"
+#include "mem.h"
+#include "utils.h"
+
+#define tcp_dbg(fmt, ...) \
+    do { if (verbose) printf("TCP: " fmt "\n", ##__VA_ARGS__); } while (0)
+
+/* Get the pktbuf back from its out-of-order queue node */
+static inline struct pktbuf *tcp_ooo_pkt(struct itree_node *node) {
+    struct tcp_skb_cb *cb = container_of(node, struct tcp_skb_cb, ooo);
+    return container_of((uint8_t *)cb, struct pktbuf, cb);
+}
+
+void tcp_parse_options(struct tcp_header *th, struct tcp_options *opts) {
+    uint8_t *p = th->options;
+    int len = th->doff * 4 - sizeof(struct tcp_header);
+
+    memset(opts, 0, sizeof(*opts));
+
+    while (len > 0) {
+        uint8_t kind = *p, optlen;
+
+        if (kind == TCPOPT_EOL) {
+            break;
+        }
+        if (kind == TCPOPT_NOP) {
+            p++;
+            len--;
+            continue;
+        }
+
+        if (len < 2) break;
+        optlen = p[1];
+        if (optlen < 2 || optlen > len) break; // malformed, ignore the rest
+
+        switch (kind) {
+            case TCPOPT_MSS:
+                if (optlen == TCPOLEN_MSS) {
+                    opts->mss = (p[2] << 8) | p[3];
+                    opts->saw_mss = 1;
+                }
+                break;
+            case TCPOPT_WSCALE:
+                if (optlen == TCPOLEN_WSCALE) {
+                    opts->wscale = p[2] > TCP_MAX_WSCALE ? TCP_MAX_WSCALE : p[2];
+                    opts->saw_wscale = 1;
+                }
+                break;
+            case TCPOPT_SACK_PERM:
+                if (optlen == TCPOLEN_SACK_PERM) {
+                    opts->sack_ok = 1;
+                }
+                break;
+            case TCPOPT_TIMESTAMP:
+                if (optlen == TCPOLEN_TIMESTAMP) {
+                    uint32_t v;
+                    memcpy(&v, p + 2, 4);
+                    opts->tsval = ntohl(v);
+                    memcpy(&v, p + 6, 4);
+                    opts->tsecr = ntohl(v);
+                    opts->saw_tstamp = 1;
+                }
+                break;
+            case TCPOPT_SACK:
+                if ((optlen - 2) % 8 == 0) {
+                    int i, n = (optlen - 2) / 8;
+                    for (i = 0; i < n && opts->num_sacks < TCP_MAX_SACKS; i++) {
+                        uint32_t v;
+                        memcpy(&v, p + 2 + 8 * i, 4);
+                        opts->sacks[opts->num_sacks].start = ntohl(v);
+                        memcpy(&v, p + 6 + 8 * i, 4);
+                        opts->sacks[opts->num_sacks].end = ntohl(v);
+                        opts->num_sacks++;
+                    }
+                }
+                break;
+        }
+
+        p += optlen;
+        len -= optlen;
+    }
+}
+
+/* Take the options a SYN offered into account */
+static void tcp_apply_syn_options(struct tcp_sock *sk, struct tcp_options *opts) {
+    sk->peer_mss = opts->saw_mss ? opts->mss : TCP_DEFAULT_MSS;
+
+    // window scaling only counts if both sides offer it
+    sk->wscale_ok = opts->saw_wscale;
+    if (sk->wscale_ok) {
+        sk->snd_wscale = opts->wscale;
+    } else {
+        sk->snd_wscale = 0;
+        sk->rcv_wscale = 0;
+    }
+
+    sk->sack_ok = opts->sack_ok;
+    sk->ts_ok = opts->saw_tstamp;
+    if (sk->ts_ok) {
+        sk->ts_recent = opts->tsval;
+        sk->ts_recent_stamp = tcp_time_stamp();
+    }
+
+    tcp_sync_mss(sk);
+}
+
+/* RTT sample from an echoed timestamp or a transmit time, whichever is more precise. Returns it or -1 */
+static int64_t tcp_ack_update_rtt(struct tcp_sock *sk, struct tcp_options *opts, uint64_t tx_ns) {
+    int64_t rtt_us = -1;
+
+    if (tx_ns) {
+        rtt_us = (clock_ns() - tx_ns) / 1000;
+    } else if (sk->ts_ok && opts->saw_tstamp && opts->tsecr) {
+        rtt_us = (int64_t)(tcp_time_stamp() - opts->tsecr) * 1000;
+    }
+
+    if (rtt_us >= 0) {
+        tcp_rtt_sample(sk, rtt_us);
+    }
+    return rtt_us;
+}
+
+/* The handshake completed: turn a request into a connection on the listener's accept queue. Returns it with a reference held */
+static struct tcp_sock *tcp_create_child(struct tcp_sock *lsk, struct tcp_request_sock *req, struct tcp_header *th, uint32_t seq) {
+    struct tcp_sock *sk = tcp_sock_alloc();
+
+    if (!sk) {
+        return NULL;
+    }
+
+    sk->saddr = req->saddr;
+    sk->sport = req->sport;
+    sk->daddr = req->daddr;
+    sk->dport = req->dport;
+
+    sk->irs = req->irs;
+    sk->rcv_nxt = req->irs + 1;
+    sk->peer_mss = req->peer_mss;
+    sk->wscale_ok = req->wscale_ok;
+    sk->snd_wscale = req->snd_wscale;
+    if (!sk->wscale_ok) {
+        sk->rcv_wscale = 0;
+    }
+    sk->sack_ok = req->sack_ok;
+    sk->ts_ok = req->ts_ok;
+    if (sk->ts_ok) {
+        sk->ts_recent = req->ts_recent;
+        sk->ts_recent_stamp = tcp_time_stamp();
+    }
+    tcp_sync_mss(sk);
+
+    // the window the SYN-ACK offered
+    sk->rcv_wnd = sk->rcv_buf > 0xffff ? 0xffff : sk->rcv_buf;
+    sk->rcv_wup = sk->rcv_nxt;
+
+    sk->iss = req->iss;
+    sk->snd_una = req->iss + 1;
+    sk->snd_nxt = req->iss + 1;
+    sk->write_seq = req->iss + 1;
+    sk->snd_wnd = (uint32_t)ntohs(th->win) << sk->snd_wscale;
+    sk->snd_wl1 = seq;
+    sk->snd_wl2 = sk->snd_una;
+    sk->max_window = sk->snd_wnd;
+    sk->nodelay = lsk->nodelay;
+    sk->cork = lsk->cork;
+    if (sk->ca_ops != lsk->ca_ops) {
+        tcp_cong_assign(sk, lsk->ca_ops);
+    }
+
+    // Karn: a retransmitted SYN-ACK gives no RTT sample
+    if (req->syn_tx_ns && !req->retries) {
+        tcp_rtt_sample(sk, (clock_ns() - req->syn_tx_ns) / 1000);
+    }
+
+    // the listener keeps the owner reference until the application accepts it
+    sk->orphan = 1;
+    sk->parent = lsk;
+    tcp_sock_hold(lsk);
+    tcp_set_state(sk, TCP_ESTABLISHED);
+
+    list_add_tail(&lsk->accept_queue, &sk->accept_list);
+    lsk->accept_count++;
+    pthread_cond_broadcast(&lsk->wait);
+
+    tcp_sock_hold(sk); // for the caller
+    tcp_hash(sk);
+    STATS_INC(STAT_TCP_PASSIVE_OPENS);
+    return sk;
+}
+
+/* A SYN arrived on a listener: remember it in the SYN queue, or in a cookie if the queue is full */
+static void tcp_listen_syn(struct tcp_sock *lsk, struct pktbuf *pkt, struct tcp_header *th, struct tcp_options *opts) {
+    struct ip_header *iph = (struct ip_header *)pkt->nh;
+    struct tcp_request_sock *req, tmp;
+
+    STATS_INC(STAT_TCP_SYN_RECV);
+
+    // a retransmitted SYN means our SYN-ACK got lost
+    req = tcp_synq_find(lsk, iph->daddr, iph->saddr, ntohs(th->sport));
+    if (req) {
+        if (TCP_CB(pkt)->seq == req->irs) {
+            tcp_send_synack_req(lsk, req);
+        }
+        return;
+    }
+
+    if (lsk->accept_count >= lsk->backlog) {
+        tcp_dbg("Accept queue full on port %d, dropping SYN", lsk->sport);
+        STATS_INC(STAT_TCP_LISTEN_DROPS);
+        return;
+    }
+
+    memset(&tmp, 0, sizeof(tmp));
+    tmp.saddr = iph->daddr;
+    tmp.sport = ntohs(th->dport);
+    tmp.daddr = iph->saddr;
+    tmp.dport = ntohs(th->sport);
+    tmp.irs = TCP_CB(pkt)->seq;
+    tmp.snd_wnd = ntohs(th->win);
+    tmp.peer_mss = opts->saw_mss ? opts->mss : TCP_DEFAULT_MSS;
+    tmp.wscale_ok = opts->saw_wscale;
+    tmp.snd_wscale = opts->saw_wscale ? opts->wscale : 0;
+    tmp.sack_ok = opts->sack_ok;
+    tmp.ts_ok = opts->saw_tstamp;
+    tmp.ts_recent = opts->tsval;
+
+    // under pressure keep nothing, the SYN-ACK's sequence number remembers the request for us
+    if (lsk->syn_count >= lsk->backlog) {
+        tcp_dbg("SYN queue full on port %d, sending cookie", lsk->sport);
+        tmp.iss = tcp_syncookie_make(&tmp);
+        lsk->cookie_ns = clock_ns();
+        STATS_INC(STAT_TCP_SYNCOOKIES_SENT);
+        tcp_send_synack_req(lsk, &tmp);
+        return;
+    }
+
+    req = malloc(sizeof(*req));
+    if (!req) {
+        return;
+    }
+    *req = tmp;
+    req->iss = tcp_new_isn(req->saddr, req->sport, req->daddr, req->dport);
+    req->syn_tx_ns = clock_ns();
+    req->expires = req->syn_tx_ns + TCP_RTO_INIT_MS * 1000000ULL;
+
+    tcp_send_synack_req(lsk, req);
+    tcp_synq_add(lsk, req);
+}
+
+/* An ACK arrived on a listener: complete a queued request or a cookie. Returns the new connection, held */
+static struct tcp_sock *tcp_listen_ack(struct tcp_sock *lsk, struct pktbuf *pkt, struct tcp_header *th, struct tcp_options *opts) {
+    struct ip_header *iph = (struct ip_header *)pkt->nh;
+    struct tcp_skb_cb *cb = TCP_CB(pkt);
+    uint32_t ack = ntohl(th->ack_seq);
+    struct tcp_request_sock *req, tmp;
+    struct tcp_sock *sk;
+
+    req = tcp_synq_find(lsk, iph->daddr, iph->saddr, ntohs(th->sport));
+    if (req) {
+        if (ack != req->iss + 1) {
+            tcp_send_reset(pkt);
+            return NULL;
+        }
+        if (cb->seq != req->irs + 1) {
+            return NULL;
+        }
+        if (lsk->accept_count >= lsk->backlog) {
+            STATS_INC(STAT_TCP_LISTEN_DROPS);
+            return NULL; // keep the request, the next SYN-ACK retransmission brings the ACK back
+        }
+
+        sk = tcp_create_child(lsk, req, th, cb->seq);
+        if (sk) {
+            tcp_synq_remove(lsk, req);
+        }
+        return sk;
+    }
+
+    // with several queue workers another one may have completed this handshake since we looked the listener up
+    sk = tcp_lookup(iph->daddr, ntohs(th->dport), iph->saddr, ntohs(th->sport));
+    if (sk && sk != lsk && sk->state != TCP_LISTEN) {
+        return sk;
+    }
+    if (sk) {
+        tcp_sock_put(sk);
+    }
+
+    // not queued, maybe one of the cookies we handed out while the queue was full
+    if (lsk->cookie_ns && clock_ns() - lsk->cookie_ns < TCP_COOKIE_WINDOW_MS * 1000000ULL) {
+        memset(&tmp, 0, sizeof(tmp));
+        tmp.saddr = iph->daddr;
+        tmp.sport = ntohs(th->dport);
+        tmp.daddr = iph->saddr;
+        tmp.dport = ntohs(th->sport);
+        tmp.irs = cb->seq - 1;
+        tmp.iss = ack - 1;
+
+        if (tcp_syncookie_check(&tmp, tmp.iss) == 0) {
+            STATS_INC(STAT_TCP_SYNCOOKIES_RECV);
+            if (lsk->accept_count >= lsk->backlog) {
+                STATS_INC(STAT_TCP_LISTEN_DROPS);
+                return NULL;
+            }
+
+            // timestamps were agreed on if the ACK carries one
+            tmp.ts_ok = opts->saw_tstamp;
+            tmp.ts_recent = opts->tsval;
+            return tcp_create_child(lsk, &tmp, th, cb->seq);
+        }
+    }
+
+    STATS_INC(STAT_TCP_SYNCOOKIES_FAILED);
+    tcp_send_reset(pkt); // nothing on this port is expecting an ACK
+    return NULL;
+}
+
+/* A segment for a listener. Returns the connection (held) that should process the rest of it, if any */
+static struct tcp_sock *tcp_listen_input(struct tcp_sock *lsk, struct pktbuf *pkt, struct tcp_header *th, struct tcp_options *opts) {
+    struct ip_header *iph = (struct ip_header *)pkt->nh;
+    struct tcp_request_sock *req;
+
+    if (th->flags & TCP_RST) {
+        // the peer gave up on the handshake
+        req = tcp_synq_find(lsk, iph->daddr, iph->saddr, ntohs(th->sport));
+        if (req && TCP_CB(pkt)->seq == req->irs + 1) {
+            tcp_synq_remove(lsk, req);
+        }
+        return NULL;
+    }
+
+    if (th->flags & TCP_ACK) {
+        if (th->flags & TCP_SYN) {
+            tcp_send_reset(pkt);
+            return NULL;
+        }
+        return tcp_listen_ack(lsk, pkt, th, opts);
+    }
+
+    if (th->flags & TCP_SYN) {
+        tcp_listen_syn(lsk, pkt, th, opts);
+    }
+    return NULL;
+}
+
+/* Response to a SYN-ACK (or a simultaneous open SYN) while in SYN_SENT */
+static void tcp_synsent_input(struct tcp_sock *sk, struct pktbuf *pkt, struct tcp_header *th, struct tcp_options *opts) {
+    struct tcp_skb_cb *cb = TCP_CB(pkt);
+    uint32_t ack = ntohl(th->ack_seq);
+
+    if (th->flags & TCP_ACK) {
+        if (seq_leq(ack, sk->iss) || seq_after(ack, sk->snd_nxt)) {
+            tcp_send_reset(pkt);
+            return;
+        }
+        if (th->flags & TCP_RST) {
+            tcp_dbg("Connection refused");
+            sk->err = ECONNREFUSED;
+            tcp_done(sk);
+            return;
+        }
+    }
+
+    if ((th->flags & TCP_RST) || !(th->flags & TCP_SYN)) {
+        return;
+    }
+
+    sk->irs = cb->seq;
+    sk->rcv_nxt = cb->seq + 1;
+    tcp_apply_syn_options(sk, opts);
+
+    if (!(th->flags & TCP_ACK)) {
+        // simultaneous open, both sides sent a SYN
+        tcp_set_state(sk, TCP_SYN_RECEIVED);
+        tcp_send_synack(sk);
+        return;
+    }
+
+    sk->snd_una = ack;
+    sk->snd_wnd = ntohs(th->win); // not scaled in a SYN
+    sk->snd_wl1 = cb->seq;
+    sk->snd_wl2 = ack;
+    sk->max_window = sk->snd_wnd;
+    sk->retries = 0;
+    tcp_ack_update_rtt(sk, opts, sk->backoff ? 0 : sk->syn_tx_ns);
+    sk->backoff = 0;
+    tcp_clear_timer(sk, &sk->rto_timer);
+
+    tcp_set_state(sk, TCP_ESTABLISHED);
+    tcp_send_ack(sk);
+    pthread_cond_broadcast(&sk->wait);
+}
+
+/* Is the segment at least partly inside our receive window */
+static int tcp_sequence_ok(struct tcp_sock *sk, uint32_t seq, uint32_t end_seq) {
+    return !seq_before(end_seq, sk->rcv_wup) && !seq_after(seq, sk->rcv_nxt + sk->rcv_wnd);
+}
+
+/* Mark segments covered by the peer's SACK blocks */
+static void tcp_sacktag(struct tcp_sock *sk, struct tcp_options *opts, uint32_t ack, struct tcp_rate_sample *rs) {
+    uint64_t now = clock_ns();
+    list_head *elem;
+    int i;
+
+    for (i = 0; i < opts->num_sacks; i++) {
+        uint32_t start = opts->sacks[i].start, end = opts->sacks[i].end;
+
+        // ignore blocks that are already cumulatively ACKed or cover data we never sent
+        if (!seq_before(start, end) || seq_leq(end, ack) || seq_after(end, sk->snd_nxt)) {
+            continue;
+        }
+
+        list_for_each(elem, &sk->write_queue) {
+            struct pktbuf *pkt = list_entry(elem, struct pktbuf, list);
+            struct tcp_skb_cb *cb = TCP_CB(pkt);
+
+            if (pkt == sk->send_head || seq_geq(cb->seq, end)) {
+                break;
+            }
+            if (seq_before(cb->seq, start) || seq_after(cb->end_seq, end) || (cb->sacked & TCPCB_SACKED)) {
+                continue;
+            }
+
+            cb->sacked |= TCPCB_SACKED;
+            sk->sacked_out++;
+            tcp_rate_skb_delivered(sk, pkt, rs);
+            tcp_rack_advance(sk, cb, now);
+            if (cb->sacked & TCPCB_LOST) {
+                cb->sacked &= ~TCPCB_LOST;
+                sk->lost_out--;
+            }
+            if (cb->sacked & TCPCB_RETRANS) {
+                cb->sacked &= ~TCPCB_RETRANS;
+                sk->retrans_out--;
+            }
+            if (seq_after(cb->end_seq, sk->highest_sack)) {
+                sk->highest_sack = cb->end_seq;
+            }
+        }
+    }
+}
+
+/* Without SACK all a dupACK or partial ACK tells is that the first segment is missing */
+static void tcp_mark_head_lost(struct tcp_sock *sk) {
+    struct pktbuf *pkt;
+    struct tcp_skb_cb *cb;
+
+    if (list_empty(&sk->write_queue) || (pkt = list_first_entry(&sk->write_queue, struct pktbuf, list)) == sk->send_head) {
+        return;
+    }
+    cb = TCP_CB(pkt);
+    if (!(cb->sacked & (TCPCB_LOST | TCPCB_RETRANS))) {
+        cb->sacked |= TCPCB_LOST;
+        sk->lost_out++;
+    }
+}
+
+/* Free everything the cumulative ACK covers. Returns the number of segments */
+static uint32_t tcp_clean_rtx_queue(struct tcp_sock *sk, uint32_t ack, uint64_t *rtt_tx_ns, struct tcp_rate_sample *rs) {
+    uint64_t now = clock_ns();
+    uint32_t acked = 0;
+
+    while (!list_empty(&sk->write_queue)) {
+        struct pktbuf *pkt = list_first_entry(&sk->write_queue, struct pktbuf, list);
+        struct tcp_skb_cb *cb = TCP_CB(pkt);
+
+        if (pkt == sk->send_head) {
+            break;
+        }
+
+        if (seq_after(cb->end_seq, ack)) {
+            // partially ACKed, drop the covered bytes so a retransmission only sends the rest
+            if (seq_after(ack, cb->seq)) {
+                if (pkt->frag) {
+                    pktbuf_frag_pull(pkt, ack - cb->seq);
+                } else {
+                    pktbuf_pull(pkt, ack - cb->seq);
+                }
+                cb->seq = ack;
+                cb->csum_ok = 0;
+            }
+            break;
+        }
+
+        // Karn: only segments never retransmitted give a usable RTT sample
+        if (!(cb->sacked & TCPCB_EVER_RETRANS)) {
+            *rtt_tx_ns = cb->tx_ns;
+        }
+
+        if (!(cb->sacked & TCPCB_SACKED)) {
+            // SACKed ones were counted back then
+            tcp_rate_skb_delivered(sk, pkt, rs);
+            tcp_rack_advance(sk, cb, now);
+        }
+
+        sk->packets_out--;
+        if (cb->sacked & TCPCB_SACKED) sk->sacked_out--;
+        if (cb->sacked & TCPCB_LOST) sk->lost_out--;
+        if (cb->sacked & TCPCB_RETRANS) sk->retrans_out--;
+
+        list_del(&pkt->list);
+        free_pktbuf(pkt);
+        acked++;
+    }
+
+    return acked;
+}
+
+/* Process the acknowledgment field. Returns -1 if the segment should be dropped */
+static int tcp_ack(struct tcp_sock *sk, struct pktbuf *pkt, struct tcp_header *th, struct tcp_options *opts) {
+    struct tcp_skb_cb *cb = TCP_CB(pkt);
+    uint32_t ack = ntohl(th->ack_seq);
+    uint32_t win = (uint32_t)ntohs(th->win) << sk->snd_wscale;
+    uint32_t prior_una = sk->snd_una;
+    struct tcp_rate_sample rs = { .rtt_us = -1 };
+    uint64_t rtt_tx_ns = 0;
+    int win_update = 0;
+
+    if (seq_after(ack, sk->snd_nxt)) {
+        tcp_send_ack(sk); // ACKs something we never sent
+        return -1;
+    }
+    if (seq_before(ack, sk->snd_una)) {
+        return 0; // old duplicate, the data may still be useful
+    }
+
+    // RFC 793 window update rules, only from the newest segments
+    if (seq_before(sk->snd_wl1, cb->seq) || (sk->snd_wl1 == cb->seq && seq_leq(sk->snd_wl2, ack))) {
+        win_update = win != sk->snd_wnd;
+        sk->snd_wnd = win;
+        sk->snd_wl1 = cb->seq;
+        sk->snd_wl2 = ack;
+        if (win > sk->max_window) sk->max_window = win;
+    }
+
+    rs.prior_in_flight = tcp_packets_in_flight(sk);
+
+    if (sk->sack_ok && opts->num_sacks) {
+        tcp_sacktag(sk, opts, ack, &rs);
+    }
+
+    if (ack == prior_una) {
+        // duplicate ACK: nothing new ACKed, no data, no window change, while data is outstanding
+        if (sk->packets_out && pktbuf_total_len(pkt) == 0 && !win_update && !(th->flags & (TCP_SYN | TCP_FIN))) {
+            sk->dupacks++;
+        }
+    } else {
+        tcp_tlp_ack(sk, ack);
+        tcp_clean_rtx_queue(sk, ack, &rtt_tx_ns, &rs);
+
+        sk->snd_una = ack;
+        sk->dupacks = 0;
+        sk->backoff = 0;
+        sk->retries = 0;
+        rs.rtt_us = tcp_ack_update_rtt(sk, opts, rtt_tx_ns);
+
+        if (sk->in_recovery) {
+            if (!seq_before(ack, sk->high_seq)) {
+                sk->in_recovery = 0; // everything outstanding at the start of recovery is ACKed
+            } else if (!sk->sack_ok) {
+                tcp_mark_head_lost(sk); // NewReno partial ACK: the next hole is lost too
+            }
+        }
+
+        // restart the retransmission timer for what's left
+        if (sk->packets_out) {
+            tcp_reset_timer(sk, &sk->rto_timer, clock_ns() + sk->rto_ms * 1000000ULL);
+        } else {
+            tcp_clear_timer(sk, &sk->rto_timer);
+        }
+
+        pthread_cond_broadcast(&sk->wait); // send buffer space freed
+    }
+
+    // with SACK, RACK finds losses by send time. Without, three duplicate ACKs mean the first segment was lost
+    if (sk->sack_ok) {
+        if (sk->rack_advanced) {
+            tcp_rack_detect_loss(sk);
+        }
+    } else if (!sk->in_recovery && sk->packets_out && sk->dupacks >= TCP_DUPTHRESH) {
+        tcp_enter_recovery(sk);
+        tcp_mark_head_lost(sk);
+    }
+
+    // hand what got delivered to the congestion control
+    tcp_rate_gen(sk, &rs);
+    if (rs.acked) {
+        sk->ca_ops->on_ack(sk, &rs);
+    }
+
+    if (sk->lost_out) {
+        tcp_xmit_retransmit_queue(sk);
+    }
+
+    // progress restarts the probe timeout
+    if (ack != prior_una || opts->num_sacks) {
+        tcp_schedule_loss_probe(sk);
+    }
+
+    // our FIN is ACKed once everything we ever queued is
+    if (sk->fin_queued && sk->snd_una == sk->write_seq) {
+        switch (sk->state) {
+            case TCP_FIN_WAIT_1:
+                tcp_set_state(sk, TCP_FIN_WAIT_2);
+                if (sk->orphan) {
+                    // don't wait forever for a peer that never closes
+                    tcp_reset_timer(sk, &sk->tw_timer, clock_ns() + TCP_TIMEWAIT_MS * 1000000ULL);
+                }
+                break;
+            case TCP_CLOSING:
+                tcp_set_state(sk, TCP_TIME_WAIT);
+                tcp_clear_timer(sk, &sk->rto_timer);
+                tcp_reset_timer(sk, &sk->tw_timer, clock_ns() + TCP_TIMEWAIT_MS * 1000000ULL);
+                break;
+            case TCP_LAST_ACK:
+                tcp_done(sk);
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* The peer closed its side */
+static void tcp_fin(struct tcp_sock *sk) {
+    sk->rcv_shutdown = 1;
+    sk->ack_now = 1;
+
+    switch (sk->state) {
+        case TCP_SYN_RECEIVED:
+        case TCP_ESTABLISHED:
+            tcp_set_state(sk, TCP_CLOSE_WAIT);
+            break;
+        case TCP_FIN_WAIT_1:
+            tcp_set_state(sk, TCP_CLOSING);
+            break;
+        case TCP_FIN_WAIT_2:
+            tcp_set_state(sk, TCP_TIME_WAIT);
+            tcp_clear_timer(sk, &sk->rto_timer);
+            tcp_reset_timer(sk, &sk->tw_timer, clock_ns() + TCP_TIMEWAIT_MS * 1000000ULL);
+            break;
+    }
+
+    pthread_cond_broadcast(&sk->wait);
+}
+
+/* Hand an in-order segment to the receive queue */
+static void tcp_queue_rcv(struct tcp_sock *sk, struct pktbuf *pkt) {
+    struct tcp_skb_cb *cb = TCP_CB(pkt);
+    int fin = cb->tcp_flags & TCP_FIN;
+    uint32_t len = pktbuf_total_len(pkt);
+
+    sk->rcv_nxt = cb->end_seq;
+
+    if (len > 0) {
+        list_add_tail(&sk->rcv_queue, &pkt->list);
+        sk->rcv_queue_bytes += len;
+        mem_charge(MEM_SOCK_RCV, len, 0);
+    } else {
+        free_pktbuf(pkt);
+    }
+
+    if (fin) {
+        tcp_fin(sk);
+    }
+}
+
+/* Queue a segment that arrived ahead of rcv_nxt, trimmed against what's already queued */
+static void tcp_ooo_queue(struct tcp_sock *sk, struct pktbuf *pkt) {
+    struct tcp_skb_cb *cb = TCP_CB(pkt);
+    uint32_t start = cb->seq, end = cb->end_seq;
+    struct itree_node *node;
+
+    while ((node = itree_first_overlap(&sk->ooo_queue, start, end))) {
+        struct pktbuf *old = tcp_ooo_pkt(node);
+
+        if (seq_leq(node->start, start) && seq_geq(node->end, end)) {
+            free_pktbuf(pkt); // nothing new in it
+            return;
+        }
+
+        if (seq_before(start, node->start) && seq_after(end, node->end)) {
+            // the new segment covers the queued one entirely, replace it
+            itree_remove(&sk->ooo_queue, node);
+            sk->ooo_bytes -= pktbuf_total_len(old);
+            mem_charge(MEM_SOCK_RCV, -(int64_t)pktbuf_total_len(old), 0);
+            free_pktbuf(old);
+        } else if (seq_leq(node->start, start)) {
+            // queued one covers our front
+            pktbuf_pull_all(pkt, node->end - start);
+            start = node->end;
+        } else {
+            // queued one covers our back (including any FIN we carry)
+            pktbuf_trim(pkt, node->start - start);
+            cb->tcp_flags &= ~TCP_FIN;
+            end = node->start;
+        }
+    }
+
+    cb->seq = cb->ooo.start = start;
+    cb->end_seq = cb->ooo.end = end;
+    itree_insert(&sk->ooo_queue, &cb->ooo);
+    sk->ooo_bytes += pktbuf_total_len(pkt);
+    mem_charge(MEM_SOCK_RCV, pktbuf_total_len(pkt), 0);
+    sk->ooo_last_start = start;
+    sk->ooo_last_end = end;
+}
+
+/* Move whatever the out-of-order queue now has in sequence to the receive queue */
+static void tcp_ooo_drain(struct tcp_sock *sk) {
+    struct itree_node *node;
+
+    while ((node = itree_first(&sk->ooo_queue)) && seq_leq(node->start, sk->rcv_nxt)) {
+        struct pktbuf *pkt = tcp_ooo_pkt(node);
+        struct tcp_skb_cb *cb = TCP_CB(pkt);
+
+        itree_remove(&sk->ooo_queue, node);
+        sk->ooo_bytes -= pktbuf_total_len(pkt);
+        mem_charge(MEM_SOCK_RCV, -(int64_t)pktbuf_total_len(pkt), 0);
+
+        if (seq_leq(cb->end_seq, sk->rcv_nxt)) {
+            free_pktbuf(pkt);
+            continue;
+        }
+
+        pktbuf_pull_all(pkt, sk->rcv_nxt - cb->seq);
+        cb->seq = sk->rcv_nxt;
+        tcp_queue_rcv(sk, pkt);
+    }
+}
+
+/*
+ * Short of memory: give up everything held out of order. Under pressure nothing more gets in to
+ * fill the holes, so it would only sit there. The sender still has it all, SACKed or not
+ */
+static void tcp_prune_ofo(struct tcp_sock *sk) {
+    struct itree_node *node;
+
+    tcp_dbg("Pruning %u bytes of out-of-order data", sk->ooo_bytes);
+    while ((node = itree_first(&sk->ooo_queue))) {
+        itree_remove(&sk->ooo_queue, node);
+        free_pktbuf(tcp_ooo_pkt(node));
+    }
+    mem_charge(MEM_SOCK_RCV, -(int64_t)sk->ooo_bytes, 0);
+    sk->ooo_bytes = 0;
+    STATS_INC(STAT_TCP_OFO_PRUNED);
+}
+
+/* Whether len more bytes of payload stay within the receive buffer */
+static inline int tcp_rmem_fits(struct tcp_sock *sk, uint32_t len) {
+    return sk->rcv_queue_bytes + sk->ooo_bytes + len <= mem_sock_limit(sk->rcv_buf);
+}
+
+/* Queue the segment's data (takes ownership of pkt) */
+static void tcp_data_queue(struct tcp_sock *sk, struct pktbuf *pkt) {
+    struct tcp_skb_cb *cb = TCP_CB(pkt);
+
+    if (mem_pressure() && !itree_empty(&sk->ooo_queue)) {
+        tcp_prune_ofo(sk);
+    }
+
+    if (cb->seq == cb->end_seq) {
+        free_pktbuf(pkt); // pure ACK
+        return;
+    }
+
+    if (seq_leq(cb->end_seq, sk->rcv_nxt)) {
+        // complete duplicate, our ACK must have been lost
+        sk->ack_now = 1;
+        tcp_schedule_ack(sk);
+        free_pktbuf(pkt);
+        return;
+    }
+
+    if (seq_before(cb->seq, sk->rcv_nxt)) {
+        // partially new, trim what we already have
+        pktbuf_pull_all(pkt, sk->rcv_nxt - cb->seq);
+        cb->seq = sk->rcv_nxt;
+    }
+
+    if (cb->seq == sk->rcv_nxt) {
+        int filled_hole = !itree_empty(&sk->ooo_queue);
+
+        // a peer overrunning the window, or memory pressure shrank the buffer under it. An empty
+        // queue always takes the segment so the connection keeps moving
+        if (!list_empty(&sk->rcv_queue) && !tcp_rmem_fits(sk, pktbuf_total_len(pkt))) {
+            tcp_dbg("Receive buffer full, dropping %u bytes", pktbuf_total_len(pkt));
+            STATS_INC(STAT_TCP_RCVQ_DROP);
+            sk->ack_now = 1;
+            tcp_schedule_ack(sk);
+            free_pktbuf(pkt);
+            return;
+        }
+
+        if (pktbuf_total_len(pkt) >= sk->mss) {
+            sk->rcv_segs += pkt->gso_segs ? pkt->gso_segs : 1; // GRO may have coalesced several
+        }
+        tcp_queue_rcv(sk, pkt);
+
+        if (filled_hole) {
+            tcp_ooo_drain(sk);
+            sk->ack_now = 1; // let the sender know right away that the hole is filled
+        }
+
+        tcp_schedule_ack(sk);
+        pthread_cond_broadcast(&sk->wait);
+        return;
+    }
+
+    if (!seq_before(cb->seq, sk->rcv_nxt + sk->rcv_wnd)) {
+        // entirely beyond the window we offered
+        sk->ack_now = 1;
+        tcp_schedule_ack(sk);
+        free_pktbuf(pkt);
+        return;
+    }
+
+    // a hole before it, queue it and send a duplicate ACK carrying SACK right away. Short of
+    // memory, only what's in order is kept, the sender retransmits the rest
+    if (mem_pressure() || !tcp_rmem_fits(sk, pktbuf_total_len(pkt))) {
+        tcp_dbg("No room for out-of-order data, dropping %u bytes", pktbuf_total_len(pkt));
+        STATS_INC(STAT_TCP_OFO_DROP);
+        sk->ack_now = 1;
+        tcp_schedule_ack(sk);
+        free_pktbuf(pkt);
+        return;
+    }
+    tcp_ooo_queue(sk, pkt);
+    sk->ack_now = 1;
+    tcp_schedule_ack(sk);
+}
+
+/* Segment processing for everything past the handshake (RFC 793 "SEGMENT ARRIVES") */
+static void tcp_rcv_state_process(struct tcp_sock *sk, struct pktbuf *pkt, struct tcp_header *th, struct tcp_options *opts) {
+    struct tcp_skb_cb *cb = TCP_CB(pkt);
+
+    // PAWS (RFC 7323): a timestamp older than the last one means an old duplicate
+    if (sk->ts_ok && opts->saw_tstamp && !(th->flags & TCP_RST) &&
+        (int32_t)(opts->tsval - sk->ts_recent) < 0 && tcp_time_stamp() - sk->ts_recent_stamp < 24U * 24 * 3600 * 1000) {
+        tcp_send_ack(sk);
+        free_pktbuf(pkt);
+        return;
+    }
+
+    if (!tcp_sequence_ok(sk, cb->seq, cb->end_seq)) {
+        if (!(th->flags & TCP_RST)) {
+            tcp_send_ack(sk);
+        }
+        free_pktbuf(pkt);
+        return;
+    }
+
+    if (th->flags & TCP_RST) {
+        if (cb->seq == sk->rcv_nxt) {
+            tcp_dbg("Connection reset by peer");
+            sk->err = sk->state == TCP_SYN_RECEIVED ? ECONNREFUSED : ECONNRESET;
+            tcp_done(sk);
+        } else {
+            tcp_send_ack(sk); // challenge ACK (RFC 5961), a blind reset won't guess rcv_nxt
+        }
+        free_pktbuf(pkt);
+        return;
+    }
+
+    // remember the timestamp to echo, from segments that don't skip ahead
+    if (sk->ts_ok && opts->saw_tstamp && seq_leq(cb->seq, sk->rcv_wup)) {
+        sk->ts_recent = opts->tsval;
+        sk->ts_recent_stamp = tcp_time_stamp();
+    }
+
+    if (th->flags & TCP_SYN) {
+        if (sk->state == TCP_SYN_RECEIVED && cb->seq == sk->irs) {
+            tcp_send_synack(sk); // our SYN-ACK got lost, the peer retransmitted its SYN
+        } else {
+            tcp_send_ack(sk); // challenge ACK for a SYN on an open connection
+        }
+        free_pktbuf(pkt);
+        return;
+    }
+
+    if (!(th->flags & TCP_ACK)) {
+        free_pktbuf(pkt);
+        return;
+    }
+
+    // simultaneous open, listeners' children are created established
+    if (sk->state == TCP_SYN_RECEIVED) {
+        uint32_t ack = ntohl(th->ack_seq);
+
+        if (!seq_after(ack, sk->snd_una) || seq_after(ack, sk->snd_nxt)) {
+            tcp_send_reset(pkt);
+            free_pktbuf(pkt);
+            return;
+        }
+
+        sk->snd_una = ack;
+        sk->snd_wnd = (uint32_t)ntohs(th->win) << sk->snd_wscale;
+        sk->snd_wl1 = cb->seq;
+        sk->snd_wl2 = ack;
+        sk->max_window = sk->snd_wnd;
+        sk->retries = 0;
+        tcp_ack_update_rtt(sk, opts, sk->backoff ? 0 : sk->syn_tx_ns);
+        sk->backoff = 0;
+        tcp_clear_timer(sk, &sk->rto_timer);
+        tcp_set_state(sk, TCP_ESTABLISHED);
+        pthread_cond_broadcast(&sk->wait);
+    }
+
+    if (tcp_ack(sk, pkt, th, opts) < 0) {
+        free_pktbuf(pkt);
+        return;
+    }
+
+    switch (sk->state) {
+        case TCP_ESTABLISHED:
+        case TCP_FIN_WAIT_1:
+        case TCP_FIN_WAIT_2:
+            tcp_data_queue(sk, pkt);
+            break;
+
+        case TCP_TIME_WAIT:
+            // the peer retransmitted its FIN, our last ACK got lost
+            if (th->flags & TCP_FIN) {
+                tcp_send_ack(sk);
+                tcp_reset_timer(sk, &sk->tw_timer, clock_ns() + TCP_TIMEWAIT_MS * 1000000ULL);
+            }
+            free_pktbuf(pkt);
+            break;
+
+        default:
+            // the peer already closed its side, later data makes no sense
+            if (cb->seq != cb->end_seq) {
+                sk->ack_now = 1;
+                tcp_schedule_ack(sk);
+            }
+            free_pktbuf(pkt);
+            break;
+    }
+
+    // ACKs may have opened the window, push out whatever is waiting
+    tcp_write_xmit(sk, 0);
+}
+
+void tcp_recv(struct pktbuf *pkt) {
+    struct ip_header *iph = (struct ip_header *)pkt->nh;
+    struct tcp_header *th;
+    struct tcp_options opts;
+    struct tcp_skb_cb *cb;
+    struct tcp_sock *sk, *child;
+    int hlen;
+
+    STATS_ADD(STAT_TCP_IN_SEGS, pkt->gso_segs ? pkt->gso_segs : 1);
+
+    if (pkt->len < sizeof(struct tcp_header)) {
+        tcp_dbg("Packet too short for TCP header");
+        STATS_INC(STAT_TCP_IN_ERRS);
+        free_pktbuf(pkt);
+        return;
+    }
+
+    th = (struct tcp_header *)pkt->data;
+    hlen = th->doff * 4;
+
+    if (hlen < sizeof(struct tcp_header) || hlen > pkt->len) {
+        tcp_dbg("Bad TCP header length %d", hlen);
+        STATS_INC(STAT_TCP_IN_ERRS);
+        free_pktbuf(pkt);
+        return;
+    }
+
+    if (!pkt->l4_csum_ok && ip_pseudo_checksum(iph->saddr, iph->daddr, IP_P_TCP, th, pkt->len) != 0) {
+        tcp_dbg("Invalid TCP checksum");
+        STATS_INC(STAT_TCP_IN_ERRS);
+        STATS_INC(STAT_TCP_IN_CSUM_ERRORS);
+        free_pktbuf(pkt);
+        return;
+    }
+
+    tcp_parse_options(th, &opts);
+    pktbuf_pull(pkt, hlen);
+
+    cb = TCP_CB(pkt);
+    cb->seq = ntohl(th->seq);
+    cb->end_seq = cb->seq + pktbuf_total_len(pkt) + !!(th->flags & TCP_SYN) + !!(th->flags & TCP_FIN);
+    cb->tcp_flags = th->flags;
+    cb->sacked = 0;
+    cb->tx_ns = 0;
+
+    sk = tcp_flow_lookup(pkt->hash, iph->daddr, ntohs(th->dport), iph->saddr, ntohs(th->sport));
+    if (!sk) {
+        tcp_dbg("No socket for port %d, sending reset", ntohs(th->dport));
+        tcp_send_reset(pkt);
+        free_pktbuf(pkt);
+        return;
+    }
+
+    pthread_mutex_lock(&sk->lock);
+
+    switch (sk->state) {
+        case TCP_LISTEN:
+            child = tcp_listen_input(sk, pkt, th, &opts);
+            if (!child) {
+                free_pktbuf(pkt);
+                break;
+            }
+
+            // whatever else the final ACK carries (data, FIN) is for the new connection
+            pthread_mutex_unlock(&sk->lock);
+            tcp_sock_put(sk);
+            sk = child;
+            pthread_mutex_lock(&sk->lock);
+            tcp_rcv_state_process(sk, pkt, th, &opts);
+            break;
+
+        case TCP_SYN_SENT:
+            tcp_synsent_input(sk, pkt, th, &opts);
+            free_pktbuf(pkt);
+            break;
+
+        case TCP_CLOSED:
+            free_pktbuf(pkt);
+            break;
+
+        default:
+            tcp_rcv_state_process(sk, pkt, th, &opts);
+            break;
+    }
+
+    pthread_mutex_unlock(&sk->lock);
+    tcp_sock_put(sk);
+}
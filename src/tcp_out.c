@@ -0,0 +1,681 @@
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "tcp.h"
+#include "netdev.h"
+#include "stats.h"
+#include "mem.h"
+#include "utils.h"
+
+#define tcp_dbg(fmt, ...) \
+    do { if (verbose) printf("TCP: " fmt "\n", ##__VA_ARGS__); } while (0)
+
+/* Sockets with an ACK due at the end of the current RX burst, owned by the RX thread */
+static __thread list_head tcp_ack_list;
+
+static inline list_head *tcp_ack_list_get(void) {
+    // thread-local addresses aren't constant, so set the list up on first use
+    if (!tcp_ack_list.next) {
+        list_init(&tcp_ack_list);
+    }
+    return &tcp_ack_list;
+}
+
+/* Payload MSS for the current options, keeps every data segment inside one frame */
+void tcp_sync_mss(struct tcp_sock *sk) {
+    struct netdev *dev = netdev_get();
+    uint16_t mss = dev->mtu - sizeof(struct ip_header) - sizeof(struct tcp_header);
+
+    if (sk->peer_mss && sk->peer_mss < mss) {
+        mss = sk->peer_mss;
+    }
+    if (sk->ts_ok) {
+        mss -= TCPOLEN_TSTAMP_ALIGNED; // every segment carries a timestamp
+    }
+    sk->mss = mss;
+}
+
+uint32_t tcp_select_window(struct tcp_sock *sk) {
+    int32_t free_space = mem_sock_limit(sk->rcv_buf) - (sk->rcv_queue_bytes + sk->ooo_bytes);
+    int32_t cur = sk->rcv_wup + sk->rcv_wnd - sk->rcv_nxt; // what's left of the last advertisement
+    uint32_t win;
+
+    if (free_space < 0) free_space = 0;
+    if (cur < 0) cur = 0;
+
+    // never shrink the window we already offered, and don't bother offering less than a segment more
+    win = free_space;
+    if (win < (uint32_t)cur || win - cur < sk->mss) {
+        win = cur;
+    }
+
+    if (win > (0xffffU << sk->rcv_wscale)) {
+        win = 0xffffU << sk->rcv_wscale;
+    }
+    win &= ~((1U << sk->rcv_wscale) - 1); // must be expressible after scaling
+
+    sk->rcv_wnd = win;
+    sk->rcv_wup = sk->rcv_nxt;
+    return win >> sk->rcv_wscale;
+}
+
+void tcp_rcv_space_update(struct tcp_sock *sk) {
+    int32_t free_space = mem_sock_limit(sk->rcv_buf) - (sk->rcv_queue_bytes + sk->ooo_bytes);
+    int32_t cur = sk->rcv_wup + sk->rcv_wnd - sk->rcv_nxt;
+
+    if (sk->state != TCP_ESTABLISHED && sk->state != TCP_FIN_WAIT_1 && sk->state != TCP_FIN_WAIT_2) {
+        return;
+    }
+
+    // tell the peer once the window has grown by a couple of segments, or reopened from (almost) zero
+    if (free_space - cur >= 2 * sk->mss || (cur < sk->mss && free_space >= sk->mss)) {
+        tcp_send_ack(sk);
+    }
+}
+
+/* Write SYN or SYN-ACK options, whichever of SACK, timestamps and window scaling are on. Returns their length */
+static int tcp_write_syn_options(uint8_t *opt, int sack, int ts, uint32_t ts_recent, int ws, uint8_t rcv_wscale) {
+    struct netdev *dev = netdev_get();
+    uint16_t mss = dev->mtu - sizeof(struct ip_header) - sizeof(struct tcp_header);
+    uint8_t *p = opt;
+
+    *p++ = TCPOPT_MSS;
+    *p++ = TCPOLEN_MSS;
+    *p++ = mss >> 8;
+    *p++ = mss & 0xff;
+
+    if (ts) {
+        uint32_t tsval = htonl(tcp_time_stamp());
+        uint32_t tsecr = htonl(ts_recent);
+
+        if (sack) {
+            *p++ = TCPOPT_SACK_PERM; // shares the alignment padding with the timestamp
+            *p++ = TCPOLEN_SACK_PERM;
+        } else {
+            *p++ = TCPOPT_NOP;
+            *p++ = TCPOPT_NOP;
+        }
+        *p++ = TCPOPT_TIMESTAMP;
+        *p++ = TCPOLEN_TIMESTAMP;
+        memcpy(p, &tsval, 4);
+        memcpy(p + 4, &tsecr, 4);
+        p += 8;
+    } else if (sack) {
+        *p++ = TCPOPT_NOP;
+        *p++ = TCPOPT_NOP;
+        *p++ = TCPOPT_SACK_PERM;
+        *p++ = TCPOLEN_SACK_PERM;
+    }
+
+    if (ws) {
+        *p++ = TCPOPT_NOP;
+        *p++ = TCPOPT_WSCALE;
+        *p++ = TCPOLEN_WSCALE;
+        *p++ = rcv_wscale;
+    }
+
+    return p - opt;
+}
+
+/* Write the options of a SYN or SYN-ACK. Returns their length */
+static int tcp_syn_options(struct tcp_sock *sk, uint8_t *opt, int synack) {
+    // a SYN offers everything, a SYN-ACK only what the peer offered
+    if (!synack) {
+        return tcp_write_syn_options(opt, 1, 1, 0, 1, sk->rcv_wscale);
+    }
+    return tcp_write_syn_options(opt, sk->sack_ok, sk->ts_ok, sk->ts_recent, sk->wscale_ok, sk->rcv_wscale);
+}
+
+/* Collect the SACK blocks for our out-of-order queue, the most recently changed one first (RFC 2018) */
+static int tcp_sack_blocks(struct tcp_sock *sk, uint32_t *blocks, int max) {
+    struct itree_node *node;
+    uint32_t start, end;
+    int n = 1;
+
+    blocks[0] = blocks[1] = 0;
+
+    for (node = itree_first(&sk->ooo_queue); node; ) {
+        // merge runs of back to back segments into one block
+        start = node->start;
+        end = node->end;
+        for (node = itree_next(&sk->ooo_queue, node); node && node->start == end; node = itree_next(&sk->ooo_queue, node)) {
+            end = node->end;
+        }
+
+        if (seq_leq(start, sk->ooo_last_start) && seq_after(end, sk->ooo_last_start)) {
+            blocks[0] = start; // contains the latest arrival
+            blocks[1] = end;
+        } else if (n < max) {
+            blocks[2 * n] = start;
+            blocks[2 * n + 1] = end;
+            n++;
+        }
+    }
+
+    if (blocks[0] == blocks[1]) {
+        // latest arrival got delivered already, shift the rest down
+        memmove(blocks, blocks + 2, 2 * (n - 1) * sizeof(uint32_t));
+        n--;
+    }
+
+    return n;
+}
+
+/* Write the options of an established segment. Returns their length */
+static int tcp_established_options(struct tcp_sock *sk, uint8_t *opt) {
+    uint8_t *p = opt;
+
+    if (sk->ts_ok) {
+        uint32_t tsval = htonl(tcp_time_stamp());
+        uint32_t tsecr = htonl(sk->ts_recent);
+
+        *p++ = TCPOPT_NOP;
+        *p++ = TCPOPT_NOP;
+        *p++ = TCPOPT_TIMESTAMP;
+        *p++ = TCPOLEN_TIMESTAMP;
+        memcpy(p, &tsval, 4);
+        memcpy(p + 4, &tsecr, 4);
+        p += 8;
+    }
+
+    if (sk->sack_ok && !itree_empty(&sk->ooo_queue)) {
+        uint32_t blocks[2 * TCP_MAX_SACKS];
+        int n = tcp_sack_blocks(sk, blocks, sk->ts_ok ? 3 : 4), i;
+
+        if (n > 0) {
+            *p++ = TCPOPT_NOP;
+            *p++ = TCPOPT_NOP;
+            *p++ = TCPOPT_SACK;
+            *p++ = 2 + 8 * n;
+            for (i = 0; i < 2 * n; i++) {
+                uint32_t v = htonl(blocks[i]);
+                memcpy(p, &v, 4);
+                p += 4;
+            }
+        }
+    }
+
+    return p - opt;
+}
+
+/* Push the TCP header onto a buffer holding the payload and send it */
+static int tcp_transmit(struct tcp_sock *sk, struct pktbuf *pkt, uint32_t seq, uint8_t flags) {
+    uint8_t opts[TCP_MAX_OPTLEN];
+    struct tcp_header *th;
+    int optlen;
+
+    if (flags & TCP_SYN) {
+        optlen = tcp_syn_options(sk, opts, flags & TCP_ACK);
+    } else {
+        optlen = tcp_established_options(sk, opts);
+    }
+
+    th = pktbuf_push(pkt, sizeof(struct tcp_header) + optlen);
+    if (!th) {
+        free_pktbuf(pkt);
+        return -1;
+    }
+
+    th->sport = htons(sk->sport);
+    th->dport = htons(sk->dport);
+    th->seq = htonl(seq);
+    th->ack_seq = (flags & TCP_ACK) ? htonl(sk->rcv_nxt) : 0;
+    th->rsvd = 0;
+    th->doff = (sizeof(struct tcp_header) + optlen) / 4;
+    th->flags = flags;
+    th->urp = 0;
+    memcpy(th->options, opts, optlen);
+
+    // windows in SYNs are never scaled
+    if (flags & TCP_SYN) {
+        uint32_t win = sk->rcv_buf > 0xffff ? 0xffff : sk->rcv_buf;
+        sk->rcv_wnd = win;
+        sk->rcv_wup = sk->rcv_nxt;
+        th->win = htons(win);
+    } else {
+        th->win = htons(tcp_select_window(sk));
+    }
+
+    // a super-frame only gets the pseudo header sum, whoever cuts it up finishes each segment's checksum
+    th->csum = 0;
+    if (pkt->gso_size) {
+        th->csum = ~checksum_fold(ip_pseudo_sum(sk->saddr, sk->daddr, IP_P_TCP, pktbuf_total_len(pkt)));
+    } else {
+        th->csum = ip_pseudo_checksum_pkt(sk->saddr, sk->daddr, IP_P_TCP, pkt);
+    }
+
+    // every segment we send carries the latest ACK
+    if (flags & TCP_ACK) {
+        sk->ack_pending = 0;
+        sk->ack_now = 0;
+        sk->rcv_segs = 0;
+        tcp_clear_timer(sk, &sk->delack_timer);
+    }
+
+    STATS_ADD(STAT_TCP_OUT_SEGS, pkt->gso_segs ? pkt->gso_segs : 1);
+    return ip_output(pkt, sk->daddr, IP_P_TCP);
+}
+
+/* Send a segment with no payload */
+static int tcp_send_ctl(struct tcp_sock *sk, uint32_t seq, uint8_t flags) {
+    struct pktbuf *pkt = alloc_pktbuf(TCP_MAX_HEADER);
+
+    if (!pkt) {
+        return -1;
+    }
+    pktbuf_reserve(pkt, TCP_MAX_HEADER);
+
+    return tcp_transmit(sk, pkt, seq, flags);
+}
+
+int tcp_send_syn(struct tcp_sock *sk) {
+    sk->syn_tx_ns = clock_ns();
+    return tcp_send_ctl(sk, sk->iss, TCP_SYN);
+}
+
+int tcp_send_synack(struct tcp_sock *sk) {
+    sk->syn_tx_ns = clock_ns();
+    return tcp_send_ctl(sk, sk->iss, TCP_SYN | TCP_ACK);
+}
+
+int tcp_send_synack_req(struct tcp_sock *lsk, struct tcp_request_sock *req) {
+    uint8_t opts[TCP_MAX_OPTLEN];
+    struct tcp_header *th;
+    struct pktbuf *pkt;
+    int optlen;
+
+    pkt = alloc_pktbuf(TCP_MAX_HEADER);
+    if (!pkt) {
+        return -1;
+    }
+    pktbuf_reserve(pkt, TCP_MAX_HEADER);
+
+    // the child will use the listener's receive buffer, so its window scale too
+    optlen = tcp_write_syn_options(opts, req->sack_ok, req->ts_ok, req->ts_recent, req->wscale_ok,
+        req->wscale_ok ? lsk->rcv_wscale : 0);
+    th = pktbuf_push(pkt, sizeof(struct tcp_header) + optlen);
+
+    th->sport = htons(req->sport);
+    th->dport = htons(req->dport);
+    th->seq = htonl(req->iss);
+    th->ack_seq = htonl(req->irs + 1);
+    th->rsvd = 0;
+    th->doff = (sizeof(struct tcp_header) + optlen) / 4;
+    th->flags = TCP_SYN | TCP_ACK;
+    th->win = htons(lsk->rcv_buf > 0xffff ? 0xffff : lsk->rcv_buf);
+    th->urp = 0;
+    memcpy(th->options, opts, optlen);
+
+    th->csum = 0;
+    th->csum = ip_pseudo_checksum(req->saddr, req->daddr, IP_P_TCP, th, pkt->len);
+
+    STATS_INC(STAT_TCP_OUT_SEGS);
+    return ip_output(pkt, req->daddr, IP_P_TCP);
+}
+
+int tcp_send_ack(struct tcp_sock *sk) {
+    return tcp_send_ctl(sk, sk->snd_nxt, TCP_ACK);
+}
+
+void tcp_send_active_reset(struct tcp_sock *sk) {
+    STATS_INC(STAT_TCP_OUT_RSTS);
+    tcp_send_ctl(sk, sk->snd_nxt, TCP_RST | TCP_ACK);
+}
+
+void tcp_send_probe(struct tcp_sock *sk) {
+    // an already ACKed sequence number makes the peer answer with its current window
+    tcp_send_ctl(sk, sk->snd_una - 1, TCP_ACK);
+}
+
+void tcp_send_reset(struct pktbuf *in) {
+    struct ip_header *iph = (struct ip_header *)in->nh;
+    struct tcp_header *inth = (struct tcp_header *)in->th;
+    struct tcp_header *th;
+    struct pktbuf *pkt;
+
+    if (inth->flags & TCP_RST) {
+        return; // never answer a reset with a reset
+    }
+
+    pkt = alloc_pktbuf(TCP_MAX_HEADER);
+    if (!pkt) {
+        return;
+    }
+    pktbuf_reserve(pkt, TCP_MAX_HEADER);
+
+    th = pktbuf_push(pkt, sizeof(struct tcp_header));
+    memset(th, 0, sizeof(*th));
+    th->sport = inth->dport;
+    th->dport = inth->sport;
+    th->doff = sizeof(struct tcp_header) / 4;
+
+    // RFC 793: take the sequence number from their ACK, or ACK whatever they sent
+    if (inth->flags & TCP_ACK) {
+        th->seq = inth->ack_seq;
+        th->flags = TCP_RST;
+    } else {
+        th->ack_seq = htonl(TCP_CB(in)->end_seq);
+        th->flags = TCP_RST | TCP_ACK;
+    }
+
+    th->csum = ip_pseudo_checksum(iph->daddr, iph->saddr, IP_P_TCP, th, pkt->len);
+    STATS_INC(STAT_TCP_OUT_SEGS);
+    STATS_INC(STAT_TCP_OUT_RSTS);
+    ip_output(pkt, iph->saddr, IP_P_TCP);
+}
+
+/* Send a copy of a queued segment, the original stays queued for retransmission */
+static int tcp_transmit_pkt(struct tcp_sock *sk, struct pktbuf *pkt) {
+    struct tcp_skb_cb *cb = TCP_CB(pkt);
+    struct pktbuf *copy = pktbuf_clone(pkt);
+
+    if (!copy) {
+        return -1;
+    }
+
+    cb->tx_ns = clock_ns();
+    tcp_rate_skb_sent(sk, pkt);
+    return tcp_transmit(sk, copy, cb->seq, cb->tcp_flags | TCP_ACK);
+}
+
+int tcp_retransmit_pkt(struct tcp_sock *sk, struct pktbuf *pkt) {
+    struct tcp_skb_cb *cb = TCP_CB(pkt);
+
+    tcp_dbg("Retransmitting seq %u len %d", cb->seq - sk->iss, pktbuf_total_len(pkt));
+
+    if (tcp_transmit_pkt(sk, pkt) < 0) {
+        return -1;
+    }
+    STATS_INC(STAT_TCP_RETRANS_SEGS);
+
+    if (!(cb->sacked & TCPCB_RETRANS)) {
+        sk->retrans_out++;
+    }
+    cb->sacked |= TCPCB_RETRANS | TCPCB_EVER_RETRANS;
+    return 0;
+}
+
+void tcp_xmit_retransmit_queue(struct tcp_sock *sk) {
+    list_head *elem;
+
+    list_for_each(elem, &sk->write_queue) {
+        struct pktbuf *pkt = list_entry(elem, struct pktbuf, list);
+        struct tcp_skb_cb *cb = TCP_CB(pkt);
+
+        if (pkt == sk->send_head) {
+            break; // the rest was never sent
+        }
+        if (tcp_packets_in_flight(sk) >= sk->cwnd) {
+            break;
+        }
+        if ((cb->sacked & (TCPCB_LOST | TCPCB_RETRANS | TCPCB_SACKED)) != TCPCB_LOST) {
+            continue;
+        }
+
+        tcp_retransmit_pkt(sk, pkt);
+    }
+
+    if (sk->packets_out && !timer_pending(&sk->rto_timer)) {
+        tcp_reset_timer(sk, &sk->rto_timer, clock_ns() + sk->rto_ms * 1000000ULL);
+    }
+}
+
+/* Largest run of payload to put in one super-frame */
+static uint32_t tcp_gso_size_goal(struct tcp_sock *sk) {
+    uint32_t goal = TCP_GSO_MAX_SIZE / sk->mss * sk->mss;
+
+    // a paced flow gets about 1 ms worth per frame, so big frames don't turn into line rate bursts
+    if (sk->pacing_rate) {
+        uint64_t paced = sk->pacing_rate / 1000;
+        if (paced < 2 * sk->mss) paced = 2 * sk->mss;
+        if (paced < goal) goal = paced;
+    }
+    return goal;
+}
+
+/* Do segs queued segments starting at first reference one stretch of application memory */
+static int tcp_run_contiguous(struct pktbuf *first, int segs) {
+    struct pktbuf *pkt = first, *next;
+    int i;
+
+    for (i = 1; i < segs; i++, pkt = next) {
+        next = list_entry(pkt->list.next, struct pktbuf, list);
+        if (!pkt->ubuf || next->ubuf != pkt->ubuf || pkt->len || next->len || next->frag != pkt->frag + pkt->frag_len) {
+            return 0;
+        }
+    }
+    return first->ubuf != NULL;
+}
+
+/* Partial checksum of a queued segment's payload, kept until the payload changes */
+static uint32_t tcp_skb_csum(struct pktbuf *pkt) {
+    struct tcp_skb_cb *cb = TCP_CB(pkt);
+
+    if (!cb->csum_ok) {
+        cb->csum = checksum_partial(pkt->data, pkt->len, 0);
+        if (pkt->frag_len) {
+            cb->csum = checksum_partial(pkt->frag, pkt->frag_len, cb->csum); // only ever one or the other
+        }
+        cb->csum_ok = 1;
+    }
+    return cb->csum;
+}
+
+/* Send segs queued segments starting at first as one frame, a GSO super-frame when there's more than one */
+static int tcp_transmit_run(struct tcp_sock *sk, struct pktbuf *first, int segs, uint32_t bytes, uint8_t flags) {
+    struct pktbuf *frame, *pkt = first;
+    int soft_gso = !(netdev_get()->features & NETDEV_F_GSO);
+    uint32_t csum;
+    int i;
+
+    if (segs == 1) {
+        frame = pktbuf_clone(first);
+        if (!frame) {
+            return -1;
+        }
+        return tcp_transmit(sk, frame, TCP_CB(first)->seq, flags);
+    }
+
+    // one zero-copy send cut into segments stays one piece of memory, the frame points at all of it
+    if (tcp_run_contiguous(first, segs)) {
+        frame = alloc_pktbuf(TCP_MAX_HEADER);
+        if (!frame) {
+            return -1;
+        }
+        pktbuf_reserve(frame, TCP_MAX_HEADER);
+        pktbuf_attach(frame, first->frag, bytes, first->ubuf);
+    } else {
+        frame = alloc_pktbuf(TCP_MAX_HEADER);
+        if (!frame) {
+            return -1;
+        }
+        pktbuf_reserve(frame, TCP_MAX_HEADER);
+
+        // the frame points at each segment's payload. Cut up in software, every slice is one of
+        // them and reuses its checksum, the device does its own otherwise
+        for (i = 0; i < segs; i++) {
+            if (soft_gso) {
+                csum = tcp_skb_csum(pkt);
+            }
+            if (pktbuf_add_piece(frame, pkt, pkt->len ? pkt->data : pkt->frag, pktbuf_total_len(pkt),
+                                 soft_gso ? &csum : NULL) < 0) {
+                free_pktbuf(frame);
+                return -1;
+            }
+            pkt = list_entry(pkt->list.next, struct pktbuf, list);
+        }
+    }
+    frame->gso_size = sk->mss;
+    frame->gso_segs = segs;
+
+    return tcp_transmit(sk, frame, TCP_CB(first)->seq, flags);
+}
+
+void tcp_write_xmit(struct tcp_sock *sk, int push_one) {
+    uint32_t prior_nxt = sk->snd_nxt;
+    struct pktbuf *pkt;
+
+    if (sk->state != TCP_ESTABLISHED && sk->state != TCP_CLOSE_WAIT &&
+        sk->state != TCP_FIN_WAIT_1 && sk->state != TCP_CLOSING && sk->state != TCP_LAST_ACK) {
+        return;
+    }
+
+    while (sk->send_head) {
+        struct pktbuf *first = sk->send_head;
+        uint32_t goal = tcp_gso_size_goal(sk), bytes = 0;
+        uint64_t now = clock_ns(), wire = 0;
+        uint8_t flags = TCP_ACK;
+        int segs = 0;
+
+        // paced: come back from the timer when the next slot opens
+        if (sk->pacing_rate && sk->pacing_next_ns > now) {
+            if (!timer_pending(&sk->pacing_timer)) {
+                tcp_reset_timer(sk, &sk->pacing_timer, sk->pacing_next_ns);
+            }
+            break;
+        }
+
+        // take every segment that may go now, up to the size goal, and send them as one frame
+        while ((pkt = sk->send_head)) {
+            struct tcp_skb_cb *cb = TCP_CB(pkt);
+            uint32_t len = pktbuf_total_len(pkt);
+
+            if (tcp_packets_in_flight(sk) >= sk->cwnd) {
+                break; // congestion window full
+            }
+            if (seq_after(cb->end_seq, sk->snd_una + sk->snd_wnd) && len > 0) {
+                break; // doesn't fit in the peer's window
+            }
+
+            // a partial segment may wait for more data
+            if (len < sk->mss && !(cb->tcp_flags & TCP_FIN) && pkt->list.next == &sk->write_queue) {
+                if (sk->cork) {
+                    break;
+                }
+                if (!sk->nodelay && sk->packets_out) {
+                    break; // Nagle: hold small segments while data is unacknowledged
+                }
+            }
+
+            // a super-frame is full sized segments, optionally ending in a short one
+            if (segs && (len == 0 || len > sk->mss || bytes + len > goal || segs == PKTBUF_MAX_PIECES)) {
+                break;
+            }
+
+            cb->tx_ns = now;
+            tcp_rate_skb_sent(sk, pkt);
+
+            if (seq_after(cb->end_seq, sk->snd_nxt)) {
+                sk->snd_nxt = cb->end_seq;
+            }
+            sk->packets_out++;
+            sk->send_head = pkt->list.next == &sk->write_queue ? NULL : list_entry(pkt->list.next, struct pktbuf, list);
+
+            flags |= cb->tcp_flags;
+            bytes += len;
+            wire += len + sizeof(struct tcp_header) + sizeof(struct ip_header) + sizeof(struct eth_header);
+            segs++;
+
+            if (len != sk->mss || push_one) {
+                break;
+            }
+        }
+
+        if (!segs) {
+            break;
+        }
+
+        // a failed send looks like loss to the rest of TCP, recovery takes care of it
+        tcp_transmit_run(sk, first, segs, bytes, flags);
+
+        // space frames out by their wire size at the pacing rate. An idle gap earns no burst credit
+        if (sk->pacing_rate) {
+            if (sk->pacing_next_ns < now) sk->pacing_next_ns = now;
+            sk->pacing_next_ns += wire * 1000000000ULL / sk->pacing_rate;
+        }
+
+        if (push_one) {
+            break;
+        }
+    }
+
+    tcp_rate_check_app_limited(sk);
+
+    // something in flight needs the retransmission timer, a closed window needs the probe timer
+    if (!timer_pending(&sk->rto_timer) && (sk->packets_out || sk->send_head)) {
+        tcp_reset_timer(sk, &sk->rto_timer, clock_ns() + sk->rto_ms * 1000000ULL);
+    }
+
+    // new data at the tail, a probe covers it in case it's lost with nothing after it
+    if (sk->snd_nxt != prior_nxt) {
+        tcp_schedule_loss_probe(sk);
+    }
+}
+
+void tcp_queue_fin(struct tcp_sock *sk) {
+    struct pktbuf *pkt = list_empty(&sk->write_queue) ? NULL : list_entry(sk->write_queue.prev, struct pktbuf, list);
+
+    // ride on the last segment if it's still unsent, otherwise queue an empty one
+    if (!pkt || !sk->send_head) {
+        pkt = alloc_pktbuf(TCP_MAX_HEADER);
+        if (!pkt) {
+            return;
+        }
+        pktbuf_reserve(pkt, TCP_MAX_HEADER);
+        TCP_CB(pkt)->seq = TCP_CB(pkt)->end_seq = sk->write_seq;
+        TCP_CB(pkt)->tcp_flags = TCP_ACK;
+        TCP_CB(pkt)->sacked = 0;
+        list_add_tail(&sk->write_queue, &pkt->list);
+        if (!sk->send_head) {
+            sk->send_head = pkt;
+        }
+    }
+
+    TCP_CB(pkt)->tcp_flags |= TCP_FIN;
+    TCP_CB(pkt)->end_seq++;
+    sk->write_seq++;
+    sk->fin_queued = 1;
+
+    tcp_write_xmit(sk, 0);
+}
+
+void tcp_schedule_ack(struct tcp_sock *sk) {
+    sk->ack_pending = 1;
+
+    // out of order data, a FIN, two full segments or the start of a connection: ACK in this burst
+    if (sk->ack_now || sk->quickacks > 0 || sk->rcv_segs >= 2) {
+        if (sk->quickacks > 0) sk->quickacks--;
+        sk->ack_now = 1;
+        if (list_empty(&sk->ack_list)) {
+            tcp_sock_hold(sk);
+            list_add_tail(tcp_ack_list_get(), &sk->ack_list);
+        }
+        return;
+    }
+
+    if (!timer_pending(&sk->delack_timer)) {
+        tcp_reset_timer(sk, &sk->delack_timer, clock_ns() + TCP_DELACK_MS * 1000000ULL);
+    }
+}
+
+void tcp_flush_acks(void) {
+    list_head *ack_list = tcp_ack_list_get();
+    struct tcp_sock *sk;
+
+    // one ACK per connection for everything that arrived in the burst
+    while (!list_empty(ack_list)) {
+        sk = list_first_entry(ack_list, struct tcp_sock, ack_list);
+        list_del(&sk->ack_list);
+        list_init(&sk->ack_list);
+
+        pthread_mutex_lock(&sk->lock);
+        if (sk->ack_now && sk->ack_pending && sk->state != TCP_CLOSED) {
+            tcp_send_ack(sk);
+        }
+        sk->ack_now = 0;
+        pthread_mutex_unlock(&sk->lock);
+
+        tcp_sock_put(sk);
+    }
+}
@@ -0,0 +1,236 @@
+#include <stdio.h>
+
+#include "tcp.h"
+#include "utils.h"
+
+#define tcp_dbg(fmt, ...) \
+    do { if (verbose) printf("TCP: " fmt "\n", ##__VA_ARGS__); } while (0)
+
+/*
+ * RACK-TLP (RFC 8985). Instead of counting duplicate ACKs, RACK uses the per-segment transmit
+ * times in the write queue: once a segment sent later than another has been delivered, the
+ * earlier one is lost if it's still missing a reordering window after it should have arrived.
+ * Retransmissions get timestamped too, so a lost retransmission is caught the same way rather
+ * than by an RTO. The tail loss probe covers the case RACK can't see, the last segments of a
+ * burst getting lost with nothing sent after them: about two RTTs in, resend the last segment
+ * (or send new data) so the peer's SACK tells us what's missing.
+ */
+
+/* Enter fast recovery (RFC 6582), the congestion control decides how far to back off */
+void tcp_enter_recovery(struct tcp_sock *sk) {
+    tcp_dbg("Entering fast recovery, %u dupacks, %u SACKed", sk->dupacks, sk->sacked_out);
+
+    sk->high_seq = sk->snd_nxt;
+    sk->in_recovery = 1;
+    sk->ca_ops->on_loss(sk, TCP_CA_RECOVERY);
+}
+
+/* Was (t1, seq1) sent after (t2, seq2). Segments of one GSO batch share a send time, their order breaks the tie */
+static inline int tcp_rack_sent_after(uint64_t t1, uint32_t seq1, uint64_t t2, uint32_t seq2) {
+    return t1 > t2 || (t1 == t2 && seq_after(seq1, seq2));
+}
+
+void tcp_rack_advance(struct tcp_sock *sk, struct tcp_skb_cb *cb, uint64_t now) {
+    uint32_t rtt_us = (now - cb->tx_ns) / 1000;
+
+    // an ACK quicker than any RTT we know is for the original transmission, not this retransmission
+    if ((cb->sacked & TCPCB_EVER_RETRANS) && rtt_us < sk->min_rtt_us) {
+        return;
+    }
+
+    // an original transmission delivered below one delivered earlier: the path reorders
+    if (!(cb->sacked & TCPCB_EVER_RETRANS)) {
+        if (sk->rack_xmit_ns && seq_before(cb->end_seq, sk->rack_fack)) {
+            if (!sk->rack_reord) tcp_dbg("Reordering detected");
+            sk->rack_reord = 1;
+        } else {
+            sk->rack_fack = cb->end_seq;
+        }
+    }
+
+    if (!sk->rack_xmit_ns || tcp_rack_sent_after(cb->tx_ns, cb->end_seq, sk->rack_xmit_ns, sk->rack_end_seq)) {
+        sk->rack_xmit_ns = cb->tx_ns;
+        sk->rack_end_seq = cb->end_seq;
+        sk->rack_rtt_us = rtt_us;
+        sk->rack_advanced = 1;
+    }
+}
+
+/* How long past its expected arrival a segment may still show up, in microseconds */
+static uint32_t tcp_rack_reo_wnd(struct tcp_sock *sk) {
+    uint32_t wnd;
+
+    // without reordering on this path, dupACK-like evidence calls for fast loss marking
+    if (!sk->rack_reord && (sk->in_recovery || sk->sacked_out >= TCP_DUPTHRESH)) {
+        return 0;
+    }
+
+    wnd = sk->min_rtt_us / 4;
+    return wnd < sk->srtt_us ? wnd : sk->srtt_us;
+}
+
+void tcp_rack_detect_loss(struct tcp_sock *sk) {
+    uint64_t now = clock_ns();
+    int64_t reo_ns = (int64_t)tcp_rack_reo_wnd(sk) * 1000, timeout = 0;
+    list_head *elem;
+
+    sk->rack_advanced = 0;
+    if (!sk->rack_xmit_ns) {
+        return;
+    }
+
+    list_for_each(elem, &sk->write_queue) {
+        struct pktbuf *pkt = list_entry(elem, struct pktbuf, list);
+        struct tcp_skb_cb *cb = TCP_CB(pkt);
+        int64_t remaining;
+
+        if (pkt == sk->send_head) {
+            break;
+        }
+        if ((cb->sacked & TCPCB_SACKED) || (cb->sacked & (TCPCB_LOST | TCPCB_RETRANS)) == TCPCB_LOST) {
+            continue; // delivered, or already waiting for its retransmission
+        }
+
+        if (!tcp_rack_sent_after(sk->rack_xmit_ns, sk->rack_end_seq, cb->tx_ns, cb->end_seq)) {
+            // original transmissions go out in sequence order, everything after this one was sent later too
+            if (!(cb->sacked & TCPCB_EVER_RETRANS)) {
+                break;
+            }
+            continue;
+        }
+
+        remaining = (int64_t)(cb->tx_ns + sk->rack_rtt_us * 1000ULL + reo_ns - now);
+        if (remaining > 0) {
+            if (remaining > timeout) timeout = remaining;
+            continue;
+        }
+
+        if (!sk->in_recovery) {
+            tcp_enter_recovery(sk);
+        }
+
+        // lost, possibly again: a lost retransmission is just another hole to fill
+        if (cb->sacked & TCPCB_RETRANS) {
+            cb->sacked &= ~TCPCB_RETRANS;
+            sk->retrans_out--;
+        }
+        if (!(cb->sacked & TCPCB_LOST)) {
+            cb->sacked |= TCPCB_LOST;
+            sk->lost_out++;
+        }
+    }
+
+    // check again once the earliest pending segment's reordering window runs out
+    if (timeout) {
+        tcp_reset_timer(sk, &sk->rack_timer, now + timeout);
+    }
+}
+
+void tcp_rack_handler(struct timer *t) {
+    struct tcp_sock *sk = t->arg;
+
+    pthread_mutex_lock(&sk->lock);
+    if (sk->state != TCP_CLOSED && sk->packets_out) {
+        tcp_rack_detect_loss(sk);
+        if (sk->lost_out) {
+            tcp_xmit_retransmit_queue(sk);
+        }
+    }
+    pthread_mutex_unlock(&sk->lock);
+
+    tcp_sock_put(sk);
+}
+
+/* States that send data, the probe only makes sense there */
+static inline int tcp_tlp_state_ok(struct tcp_sock *sk) {
+    return sk->state == TCP_ESTABLISHED || sk->state == TCP_CLOSE_WAIT || sk->state == TCP_FIN_WAIT_1 ||
+        sk->state == TCP_CLOSING || sk->state == TCP_LAST_ACK;
+}
+
+void tcp_schedule_loss_probe(struct tcp_sock *sk) {
+    uint64_t pto_ns, expires;
+
+    // TLP needs SACK to learn what the probe repaired, and is for the tail only, not for ongoing recovery
+    if (!sk->sack_ok || !sk->packets_out || sk->in_recovery || sk->lost_out || sk->tlp_high_seq ||
+        !sk->srtt_us || !tcp_tlp_state_ok(sk)) {
+        tcp_clear_timer(sk, &sk->tlp_timer);
+        return;
+    }
+
+    // two RTTs, plus the peer's delayed ACK timer if a lone segment may be waiting for company
+    pto_ns = 2ULL * sk->srtt_us * 1000;
+    if (sk->packets_out == 1) {
+        pto_ns += TCP_WC_DELACK_MS * 1000000ULL;
+    }
+    if (pto_ns < TCP_PTO_MIN_MS * 1000000ULL) {
+        pto_ns = TCP_PTO_MIN_MS * 1000000ULL;
+    }
+
+    // never later than the RTO, a probe in its place recovers without collapsing the window
+    expires = clock_ns() + pto_ns;
+    if (timer_pending(&sk->rto_timer) && sk->rto_timer.expires < expires) {
+        expires = sk->rto_timer.expires;
+    }
+    tcp_reset_timer(sk, &sk->tlp_timer, expires);
+}
+
+/* Send new data if the peer's window allows, otherwise retransmit the last segment */
+static void tcp_send_loss_probe(struct tcp_sock *sk) {
+    uint32_t nxt = sk->snd_nxt;
+    struct pktbuf *last;
+
+    if (sk->send_head) {
+        tcp_write_xmit(sk, 1);
+    }
+
+    if (sk->snd_nxt != nxt) {
+        sk->tlp_retrans = 0;
+    } else {
+        list_head *prev = sk->send_head ? sk->send_head->list.prev : sk->write_queue.prev;
+
+        if (prev == &sk->write_queue) {
+            return;
+        }
+        last = list_entry(prev, struct pktbuf, list);
+        if (TCP_CB(last)->sacked & TCPCB_SACKED) {
+            return; // the tail got there, whatever is missing RACK will find
+        }
+        if (tcp_retransmit_pkt(sk, last) < 0) {
+            return;
+        }
+        sk->tlp_retrans = 1;
+    }
+
+    tcp_dbg("Tail loss probe, %s", sk->tlp_retrans ? "retransmitted the last segment" : "sent new data");
+    sk->tlp_high_seq = sk->snd_nxt;
+
+    // the probe used up the PTO, the RTO backs it up from here
+    tcp_clear_timer(sk, &sk->tlp_timer);
+    tcp_reset_timer(sk, &sk->rto_timer, clock_ns() + sk->rto_ms * 1000000ULL);
+}
+
+void tcp_tlp_handler(struct timer *t) {
+    struct tcp_sock *sk = t->arg;
+
+    pthread_mutex_lock(&sk->lock);
+    if (tcp_tlp_state_ok(sk) && sk->packets_out && !sk->in_recovery && !sk->tlp_high_seq) {
+        tcp_send_loss_probe(sk);
+    }
+    pthread_mutex_unlock(&sk->lock);
+
+    tcp_sock_put(sk);
+}
+
+void tcp_tlp_ack(struct tcp_sock *sk, uint32_t ack) {
+    if (!sk->tlp_high_seq || seq_before(ack, sk->tlp_high_seq)) {
+        return;
+    }
+
+    // without DSACK we can't tell whether the probe or the original got through, so assume a loss
+    // was repaired and respond to it (RFC 8985 7.4.2). Call before the ACKed segments leave the flight
+    if (sk->tlp_retrans && !sk->in_recovery) {
+        tcp_dbg("Tail loss probe repaired a loss");
+        sk->ca_ops->on_loss(sk, TCP_CA_RECOVERY);
+    }
+    sk->tlp_high_seq = 0;
+}
@@ -0,0 +1,50 @@
+#include "tcp.h"
+
+/* NewReno (RFC 5681, RFC 6582): slow start, then one segment per window, halve on loss */
+
+static void reno_init(struct tcp_sock *sk) {
+    sk->cwnd = TCP_INIT_CWND;
+    sk->ssthresh = 0x7fffffff;
+    sk->cwnd_cnt = 0;
+}
+
+static void reno_on_ack(struct tcp_sock *sk, const struct tcp_rate_sample *rs) {
+    uint32_t acked = rs->acked;
+
+    // the window stays at ssthresh until recovery is over
+    if (sk->in_recovery) {
+        return;
+    }
+
+    if (sk->cwnd < sk->ssthresh) {
+        // slow start, one segment per segment ACKed
+        sk->cwnd += acked;
+        if (sk->cwnd <= sk->ssthresh) {
+            return;
+        }
+        acked = sk->cwnd - sk->ssthresh;
+        sk->cwnd = sk->ssthresh;
+    }
+
+    // congestion avoidance, one segment per window
+    sk->cwnd_cnt += acked;
+    if (sk->cwnd_cnt >= sk->cwnd) {
+        sk->cwnd_cnt -= sk->cwnd;
+        sk->cwnd++;
+    }
+}
+
+static void reno_on_loss(struct tcp_sock *sk, int event) {
+    uint32_t in_flight = tcp_packets_in_flight(sk);
+
+    sk->ssthresh = in_flight / 2 > 2 ? in_flight / 2 : 2;
+    sk->cwnd = event == TCP_CA_LOSS ? 1 : sk->ssthresh;
+    sk->cwnd_cnt = 0;
+}
+
+struct tcp_cong_ops tcp_reno_ops = {
+    .name = "reno",
+    .init = reno_init,
+    .on_ack = reno_on_ack,
+    .on_loss = reno_on_loss,
+};
@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/random.h>
+
+#include "tcp.h"
+#include "stats.h"
+#include "utils.h"
+
+#define tcp_dbg(fmt, ...) \
+    do { if (verbose) printf("TCP: " fmt "\n", ##__VA_ARGS__); } while (0)
+
+/*
+ * SYN cookies. When a listener's SYN queue is full the SYN-ACK's sequence number carries what we
+ * would otherwise have queued, and the final ACK (cookie + 1) brings it back:
+ *
+ *   cookie = H(tuple, k0) + their ISN + (count << 24) + ((H(tuple, count, k1) + data) & 0xffffff)
+ *
+ * count ticks about every minute and bounds how old a cookie may be. data packs the MSS as an index
+ * into a table, the peer's window scale (15 = none) and SACK permitted. Timestamps need no room,
+ * the final ACK carries one if they were agreed on. A forged ACK has to hit a valid data value in
+ * a 24 bit field, 1 in 65536.
+ */
+#define COOKIE_BITS    24
+#define COOKIE_MASK    ((1U << COOKIE_BITS) - 1)
+#define COOKIE_MAX_AGE 2    // count ticks a cookie stays valid, so two to three minutes
+#define COOKIE_NO_WS   15
+
+static const uint16_t cookie_mss[] = { 536, 1024, 1220, 1300, 1360, 1400, 1440, 1460 };
+static uint32_t cookie_secret[2];
+
+void tcp_synq_init(void) {
+    if (getrandom(cookie_secret, sizeof(cookie_secret), 0) != sizeof(cookie_secret)) {
+        cookie_secret[0] = (uint32_t)clock_ns();
+        cookie_secret[1] = (uint32_t)(clock_ns() * 0x9e3779b1);
+    }
+}
+
+/* murmur3 finalizer */
+static inline uint32_t cookie_mix(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+static uint32_t cookie_hash(struct tcp_request_sock *req, uint32_t count, int c) {
+    uint32_t h = cookie_secret[c] + count * 0x9e3779b1;
+
+    h = cookie_mix(h ^ req->saddr);
+    h = cookie_mix(h ^ req->daddr);
+    h = cookie_mix(h ^ (((uint32_t)req->sport << 16) | req->dport));
+    return h;
+}
+
+static inline uint32_t cookie_count(void) {
+    return (uint32_t)(clock_ns() >> 36); // about 68 s
+}
+
+uint32_t tcp_syncookie_make(struct tcp_request_sock *req) {
+    uint32_t count = cookie_count() & 0xff;
+    uint32_t data;
+    int i;
+
+    // largest table MSS the peer can take
+    for (i = sizeof(cookie_mss) / sizeof(cookie_mss[0]) - 1; i > 0 && cookie_mss[i] > req->peer_mss; i--)
+        ;
+
+    data = i | (req->wscale_ok ? req->snd_wscale : COOKIE_NO_WS) << 3 | req->sack_ok << 7;
+
+    return cookie_hash(req, 0, 0) + req->irs + (count << COOKIE_BITS) +
+        ((cookie_hash(req, count, 1) + data) & COOKIE_MASK);
+}
+
+int tcp_syncookie_check(struct tcp_request_sock *req, uint32_t cookie) {
+    uint32_t count, data;
+
+    cookie -= cookie_hash(req, 0, 0) + req->irs;
+    count = cookie >> COOKIE_BITS;
+    if (((cookie_count() - count) & 0xff) > COOKIE_MAX_AGE) {
+        return -1;
+    }
+
+    data = (cookie - cookie_hash(req, count, 1)) & COOKIE_MASK;
+    if (data > 0xff) {
+        return -1;
+    }
+
+    req->peer_mss = cookie_mss[data & 7];
+    req->wscale_ok = ((data >> 3) & 0xf) != COOKIE_NO_WS;
+    req->snd_wscale = req->wscale_ok ? (data >> 3) & 0xf : 0;
+    req->sack_ok = data >> 7;
+    return 0;
+}
+
+int tcp_synq_alloc(struct tcp_sock *lsk) {
+    int i;
+
+    lsk->syn_table = malloc(TCP_SYNQ_HASH * sizeof(list_head));
+    if (!lsk->syn_table) {
+        perror("Failed to allocate SYN queue");
+        return -1;
+    }
+    for (i = 0; i < TCP_SYNQ_HASH; i++) {
+        list_init(&lsk->syn_table[i]);
+    }
+    return 0;
+}
+
+/* The listener fixes the local port, the remote end picks the bucket */
+static inline list_head *tcp_synq_bucket(struct tcp_sock *lsk, uint32_t daddr, uint16_t dport) {
+    return &lsk->syn_table[cookie_mix(daddr ^ dport ^ cookie_secret[0]) & (TCP_SYNQ_HASH - 1)];
+}
+
+struct tcp_request_sock *tcp_synq_find(struct tcp_sock *lsk, uint32_t saddr, uint32_t daddr, uint16_t dport) {
+    list_head *elem;
+
+    list_for_each(elem, tcp_synq_bucket(lsk, daddr, dport)) {
+        struct tcp_request_sock *req = list_entry(elem, struct tcp_request_sock, list);
+
+        if (req->daddr == daddr && req->dport == dport && req->saddr == saddr) {
+            return req;
+        }
+    }
+    return NULL;
+}
+
+void tcp_synq_add(struct tcp_sock *lsk, struct tcp_request_sock *req) {
+    list_add_tail(tcp_synq_bucket(lsk, req->daddr, req->dport), &req->list);
+    lsk->syn_count++;
+
+    // one timer per listener, armed for the request due first
+    if (!timer_pending(&lsk->rto_timer) || req->expires < lsk->rto_timer.expires) {
+        tcp_reset_timer(lsk, &lsk->rto_timer, req->expires);
+    }
+}
+
+void tcp_synq_remove(struct tcp_sock *lsk, struct tcp_request_sock *req) {
+    list_del(&req->list);
+    lsk->syn_count--;
+    free(req);
+}
+
+void tcp_synq_purge(struct tcp_sock *lsk) {
+    list_head *elem, *tmp;
+    int i;
+
+    if (!lsk->syn_table) {
+        return;
+    }
+    for (i = 0; i < TCP_SYNQ_HASH; i++) {
+        list_for_each_safe(elem, tmp, &lsk->syn_table[i]) {
+            tcp_synq_remove(lsk, list_entry(elem, struct tcp_request_sock, list));
+        }
+    }
+}
+
+void tcp_synq_timer(struct tcp_sock *lsk) {
+    uint64_t now = clock_ns(), next = UINT64_MAX;
+    list_head *elem, *tmp;
+    int i;
+
+    if (!lsk->syn_count) {
+        return;
+    }
+
+    for (i = 0; i < TCP_SYNQ_HASH; i++) {
+        list_for_each_safe(elem, tmp, &lsk->syn_table[i]) {
+            struct tcp_request_sock *req = list_entry(elem, struct tcp_request_sock, list);
+
+            if (req->expires <= now) {
+                if (req->retries >= TCP_SYNACK_RETRIES) {
+                    tcp_dbg("Handshake from port %d timed out", req->dport);
+                    STATS_INC(STAT_TCP_SYNACK_TIMEOUTS);
+                    tcp_synq_remove(lsk, req);
+                    continue;
+                }
+                req->retries++;
+                tcp_send_synack_req(lsk, req);
+                req->expires = now + ((uint64_t)TCP_RTO_INIT_MS << req->retries) * 1000000ULL;
+            }
+            if (req->expires < next) {
+                next = req->expires;
+            }
+        }
+    }
+
+    if (next != UINT64_MAX) {
+        tcp_reset_timer(lsk, &lsk->rto_timer, next);
+    }
+}
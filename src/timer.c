@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
+
+#include "timer.h"
+#include "utils.h"
+
+/* A wheel, plus the last tick we ran up to */
+struct timer_wheel {
+    pthread_mutex_t lock;
+    list_head slots[TIMER_WHEEL_SIZE];
+    int ready;
+    uint64_t tick;
+    int count;   // armed timers
+    int retired; // its thread is gone, timers still bound here move to the shared wheel
+    int tfd;        // timerfd kept armed to the earliest deadline, -1 if nobody waits on one
+    uint64_t armed; // deadline tfd is set for, UINT64_MAX when it isn't
+};
+
+/* The shared wheel, and the calling thread's own if it asked for one */
+static struct timer_wheel timer_global = { .lock = PTHREAD_MUTEX_INITIALIZER, .tfd = -1, .armed = UINT64_MAX };
+static __thread struct timer_wheel *timer_local;
+
+/* Lazily set up the slots the first time the wheel is touched. Call with its lock held */
+static void wheel_init(struct timer_wheel *w) {
+    int i;
+
+    for (i = 0; i < TIMER_WHEEL_SIZE; i++) {
+        list_init(&w->slots[i]);
+    }
+    w->tick = clock_ns() / TIMER_TICK_NS;
+    w->ready = 1;
+}
+
+static inline struct timer_wheel *wheel_this_thread(void) {
+    return timer_local ? timer_local : &timer_global;
+}
+
+/* Lock the wheel t is bound to */
+static struct timer_wheel *wheel_lock(struct timer *t) {
+    struct timer_wheel *w = t->wheel;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->retired) {
+        // nothing is pending on a retired wheel, so the timer can simply move
+        pthread_mutex_unlock(&w->lock);
+        t->wheel = w = &timer_global;
+        pthread_mutex_lock(&w->lock);
+    }
+    return w;
+}
+
+/* Point the wheel's timerfd at deadline (UINT64_MAX = disarm). Call with its lock held */
+static void wheel_arm(struct timer_wheel *w, uint64_t deadline) {
+    struct itimerspec its;
+
+    if (w->tfd < 0 || deadline == w->armed) {
+        return;
+    }
+    memset(&its, 0, sizeof(its));
+    if (deadline != UINT64_MAX) {
+        // an absolute time of 0 would disarm it, and clock_ns shares CLOCK_MONOTONIC's base
+        its.it_value.tv_sec = deadline / 1000000000ULL;
+        its.it_value.tv_nsec = deadline % 1000000000ULL;
+        if (!its.it_value.tv_sec && !its.it_value.tv_nsec) {
+            its.it_value.tv_nsec = 1;
+        }
+    }
+    if (timerfd_settime(w->tfd, TFD_TIMER_ABSTIME, &its, NULL) == 0) {
+        w->armed = deadline;
+    }
+}
+
+void timer_init(struct timer *t, void (*handler)(struct timer *t), void *arg) {
+    list_init(&t->list);
+    t->expires = 0;
+    t->handler = handler;
+    t->arg = arg;
+    t->pending = 0;
+    t->wheel = wheel_this_thread();
+}
+
+int timer_mod(struct timer *t, uint64_t expires) {
+    uint64_t tick = expires / TIMER_TICK_NS;
+    struct timer_wheel *w = wheel_lock(t);
+    int was_pending;
+
+    if (!w->ready) {
+        wheel_init(w);
+    }
+
+    was_pending = t->pending;
+    if (was_pending) {
+        list_del(&t->list);
+    } else {
+        w->count++;
+    }
+
+    // anything already due goes in the next slot we'll look at
+    if (tick < w->tick) {
+        tick = w->tick;
+    }
+
+    t->expires = expires;
+    t->pending = 1;
+    list_add_tail(&w->slots[tick & (TIMER_WHEEL_SIZE - 1)], &t->list);
+
+    // the wheel's thread may be asleep until a later deadline, bring its wakeup forward
+    if (expires < w->armed) {
+        wheel_arm(w, expires);
+    }
+
+    pthread_mutex_unlock(&w->lock);
+    return was_pending;
+}
+
+int timer_del(struct timer *t) {
+    struct timer_wheel *w = wheel_lock(t);
+    int was_pending;
+
+    was_pending = t->pending;
+    if (was_pending) {
+        list_del(&t->list);
+        list_init(&t->list);
+        t->pending = 0;
+        w->count--;
+    }
+
+    pthread_mutex_unlock(&w->lock);
+    return was_pending;
+}
+
+int timer_pending(struct timer *t) {
+    return t->pending;
+}
+
+/* Earliest pending deadline on a wheel. Call with its lock held */
+static uint64_t wheel_next_deadline(struct timer_wheel *w) {
+    uint64_t next = UINT64_MAX;
+    list_head *elem;
+    struct timer *t;
+    int i;
+
+    if (w->ready && w->count > 0) {
+        // slots are visited in tick order, the first non-empty slot within this revolution holds the soonest timer
+        for (i = 0; i < TIMER_WHEEL_SIZE; i++) {
+            list_head *slot = &w->slots[(w->tick + i) & (TIMER_WHEEL_SIZE - 1)];
+
+            list_for_each(elem, slot) {
+                t = list_entry(elem, struct timer, list);
+                if (t->expires < next) {
+                    next = t->expires;
+                }
+            }
+
+            // a deadline in this revolution can't be beaten by later slots
+            if (next != UINT64_MAX && next / TIMER_TICK_NS <= w->tick + i) {
+                break;
+            }
+        }
+    }
+    return next;
+}
+
+void timers_run(void) {
+    struct timer_wheel *w = wheel_this_thread();
+    uint64_t now = clock_ns();
+    uint64_t now_tick = now / TIMER_TICK_NS;
+    LIST_HEAD(expired);
+    list_head *elem, *tmp;
+    struct timer *t;
+
+    pthread_mutex_lock(&w->lock);
+    if (!w->ready || w->count == 0) {
+        if (w->ready) w->tick = now_tick;
+        w->armed = UINT64_MAX; // a timerfd that fired for a cancelled timer is disarmed already
+        pthread_mutex_unlock(&w->lock);
+        return;
+    }
+
+    // walk every slot we passed since the last run, but never more than one revolution
+    if (now_tick - w->tick >= TIMER_WHEEL_SIZE) {
+        w->tick = now_tick - TIMER_WHEEL_SIZE + 1;
+    }
+
+    for (; w->tick <= now_tick; w->tick++) {
+        list_head *slot = &w->slots[w->tick & (TIMER_WHEEL_SIZE - 1)];
+
+        list_for_each_safe(elem, tmp, slot) {
+            t = list_entry(elem, struct timer, list);
+            if (t->expires <= now) {
+                // still pending until its handler starts, so timer_mod/timer_del can take it back
+                list_del(elem);
+                list_add_tail(&expired, elem);
+            }
+        }
+    }
+    w->tick = now_tick; // the current slot may still get timers due later this tick
+
+    // run handlers without the lock so they can re-arm timers
+    while (!list_empty(&expired)) {
+        t = list_first_entry(&expired, struct timer, list);
+        list_del(&t->list);
+        list_init(&t->list);
+        t->pending = 0;
+        w->count--;
+
+        pthread_mutex_unlock(&w->lock);
+        t->handler(t);
+        pthread_mutex_lock(&w->lock);
+    }
+
+    // a timerfd fires once, set it again for whatever is due next
+    if (w->tfd >= 0) {
+        w->armed = UINT64_MAX;
+        wheel_arm(w, wheel_next_deadline(w));
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+uint64_t timers_next_deadline(void) {
+    struct timer_wheel *w = wheel_this_thread();
+    uint64_t next;
+
+    pthread_mutex_lock(&w->lock);
+    next = wheel_next_deadline(w);
+    pthread_mutex_unlock(&w->lock);
+    return next;
+}
+
+int timers_set_timerfd(int tfd) {
+    struct timer_wheel *w = wheel_this_thread();
+
+    pthread_mutex_lock(&w->lock);
+    if (tfd >= 0 && w->tfd >= 0) {
+        pthread_mutex_unlock(&w->lock);
+        return -1; // another thread already sleeps on this wheel
+    }
+    w->tfd = tfd;
+    w->armed = UINT64_MAX;
+    wheel_arm(w, wheel_next_deadline(w));
+    pthread_mutex_unlock(&w->lock);
+    return 0;
+}
+
+int timer_wheel_local(void) {
+    struct timer_wheel *w = calloc(1, sizeof(struct timer_wheel));
+
+    if (!w) {
+        perror("Failed to allocate timer wheel");
+        return -1;
+    }
+    pthread_mutex_init(&w->lock, NULL);
+    wheel_init(w);
+    w->tfd = -1;
+    w->armed = UINT64_MAX;
+
+    timer_local = w;
+    return 0;
+}
+
+void timer_wheel_local_exit(void) {
+    struct timer_wheel *w = timer_local;
+    struct timer_wheel *g = &timer_global;
+    struct timer *t;
+    uint64_t tick;
+    int i;
+
+    if (!w) {
+        return;
+    }
+    timer_local = NULL;
+
+    // the timers outlive the thread, the pending ones move over now and the rest on their next use
+    pthread_mutex_lock(&w->lock);
+    pthread_mutex_lock(&g->lock);
+    if (!g->ready) {
+        wheel_init(g);
+    }
+    for (i = 0; i < TIMER_WHEEL_SIZE; i++) {
+        while (!list_empty(&w->slots[i])) {
+            t = list_first_entry(&w->slots[i], struct timer, list);
+            list_del(&t->list);
+            tick = t->expires / TIMER_TICK_NS;
+            if (tick < g->tick) {
+                tick = g->tick;
+            }
+            list_add_tail(&g->slots[tick & (TIMER_WHEEL_SIZE - 1)], &t->list);
+            t->wheel = g;
+            g->count++;
+        }
+    }
+    w->count = 0;
+    w->retired = 1; // left allocated, timers that weren't pending may still point at it
+    if (wheel_next_deadline(g) < g->armed) {
+        wheel_arm(g, wheel_next_deadline(g));
+    }
+    pthread_mutex_unlock(&g->lock);
+    pthread_mutex_unlock(&w->lock);
+}
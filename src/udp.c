@@ -0,0 +1,419 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "udp.h"
+#include "ip.h"
+#include "icmp.h"
+#include "ethernet.h"
+#include "netdev.h"
+#include "zerocopy.h"
+#include "stats.h"
+#include "mem.h"
+#include "utils.h"
+
+/* Port demux table. Readers are the RX threads, writers are bind/close, so a rwlock keeps lookups uncontended */
+static list_head udp_hash[UDP_HASH_SIZE];
+static pthread_rwlock_t udp_hash_lock = PTHREAD_RWLOCK_INITIALIZER;
+static uint16_t udp_next_ephemeral = UDP_PORT_EPHEMERAL_MIN;
+
+#define udp_dbg(fmt, ...) \
+    do { if (verbose) printf("UDP: " fmt "\n", ##__VA_ARGS__); } while (0)
+
+static inline list_head *udp_bucket(uint16_t port) {
+    return &udp_hash[port & (UDP_HASH_SIZE - 1)];
+}
+
+void udp_init(void) {
+    int i;
+
+    for (i = 0; i < UDP_HASH_SIZE; i++) {
+        list_init(&udp_hash[i]);
+    }
+
+    udp_dbg("UDP layer initialized");
+}
+
+/* Find the socket for a local address/port. Call with udp_hash_lock held */
+static struct udp_sock *udp_lookup(uint32_t addr, uint16_t port) {
+    struct udp_sock *sk;
+    list_head *elem;
+
+    list_for_each(elem, udp_bucket(port)) {
+        sk = list_entry(elem, struct udp_sock, hash_list);
+        if (sk->port == port && (sk->addr == 0 || sk->addr == addr)) {
+            return sk;
+        }
+    }
+
+    return NULL;
+}
+
+/* Producer side of the receive ring, RSS workers may feed one socket from several threads */
+static int udp_ring_push(struct udp_sock *sk, struct pktbuf *pkt) {
+    uint32_t head, tail;
+    int ret = 0, wake = 0;
+
+    pthread_spin_lock(&sk->push_lock);
+
+    head = atomic_load_explicit(&sk->head, memory_order_relaxed);
+    tail = atomic_load_explicit(&sk->tail, memory_order_acquire);
+    if (head - tail == UDP_RING_SIZE ||
+        atomic_load_explicit(&sk->rmem, memory_order_relaxed) + pkt->len > mem_sock_limit(sk->rcvbuf)) {
+        ret = -1; // full
+    } else {
+        atomic_fetch_add_explicit(&sk->rmem, pkt->len, memory_order_relaxed);
+        mem_charge(MEM_SOCK_RCV, pkt->len, 0);
+        sk->ring[head & (UDP_RING_SIZE - 1)] = pkt;
+        atomic_store_explicit(&sk->head, head + 1, memory_order_release); // publish the slot
+        wake = head == tail;
+    }
+
+    pthread_spin_unlock(&sk->push_lock);
+
+    // a reader only ever waits on an empty ring. The fence pairs with the one in udp_wait: either
+    // we see it waiting or it sees the slot we just published
+    if (wake) {
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load_explicit(&sk->waiters, memory_order_relaxed)) {
+            pthread_mutex_lock(&sk->wait_lock);
+            pthread_cond_broadcast(&sk->wait);
+            pthread_mutex_unlock(&sk->wait_lock);
+        }
+    }
+    return ret;
+}
+
+/* Fill in a datagram descriptor from a queued buffer */
+static void udp_dgram_fill(struct udp_dgram *dgram, struct pktbuf *pkt) {
+    struct ip_header *iph = (struct ip_header *)pkt->nh;
+    struct udp_header *udph = (struct udp_header *)pkt->th;
+
+    dgram->pkt = pkt;
+    dgram->data = pkt->data;
+    dgram->len = pkt->len;
+    dgram->saddr = iph->saddr;
+    dgram->sport = ntohs(udph->sport);
+}
+
+void udp_recv(struct pktbuf *pkt) {
+    struct ip_header *iph = (struct ip_header *)pkt->nh;
+    struct udp_header *udph;
+    struct udp_sock *sk;
+    uint16_t len;
+
+    if (pkt->len < sizeof(struct udp_header)) {
+        udp_dbg("Packet too short for UDP header");
+        STATS_INC(STAT_UDP_IN_ERRORS);
+        free_pktbuf(pkt);
+        return;
+    }
+
+    udph = (struct udp_header *)pkt->data;
+    len = ntohs(udph->len);
+
+    if (len < sizeof(struct udp_header) || len > pkt->len) {
+        udp_dbg("Bad UDP length %d (packet has %d bytes)", len, pkt->len);
+        STATS_INC(STAT_UDP_IN_ERRORS);
+        free_pktbuf(pkt);
+        return;
+    }
+
+    // a zero checksum means the sender didn't compute one
+    if (udph->csum && ip_pseudo_checksum(iph->saddr, iph->daddr, IP_P_UDP, udph, len) != 0) {
+        udp_dbg("Invalid UDP checksum");
+        STATS_INC(STAT_UDP_IN_ERRORS);
+        STATS_INC(STAT_UDP_IN_CSUM_ERRORS);
+        free_pktbuf(pkt);
+        return;
+    }
+
+    pkt->len = len; // trim anything after the datagram
+    pktbuf_pull(pkt, sizeof(struct udp_header));
+
+    pthread_rwlock_rdlock(&udp_hash_lock);
+
+    sk = udp_lookup(iph->daddr, ntohs(udph->dport));
+    if (sk && sk->reuse) {
+        sk = reuseport_select(sk->reuse, reuseport_hash(iph->saddr, ntohs(udph->sport), iph->daddr, ntohs(udph->dport)));
+    }
+    if (!sk) {
+        pthread_rwlock_unlock(&udp_hash_lock);
+        udp_dbg("No socket on port %d", ntohs(udph->dport));
+        STATS_INC(STAT_UDP_NO_PORTS);
+        icmp_send_dest_unreachable(pkt, ICMP_PORT_UNREACHABLE);
+        free_pktbuf(pkt);
+        return;
+    }
+
+    // hand the buffer itself to the socket, the app reads the payload in place
+    if (udp_ring_push(sk, pkt) < 0) {
+        sk->drops++;
+        pthread_rwlock_unlock(&udp_hash_lock);
+        STATS_INC(STAT_UDP_RCVBUF_ERRORS);
+        udp_dbg("Receive buffer full on port %d, dropping", sk->port);
+        free_pktbuf(pkt);
+        return;
+    }
+
+    pthread_rwlock_unlock(&udp_hash_lock);
+    STATS_INC(STAT_UDP_IN_DATAGRAMS);
+}
+
+static struct udp_sock *udp_bind_common(uint32_t addr, uint16_t port, int reuseport) {
+    struct udp_sock *sk, *other;
+    int tries;
+
+    sk = aligned_alloc(CACHELINE_SIZE, sizeof(struct udp_sock));
+    if (!sk) {
+        perror("Failed to allocate UDP socket");
+        return NULL;
+    }
+    memset(sk, 0, sizeof(*sk));
+    list_init(&sk->hash_list);
+    pthread_spin_init(&sk->push_lock, PTHREAD_PROCESS_PRIVATE);
+    pthread_mutex_init(&sk->wait_lock, NULL);
+    pthread_cond_init(&sk->wait, NULL);
+    sk->rcvbuf = UDP_RCVBUF;
+    sk->addr = addr;
+
+    pthread_rwlock_wrlock(&udp_hash_lock);
+
+    if (port == 0) {
+        // walk the ephemeral range for a free port
+        for (tries = 0; tries < 65536 - UDP_PORT_EPHEMERAL_MIN; tries++) {
+            uint16_t candidate = udp_next_ephemeral++;
+            if (udp_next_ephemeral == 0) {
+                udp_next_ephemeral = UDP_PORT_EPHEMERAL_MIN; // wrapped
+            }
+            if (!udp_lookup(addr, candidate)) {
+                port = candidate;
+                break;
+            }
+        }
+    } else if ((other = udp_lookup(addr, port))) {
+        // taken, unless everyone on it asked for sharing and is bound to exactly this address
+        if (!reuseport || !other->reuse || other->addr != addr || reuseport_add(other->reuse, sk) < 0) {
+            port = 0;
+        } else {
+            sk->reuse = other->reuse;
+        }
+    }
+
+    if (port && reuseport && !sk->reuse && !(sk->reuse = reuseport_alloc(sk))) {
+        port = 0;
+    }
+
+    if (port == 0) {
+        pthread_rwlock_unlock(&udp_hash_lock);
+        udp_dbg("No port available to bind");
+        pthread_spin_destroy(&sk->push_lock);
+        pthread_mutex_destroy(&sk->wait_lock);
+        pthread_cond_destroy(&sk->wait);
+        free(sk);
+        return NULL;
+    }
+
+    sk->port = port;
+    list_add(udp_bucket(port), &sk->hash_list);
+
+    pthread_rwlock_unlock(&udp_hash_lock);
+
+    udp_dbg("Bound socket to port %d%s", port, sk->reuse ? ", shared" : "");
+    return sk;
+}
+
+struct udp_sock *udp_bind(uint32_t addr, uint16_t port) {
+    return udp_bind_common(addr, port, 0);
+}
+
+struct udp_sock *udp_bind_reuseport(uint32_t addr, uint16_t port) {
+    return udp_bind_common(addr, port, 1);
+}
+
+void udp_close(struct udp_sock *sk) {
+    struct udp_dgram dgram;
+
+    if (!sk) {
+        return;
+    }
+
+    // once it's out of the table no RX thread can push to it anymore
+    pthread_rwlock_wrlock(&udp_hash_lock);
+    list_del(&sk->hash_list);
+    if (sk->reuse) {
+        reuseport_remove(sk->reuse, sk);
+    }
+    pthread_rwlock_unlock(&udp_hash_lock);
+    udp_shutdown(sk);
+
+    while (udp_recv_zc(sk, &dgram)) {
+        udp_release(&dgram);
+    }
+
+    udp_dbg("Closed socket on port %d", sk->port);
+    pthread_spin_destroy(&sk->push_lock);
+    pthread_mutex_destroy(&sk->wait_lock);
+    pthread_cond_destroy(&sk->wait);
+    free(sk);
+}
+
+int udp_wait(struct udp_sock *sk) {
+    int ret = 0;
+
+    pthread_mutex_lock(&sk->wait_lock);
+    atomic_fetch_add(&sk->waiters, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    while (atomic_load_explicit(&sk->head, memory_order_acquire) == atomic_load_explicit(&sk->tail, memory_order_relaxed)) {
+        if (atomic_load(&sk->shutdown)) {
+            errno = EPIPE;
+            ret = -1;
+            break;
+        }
+        pthread_cond_wait(&sk->wait, &sk->wait_lock);
+    }
+    atomic_fetch_sub(&sk->waiters, 1);
+    pthread_mutex_unlock(&sk->wait_lock);
+    return ret;
+}
+
+void udp_shutdown(struct udp_sock *sk) {
+    if (!sk) {
+        return;
+    }
+    pthread_mutex_lock(&sk->wait_lock);
+    atomic_store(&sk->shutdown, 1);
+    pthread_cond_broadcast(&sk->wait);
+    pthread_mutex_unlock(&sk->wait_lock);
+}
+
+/* Room for every header below the payload */
+#define UDP_HLEN (sizeof(struct eth_header) + sizeof(struct ip_header) + sizeof(struct udp_header))
+
+/* Put the UDP header in front of the payload, in the buffer or its zero-copy fragment, and send it */
+static int udp_xmit(struct udp_sock *sk, struct pktbuf *pkt, uint32_t daddr, uint16_t dport) {
+    struct netdev *dev = netdev_get();
+    struct udp_header *udph;
+
+    udph = pktbuf_push(pkt, sizeof(struct udp_header));
+    udph->sport = htons(sk->port);
+    udph->dport = htons(dport);
+    udph->len = htons(pktbuf_total_len(pkt));
+    udph->csum = 0;
+
+    udph->csum = ip_pseudo_checksum_pkt(sk->addr ? sk->addr : dev->addr, daddr, IP_P_UDP, pkt);
+    if (udph->csum == 0) {
+        udph->csum = 0xffff; // zero is reserved for "no checksum"
+    }
+
+    STATS_INC(STAT_UDP_OUT_DATAGRAMS);
+    return ip_output(pkt, daddr, IP_P_UDP);
+}
+
+/*
+ * ip_output doesn't fragment, so a datagram has to fit a single frame. Anything bigger would
+ * get lost on the way out while the caller is told it was sent
+ */
+static int udp_check_len(int len) {
+    if (len < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (len > NETDEV_MTU - sizeof(struct ip_header) - sizeof(struct udp_header)) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    return 0;
+}
+
+int udp_sendto(struct udp_sock *sk, uint32_t daddr, uint16_t dport, const void *data, int len) {
+    struct pktbuf *pkt;
+
+    if (udp_check_len(len) < 0) {
+        return -1;
+    }
+
+    pkt = alloc_pktbuf(UDP_HLEN + len);
+    if (!pkt) {
+        udp_dbg("Failed to allocate packet buffer");
+        return -1;
+    }
+    pktbuf_reserve(pkt, UDP_HLEN);
+    memcpy(pktbuf_put(pkt, len), data, len);
+
+    if (udp_xmit(sk, pkt, daddr, dport) < 0) {
+        return -1;
+    }
+
+    return len;
+}
+
+int udp_sendto_zc(struct udp_sock *sk, uint32_t daddr, uint16_t dport, const void *data, int len,
+                  struct zc_queue *cq, uint64_t cookie) {
+    struct zc_ubuf *ubuf;
+    struct pktbuf *pkt;
+    int ret;
+
+    if (udp_check_len(len) < 0) {
+        return -1;
+    }
+
+    ubuf = zc_ubuf_alloc(cq, cookie);
+    if (!ubuf) {
+        return -1;
+    }
+
+    // only the headers get a buffer of their own
+    pkt = alloc_pktbuf(UDP_HLEN);
+    if (!pkt) {
+        udp_dbg("Failed to allocate packet buffer");
+        zc_ubuf_abort(ubuf);
+        return -1;
+    }
+    pktbuf_reserve(pkt, UDP_HLEN);
+    pktbuf_attach(pkt, (uint8_t *)data, len, ubuf);
+
+    // the completion comes once the buffer is gone, whether it made it out or not
+    ret = udp_xmit(sk, pkt, daddr, dport);
+    zc_ubuf_put(ubuf);
+    if (ret < 0) {
+        errno = EIO;
+        return -1;
+    }
+
+    return len;
+}
+
+int udp_recv_batch(struct udp_sock *sk, struct udp_dgram *dgrams, int max) {
+    uint32_t tail = atomic_load_explicit(&sk->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&sk->head, memory_order_acquire);
+    uint32_t bytes = 0;
+    int n = 0;
+
+    // take everything available up to max with a single index update
+    while (tail != head && n < max) {
+        udp_dgram_fill(&dgrams[n], sk->ring[tail & (UDP_RING_SIZE - 1)]);
+        bytes += dgrams[n++].len;
+        tail++;
+    }
+
+    if (n) {
+        atomic_fetch_sub_explicit(&sk->rmem, bytes, memory_order_relaxed);
+        mem_charge(MEM_SOCK_RCV, -(int64_t)bytes, 0);
+        atomic_store_explicit(&sk->tail, tail, memory_order_release); // hand the slots back to the producer
+    }
+
+    return n;
+}
+
+int udp_recv_zc(struct udp_sock *sk, struct udp_dgram *dgram) {
+    return udp_recv_batch(sk, dgram, 1);
+}
+
+void udp_release(struct udp_dgram *dgram) {
+    free_pktbuf(dgram->pkt);
+    dgram->pkt = NULL;
+}
@@ -3,6 +3,9 @@
 /* Define debug flag, set it off */
 int debug = 0;
 
+/* Per-packet debug output on by default, -q turns it off */
+int verbose = 1;
+
 int run_cmd(char *cmd, ...) {
     
     va_list args;
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "zerocopy.h"
+#include "utils.h"
+
+#define zc_dbg(fmt, ...) \
+    do { if (verbose) printf("ZC: " fmt "\n", ##__VA_ARGS__); } while (0)
+
+struct zc_queue *zc_queue_create(void) {
+    struct zc_queue *cq = malloc(sizeof(struct zc_queue));
+
+    if (!cq) {
+        perror("Failed to allocate completion queue");
+        return NULL;
+    }
+
+    pthread_mutex_init(&cq->lock, NULL);
+    pthread_cond_init(&cq->wait, NULL);
+    list_init(&cq->done);
+    cq->count = 0;
+    return cq;
+}
+
+void zc_queue_destroy(struct zc_queue *cq) {
+    list_head *elem, *tmp;
+
+    if (!cq) {
+        return;
+    }
+
+    // completions nobody collected
+    list_for_each_safe(elem, tmp, &cq->done) {
+        free(list_entry(elem, struct zc_ubuf, list));
+    }
+
+    pthread_cond_destroy(&cq->wait);
+    pthread_mutex_destroy(&cq->lock);
+    free(cq);
+}
+
+/* Call with cq->lock held */
+static int zc_take(struct zc_queue *cq, uint64_t *cookies, int max) {
+    int n = 0;
+
+    while (n < max && !list_empty(&cq->done)) {
+        struct zc_ubuf *ubuf = list_first_entry(&cq->done, struct zc_ubuf, list);
+
+        list_del(&ubuf->list);
+        cookies[n++] = ubuf->cookie;
+        free(ubuf);
+    }
+    cq->count -= n;
+    return n;
+}
+
+int zc_poll(struct zc_queue *cq, uint64_t *cookies, int max) {
+    int n;
+
+    pthread_mutex_lock(&cq->lock);
+    n = zc_take(cq, cookies, max);
+    pthread_mutex_unlock(&cq->lock);
+    return n;
+}
+
+int zc_wait(struct zc_queue *cq, uint64_t *cookies, int max) {
+    int n;
+
+    pthread_mutex_lock(&cq->lock);
+    while (cq->count == 0) {
+        pthread_cond_wait(&cq->wait, &cq->lock);
+    }
+    n = zc_take(cq, cookies, max);
+    pthread_mutex_unlock(&cq->lock);
+    return n;
+}
+
+struct zc_ubuf *zc_ubuf_alloc(struct zc_queue *cq, uint64_t cookie) {
+    struct zc_ubuf *ubuf = malloc(sizeof(struct zc_ubuf));
+
+    if (!ubuf) {
+        perror("Failed to allocate zero-copy send");
+        return NULL;
+    }
+
+    list_init(&ubuf->list);
+    atomic_init(&ubuf->refcnt, 1);
+    ubuf->cq = cq;
+    ubuf->cookie = cookie;
+    return ubuf;
+}
+
+void zc_ubuf_get(struct zc_ubuf *ubuf) {
+    atomic_fetch_add_explicit(&ubuf->refcnt, 1, memory_order_relaxed);
+}
+
+void zc_ubuf_put(struct zc_ubuf *ubuf) {
+    struct zc_queue *cq = ubuf->cq;
+
+    if (atomic_fetch_sub_explicit(&ubuf->refcnt, 1, memory_order_acq_rel) != 1) {
+        return;
+    }
+
+    // the memory is the application's again
+    zc_dbg("Send %llu complete", (unsigned long long)ubuf->cookie);
+
+    pthread_mutex_lock(&cq->lock);
+    list_add_tail(&cq->done, &ubuf->list);
+    cq->count++;
+    pthread_cond_signal(&cq->wait);
+    pthread_mutex_unlock(&cq->lock);
+}
+
+void zc_ubuf_abort(struct zc_ubuf *ubuf) {
+    free(ubuf);
+}